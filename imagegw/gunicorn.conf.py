@@ -0,0 +1,108 @@
+# Shifter, Copyright (c) 2015, The Regents of the University of California,
+# through Lawrence Berkeley National Laboratory (subject to receipt of any
+# required approvals from the U.S. Dept. of Energy).  All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#  1. Redistributions of source code must retain the above copyright notice,
+#     this list of conditions and the following disclaimer.
+#  2. Redistributions in binary form must reproduce the above copyright notice,
+#     this list of conditions and the following disclaimer in the documentation
+#     and/or other materials provided with the distribution.
+#  3. Neither the name of the University of California, Lawrence Berkeley
+#     National Laboratory, U.S. Dept. of Energy nor the names of its
+#     contributors may be used to endorse or promote products derived from this
+#     software without specific prior written permission.`
+#
+# See LICENSE for full text.
+
+"""
+gunicorn configuration for the image gateway API, e.g.
+
+    gunicorn -c /usr/libexec/shifter/gunicorn.conf.py shifter_imagegw.api:app
+
+Each worker process serves the API with its own mongo connections and
+munge decoding.  The pulls, expires and imports of all workers are handed to
+a single pipeline process started by the master, listening on the unix
+socket IMAGEGW_WORKER_SOCKET, so that WorkerThreads, WorkerUserLimit, the
+fair share and the disk admission apply to the gateway as a whole.  The
+settings can be overridden with the IMAGEGW_* environment variables below or
+on the gunicorn command line.
+
+Send SIGHUP to the master for a graceful reload: new workers are started
+with the new configuration and the old ones finish their requests.  The
+pipeline process and its pulls carry on; changes to its settings in
+imagemanager.json need a restart of the master, which lets the running
+pulls finish or marks them for a re-pull.
+"""
+
+import errno
+import multiprocessing
+import os
+import signal
+import tempfile
+from time import sleep
+
+bind = os.environ.get('IMAGEGW_BIND', '0.0.0.0:5000')
+backlog = 2048
+
+# Lookups spend their time waiting on mongo and munged, so each worker
+# process handles requests in several threads.
+workers = int(os.environ.get('IMAGEGW_WORKERS', multiprocessing.cpu_count()))
+worker_class = 'gthread'
+threads = int(os.environ.get('IMAGEGW_THREADS', 8))
+
+# Each worker opens its own mongo connections after the fork
+preload_app = False
+
+timeout = 120
+graceful_timeout = 120
+# Time the pipeline waits for its pulls when the master stops
+drain_timeout = int(os.environ.get('IMAGEGW_DRAIN_TIMEOUT', 100))
+
+
+def when_ready(server):
+    """
+    Start the pipeline process before the workers are forked, so that they
+    inherit its address and the key to connect to it
+    """
+    import shifter_imagegw
+    from shifter_imagegw.imagemngr import serve_workers
+    if 'GWCONFIG' in os.environ:
+        config_file = os.environ['GWCONFIG']
+    else:
+        config_file = '%s/imagemanager.json' % (shifter_imagegw.CONFIG_PATH)
+    address = os.environ.get('IMAGEGW_WORKER_SOCKET')
+    if address is None:
+        address = os.path.join(tempfile.gettempdir(),
+                               'shifter_imagegw.%d.sock' % (os.getpid()))
+        os.environ['IMAGEGW_WORKER_SOCKET'] = address
+    proc = multiprocessing.Process(target=serve_workers, name='Pipeline',
+                                   args=(address, config_file, drain_timeout))
+    proc.start()
+    server.imagegw_pipeline = proc.pid
+    server.log.info('Started the pipeline process %d on %s', proc.pid,
+                    address)
+
+
+def on_exit(server):
+    """
+    Stop the pipeline process, letting it finish or hand back its pulls.
+    The master may have reaped it already, so wait on the pid directly.
+    """
+    pid = getattr(server, 'imagegw_pipeline', None)
+    if pid is None:
+        return
+    try:
+        os.kill(pid, signal.SIGTERM)
+    except OSError:
+        return
+    for _ in range(drain_timeout + 20):
+        try:
+            if os.waitpid(pid, os.WNOHANG)[0] == pid:
+                return
+        except OSError as err:
+            if err.errno == errno.ECHILD:
+                return
+        sleep(1)
+    server.log.warning('Pipeline process %d did not stop', pid)
@@ -0,0 +1,208 @@
+#!/usr/bin/env python
+# Shifter, Copyright (c) 2015, The Regents of the University of California,
+# through Lawrence Berkeley National Laboratory (subject to receipt of any
+# required approvals from the U.S. Dept. of Energy).  All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#  1. Redistributions of source code must retain the above copyright notice,
+#     this list of conditions and the following disclaimer.
+#  2. Redistributions in binary form must reproduce the above copyright notice,
+#     this list of conditions and the following disclaimer in the documentation
+#     and/or other materials provided with the distribution.
+#  3. Neither the name of the University of California, Lawrence Berkeley
+#     National Laboratory, U.S. Dept. of Energy nor the names of its
+#     contributors may be used to endorse or promote products derived from this
+#     software without specific prior written permission.`
+#
+# See LICENSE for full text.
+
+"""
+Replay a lookup storm against an image gateway.
+
+Lookups are recorded from the metrics of a gateway (Metrics must be enabled
+in imagemanager.json):
+
+    loadtest.py record -u http://gw:5000 -s edison -a <admin cred> storm.json
+
+or made up, e.g. 5000 nodes looking up one image within 10 seconds:
+
+    loadtest.py synth -s systema -t ubuntu:latest -n 5000 -d 10 storm.json
+
+and replayed with their original spacing (or faster with --speedup):
+
+    loadtest.py replay -u http://localhost:5555 -a <cred> storm.json
+    loadtest.py replay -u http://localhost:5555 --munge-socket \
+        /var/run/munge/systema.socket storm.json
+
+Each replayed lookup needs a credential the gateway accepts.  A fixed one
+(-a) works with the mock authentication of a test gateway; with munge a
+fresh credential is encoded for each lookup before the replay starts, since
+the gateway refuses a credential it has seen before.
+"""
+
+import json
+import sys
+import threading
+import urllib
+import urllib2
+from argparse import ArgumentParser
+from Queue import Queue
+from subprocess import Popen, PIPE
+from time import time, sleep
+
+AUTH_HEADER = 'authentication'
+
+
+def _get(url, auth, timeout=60):
+    req = urllib2.Request(url, headers={AUTH_HEADER: auth})
+    return urllib2.urlopen(req, timeout=timeout)
+
+
+def record(args):
+    """ save the lookups recorded in the metrics of a gateway """
+    url = '%s/api/metrics/%s/?limit=%d' % (args.url, args.system, args.limit)
+    recs = json.load(_get(url, args.auth))
+    with open(args.file, 'w') as out:
+        json.dump(recs, out)
+    print "Recorded %d lookups" % (len(recs))
+
+
+def synth(args):
+    """ make up a storm of lookups of one image spread over a duration """
+    recs = []
+    for idx in range(args.count):
+        recs.append({'system': args.system, 'type': args.itype,
+                     'tag': args.tag, 'user': 'user%d' % (idx % args.users),
+                     'time': args.duration * idx / float(args.count)})
+    with open(args.file, 'w') as out:
+        json.dump(recs, out)
+
+
+def _munge(socket):
+    proc = Popen(['munge', '-n', '-S', socket], stdout=PIPE)
+    return proc.communicate()[0].strip()
+
+
+def _percentile(values, pct):
+    if len(values) == 0:
+        return 0.0
+    return values[min(len(values) - 1, int(len(values) * pct / 100.0))]
+
+
+def replay(args):
+    """ send the lookups with their recorded spacing and report latencies """
+    with open(args.file) as infile:
+        recs = sorted(json.load(infile), key=lambda x: x['time'])
+    if len(recs) == 0:
+        print "No lookups to replay"
+        return 1
+    lookups = []
+    for rec in recs:
+        if args.munge_socket is not None:
+            auth = _munge(args.munge_socket)
+        else:
+            auth = args.auth
+        url = '%s/api/lookup/%s/%s/%s/' % (args.url, rec['system'],
+                                          rec['type'],
+                                          urllib.quote(rec['tag']))
+        lookups.append(((rec['time'] - recs[0]['time']) / args.speedup,
+                        url, auth))
+
+    queue = Queue()
+    lock = threading.Lock()
+    latencies = []
+    errors = {}
+
+    def _worker():
+        while True:
+            (url, auth) = queue.get()
+            start = time()
+            try:
+                _get(url, auth).read()
+                status = 200
+            except urllib2.HTTPError as err:
+                status = err.code
+            except Exception as err:
+                status = type(err).__name__
+            elapsed = time() - start
+            with lock:
+                latencies.append(elapsed)
+                if status != 200:
+                    errors[status] = errors.get(status, 0) + 1
+            queue.task_done()
+
+    for _ in range(args.concurrency):
+        thread = threading.Thread(target=_worker)
+        thread.daemon = True
+        thread.start()
+
+    start = time()
+    late = 0
+    for (offset, url, auth) in lookups:
+        delay = start + offset - time()
+        if delay > 0:
+            sleep(delay)
+        elif delay < -0.1:
+            late += 1
+        queue.put((url, auth))
+    queue.join()
+    elapsed = time() - start
+
+    latencies.sort()
+    print "Lookups:    %d in %.2fs (%.1f/s)" % (len(latencies), elapsed,
+                                               len(latencies) / elapsed)
+    print "Latency:    p50 %.3fs p90 %.3fs p99 %.3fs max %.3fs" % (
+        _percentile(latencies, 50), _percentile(latencies, 90),
+        _percentile(latencies, 99), latencies[-1])
+    if late > 0:
+        print "Late:       %d lookups sent more than 0.1s behind " \
+            "schedule, raise --concurrency" % (late)
+    for (status, count) in sorted(errors.items()):
+        print "Errors:     %d x %s" % (count, status)
+    if len(errors) > 0:
+        return 1
+    return 0
+
+
+def main():
+    """ main """
+    parser = ArgumentParser(description='Replay a lookup storm against an '
+                            'image gateway')
+    sub = parser.add_subparsers()
+
+    cmd = sub.add_parser('record', help='save lookups from gateway metrics')
+    cmd.add_argument('-u', '--url', default='http://localhost:5000')
+    cmd.add_argument('-s', '--system', required=True)
+    cmd.add_argument('-a', '--auth', required=True,
+                     help='credential of a gateway admin')
+    cmd.add_argument('-l', '--limit', type=int, default=100000)
+    cmd.add_argument('file')
+    cmd.set_defaults(func=record)
+
+    cmd = sub.add_parser('synth', help='make up a lookup storm')
+    cmd.add_argument('-s', '--system', required=True)
+    cmd.add_argument('-i', '--itype', default='docker')
+    cmd.add_argument('-t', '--tag', required=True)
+    cmd.add_argument('-n', '--count', type=int, default=1000)
+    cmd.add_argument('-d', '--duration', type=float, default=10.0)
+    cmd.add_argument('--users', type=int, default=1)
+    cmd.add_argument('file')
+    cmd.set_defaults(func=synth)
+
+    cmd = sub.add_parser('replay', help='replay lookups against a gateway')
+    cmd.add_argument('-u', '--url', default='http://localhost:5000')
+    cmd.add_argument('-a', '--auth', default='good:user:user::500:500')
+    cmd.add_argument('--munge-socket', default=None,
+                     help='encode a munge credential per lookup')
+    cmd.add_argument('-c', '--concurrency', type=int, default=64)
+    cmd.add_argument('--speedup', type=float, default=1.0)
+    cmd.add_argument('file')
+    cmd.set_defaults(func=replay)
+
+    args = parser.parse_args()
+    return args.func(args)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
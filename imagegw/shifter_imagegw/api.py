@@ -95,7 +95,28 @@ def not_found(error=None):
 @app.route('/')
 def apihelp():
     """ API helper return """
-    return "{lookup,pull,expire,list}"
+    return "{lookup,pull,expire,list,health,ready}"
+
+
+# Health check
+# The process is up and serving requests
+@app.route('/api/health/', methods=["GET"])
+def health():
+    """ Liveness of this API process """
+    return jsonify({'status': 'ok', 'pid': os.getpid()})
+
+
+# Readiness check
+# This process can serve requests: it is not shutting down and mongo answers
+@app.route('/api/ready/', methods=["GET"])
+def ready():
+    """ Readiness of this API process """
+    (is_ready, message) = mgr.ready()
+    resp = jsonify({'ready': is_ready, 'message': message,
+                    'pid': os.getpid()})
+    if not is_ready:
+        resp.status_code = 503
+    return resp
 
 
 def create_response(rec):
@@ -212,6 +233,8 @@ def pull(system, imgtype, tag):
         # Convert to integers
         i['groupACL'] = map(lambda x: int(x),
                             data['allowed_gids'].split(','))
+    if 'priority' in data:
+        i['priority'] = data['priority']
     try:
         app.logger.debug(i)
         session = mgr.new_session(auth, system)
@@ -339,8 +362,9 @@ def queue(system):
     try:
         session = mgr.new_session(None, system)
         records = mgr.show_queue(session, system)
+        stages = mgr.worker_stats()
     except:
         app.logger.exception('Exception in queue')
         return not_found('%s' % (sys.exc_value))
-    resp = {'list': records}
+    resp = {'list': records, 'stages': stages}
     return jsonify(resp)
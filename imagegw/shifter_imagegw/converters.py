@@ -134,11 +134,13 @@ def writemeta(fmt, meta, metafile):
             meta_fd.write("ENTRY: %s\n" % (meta['entrypoint']))
         if 'workdir' in meta and meta['workdir'] is not None:
             meta_fd.write("WORKDIR: %s\n" % (meta['workdir']))
+        # ACLs are written sorted and unique so the runtime can use them
+        # without sorting
         if private and 'userACL' in meta and meta['userACL'] is not None:
-            acls = ','.join(map(lambda x: str(x), meta['userACL']))
+            acls = ','.join(map(str, sorted(set(map(int, meta['userACL'])))))
             meta_fd.write("USERACL: %s\n" % (acls))
         if private and 'groupACL' in meta and meta['groupACL'] is not None:
-            acls = ','.join(map(lambda x: str(x), meta['groupACL']))
+            acls = ','.join(map(str, sorted(set(map(int, meta['groupACL'])))))
             meta_fd.write("GROUPACL: %s\n" % (acls))
         if 'env' in meta and meta['env'] is not None:
             for keyval in meta['env']:
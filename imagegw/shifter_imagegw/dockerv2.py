@@ -496,6 +496,59 @@ class DockerV2Handle(object):
             layer = layer['child']
         return True
 
+    def get_layer_size(self, layer):
+        """
+        Ask the registry for the size of a layer blob.  Returns None if the
+        registry does not say.
+        """
+        path = "/v2/%s/blobs/%s" % (self.repo, layer)
+        url = self.url
+        while True:
+            conn = _setup_http_conn(url, self.cacert)
+            if conn is None:
+                return None
+            conn.request("HEAD", path, None, self.headers)
+            resp1 = conn.getresponse()
+            resp1.read()
+            location = resp1.getheader('location')
+            if resp1.status == 200:
+                break
+            elif resp1.status == 401 and self.auth_method == 'token':
+                self.do_token_auth(resp1.getheader('WWW-Authenticate'))
+                continue
+            elif location is not None:
+                match_obj = re.match(r'(https?)://(.*?)(/.*)', location)
+                url = '%s://%s' % (match_obj.groups()[0],
+                                   match_obj.groups()[1])
+                path = match_obj.groups()[2]
+            else:
+                return None
+        length = resp1.getheader('content-length')
+        if length is None:
+            return None
+        return int(length)
+
+    def get_layer_sizes(self, manifest):
+        """
+        List the layers to pull with their download size and, if the
+        manifest records it, their size once extracted.
+        """
+        if self.eldest is None:
+            self.examine_manifest(manifest)
+        sizes = []
+        layer = self.eldest
+        while layer is not None:
+            blobsum = layer['fsLayer']['blobSum']
+            if blobsum not in self.excludeBlobSums:
+                expanded = layer.get('Size')
+                if not isinstance(expanded, (int, long)) or expanded <= 0:
+                    expanded = None
+                sizes.append({'blobSum': blobsum,
+                              'size': self.get_layer_size(blobsum),
+                              'expanded': expanded})
+            layer = layer['child']
+        return sizes
+
     def _get_auth_header(self):
         """
         Helper function to generate the header.
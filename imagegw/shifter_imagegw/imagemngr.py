@@ -29,13 +29,17 @@ interactions with the Mongo Database and dispatches work through a thread pool.
 import json
 import sys
 import os
+import signal
+import socket
 import logging
 from subprocess import Popen, PIPE
 from time import time, sleep
 from pymongo import MongoClient
 import pymongo.errors
+from pymongo.errors import DuplicateKeyError
 from shifter_imagegw.auth import Authentication
-from shifter_imagegw.imageworker import WorkerThreads
+from shifter_imagegw.imageworker import WorkerThreads, RemoteWorkers, \
+    WorkerServer, PRIORITIES, DEFAULT_PRIORITY
 from multiprocessing.process import Process
 import atexit
 
@@ -44,6 +48,16 @@ import atexit
 # owing to AutoReconnect (e.g., mongod coming back, etc).  This may increase
 # the opportunity for race conditions, and should be more closely considered
 # for the insert/update functions
+# How long a process may own a pull before another may take it over, the
+# same as the heartbeat age at which a pull is considered hung
+PULL_LEASE = 3600
+# Failed pulls are cleaned up at most this often
+STATE_UPDATE_INTERVAL = 10
+# A lookup only pushes back the expiration of an image if it moves by more
+# than this
+EXPIRE_SLACK = 3600
+
+
 def mongo_reconnect_reattempt(call):
     """Automatically re-attempt potentially failed mongo operations"""
     def _mongo_reconnect_safe(self, *args, **kwargs):
@@ -65,9 +79,13 @@ class ImageMngr(object):
     and has public functions to lookup, pull and expire images.
     """
 
-    def __init__(self, config, logger=None, logname='imagemngr'):
+    def __init__(self, config, logger=None, logname='imagemngr',
+                 local_workers=False):
         """
-        Create an instance of the image manager.
+        Create an instance of the image manager.  With IMAGEGW_WORKER_SOCKET
+        set in the environment the work is handed to the pipeline served
+        there (see serve_workers) instead of to a pipeline of its own,
+        unless local_workers is set.
         """
         if logger is None and logname is None:
             self.logger = logging.getLogger(logname)
@@ -109,21 +127,82 @@ class ImageMngr(object):
         # Connect to database
         if 'MongoDBURI' not in self.config:
             raise NameError('MongoDBURI not defined')
-        self.workers = WorkerThreads()
-        self.status_queue = self.workers.get_updater_queue()
-        self.status_proc = Process(target=self.status_thread,
-                                   name='StatusThread')
-        self.status_proc.start()
-        atexit.register(self.shutdown)
+        self.draining = False
+        self.last_state_update = 0
+        address = os.environ.get('IMAGEGW_WORKER_SOCKET')
+        if address is not None and not local_workers:
+            # the pipeline process updates the records and owns the leases
+            self.workers = RemoteWorkers(address)
+            self.owner = self.workers.owner
+            self.status_proc = None
+        else:
+            self.workers = WorkerThreads(
+                threads=self.config.get('WorkerThreads', 1),
+                stages=self.config.get('WorkerStages'),
+                queue_depth=self.config.get('WorkerQueueDepth'),
+                user_limit=self.config.get('WorkerUserLimit', 0))
+            self.owner = '%s:%d' % (socket.gethostname(), os.getpid())
+            self.status_queue = self.workers.get_updater_queue()
+            self.status_proc = Process(target=self.status_thread,
+                                       name='StatusThread')
+            self.status_proc.start()
+            atexit.register(self.shutdown)
         self.mongo_init()
 
     def shutdown(self):
+        if self.status_proc is None:
+            return
         self.status_queue.put('stop')
+        self.status_proc.join(10)
+        self.status_proc = None
+
+    def drain(self, timeout):
+        """
+        Stop for a restart: wait up to timeout seconds for the pulls of
+        this process to finish.  The ones still running are marked failed
+        and their leases given up, so that the next pull starts them over.
+        """
+        self.draining = True
+        running = self.workers.drain(timeout)
+        # let the status process write out the updates it has first
+        self.shutdown()
+        for job in running:
+            (system, itype, tag) = job.key
+            self.logger.warn('Interrupting pull s=%s t=%s', system, tag)
+            for ident in job.updater.idents():
+                self._images_update({'_id': ident}, {'$set': {
+                    'status': 'FAILURE',
+                    'status_message': 'Interrupted by gateway restart',
+                    'last_pull': 0}})
+            self._pulls_remove({'_id': self._pull_key(system, itype, tag),
+                                'owner': self.owner})
+
+    def ready(self):
+        """
+        Readiness of this process to serve requests: not draining, the
+        status process is alive and mongo answers.
+        """
+        if self.draining:
+            return (False, 'draining')
+        if isinstance(self.workers, RemoteWorkers):
+            try:
+                self.workers.ping()
+            except OSError as err:
+                return (False, 'worker pipeline: %s' % err)
+        elif self.status_proc is None or not self.status_proc.is_alive():
+            return (False, 'status process not running')
+        try:
+            self.client.admin.command('ping')
+        except pymongo.errors.PyMongoError as err:
+            return (False, 'mongo: %s' % err)
+        return (True, 'ready')
 
     def mongo_init(self):
         client = MongoClient(self.config['MongoDBURI'])
         db_ = self.config['MongoDB']
+        self.client = client
         self.images = client[db_].images
+        self.pulls = client[db_].pulls
         self.metrics = None
         if 'Metrics' in self.config and self.config['Metrics'] is True:
             self.metrics = client[db_].metrics
@@ -145,6 +224,10 @@ class ImageMngr(object):
             if state == "FAILURE":
                 self.logger.warn("Operation failed for %s", ident)
 
+            if meta.get('kind') == 'pull' and \
+                    (state == 'READY' or state == 'FAILURE'):
+                self._release_pull(ident)
+
             # print "Status: %s" % (state)
             # A response message
             if state != 'READY':
@@ -239,17 +322,55 @@ class ImageMngr(object):
                 return True
         return False
 
-    def _resetexpire(self, ident):
-        """Reset the expire time.  (Not fully implemented)."""
+    def _resetexpire(self, ident, current=None):
+        """
+        Reset the expire time.  (Not fully implemented).
+        If the current expire time is given, it is only updated if it
+        moves by more than EXPIRE_SLACK, so lookup storms do not turn into
+        a write per lookup.
+        """
         # Change expire time for image
         # TODO shore up expire-time parsing
         expire_timeout = self.config['ImageExpirationTimeout']
         (days, hours, minutes, secs) = expire_timeout.split(':')
         expire = time() + int(secs) + 60 * (int(minutes) +
                                             60 * (int(hours) + 24 * int(days)))
+        if current is not None and current > expire - EXPIRE_SLACK:
+            return current
         self._images_update({'_id': ident}, {'$set': {'expiration': expire}})
         return expire
 
+    def _pull_key(self, system, itype, tag):
+        return '%s/%s/%s' % (system, itype, tag)
+
+    def _claim_pull(self, request):
+        """
+        Take the lease on pulling an image so that only one gateway process
+        pulls it.  Returns False if another process holds the lease.
+        """
+        now = time()
+        key = self._pull_key(request['system'], request['itype'],
+                             request['pulltag'])
+        try:
+            self._pulls_update({'_id': key, 'expires': {'$lt': now}},
+                               {'$set': {'owner': self.owner,
+                                         'expires': now + PULL_LEASE}},
+                               upsert=True)
+        except DuplicateKeyError:
+            return False
+        return True
+
+    def _release_pull(self, ident):
+        """
+        Give up the lease of this process on the pull with _id==ident.  A
+        lease taken over by another process is left alone.
+        """
+        rec = self._images_find_one({'_id': ident})
+        if rec is None or 'pulltag' not in rec:
+            return
+        key = self._pull_key(rec['system'], rec['itype'], rec['pulltag'])
+        self._pulls_remove({'_id': key, 'owner': self.owner})
+
     def _make_acl(self, acllist, id):
         if id not in acllist:
             acllist.append(id)
@@ -356,7 +477,7 @@ class ImageMngr(object):
         if rec is not None:
             if self._checkread(session, rec) is False:
                 return None
-            self._resetexpire(rec['_id'])
+            self._resetexpire(rec['_id'], rec.get('expiration'))
 
         if self.metrics is not None:
             self._add_metrics(session, image, rec)
@@ -397,6 +518,12 @@ class ImageMngr(object):
                         'image': record['pulltag']})
         return resp
 
+    def worker_stats(self):
+        """
+        Queue depth and throughput of each stage of the workers.
+        """
+        return self.workers.stats()
+
     def _isready(self, image):
         """Helper function to determine if an image is READY."""
         query = {
@@ -494,16 +621,26 @@ class ImageMngr(object):
         pull the image
         Takes an auth token, a request object
         Optional: testmode={0,1,2} See below...
+        The request may carry a priority (prolog, interactive or batch);
+        only root and admins may request prolog.
         """
         request = {
             'system': image['system'],
             'itype': image['itype'],
             'pulltag': image['tag']
         }
+        priority = image.get('priority', DEFAULT_PRIORITY)
         self.logger.debug('Pull called Test Mode=%d', testmode)
         if not self.check_session(session, request['system']):
             self.logger.warn('Invalid session on system %s', request['system'])
             raise OSError("Invalid Session")
+        if priority not in PRIORITIES:
+            raise OSError("Invalid priority %s" % priority)
+        if priority == 'prolog' and session.get('uid') != 0 and \
+                not self._isadmin(session, request['system']):
+            self.logger.warn('User %s may not pull with prolog priority',
+                             session.get('user'))
+            raise OSError("Priority prolog needs root or an admin")
         # If a pull request exist for this tag
         #  check to see if it is expired or a failure, if so remove it
         # otherwise
@@ -560,20 +697,47 @@ class ImageMngr(object):
             self.logger.debug("Pullable image")
             update = True
 
+        if update and not self._claim_pull(request):
+            # another gateway process is pulling it
+            self.logger.debug("Pull running elsewhere")
+            update = False
+            running = self._images_find_one({
+                'system': request['system'],
+                'itype': request['itype'],
+                'pulltag': request['pulltag'],
+                'status': {'$ne': 'READY'}
+            })
+            if running is not None:
+                rec = running
+
         if update:
-            self.logger.debug("Creating New Pull Record")
-            rec = self.new_pull_record(request)
-            ident = rec['_id']
-            self.logger.debug("ENQUEUEING Request")
-            self.update_mongo_state(ident, 'ENQUEUED')
-            request['tag'] = request['pulltag']
-            request['session'] = session
-            self.logger.debug("Calling do pull with queue=%s",
-                              request['system'])
-            self.workers.dopull(ident, request, testmode=testmode)
-
-            memo = "pull request queued s=%s t=%s" \
-                % (request['system'], request['tag'])
+            try:
+                self.logger.debug("Creating New Pull Record")
+                rec = self.new_pull_record(request)
+                ident = rec['_id']
+                self.logger.debug("ENQUEUEING Request")
+                self.update_mongo_state(ident, 'ENQUEUED')
+                request['tag'] = request['pulltag']
+                request['session'] = session
+                self.logger.debug("Calling do pull with queue=%s",
+                                  request['system'])
+                queued = self.workers.dopull(ident, request,
+                                             testmode=testmode,
+                                             priority=priority)
+            except:
+                # nothing will finish the pull and give the lease up
+                self._pulls_remove({
+                    '_id': self._pull_key(request['system'],
+                                          request['itype'],
+                                          request['pulltag']),
+                    'owner': self.owner})
+                raise
+            if queued:
+                memo = "pull request queued s=%s t=%s p=%s" \
+                    % (request['system'], request['tag'], priority)
+            else:
+                memo = "pull request attached to running pull s=%s t=%s" \
+                    % (request['system'], request['tag'])
             self.logger.info(memo)
 
             self.update_mongo(ident, {'last_pull': time()})
@@ -806,13 +970,17 @@ class ImageMngr(object):
 
     def update_states(self):
         """
-        Cleanup failed transcations after a period
+        Cleanup failed transcations after a period.  This runs at most
+        every STATE_UPDATE_INTERVAL seconds.
         """
-        for rec in self._images_find({'status': 'FAILURE'}):
-            nextpull = self.pullupdatetimeout + rec['last_pull']
-            # It it has been a while then let's clean up
-            if time() > nextpull:
-                self._images_remove({'_id': rec['_id']})
+        now = time()
+        if now - self.last_state_update < STATE_UPDATE_INTERVAL:
+            return
+        self.last_state_update = now
+        # It it has been a while then let's clean up
+        self._images_remove({'status': 'FAILURE',
+                             'last_pull': {'$lt': now -
+                                           self.pullupdatetimeout}})
 
     def autoexpire(self, session, system, testmode=0):
         """Auto expire images and do cleanup"""
@@ -907,6 +1075,16 @@ class ImageMngr(object):
         """ Decorated function to insert an image in mongo """
         return self.images.insert(*args, **kwargs)
 
+    @mongo_reconnect_reattempt
+    def _pulls_update(self, *args, **kwargs):
+        """ Decorated function to update pull leases in mongo """
+        return self.pulls.update(*args, **kwargs)
+
+    @mongo_reconnect_reattempt
+    def _pulls_remove(self, *args, **kwargs):
+        """ Decorated function to remove pull leases in mongo """
+        return self.pulls.remove(*args, **kwargs)
+
     @mongo_reconnect_reattempt
     def _metrics_insert(self, *args, **kwargs):
         """ Decorated function to insert an image in mongo """
@@ -914,6 +1092,30 @@ class ImageMngr(object):
             return self.metrics.insert(*args, **kwargs)
 
 
+def serve_workers(address, config_file, drain_timeout=100):
+    """
+    Run the worker pipeline of a gateway and serve it on the unix socket
+    address to the API processes, which then create their ImageMngr with
+    IMAGEGW_WORKER_SOCKET set to address.  On SIGTERM the running pulls are
+    given drain_timeout seconds to finish before the process exits.
+    """
+    with open(config_file) as handle:
+        config = json.load(handle)
+    mgr = ImageMngr(config, logname='imagemngr', local_workers=True)
+    if os.path.exists(address):
+        os.unlink(address)
+    server = WorkerServer(mgr.workers, mgr.owner, address)
+
+    def _stop(signum, frame):
+        mgr.drain(drain_timeout)
+        server.close()
+        sys.exit(0)
+
+    signal.signal(signal.SIGTERM, _stop)
+    mgr.logger.info('Serving the worker pipeline on %s', address)
+    server.serve_forever()
+
+
 def usage():
     """Print usage"""
     print "Usage: imagemngr <lookup|pull|expire>"
@@ -21,14 +21,20 @@ This module provides the worker function for the image gateway.
 """
 
 import json
+import hashlib
 import os
 import shutil
 import sys
 import subprocess
 import logging
 import tempfile
+import threading
+import traceback
+from collections import deque, OrderedDict
+from multiprocessing import Process, Pipe, current_process
+from multiprocessing.connection import Listener, Client
 from multiprocessing.queues import Queue
-from multiprocessing.pool import ThreadPool
+from Queue import Queue as StageQueue
 from time import time, sleep
 from random import randint
 from shifter_imagegw import CONFIG_PATH, dockerv2, converters, transfer
@@ -62,27 +68,398 @@ class Updater(object):
     """
     This is a helper class to update the status for the request.
     """
-    def __init__(self, ident, update_method):
-        """ init the updater. """
+    def __init__(self, ident, update_method, kind=None):
+        """ init the updater.  kind is sent along with each update. """
         self.ident = ident
         self.update_method = update_method
+        self.kind = kind
+        self.waiters = []
+        self.last = None
+        self.done = False
+        self.lock = threading.Lock()
+
+    def attach(self, ident):
+        """
+        Send the updates of this request to ident as well and replay the
+        latest one.  Returns False if the request already finished.
+        """
+        with self.lock:
+            if self.done:
+                return False
+            self.waiters.append(ident)
+            last = self.last
+        if last is not None and self.update_method is not None:
+            self.update_method(ident=ident, state=last[0], meta=last[1])
+        return True
+
+    def idents(self):
+        """ the request and the requests attached to it """
+        with self.lock:
+            return [self.ident] + self.waiters
 
     def update_status(self, state, message, response=None):
         """ update the status including the heartbeat and message """
+        metadata = {'heartbeat': time(),
+                    'message': message,
+                    'response': response,
+                    'kind': self.kind}
+        with self.lock:
+            self.last = (state, metadata)
+            if state in ('READY', 'FAILURE'):
+                self.done = True
+            idents = [self.ident] + self.waiters
         if self.update_method is not None:
-            metadata = {'heartbeat': time(),
-                        'message': message,
-                        'response': response}
-            self.update_method(ident=self.ident, state=state, meta=metadata)
+            for ident in idents:
+                self.update_method(ident=ident, state=state, meta=metadata)
+
+
+class DiskSpaceWait(Exception):
+    """ Raised by a step that has to wait for disk space """
+    pass
+
+
+class DiskBudget(object):
+    """
+    Disk space promised to running pulls.  A pull reserves what it still
+    needs on each filesystem and is admitted only while every filesystem
+    keeps min_free bytes free after all reservations.  As the pull writes
+    its files the reservation shrinks to what is left to write.
+    """
+    def __init__(self, min_free=0):
+        self.min_free = min_free
+        self.cond = threading.Condition()
+        self.reserved = {}
+
+    def _by_device(self, needs):
+        by_dev = {}
+        for (path, size) in needs.items():
+            dev = os.stat(path).st_dev
+            (prev, _) = by_dev.get(dev, (0, path))
+            by_dev[dev] = (prev + size, path)
+        return by_dev
+
+    def reserve(self, needs):
+        """
+        needs maps directories to bytes.  Returns the reservation or None
+        if there is not enough space now.  Raises OSError if the space
+        could never be found.
+        """
+        by_dev = self._by_device(needs)
+        with self.cond:
+            for (dev, (size, path)) in by_dev.items():
+                stat = os.statvfs(path)
+                if size + self.min_free > stat.f_blocks * stat.f_frsize:
+                    raise OSError('%d bytes needed in %s, more than the '
+                                  'filesystem holds' % (size, path))
+                free = stat.f_bavail * stat.f_frsize
+                if free - self.reserved.get(dev, 0) - self.min_free < size:
+                    return None
+            reservation = {}
+            for (dev, (size, _)) in by_dev.items():
+                self.reserved[dev] = self.reserved.get(dev, 0) + size
+                reservation[dev] = size
+            return reservation
+
+    def update(self, reservation, needs):
+        """
+        Shrink a reservation to what is still needed, e.g. once a stage
+        wrote its files
+        """
+        by_dev = self._by_device(needs)
+        with self.cond:
+            for dev in set(reservation.keys() + by_dev.keys()):
+                size = by_dev.get(dev, (0, None))[0]
+                self.reserved[dev] = self.reserved.get(dev, 0) + size - \
+                    reservation.get(dev, 0)
+                if self.reserved[dev] <= 0:
+                    del self.reserved[dev]
+                if size > 0:
+                    reservation[dev] = size
+                else:
+                    reservation.pop(dev, None)
+            self.cond.notify_all()
+
+    def release(self, reservation):
+        """ give back all of a reservation """
+        self.update(reservation, {})
+
+    def wait(self, timeout):
+        """ wait for space to be given back """
+        with self.cond:
+            self.cond.wait(timeout)
+
+
+DISK_BUDGET = DiskBudget(int(CONFIG.get('MinFreeSpaceMB', 0)) * 1024 * 1024)
+
+# Expanded size of a layer relative to its download when the manifest does
+# not record it, and of a squashfs image relative to the layers
+EXPAND_RATIO = 3
+IMAGE_RATIO = 1
+
+
+def estimate_disk_needs(layers, cachedir, expanddir):
+    """
+    Estimate the space a pull takes from the layer sizes: the layers not
+    yet in cachedir, plus the extracted tree and the image in expanddir.
+    Layers of unknown size are not counted.
+    """
+    download = 0
+    expanded = 0
+    image = 0
+    for layer in layers:
+        size = layer['size']
+        if size is None:
+            continue
+        if not os.path.exists(os.path.join(cachedir,
+                                           '%s.tar' % layer['blobSum'])):
+            download += size
+        if layer['expanded'] is not None:
+            expanded += layer['expanded']
+        else:
+            expanded += size * EXPAND_RATIO
+        image += size * IMAGE_RATIO
+    return {cachedir: download, expanddir: expanded + image}, image
+
+
+# Stages of the worker pipeline in order.  A pull goes through all of them
+# (or straight from download to transfer if the image is already on the
+# system), an import is hashed in the convert stage and an expire only runs
+# in the transfer stage.
+STAGES = ('download', 'examine', 'convert', 'transfer')
+DEFAULT_QUEUE_DEPTH = 4
+THROUGHPUT_WINDOW = 600
+HOLD_RETRY = 60
+
+# Pull priorities, highest first.  Pulls triggered by a job prolog are
+# waited on by a running allocation, interactive pulls by a user at a
+# terminal, and batch pulls by nobody in particular.
+PRIORITIES = ('prolog', 'interactive', 'batch')
+DEFAULT_PRIORITY = 'interactive'
+
+
+class Job(object):
+    """ A request making its way through the stages """
+    def __init__(self, kind, request, updater, testmode=0,
+                 priority=DEFAULT_PRIORITY, user=None):
+        if priority not in PRIORITIES:
+            raise ValueError('Unknown priority %s' % priority)
+        self.kind = kind
+        self.request = request
+        self.updater = updater
+        self.testmode = testmode
+        self.priority = priority
+        self.user = user
+        self.key = None
+        self.dedup = None
+        self.scheduled = False
+
+
+class FairShareQueue(object):
+    """
+    Queue for the first stage of pulls.  Jobs are taken highest priority
+    first and, within a priority, from the user with the fewest jobs in
+    the pipeline, round robin among equals.  A user with user_limit jobs
+    in the pipeline waits until one of them finishes (release).  Jobs
+    taken by get are marked as scheduled.
+    """
+    def __init__(self, user_limit=0):
+        self.user_limit = user_limit
+        self.cond = threading.Condition()
+        self.levels = dict((prio, OrderedDict()) for prio in PRIORITIES)
+        self.running = {}
+        self.count = 0
+
+    def put(self, item):
+        (job, _) = item
+        with self.cond:
+            users = self.levels[job.priority]
+            users.setdefault(job.user, deque()).append(item)
+            self.count += 1
+            self.cond.notify()
+
+    def _pick(self):
+        for prio in PRIORITIES:
+            users = self.levels[prio]
+            best = None
+            for user in users:
+                running = self.running.get(user, 0)
+                if self.user_limit > 0 and running >= self.user_limit:
+                    continue
+                if best is None or running < best[1]:
+                    best = (user, running)
+            if best is not None:
+                best = best[0]
+                items = users.pop(best)
+                item = items.popleft()
+                if len(items) > 0:
+                    # back of the line for this user
+                    users[best] = items
+                return item
+        return None
+
+    def get(self):
+        with self.cond:
+            while True:
+                item = self._pick()
+                if item is not None:
+                    break
+                self.cond.wait()
+            item[0].scheduled = True
+            user = item[0].user
+            self.running[user] = self.running.get(user, 0) + 1
+            self.count -= 1
+            return item
+
+    def release(self, user):
+        """ a job taken by get left the pipeline """
+        with self.cond:
+            self.running[user] -= 1
+            if self.running[user] == 0:
+                del self.running[user]
+            self.cond.notify_all()
+
+    def promote(self, job, priority):
+        """ move a queued job up to priority, returns False if not queued """
+        with self.cond:
+            if PRIORITIES.index(priority) >= PRIORITIES.index(job.priority):
+                return False
+            users = self.levels[job.priority]
+            items = users.get(job.user, ())
+            for item in items:
+                if item[0] is job:
+                    items.remove(item)
+                    if len(items) == 0:
+                        del users[job.user]
+                    job.priority = priority
+                    self.levels[priority].setdefault(job.user,
+                                                     deque()).append(item)
+                    self.cond.notify()
+                    return True
+            return False
+
+    def qsize(self):
+        with self.cond:
+            return self.count
+
+    def waiting(self):
+        """ number of queued jobs of each priority """
+        with self.cond:
+            return dict((prio, sum(len(x) for x in users.values()))
+                        for (prio, users) in self.levels.items())
+
+
+class Stage(object):
+    """
+    A bounded pool of threads taking jobs from a queue.  At most queue_depth
+    jobs handed over by the previous stage wait in the queue, so a slow
+    stage holds up the stage feeding it instead of letting work pile up on
+    disk.  New requests from the API are always accepted.
+    """
+    def __init__(self, name, workers, queue_depth, run_job, queue=None):
+        self.name = name
+        self.workers = workers
+        if queue is None:
+            queue = StageQueue()
+        self.queue = queue
+        self.slots = threading.BoundedSemaphore(queue_depth)
+        self.run_job = run_job
+        self.lock = threading.Lock()
+        self.active = 0
+        self.completed = 0
+        self.failed = 0
+        self.busy_time = 0.0
+        self.finished = deque(maxlen=1000)
+        self.threads = []
+        for idx in range(workers):
+            thread = threading.Thread(target=self._worker,
+                                      name='%s-%d' % (name, idx))
+            thread.daemon = True
+            thread.start()
+            self.threads.append(thread)
+
+    def put(self, job, handoff=False):
+        """
+        queue a job; a job handed over from another stage waits while the
+        queue is full
+        """
+        if handoff:
+            self.slots.acquire()
+        self.queue.put((job, handoff))
+
+    def _worker(self):
+        while True:
+            (job, handoff) = self.queue.get()
+            if handoff:
+                self.slots.release()
+            with self.lock:
+                self.active += 1
+            start = time()
+            try:
+                success = self.run_job(self, job)
+            except Exception:
+                logging.error("Worker: %s stage error: %s", self.name,
+                              traceback.format_exc())
+                success = False
+            end = time()
+            with self.lock:
+                self.active -= 1
+                self.busy_time += end - start
+                if success:
+                    self.completed += 1
+                    self.finished.append(end)
+                elif success is not None:
+                    self.failed += 1
+
+    def stats(self):
+        """ queue depth and throughput of the stage """
+        now = time()
+        with self.lock:
+            done = self.completed + self.failed
+            recent = len([x for x in self.finished
+                          if x > now - THROUGHPUT_WINDOW])
+            stats = {
+                'stage': self.name,
+                'workers': self.workers,
+                'queued': self.queue.qsize(),
+                'active': self.active,
+                'completed': self.completed,
+                'failed': self.failed,
+                'avg_seconds': self.busy_time / done if done > 0 else 0.0,
+                'per_minute': recent * 60.0 / THROUGHPUT_WINDOW,
+            }
+        if isinstance(self.queue, FairShareQueue):
+            stats['waiting'] = self.queue.waiting()
+        return stats
 
 
 class WorkerThreads(object):
-    def __init__(self, threads=1):
+    def __init__(self, threads=1, stages=None, queue_depth=None,
+                 user_limit=0):
         """
-        Initialize the thread pool and queues.
+        Initialize the stage pools and queues.  threads is the number of
+        workers of each stage unless stages gives a count for it.
+        user_limit caps the pulls of one user in the pipeline at once.
         """
-        self.pools = ThreadPool(processes=threads)
+        if stages is None:
+            stages = {}
+        if queue_depth is None:
+            queue_depth = DEFAULT_QUEUE_DEPTH
         self.updater_queue = Queue()
+        self.lock = threading.Lock()
+        self.inflight = {}
+        self.scheduler = FairShareQueue(user_limit=user_limit)
+        self.held = []
+        self.stages = dict()
+        for name in STAGES:
+            workers = max(1, int(stages.get(name, threads)))
+            queue = None
+            if name == 'download':
+                queue = self.scheduler
+            self.stages[name] = Stage(name, workers, queue_depth,
+                                      self._run_job, queue=queue)
+        thread = threading.Thread(target=self._retry_held, name='held')
+        thread.daemon = True
+        thread.start()
 
     def get_updater_queue(self):
         return self.updater_queue
@@ -93,47 +470,288 @@ class WorkerThreads(object):
         """
         self.updater_queue.put({'id': ident, 'state': state, 'meta': meta})
 
-    def pull(self, request, updater, testmode=0):
-        try:
-            pull(request, updater, testmode=testmode)
-        except Exception as err:
-            resp = {'error_type': str(type(err)),
-                    'message': str(err)}
-            updater.update_status('FAILURE', 'FAILURE', response=resp)
-
-    def expire(self, request, updater):
-        try:
-            remove_image(request, updater)
-        except Exception as err:
-            resp = {'error_type': str(type(err)),
-                    'message': str(err)}
-            updater.update_status('FAILURE', 'FAILURE', response=resp)
+    def stats(self):
+        """
+        Per-stage queue depth and throughput, in pipeline order
+        """
+        stats = [self.stages[name].stats() for name in STAGES]
+        with self.lock:
+            stats[0]['held'] = len(self.held)
+        return stats
 
-    def wrkimport(self, request, updater, testmode=0):
+    def drain(self, timeout):
+        """
+        Wait up to timeout seconds for the pulls in the pipeline to finish.
+        Returns the pulls still running.
+        """
+        end = time() + timeout
+        while True:
+            with self.lock:
+                running = self.inflight.values()
+            if len(running) == 0 or time() >= end:
+                return running
+            sleep(0.5)
+
+    def _retry_held(self):
+        """
+        Queue the jobs waiting for disk space again whenever space is given
+        back, and every HOLD_RETRY seconds for space freed by others
+        """
+        while True:
+            DISK_BUDGET.wait(HOLD_RETRY)
+            with self.lock:
+                held = self.held
+                self.held = []
+            for (name, job) in held:
+                self.stages[name].put(job)
+
+    def _finish(self, job):
+        """ job left the pipeline """
+        if job.dedup is not None:
+            with self.lock:
+                if self.inflight.get(job.dedup) is job:
+                    del self.inflight[job.dedup]
+        if job.scheduled:
+            self.scheduler.release(job.user)
+
+    def _run_job(self, stage, job):
+        """
+        Run one stage of a job and hand it to the next stage.
+        Returns False if the job failed and None if it is held until
+        there is disk space.
+        """
+        request = job.request
         try:
-            img_import(request, updater, testmode=testmode)
+            nxt = STAGE_STEPS[job.kind][stage.name](request, job.updater,
+                                                    job.testmode)
+        except DiskSpaceWait as err:
+            logging.info("Worker: holding %s of %s: %s", job.kind,
+                         request.get('tag'), err)
+            job.updater.update_status('ENQUEUED', str(err))
+            if job.scheduled:
+                job.scheduled = False
+                self.scheduler.release(job.user)
+            with self.lock:
+                self.held.append((stage.name, job))
+            return None
         except Exception as err:
+            logging.error("Worker: %s %s failed system=%s tag=%s: %s",
+                          job.kind, stage.name, request.get('system'),
+                          request.get('tag'), err)
+            logging.debug(traceback.format_exc())
             resp = {'error_type': str(type(err)),
                     'message': str(err)}
-            updater.update_status('FAILURE', 'FAILURE', response=resp)
+            job.updater.update_status('FAILURE', 'FAILURE', response=resp)
+            if job.kind != 'expire':
+                cleanup_temporary(request,
+                                  import_image=(job.kind == 'import'))
+            self._finish(job)
+            return False
+        if nxt is None:
+            self._finish(job)
+        else:
+            self.stages[nxt].put(job, handoff=True)
+        return True
 
-    def dopull(self, ident, request, testmode=0):
+    def dopull(self, ident, request, testmode=0, priority=DEFAULT_PRIORITY):
         """
-        Kick off a pull operation.
+        Kick off a pull operation.  If the same image is already being
+        pulled with the same ACLs and registry credentials, ident is
+        attached to that pull instead and False is returned.
         """
-        updater = Updater(ident, self.updater)
-        self.pools.apply_async(self.pull, [request, updater],
-                               {'testmode': testmode})
+        user = None
+        if 'session' in request:
+            user = request['session'].get('user')
+        key = (request['system'], request.get('itype'), request['tag'])
+        token = _registry_token(request, _get_location(request['tag'])[0])
+        if token is not None:
+            token = hashlib.sha256(token).hexdigest()
+        dedup = (key, tuple(sorted(request.get('userACL', []))),
+                 tuple(sorted(request.get('groupACL', []))), token)
+        with self.lock:
+            job = self.inflight.get(dedup)
+            if job is not None and job.updater.attach(ident):
+                logging.debug("Worker: attached %s to pull of %s", ident,
+                              request['tag'])
+                self.scheduler.promote(job, priority)
+                return False
+            updater = Updater(ident, self.updater, kind='pull')
+            job = Job('pull', request, updater, testmode=testmode,
+                      priority=priority, user=user)
+            job.key = key
+            job.dedup = dedup
+            self.inflight[dedup] = job
+        self.stages['download'].put(job)
+        return True
 
     def doexpire(self, ident, request, testmode=0):
-        updater = Updater(ident, self.updater)
-        self.pools.apply_async(self.expire, [request, updater])
+        updater = Updater(ident, self.updater, kind='expire')
+        self.stages['transfer'].put(Job('expire', request, updater,
+                                        testmode=testmode))
 
     def dowrkimport(self, ident, request, testmode=0):
         logging.debug("wrkimport starting")
-        updater = Updater(ident, self.updater)
-        self.pools.apply_async(self.wrkimport, [request, updater],
-                               {'testmode': testmode})
+        updater = Updater(ident, self.updater, kind='import')
+        self.stages['convert'].put(Job('import', request, updater,
+                                       testmode=testmode))
+
+
+# calls API processes may make on the worker pipeline of another process
+REMOTE_CALLS = ('dopull', 'doexpire', 'dowrkimport', 'stats', 'owner',
+                'ping')
+
+
+class WorkerServer(object):
+    """
+    Serve the worker pipeline of this process to other processes on a unix
+    socket, so that all API processes of a gateway share one pipeline, one
+    disk budget and one fair-share queue.  Only processes forked from the
+    same parent (sharing its authkey) may connect.
+    """
+    def __init__(self, workers, owner, address):
+        self.workers = workers
+        self.owner = owner
+        self.running = True
+        self.listener = Listener(str(address), family='AF_UNIX',
+                                 authkey=current_process().authkey)
+
+    def serve_forever(self):
+        while self.running:
+            try:
+                conn = self.listener.accept()
+            except Exception:
+                if not self.running:
+                    return
+                logging.warn("Worker: rejected connection: %s",
+                             sys.exc_value)
+                continue
+            thread = threading.Thread(target=self._serve, args=(conn,))
+            thread.daemon = True
+            thread.start()
+
+    def close(self):
+        """ stop accepting connections and remove the socket """
+        self.running = False
+        self.listener.close()
+
+    def _serve(self, conn):
+        while True:
+            try:
+                (method, args, kwargs) = conn.recv()
+            except (EOFError, IOError):
+                conn.close()
+                return
+            try:
+                if method not in REMOTE_CALLS:
+                    raise ValueError('Unknown call %s' % method)
+                if method == 'owner':
+                    result = self.owner
+                elif method == 'ping':
+                    result = True
+                else:
+                    result = getattr(self.workers, method)(*args, **kwargs)
+                conn.send((True, result))
+            except Exception as err:
+                conn.send((False, '%s: %s' % (type(err).__name__, err)))
+
+
+class RemoteWorkers(object):
+    """
+    Stand-in for WorkerThreads handing the work to the pipeline of another
+    process through a WorkerServer
+    """
+    def __init__(self, address, connect_timeout=30):
+        self.address = str(address)
+        self.connect_timeout = connect_timeout
+        self.conn = None
+        self.lock = threading.Lock()
+        self._owner = None
+
+    def _connect(self):
+        end = time() + self.connect_timeout
+        while True:
+            try:
+                return Client(self.address, family='AF_UNIX',
+                              authkey=current_process().authkey)
+            except (IOError, OSError):
+                # the pipeline process may still be starting
+                if time() >= end:
+                    raise OSError('Worker pipeline at %s unavailable' %
+                                  self.address)
+                sleep(0.5)
+
+    def _call(self, method, *args, **kwargs):
+        with self.lock:
+            if self.conn is None:
+                self.conn = self._connect()
+            try:
+                self.conn.send((method, args, kwargs))
+                (success, result) = self.conn.recv()
+            except (EOFError, IOError):
+                self.conn = None
+                raise OSError('Lost connection to the worker pipeline')
+        if not success:
+            raise OSError(result)
+        return result
+
+    @property
+    def owner(self):
+        """ identity of the pipeline process, used for pull leases """
+        if self._owner is None:
+            self._owner = self._call('owner')
+        return self._owner
+
+    def ping(self):
+        return self._call('ping')
+
+    def stats(self):
+        return self._call('stats')
+
+    def dopull(self, ident, request, testmode=0, priority=DEFAULT_PRIORITY):
+        return self._call('dopull', ident, request, testmode=testmode,
+                          priority=priority)
+
+    def doexpire(self, ident, request, testmode=0):
+        return self._call('doexpire', ident, request, testmode=testmode)
+
+    def dowrkimport(self, ident, request, testmode=0):
+        return self._call('dowrkimport', ident, request, testmode=testmode)
+
+    def drain(self, timeout):
+        """ the pulls belong to the pipeline process, not this one """
+        return []
+
+
+def _run_in_process(func, *args, **kwargs):
+    """
+    Run func in a forked child so that CPU-bound Python work does not hold
+    the GIL of the gateway.  Exceptions are re-raised in the caller as
+    OSError with the original message.
+    """
+    (parent_conn, child_conn) = Pipe(duplex=False)
+
+    def _child():
+        parent_conn.close()
+        try:
+            func(*args, **kwargs)
+            child_conn.send(None)
+        except Exception as err:
+            child_conn.send('%s: %s' % (type(err).__name__, err))
+        child_conn.close()
+
+    proc = Process(target=_child)
+    proc.start()
+    child_conn.close()
+    try:
+        error = parent_conn.recv()
+    except EOFError:
+        error = 'child exited without a result'
+    parent_conn.close()
+    proc.join()
+    if error is None and proc.exitcode != 0:
+        error = 'child exited with status %s' % proc.exitcode
+    if error is not None:
+        raise OSError(error)
 
 
 def _get_cacert(location):
@@ -151,6 +769,33 @@ def _get_cacert(location):
     return cacert
 
 
+def _get_location(tag):
+    """
+    Split the registry location off a tag.  Returns the location and the
+    rest of the tag.
+    """
+    location = CONFIG['DefaultImageLocation']
+    if tag.find('/') > 0:
+        parts = tag.split('/')
+        if parts[0] in CONFIG['Locations']:
+            # This is a location
+            location = parts[0]
+            tag = '/'.join(parts[1:])
+    return (location, tag)
+
+
+def _registry_token(request, location):
+    """ The user:password the request pulls from location with, or None """
+    if ('session' in request and 'tokens' in request['session'] and
+            request['session']['tokens']):
+        tokens = request['session']['tokens']
+        if location in tokens:
+            return tokens[location]
+        elif 'default' in tokens:
+            return tokens['default']
+    return None
+
+
 def _pull_dockerv2(request, location, repo, tag, updater):
     """ Private method to pull a docker images. """
     cdir = CONFIG['CacheDirectory']
@@ -169,16 +814,10 @@ def _pull_dockerv2(request, location, repo, tag, updater):
         if 'authMethod' in params:
             options['authMethod'] = params['authMethod']
 
-        if ('session' in request and 'tokens' in request['session'] and
-                request['session']['tokens']):
-            if location in request['session']['tokens']:
-                userpass = request['session']['tokens'][location]
-                options['username'] = userpass.split(':')[0]
-                options['password'] = ''.join(userpass.split(':')[1:])
-            elif ('default' in request['session']['tokens']):
-                userpass = request['session']['tokens']['default']
-                options['username'] = userpass.split(':')[0]
-                options['password'] = ''.join(userpass.split(':')[1:])
+        userpass = _registry_token(request, location)
+        if userpass is not None:
+            options['username'] = userpass.split(':')[0]
+            options['password'] = ''.join(userpass.split(':')[1:])
         imageident = '%s:%s' % (repo, tag)
         dock = dockerv2.DockerV2Handle(imageident, options, updater=updater)
         updater.update_status("PULLING", 'Getting manifest')
@@ -189,6 +828,14 @@ def _pull_dockerv2(request, location, repo, tag, updater):
         if check_image(request):
             return True
 
+        (needs, image) = estimate_disk_needs(dock.get_layer_sizes(manifest),
+                                             cdir, edir)
+        reservation = DISK_BUDGET.reserve(needs)
+        if reservation is None:
+            raise DiskSpaceWait('Waiting for %d MB of disk space' %
+                                (sum(needs.values()) / (1024 * 1024)))
+        request['disk_reservation'] = reservation
+
         dock.pull_layers(manifest, cdir)
 
         expandedpath = tempfile.mkdtemp(suffix='extract',
@@ -196,9 +843,13 @@ def _pull_dockerv2(request, location, repo, tag, updater):
         request['expandedpath'] = expandedpath
 
         updater.update_status("PULLING", 'Extracting Layers')
-        dock.extract_docker_layers(expandedpath, dock.get_eldest_layer(),
-                                   cachedir=cdir)
+        _run_in_process(dock.extract_docker_layers, expandedpath,
+                        dock.get_eldest_layer(), cachedir=cdir)
+        # the layers and tree are on disk now, only the image is to come
+        DISK_BUDGET.update(reservation, {edir: image})
         return True
+    except DiskSpaceWait:
+        raise
     except:
         logging.warn(sys.exc_value)
         raise
@@ -216,14 +867,7 @@ def pull_image(request, updater):
     rtype = None
 
     # See if there is a location specified
-    location = CONFIG['DefaultImageLocation']
-    tag = request['tag']
-    if tag.find('/') > 0:
-        parts = tag.split('/')
-        if parts[0] in CONFIG['Locations']:
-            # This is a location
-            location = parts[0]
-            tag = '/'.join(parts[1:])
+    (location, tag) = _get_location(request['tag'])
 
     parts = tag.split(':')
     if len(parts) == 2:
@@ -396,47 +1040,53 @@ def remove_image(request, updater):
         raise OSError('Expire failed')
 
 
+def _remove_temporary(request, item):
+    """
+    Helper function to remove one temporary file or directory of a request.
+    """
+    if item not in request or request[item] is None:
+        return
+    cleanitem = request[item]
+    if isinstance(cleanitem, unicode):
+        cleanitem = str(cleanitem)
+
+    if not isinstance(cleanitem, str):
+        raise ValueError('Invalid type for %s,%s' %
+                         (item, type(cleanitem)))
+    if cleanitem == '' or cleanitem == '/':
+        raise ValueError('Invalid value for %s: %s' % (item, cleanitem))
+    if not cleanitem.startswith(CONFIG['ExpandDirectory']):
+        raise ValueError('Invalid location for %s: %s' % (item, cleanitem))
+    if os.path.exists(cleanitem):
+        logging.info("Worker: removing %s", cleanitem)
+        try:
+            subprocess.call(['chmod', '-R', 'u+w', cleanitem])
+            if os.path.isdir(cleanitem):
+                shutil.rmtree(cleanitem, ignore_errors=True)
+            else:
+                os.unlink(cleanitem)
+        except:
+            logging.error("Worker: caught exception while trying to "
+                          "clean up (%s) %s.", item, cleanitem)
+
+
 def cleanup_temporary(request, import_image=False):
     """
-    Helper function to cleanup any temporary files or directories.
+    Helper function to cleanup any temporary files or directories and give
+    back the disk space reserved for them.
     """
     if not import_image:
         items = ('expandedpath', 'imagefile', 'metafile')
     else:
         items = ('expandedpath', 'metafile')
     for item in items:
-        if item not in request or request[item] is None:
-            continue
-        cleanitem = request[item]
-        if isinstance(cleanitem, unicode):
-            cleanitem = str(cleanitem)
-
-        if not isinstance(cleanitem, str):
-            raise ValueError('Invalid type for %s,%s' %
-                             (item, type(cleanitem)))
-        if cleanitem == '' or cleanitem == '/':
-            raise ValueError('Invalid value for %s: %s' % (item, cleanitem))
-        if not cleanitem.startswith(CONFIG['ExpandDirectory']):
-            raise ValueError('Invalid location for %s: %s' % (item, cleanitem))
-        if os.path.exists(cleanitem):
-            logging.info("Worker: removing %s", cleanitem)
-            try:
-                subprocess.call(['chmod', '-R', 'u+w', cleanitem])
-                if os.path.isdir(cleanitem):
-                    shutil.rmtree(cleanitem, ignore_errors=True)
-                else:
-                    os.unlink(cleanitem)
-            except:
-                logging.error("Worker: caught exception while trying to "
-                              "clean up (%s) %s.", item, cleanitem)
+        _remove_temporary(request, item)
+    if request.get('disk_reservation'):
+        DISK_BUDGET.release(request['disk_reservation'])
 
 
-def pull(request, updater, testmode=0):
-    """
-    Main task to do the full workflow of pulling an image and transferring it
-    """
-    tag = request['tag']
-    logging.debug("dopull system=%s tag=%s", request['system'], tag)
+def _pull_testmode(request, updater, testmode):
+    """ simulated pull used by the tests """
     if testmode == 1:
         states = ('PULLING', 'EXAMINATION', 'CONVERSION', 'TRANSFER')
         for state in states:
@@ -453,71 +1103,87 @@ def pull(request, updater, testmode=0):
         state = 'READY'
         updater.update_status(state, state, ret)
         return ret
-    elif testmode == 2:
-        logging.info("Worker: testmode 2 setting failure")
-        raise OSError('task failed')
-    try:
-        # Step 1 - Do the pull
-        updater.update_status('PULLING', 'PULLING')
-        logging.info(request)
-        if not pull_image(request, updater=updater):
-            logging.info("Worker: Pull failed")
-            raise OSError('Pull failed')
-
-        if 'meta' not in request:
-            raise OSError('Metadata not populated')
-
-        if not check_image(request):
-            # Step 2 - Check the image
-            updater.update_status('EXAMINATION', 'Examining image')
-            logging.debug("Worker: examining image %s" % tag)
-            if not examine_image(request):
-                raise OSError('Examine failed')
-            # Step 3 - Convert
-            updater.update_status('CONVERSION', 'Converting image')
-            logging.debug("Worker: converting image %s" % tag)
-            if not convert_image(request):
-                raise OSError('Conversion failed')
-            if not write_metadata(request):
-                raise OSError('Metadata creation failed')
-            # Step 4 - TRANSFER
-            updater.update_status('TRANSFER', 'Transferring image')
-            logging.debug("Worker: transferring image %s", tag)
-            if not transfer_image(request):
-                raise OSError('Transfer failed')
-        else:
-            logging.debug("Need to update metadata")
-            request['format'] = get_image_format(request)
-
-            if not write_metadata(request):
-                raise OSError('Metadata creation failed')
-            updater.update_status('TRANSFER', 'Transferring metadata')
-            logging.debug("Worker: transferring metadata %s", request['tag'])
-            if not transfer_image(request, meta_only=True):
-                raise OSError('Transfer failed')
-
-        # Done
-        updater.update_status('READY', 'Image ready', response=request['meta'])
-        cleanup_temporary(request)
-        return request['meta']
+    logging.info("Worker: testmode 2 setting failure")
+    raise OSError('task failed')
 
-    except:
-        logging.error("ERROR: dopull failed system=%s tag=%s",
-                      request['system'], request['tag'])
-        print sys.exc_value
-        updater.update_state('FAILURE', 'FAILED')
 
-        # TODO: add a debugging flag and only disable cleanup if debugging
-        cleanup_temporary(request)
-        raise
+def _pull_download(request, updater, testmode=0):
+    """
+    Pull step 1: download and extract the image.  Returns the next stage.
+    """
+    if testmode:
+        _pull_testmode(request, updater, testmode)
+        return None
+    logging.debug("dopull system=%s tag=%s", request['system'],
+                  request['tag'])
+    updater.update_status('PULLING', 'PULLING')
+    logging.info(request)
+    if not pull_image(request, updater=updater):
+        logging.info("Worker: Pull failed")
+        raise OSError('Pull failed')
+
+    if 'meta' not in request:
+        raise OSError('Metadata not populated')
+
+    if check_image(request):
+        # only the metadata needs to be updated
+        logging.debug("Need to update metadata")
+        request['format'] = get_image_format(request)
+        if not write_metadata(request):
+            raise OSError('Metadata creation failed')
+        request['meta_only'] = True
+        return 'transfer'
+    return 'examine'
+
+
+def _pull_examine(request, updater, testmode=0):
+    """ Pull step 2: check the image """
+    updater.update_status('EXAMINATION', 'Examining image')
+    logging.debug("Worker: examining image %s" % request['tag'])
+    if not examine_image(request):
+        raise OSError('Examine failed')
+    return 'convert'
+
+
+def _pull_convert(request, updater, testmode=0):
+    """ Pull step 3: convert the image and write its metadata """
+    updater.update_status('CONVERSION', 'Converting image')
+    logging.debug("Worker: converting image %s" % request['tag'])
+    if not convert_image(request):
+        raise OSError('Conversion failed')
+    if not write_metadata(request):
+        raise OSError('Metadata creation failed')
+    # the extracted tree is not needed for the transfer
+    _remove_temporary(request, 'expandedpath')
+    request['expandedpath'] = None
+    if request.get('disk_reservation'):
+        DISK_BUDGET.release(request['disk_reservation'])
+    return 'transfer'
+
+
+def _pull_transfer(request, updater, testmode=0):
+    """ Pull step 4: transfer the image, or only its metadata """
+    if request.get('meta_only'):
+        updater.update_status('TRANSFER', 'Transferring metadata')
+        logging.debug("Worker: transferring metadata %s", request['tag'])
+        if not transfer_image(request, meta_only=True):
+            raise OSError('Transfer failed')
+    else:
+        updater.update_status('TRANSFER', 'Transferring image')
+        logging.debug("Worker: transferring image %s", request['tag'])
+        if not transfer_image(request):
+            raise OSError('Transfer failed')
 
+    # Done
+    updater.update_status('READY', 'Image ready', response=request['meta'])
+    cleanup_temporary(request)
+    return None
 
-def img_import(request, updater, testmode=0):
+
+def _import_prepare(request, updater, testmode=0):
     """
-    Task to do the full workflow of copying an image and processing it
+    Import step 1: hash the image and write its metadata
     """
-    tag = request['tag']
-    logging.debug("img_import system=%s tag=%s", request['system'], tag)
     if testmode == 1:
         states = ('HASHING', 'TRANSFER', 'READY')
         for state in states:
@@ -533,42 +1199,110 @@ def img_import(request, updater, testmode=0):
         }
         state = 'READY'
         updater.update_status(state, state, ret)
-        return ret
+        request['meta'] = ret
+        return None
+    logging.debug("img_import system=%s tag=%s", request['system'],
+                  request['tag'])
+    # Step 0 - Check if path is valid
+    sysconf = CONFIG['Platforms'][request['system']]
+    if not transfer.check_file(request["filepath"], sysconf, logging,
+                               import_image=True):
+        raise OSError('Path not valid')
+    # Step 1 - Calculate the hash of the file
+    logging.debug("starting import hashing")
+    updater.update_status('HASHING', 'HASHING')
+    logging.info(request)
+    request['id'] = transfer.hash_file(request['filepath'], sysconf,
+                                       logging)
+    # Step 2 - Populate the metadata file
+    logging.debug("starting writing metadata")
+    if 'meta' not in request:
+        raise OSError('Metadata not populated')
+    request['meta']['format'] = request['format']
+    request['meta']['user'] = request['session']['user']
+    if not write_metadata(request):
+        logging.info("Writing metadata")
+        raise OSError('Metadata creation failed')
+    return 'transfer'
+
+
+def _import_transfer(request, updater, testmode=0):
+    """
+    Import step 2: copy the image and meta file from user space to the
+    shifter area
+    """
+    logging.debug("starting transfer")
+    request['imagefile'] = request['id']+'.'+request['format']
+    request['meta']['id'] = request['id']
+    updater.update_status('TRANSFER', 'TRANSFER')
+    if not transfer_image(request, import_image=True):
+        logging.warn("Worker: Import copy failed")
+        raise OSError("Import copy failed")
+
+    # Done
+    updater.update_status('READY', 'Image ready', response=request['meta'])
+    cleanup_temporary(request, import_image=True)
+    return None
+
+
+def _expire(request, updater, testmode=0):
+    remove_image(request, updater)
+    return None
+
+
+# step run by each stage for each kind of job
+STAGE_STEPS = {
+    'pull': {
+        'download': _pull_download,
+        'examine': _pull_examine,
+        'convert': _pull_convert,
+        'transfer': _pull_transfer,
+    },
+    'import': {
+        'convert': _import_prepare,
+        'transfer': _import_transfer,
+    },
+    'expire': {
+        'transfer': _expire,
+    },
+}
+
+
+def _run_steps(kind, first, request, updater, testmode=0):
+    """
+    Run the steps of a job one after the other in the calling thread
+    """
+    stage = first
+    while stage is not None:
+        stage = STAGE_STEPS[kind][stage](request, updater, testmode)
+    return request['meta']
+
+
+def pull(request, updater, testmode=0):
+    """
+    Main task to do the full workflow of pulling an image and transferring it
+    """
+    if testmode:
+        return _pull_testmode(request, updater, testmode)
     try:
-        # Step 0 - Check if path is valid
-        sysconf = CONFIG['Platforms'][request['system']]
-        if not transfer.check_file(request["filepath"], sysconf, logging,
-                                   import_image=True):
-            raise OSError('Path not valid')
-        # Step 1 - Calculate the hash of the file
-        logging.debug("starting import hashing")
-        updater.update_status('HASHING', 'HASHING')
-        logging.info(request)
-        request['id'] = transfer.hash_file(request['filepath'], sysconf,
-                                           logging)
-        # Step 2 - Populate the metadata file
-        logging.debug("starting writing metadata")
-        if 'meta' not in request:
-            raise OSError('Metadata not populated')
-        request['meta']['format'] = request['format']
-        request['meta']['user'] = request['session']['user']
-        if not write_metadata(request):
-            logging.info("Writing metadata")
-            raise OSError('Metadata creation failed')
-        # Step 3 - Copy image and meta file from user space to shifter area
-        logging.debug("starting transfer")
-        request['imagefile'] = request['id']+'.'+request['format']
-        request['meta']['id'] = request['id']
-        updater.update_status('TRANSFER', 'TRANSFER')
-        if not transfer_image(request, import_image=True):
-            logging.warn("Worker: Import copy failed")
-            raise OSError("Import copy failed")
-
-        # Done
-        updater.update_status('READY', 'Image ready', response=request['meta'])
-        cleanup_temporary(request, import_image=True)
-        return request['meta']
+        return _run_steps('pull', 'download', request, updater)
+    except:
+        logging.error("ERROR: dopull failed system=%s tag=%s",
+                      request['system'], request['tag'])
+        print sys.exc_value
+        updater.update_status('FAILURE', 'FAILED')
 
+        # TODO: add a debugging flag and only disable cleanup if debugging
+        cleanup_temporary(request)
+        raise
+
+
+def img_import(request, updater, testmode=0):
+    """
+    Task to do the full workflow of copying an image and processing it
+    """
+    try:
+        return _run_steps('import', 'convert', request, updater, testmode)
     except:
         logging.error("ERROR: img_import failed system=%s tag=%s",
                       request['system'], request['tag'])
@@ -19,12 +19,215 @@
 
 """
 Helper routines for munge
+
+Credentials are decoded in-process through libmunge when it can be loaded,
+falling back to the unmunge command otherwise.  Every decoded credential is
+remembered until it expires so that a replay is refused without another
+round trip to munged.
 """
 
 import sys
+import time
+import hashlib
+import threading
+import ctypes
+import ctypes.util
+import pwd
+import grp
+from collections import OrderedDict
 from subprocess import Popen, PIPE
 debug = False
 
+# set to False to always use the unmunge command
+native = True
+
+# munge.h
+MUNGE_OPT_TTL = 4
+MUNGE_OPT_ENCODE_TIME = 6
+MUNGE_OPT_SOCKET = 8
+EMUNGE_CRED_EXPIRED = 15
+EMUNGE_CRED_REPLAYED = 17
+
+# credentials older than this are never accepted by munged
+DEFAULT_TTL = 300
+REPLAY_CACHE_SIZE = 65536
+
+
+class ReplayCache(object):
+    """
+    Bounded record of decoded credentials, keyed by a digest of the
+    credential, kept until the credential expires.  Evicting a credential
+    early only means its replay is caught by munged instead.
+    """
+
+    def __init__(self, maxsize=REPLAY_CACHE_SIZE):
+        self.maxsize = maxsize
+        self.entries = OrderedDict()
+        self.lock = threading.Lock()
+
+    @staticmethod
+    def _key(encoded):
+        if not isinstance(encoded, bytes):
+            encoded = encoded.encode('utf-8')
+        return hashlib.sha256(encoded.strip()).hexdigest()
+
+    def _expire(self, now):
+        while len(self.entries) > 0:
+            key = next(iter(self.entries))
+            if self.entries[key] > now:
+                break
+            del self.entries[key]
+
+    def check(self, encoded):
+        """
+        raise OSError if the credential was already decoded and has not
+        expired
+        """
+        key = self._key(encoded)
+        with self.lock:
+            expires = self.entries.get(key)
+            if expires is not None and expires > time.time():
+                raise OSError("Replayed Credential")
+
+    def add(self, encoded, expires):
+        """
+        record a decoded credential until its expiration time
+        """
+        key = self._key(encoded)
+        with self.lock:
+            self._expire(time.time())
+            self.entries[key] = expires
+            while len(self.entries) > self.maxsize:
+                self.entries.popitem(last=False)
+
+    def clear(self):
+        with self.lock:
+            self.entries.clear()
+
+
+replay_cache = ReplayCache()
+
+_libmunge = None
+_libc = None
+_libmunge_lock = threading.Lock()
+_libmunge_loaded = False
+
+
+def _load_libmunge():
+    """
+    Load libmunge once; returns None if it is not available.
+    """
+    global _libmunge, _libc, _libmunge_loaded
+    with _libmunge_lock:
+        if _libmunge_loaded:
+            return _libmunge
+        _libmunge_loaded = True
+        try:
+            path = ctypes.util.find_library('munge')
+            if path is None:
+                return None
+            lib = ctypes.CDLL(path)
+            lib.munge_ctx_create.restype = ctypes.c_void_p
+            lib.munge_ctx_create.argtypes = []
+            lib.munge_ctx_destroy.restype = None
+            lib.munge_ctx_destroy.argtypes = [ctypes.c_void_p]
+            lib.munge_ctx_set.restype = ctypes.c_int
+            lib.munge_ctx_get.restype = ctypes.c_int
+            lib.munge_decode.restype = ctypes.c_int
+            lib.munge_decode.argtypes = [
+                ctypes.c_char_p, ctypes.c_void_p,
+                ctypes.POINTER(ctypes.c_void_p), ctypes.POINTER(ctypes.c_int),
+                ctypes.POINTER(ctypes.c_uint), ctypes.POINTER(ctypes.c_uint)]
+            lib.munge_strerror.restype = ctypes.c_char_p
+            lib.munge_strerror.argtypes = [ctypes.c_int]
+            libc = ctypes.CDLL(ctypes.util.find_library('c'))
+            libc.free.restype = None
+            libc.free.argtypes = [ctypes.c_void_p]
+        except (OSError, AttributeError):
+            return None
+        _libmunge = lib
+        _libc = libc
+        return _libmunge
+
+
+def _idname(ident, lookup):
+    try:
+        return lookup(ident)[0]
+    except KeyError:
+        return str(ident)
+
+
+def _unmunge_native(lib, encoded, socket=None):
+    """
+    Decode a credential with libmunge.  Returns the same dictionary as the
+    unmunge command output parsed by _unmunge_command, with the expiration
+    time of the credential in EXPIRES.
+    """
+    if not isinstance(encoded, bytes):
+        encoded = encoded.encode('utf-8')
+    # munge_ctx_set and munge_ctx_get are variadic, so the context must be
+    # passed as an explicit pointer rather than a converted int
+    ctx = ctypes.c_void_p(lib.munge_ctx_create())
+    if not ctx.value:
+        raise OSError("Failed to create munge context")
+    buf = ctypes.c_void_p()
+    length = ctypes.c_int(0)
+    uid = ctypes.c_uint(0)
+    gid = ctypes.c_uint(0)
+    try:
+        if socket is not None:
+            if not isinstance(socket, bytes):
+                socket = socket.encode('utf-8')
+            lib.munge_ctx_set(ctx, MUNGE_OPT_SOCKET, ctypes.c_char_p(socket))
+        err = lib.munge_decode(encoded.strip(), ctx, ctypes.byref(buf),
+                               ctypes.byref(length), ctypes.byref(uid),
+                               ctypes.byref(gid))
+        message = b''
+        if buf.value:
+            message = ctypes.string_at(buf, length.value)
+            ctypes.memset(buf, 0, length.value)
+            _libc.free(buf)
+        if err == EMUNGE_CRED_EXPIRED:
+            raise OSError("Expired Credential")
+        if err == EMUNGE_CRED_REPLAYED:
+            raise OSError("Replayed Credential")
+        elif err != 0:
+            memo = "Unknown munge error %d %s (%s)" % \
+                   (err, socket, lib.munge_strerror(err))
+            raise OSError(memo)
+
+        encode_time = ctypes.c_long(0)
+        ttl = ctypes.c_int(DEFAULT_TTL)
+        lib.munge_ctx_get(ctx, MUNGE_OPT_ENCODE_TIME, ctypes.byref(encode_time))
+        lib.munge_ctx_get(ctx, MUNGE_OPT_TTL, ctypes.byref(ttl))
+    finally:
+        lib.munge_ctx_destroy(ctx)
+
+    if not isinstance(message, str):
+        message = message.decode('utf-8', 'replace')
+    expires = encode_time.value + ttl.value
+    if encode_time.value <= 0:
+        expires = time.time() + ttl.value
+    return {
+        'STATUS': 'Success (0)',
+        'UID': '%s (%d)' % (_idname(uid.value, pwd.getpwuid), uid.value),
+        'GID': '%s (%d)' % (_idname(gid.value, grp.getgrgid), gid.value),
+        'TTL': str(ttl.value),
+        'LENGTH': str(len(message)),
+        'MESSAGE': message,
+        'EXPIRES': expires,
+    }
+
+
+def _parse_seconds(value):
+    """
+    Parse the trailing "(seconds)" of unmunge time output
+    """
+    try:
+        return int(value[value.rindex('(') + 1:value.rindex(')')])
+    except (ValueError, AttributeError):
+        return None
+
 
 def munge(text, socket=None):
     """
@@ -45,7 +248,24 @@ def unmunge(encoded, socket=None):
     """
     Unmunge an encoded string using an optional socket.
     returns a dictionary object.
-    raises exceptions if it fails.
+    raises exceptions if it fails, including for a credential that was
+    already decoded.
+    """
+    replay_cache.check(encoded)
+    lib = _load_libmunge() if native else None
+    if lib is not None:
+        resp = _unmunge_native(lib, encoded, socket)
+    else:
+        resp = _unmunge_command(encoded, socket)
+    if resp is None:
+        return None
+    replay_cache.add(encoded, resp.pop('EXPIRES'))
+    return resp
+
+
+def _unmunge_command(encoded, socket=None):
+    """
+    Unmunge an encoded string by running the unmunge command.
     """
     try:
         com = ["unmunge"]
@@ -81,6 +301,14 @@ def unmunge(encoded, socket=None):
         if resp['STATUS'] != 'Success (0)':
             return None
         resp['MESSAGE'] = message
+        encode_time = _parse_seconds(resp.get('ENCODE_TIME'))
+        try:
+            ttl = int(resp.get('TTL', DEFAULT_TTL))
+        except ValueError:
+            ttl = DEFAULT_TTL
+        if encode_time is None:
+            encode_time = time.time()
+        resp['EXPIRES'] = encode_time + ttl
         return resp
     except:
         if debug:
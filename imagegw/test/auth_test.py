@@ -18,6 +18,7 @@
 
 import os
 import unittest
+from shifter_imagegw import munge
 from shifter_imagegw.auth import Authentication
 
 
@@ -37,10 +38,13 @@ class AuthTestCase(unittest.TestCase):
             "Platforms": {self.system: {"mungeSocketPath": "/tmp/munge.s"}}
         }
         self.auth = Authentication(self.config)
+        munge.native = False
+        munge.replay_cache.clear()
 
     def tearDown(self):
         with open(self.test_dir + "munge.expired", 'w') as f:
             f.write('')
+        munge.native = True
 
     def test_auth(self):
         """ Test success """
@@ -76,7 +76,7 @@ class ConvertersTestCase(unittest.TestCase):
                 'env': ['a=b', 'c=d'],
                 'private': True,
                 'userACL': [1000, 1001],
-                'groupACL': [1002, 1003],
+                'groupACL': [1003, 1002, 1003],
                 }
         output = '%s/test.meta' % (self.outdir)
         resp = converters.writemeta('squashfs', meta, output)
@@ -97,6 +97,7 @@ class ConvertersTestCase(unittest.TestCase):
         if 'DISABLE_ACL_METADATA' not in os.environ:
             self.assertEquals(meta['USERACL'].find("["), -1)
             self.assertEquals(meta['USERACL'].find("]"), -1)
+            self.assertEquals(meta['GROUPACL'], '1002,1003')
         self.assertGreater(len(meta['ENV']), 0)
 
     def test_ext4(self):
@@ -43,6 +43,7 @@ class GWTestCase(unittest.TestCase):
             os.makedirs(p)
         self.images = client[db].images
         self.images.drop()
+        client[db].pulls.drop()
         self.metrics = client[db].metrics
         self.metrics.remove({})
         self.url = "/api"
@@ -152,6 +153,20 @@ class GWTestCase(unittest.TestCase):
         uri = '%s/queue/%s/' % (self.url, self.system)
         rv = self.app.get(uri, headers={AUTH_HEADER: self.auth})
         assert rv.status_code == 200
+        data = json.loads(rv.data)
+        stages = [x['stage'] for x in data['stages']]
+        self.assertEquals(stages,
+                          ['download', 'examine', 'convert', 'transfer'])
+
+    def test_health_ready(self):
+        rv = self.app.get('%s/health/' % (self.url))
+        assert rv.status_code == 200
+        data = json.loads(rv.data)
+        self.assertEquals(data['status'], 'ok')
+        rv = self.app.get('%s/ready/' % (self.url))
+        assert rv.status_code == 200
+        data = json.loads(rv.data)
+        self.assertTrue(data['ready'])
 
     def test_pulllookup(self):
         # Do a pull so we can create an image record
@@ -40,6 +40,8 @@ class ImageMngrTestCase(unittest.TestCase):
         self.images = client[db].images
         self.metrics = client[db].metrics
         self.images.drop()
+        self.pulls = client[db].pulls
+        self.pulls.drop()
         self.logger = logging.getLogger("imagemngr")
         if len(self.logger.handlers) < 1:
             print "Number of loggers %d" % (len(self.logger.handlers))
@@ -539,6 +541,93 @@ class ImageMngrTestCase(unittest.TestCase):
         state = self.m.get_state(id)
         self.assertEquals(state, 'FAILURE')
 
+    def test_pull_priority(self):
+        """
+        Pull with a priority and refuse an unknown one
+        """
+        pr = dict(self.pull)
+        session = self.m.new_session(self.auth, self.system)
+        pr['priority'] = 'bogus'
+        with self.assertRaises(OSError):
+            self.m.pull(session, pr, testmode=1)
+        # only root and admins may jump ahead of everybody else
+        pr['priority'] = 'prolog'
+        with self.assertRaises(OSError):
+            self.m.pull(session, pr, testmode=1)
+        pr['priority'] = 'batch'
+        rec = self.m.pull(session, pr, testmode=1)
+        assert rec is not None
+        state = self.time_wait(rec['_id'])
+        self.assertEquals(state, 'READY')
+        pr['priority'] = 'prolog'
+        session = self.m.new_session(self.authadmin, self.system)
+        rec = self.m.pull(session, pr, testmode=1)
+        assert rec is not None
+
+    def test_pull_lease(self):
+        """
+        Only one gateway process may pull an image at a time
+        """
+        request = {'system': self.system, 'itype': self.itype,
+                   'pulltag': self.tag}
+        assert self.m._claim_pull(request)
+        # a second process finds the lease taken
+        assert not self.m._claim_pull(request)
+        lease = self.pulls.find_one({})
+        self.assertEquals(lease['owner'], self.m.owner)
+        # an expired lease can be taken over
+        self.pulls.update({}, {'$set': {'expires': time.time() - 1}})
+        assert self.m._claim_pull(request)
+        # the pull in the other process is returned instead of a new one
+        session = self.m.new_session(self.auth, self.system)
+        pr = dict(self.pull)
+        rec = self.m.pull(session, pr, testmode=1)
+        assert rec is None
+        self.pulls.remove({})
+        rec = self.m.pull(session, pr, testmode=1)
+        assert rec is not None
+        rec2 = self.m.pull(session, pr, testmode=1)
+        self.assertEquals(rec['_id'], rec2['_id'])
+        state = self.time_wait(rec['_id'])
+        self.assertEquals(state, 'READY')
+        # the lease is given up when the pull completes
+        assert self.pulls.find_one({}) is None
+        # a lease taken over by another process is left alone
+        self.pulls.insert({'_id': self.m._pull_key(self.system, self.itype,
+                                                   self.tag),
+                           'owner': 'otherhost:1',
+                           'expires': time.time() + 100})
+        self.m._release_pull(rec['_id'])
+        assert self.pulls.find_one({}) is not None
+        self.pulls.remove({})
+        # a pull that fails before it is queued gives up its lease
+
+        def broken(image):
+            raise OSError('broken')
+        self.m.new_pull_record = broken
+        self.images.remove({})
+        with self.assertRaises(OSError):
+            self.m.pull(session, pr, testmode=1)
+        assert self.pulls.find_one({}) is None
+
+    def test_drain(self):
+        """
+        A restart marks unfinished pulls as failed and gives up their leases
+        """
+        session = self.m.new_session(self.auth, self.system)
+        rec = self.m.pull(session, dict(self.pull), testmode=1)
+        assert self.pulls.find_one({}) is not None
+        (ready, _) = self.m.ready()
+        assert ready
+        self.m.drain(0)
+        (ready, message) = self.m.ready()
+        assert not ready
+        self.assertEquals(message, 'draining')
+        rec = self.images.find_one({'_id': rec['_id']})
+        self.assertEquals(rec['status'], 'FAILURE')
+        assert self.m._pullable(rec)
+        assert self.pulls.find_one({}) is None
+
     def test_pull2(self):
         """
         Test pulling two different images
@@ -20,6 +20,8 @@ import os
 import unittest
 import json
 import shutil
+import time
+import threading
 DEBUG = False
 
 
@@ -241,6 +243,278 @@ class ImageWorkerTestCase(unittest.TestCase):
         self.assertFalse(result)
         self.imageworker.CONFIG.pop('examiner')
 
+    def _wait_states(self, workers, count, timeout=10):
+        states = []
+        start = time.time()
+        while len(states) < count and time.time() - start < timeout:
+            msg = workers.get_updater_queue().get(timeout=timeout)
+            states.append(msg['state'])
+        return states
+
+    def test_pipeline(self):
+        """ jobs move through the stages and are counted by each """
+        def step(nxt):
+            def _step(request, updater, testmode=0):
+                if 'fail' in request and request['fail'] == nxt:
+                    raise OSError('failed before %s' % nxt)
+                updater.update_status('STEP', 'STEP')
+                if nxt is None:
+                    updater.update_status('READY', 'READY')
+                return nxt
+            return _step
+        self.imageworker.STAGE_STEPS['fake'] = {
+            'download': step('examine'),
+            'examine': step('convert'),
+            'convert': step('transfer'),
+            'transfer': step(None),
+        }
+        workers = self.imageworker.WorkerThreads(threads=2,
+                                                 stages={'convert': 1},
+                                                 queue_depth=1)
+        try:
+            for idx in range(3):
+                updater = self.imageworker.Updater(idx, workers.updater)
+                job = self.imageworker.Job('fake', {}, updater)
+                workers.stages['download'].put(job)
+            states = self._wait_states(workers, 15)
+            self.assertEquals(states.count('READY'), 3)
+
+            updater = self.imageworker.Updater('bad', workers.updater)
+            job = self.imageworker.Job('fake', {'fail': 'transfer'}, updater)
+            workers.stages['download'].put(job)
+            states = self._wait_states(workers, 3)
+            self.assertEquals(states[-1], 'FAILURE')
+            time.sleep(0.5)
+            stats = workers.stats()
+            self.assertEquals([x['stage'] for x in stats],
+                              list(self.imageworker.STAGES))
+            self.assertEquals(stats[0]['workers'], 2)
+            self.assertEquals(stats[2]['workers'], 1)
+            self.assertEquals(stats[0]['completed'], 4)
+            self.assertEquals(stats[1]['completed'], 4)
+            self.assertEquals(stats[2]['completed'], 3)
+            self.assertEquals(stats[2]['failed'], 1)
+            self.assertEquals(stats[3]['completed'], 3)
+            self.assertEquals(stats[3]['queued'], 0)
+            self.assertEquals(workers.scheduler.running, {})
+        finally:
+            self.imageworker.STAGE_STEPS.pop('fake')
+
+    def test_pipeline_testmode(self):
+        workers = self.imageworker.WorkerThreads()
+        workers.dopull('id', dict(self.request), testmode=1)
+        states = self._wait_states(workers, 5)
+        self.assertEquals(states[-1], 'READY')
+        workers.dopull('id', dict(self.request), testmode=2)
+        states = self._wait_states(workers, 1)
+        self.assertEquals(states, ['FAILURE'])
+
+    def test_fair_share(self):
+        """ priority first, then the user with the fewest running jobs """
+        sched = self.imageworker.FairShareQueue(user_limit=2)
+        jobs = {}
+
+        def put(name, user, priority='interactive'):
+            jobs[name] = self.imageworker.Job('pull', {}, None,
+                                              priority=priority, user=user)
+            sched.put((jobs[name], False))
+
+        def get():
+            (job, _) = sched.get()
+            return [x for x in jobs if jobs[x] is job][0]
+
+        for idx in range(4):
+            put('a%d' % idx, 'alice')
+        put('b0', 'bob')
+        put('b1', 'bob')
+        put('c0', 'carol', priority='batch')
+        put('p0', 'carol', priority='prolog')
+        self.assertEquals(sched.qsize(), 8)
+        self.assertEquals(sched.waiting(),
+                          {'prolog': 1, 'interactive': 6, 'batch': 1})
+        self.assertEquals(get(), 'p0')
+        self.assertEquals(get(), 'a0')
+        self.assertEquals(get(), 'b0')
+        self.assertEquals(get(), 'a1')
+        self.assertEquals(get(), 'b1')
+        # alice and bob are at the limit, carol's batch pull goes
+        self.assertEquals(get(), 'c0')
+        self.assertTrue(sched.promote(jobs['a3'], 'prolog'))
+        self.assertFalse(sched.promote(jobs['a3'], 'batch'))
+        self.assertFalse(sched.promote(jobs['a0'], 'prolog'))
+        sched.release('alice')
+        self.assertEquals(get(), 'a3')
+        sched.release('alice')
+        sched.release('alice')
+        self.assertEquals(get(), 'a2')
+        self.assertEquals(sched.qsize(), 0)
+
+    def test_pull_dedup(self):
+        """ a second pull of the same image attaches to the first """
+        workers = self.imageworker.WorkerThreads()
+        self.assertTrue(workers.dopull('first', dict(self.request),
+                                       testmode=1))
+        time.sleep(0.5)
+        self.assertFalse(workers.dopull('second', dict(self.request),
+                                        testmode=1, priority='prolog'))
+        msgs = []
+        while len([x for x in msgs if x['state'] == 'READY']) < 2:
+            msgs.append(workers.get_updater_queue().get(timeout=10))
+        first = [x['state'] for x in msgs if x['id'] == 'first']
+        second = [x['state'] for x in msgs if x['id'] == 'second']
+        self.assertEquals(first, ['PULLING', 'EXAMINATION', 'CONVERSION',
+                                  'TRANSFER', 'READY'])
+        # the latest state is replayed on attach
+        self.assertEquals(second, first)
+        self.assertEquals(workers.stats()[0]['completed'], 1)
+        # different ACLs or registry credentials get a pull of their own
+        request = dict(self.request)
+        self.assertTrue(workers.dopull('first', request, testmode=1))
+        acl = dict(self.request, userACL=[1001])
+        self.assertTrue(workers.dopull('acl', acl, testmode=1))
+        creds = dict(self.request, session={'user': 'bob',
+                                            'tokens': {'default': 'bob:pw'}})
+        self.assertTrue(workers.dopull('creds', creds, testmode=1))
+        self.assertFalse(workers.dopull('again', dict(creds), testmode=1))
+        msgs = []
+        while len([x for x in msgs if x['state'] == 'READY']) < 4:
+            msgs.append(workers.get_updater_queue().get(timeout=10))
+        self.assertEquals(workers.stats()[0]['completed'], 4)
+        # a finished pull is not attached to
+        time.sleep(0.5)
+        self.assertTrue(workers.dopull('third', dict(self.request),
+                                       testmode=2))
+        self.assertEquals(self._wait_states(workers, 1), ['FAILURE'])
+
+    def test_disk_budget(self):
+        cdir = self.config['CacheDirectory']
+        stat = os.statvfs(cdir)
+        free = stat.f_bavail * stat.f_frsize
+        total = stat.f_blocks * stat.f_frsize
+        budget = self.imageworker.DiskBudget()
+        first = budget.reserve({cdir: free / 2})
+        self.assertIsNotNone(first)
+        # the first reservation leaves less than half
+        self.assertIsNone(budget.reserve({cdir: free / 2 + 1024 * 1024}))
+        with self.assertRaises(OSError):
+            budget.reserve({cdir: total + 1})
+        budget.update(first, {cdir: 1024})
+        self.assertEquals(first.values(), [1024])
+        second = budget.reserve({cdir: free / 2 + 1024 * 1024})
+        self.assertIsNotNone(second)
+        budget.release(first)
+        budget.release(second)
+        self.assertEquals(budget.reserved, {})
+        budget = self.imageworker.DiskBudget(min_free=free)
+        self.assertIsNone(budget.reserve({cdir: 1024 * 1024}))
+
+    def test_estimate_disk_needs(self):
+        cdir = self.config['CacheDirectory']
+        edir = os.path.join(cdir, 'expand')
+        cached = os.path.join(cdir, 'sha256:cached.tar')
+        with open(cached, 'w') as f:
+            f.write('x')
+        layers = [
+            {'blobSum': 'sha256:cached', 'size': 100, 'expanded': 250},
+            {'blobSum': 'sha256:new', 'size': 1000, 'expanded': None},
+            {'blobSum': 'sha256:unknown', 'size': None, 'expanded': None},
+        ]
+        try:
+            (needs, image) = \
+                self.imageworker.estimate_disk_needs(layers, cdir, edir)
+        finally:
+            os.remove(cached)
+        ratio = self.imageworker.EXPAND_RATIO
+        self.assertEquals(image, 1100 * self.imageworker.IMAGE_RATIO)
+        self.assertEquals(needs, {cdir: 1000,
+                                  edir: 250 + 1000 * ratio + image})
+
+    def test_disk_space_hold(self):
+        """ a pull waiting for disk space is held and retried """
+        waits = []
+
+        def download(request, updater, testmode=0):
+            if len(waits) == 0:
+                waits.append(time.time())
+                raise self.imageworker.DiskSpaceWait('Waiting for space')
+            updater.update_status('READY', 'READY')
+            return None
+        self.imageworker.STAGE_STEPS['fake'] = {'download': download}
+        workers = self.imageworker.WorkerThreads()
+        try:
+            updater = self.imageworker.Updater('held', workers.updater)
+            workers.stages['download'].put(
+                self.imageworker.Job('fake', {}, updater, user='alice'))
+            self.assertEquals(self._wait_states(workers, 1), ['ENQUEUED'])
+            time.sleep(0.5)
+            stats = workers.stats()
+            self.assertEquals(stats[0]['held'], 1)
+            self.assertEquals(stats[0]['completed'], 0)
+            self.assertEquals(workers.scheduler.running, {})
+            # space given back by another pull
+            self.imageworker.DISK_BUDGET.release({})
+            self.assertEquals(self._wait_states(workers, 1), ['READY'])
+            time.sleep(0.5)
+            stats = workers.stats()
+            self.assertEquals(stats[0]['held'], 0)
+            self.assertEquals(stats[0]['completed'], 1)
+        finally:
+            self.imageworker.STAGE_STEPS.pop('fake')
+
+    def test_drain(self):
+        workers = self.imageworker.WorkerThreads()
+        self.assertEquals(workers.drain(0), [])
+        workers.dopull('first', dict(self.request), testmode=1)
+        workers.dopull('second', dict(self.request), testmode=1)
+        running = workers.drain(0.5)
+        self.assertEquals(len(running), 1)
+        self.assertEquals(running[0].updater.idents(), ['first', 'second'])
+        self.assertEquals(workers.drain(10), [])
+
+    def test_remote_workers(self):
+        """ pulls handed over the socket run in the serving pipeline """
+        workers = self.imageworker.WorkerThreads()
+        address = os.path.join(self.config['CacheDirectory'], 'workers.sock')
+        server = self.imageworker.WorkerServer(workers, 'gw:1', address)
+        thread = threading.Thread(target=server.serve_forever)
+        thread.daemon = True
+        thread.start()
+        try:
+            remote = self.imageworker.RemoteWorkers(address)
+            self.assertTrue(remote.ping())
+            self.assertEquals(remote.owner, 'gw:1')
+            self.assertTrue(remote.dopull('id1', dict(self.request),
+                                          testmode=1))
+            # a second API process attaches to the running pull
+            other = self.imageworker.RemoteWorkers(address)
+            self.assertFalse(other.dopull('id2', dict(self.request),
+                                          testmode=1))
+            self.assertEquals(sorted(remote.stats()), sorted(workers.stats()))
+            with self.assertRaises(OSError):
+                remote._call('drain', 0)
+            self.assertEquals(remote.drain(0), [])
+            # both requests get the updates of the one pull
+            states = self._wait_states(workers, 10)
+            self.assertEquals(states[-2:], ['READY', 'READY'])
+        finally:
+            server.close()
+
+    def test_run_in_process(self):
+        path = os.path.join(self.config['CacheDirectory'], 'inprocess')
+
+        def touch(name, fail=False):
+            if fail:
+                raise ValueError('bad %s' % name)
+            with open(name, 'w') as f:
+                f.write(str(os.getpid()))
+
+        self.imageworker._run_in_process(touch, path)
+        with open(path) as f:
+            self.assertNotEquals(int(f.read()), os.getpid())
+        os.remove(path)
+        with self.assertRaises(OSError):
+            self.imageworker._run_in_process(touch, path, fail=True)
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -17,6 +17,7 @@
 # See LICENSE for full text.
 
 import os
+import time
 import unittest
 from shifter_imagegw import munge
 
@@ -31,10 +32,14 @@ class MungeTestCase(unittest.TestCase):
         self.expired = "expired"
         with open(self.test_dir + "munge.test", 'w') as f:
             f.write(self.encoded)
+        # the mock credentials are only understood by the mock unmunge
+        munge.native = False
+        munge.replay_cache.clear()
 
     def tearDown(self):
         with open(self.test_dir + "munge.expired", 'w') as f:
             f.write('')
+        munge.native = True
 
     def test_munge(self):
         resp = munge.munge(self.message)
@@ -56,6 +61,42 @@ class MungeTestCase(unittest.TestCase):
         with self.assertRaises(OSError):
             munge.unmunge(self.encoded)
 
+    def test_unmunge_replay_cached(self):
+        """ a recorded credential is refused without decoding it again """
+        munge.replay_cache.add(self.encoded, time.time() + 60)
+        with self.assertRaises(OSError):
+            munge.unmunge(self.encoded)
+        # the mock would still have accepted it
+        resp = munge._unmunge_command(self.encoded)
+        assert resp['MESSAGE'] == self.message
+
+    def test_replay_cache(self):
+        cache = munge.ReplayCache(maxsize=2)
+        now = time.time()
+        cache.add("a", now + 60)
+        with self.assertRaises(OSError):
+            cache.check("a\n")
+        cache.add("b", now - 1)
+        cache.check("b")
+        cache.add("c", now + 60)
+        cache.add("d", now + 60)
+        self.assertEquals(len(cache.entries), 2)
+        cache.check("a")
+        with self.assertRaises(OSError):
+            cache.check("d")
+
+    def test_unmunge_fallback(self):
+        """ without libmunge the unmunge command is used """
+        munge.native = True
+        load = munge._load_libmunge
+        munge._load_libmunge = lambda: None
+        try:
+            resp = munge.unmunge(self.encoded)
+        finally:
+            munge._load_libmunge = load
+        assert resp['MESSAGE'] == self.message
+        assert 'EXPIRES' not in resp
+
 
 if __name__ == '__main__':
     unittest.main()
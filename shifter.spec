@@ -231,6 +231,7 @@ getent group > %{_sysconfdir}/shifter_etc_files/group
 %{_libexecdir}/shifter/imagecli.py*
 %{_libexecdir}/shifter/imagegwapi.py*
 %{_libexecdir}/shifter/sitecustomize.py*
+%{_libexecdir}/shifter/gunicorn.conf.py*
 %{_datadir}/shifter/requirements.txt
 %{_sysconfdir}/imagemanager.json.example
 %if 0%{!?_without_systemd:1}
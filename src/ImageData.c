@@ -426,9 +426,27 @@ int _ImageData_assign(const char *key, const char *value, void *t_image) {
     return 0;
 }
 
+static int _compare_id(const void *a, const void *b) {
+    uid_t ida = *(const uid_t *) a;
+    uid_t idb = *(const uid_t *) b;
+    if (ida < idb) return -1;
+    if (ida > idb) return 1;
+    return 0;
+}
+
+/**
+ * _convert_to_list
+ * parse a comma separated list of numeric ids into a newly allocated array,
+ * sorted ascending and without duplicates so that check_image_permissions
+ * can binary search it for each of the user's groups.  The gateway writes the lists
+ * sorted already, in which case no sort is needed.
+ */
 size_t _convert_to_list(const char *text, uid_t **uids, size_t *n_uids) {
-    size_t id_capacity = 0;
+    size_t id_capacity = 1;
     size_t id_count = 0;
+    size_t idx = 0;
+    int sorted = 1;
+    const char *cptr = NULL;
     char *ptr = NULL;
     char *buffer = NULL;
     char *search = NULL;
@@ -444,6 +462,12 @@ size_t _convert_to_list(const char *text, uid_t **uids, size_t *n_uids) {
     }
     *n_uids = 0;
 
+    /* size the list once from the number of separators */
+    for (cptr = text; *cptr != 0; cptr++) {
+        if (*cptr == ',') id_capacity++;
+    }
+    *uids = (uid_t *) _malloc(sizeof(uid_t) * id_capacity);
+
     buffer = _strdup(text);
     search = shifter_trim(buffer);
     svPtr = NULL;
@@ -451,11 +475,6 @@ size_t _convert_to_list(const char *text, uid_t **uids, size_t *n_uids) {
         uid_t tmp = 0;
         size_t len = 0;
         search = NULL;
-        if (id_capacity < id_count + 2) {
-            size_t alloc_size = sizeof(uid_t) * (id_count + 2) * 2;
-            *uids = _realloc(*uids, alloc_size);
-            id_capacity = (id_count + 2) * 2;
-        }
         ptr = shifter_trim(ptr);
         len = strlen(ptr);
         if (len == 0)
@@ -463,26 +482,35 @@ size_t _convert_to_list(const char *text, uid_t **uids, size_t *n_uids) {
         tmp = (uid_t) strtoul(ptr, &endPtr, 10);
         if (endPtr != ptr + len)
             continue;
+        if (id_count > 0 && tmp <= (*uids)[id_count - 1])
+            sorted = 0;
         (*uids)[id_count++] = tmp;
         if (id_count > 1000) {
             fprintf(stderr, "ERROR: id list growing too large.\n");
-            goto error;
+            id_count = 0;
+            break;
         }
     }
-    *n_uids = id_count;
-
-    free(buffer);
-    buffer = NULL;
-    return id_count;
-error:
     free(buffer);
     buffer = NULL;
-    if (*uids) {
+
+    if (id_count == 0) {
         free(*uids);
         *uids = NULL;
+        return 0;
     }
-    *n_uids = 0;
-    return 0;
+    if (!sorted) {
+        size_t unique = 1;
+        qsort(*uids, id_count, sizeof(uid_t), _compare_id);
+        for (idx = 1; idx < id_count; idx++) {
+            if ((*uids)[idx] != (*uids)[unique - 1]) {
+                (*uids)[unique++] = (*uids)[idx];
+            }
+        }
+        id_count = unique;
+    }
+    *n_uids = id_count;
+    return id_count;
 }
 
 char *_ImageData_filterString(const char *input, int allowSlash) {
@@ -632,24 +660,41 @@ _error:
     return -1;
 }
 
+/* binary search of a sorted id list; ids are compared inline since this runs
+ * once per group of the user */
+static int _id_in_list(uid_t id, const uid_t *list, size_t n) {
+    size_t lo = 0;
+    size_t hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (list[mid] < id) {
+            lo = mid + 1;
+        } else if (list[mid] > id) {
+            hi = mid;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 int check_image_permissions(uid_t actualUid, gid_t actualGid, gid_t *aux_gids,
                             int naux_gids, ImageData *imageData)
 {
-    size_t iidx = 0;
-    size_t jidx = 0;
+    int idx = 0;
 
     if (imageData->n_uids == 0 && imageData->n_gids == 0)
         return 1;
 
-    for (iidx = 0; iidx < imageData->n_uids; iidx++)
-        if (imageData->uids[iidx] == actualUid)
-            return 1;
-    for (iidx = 0; iidx < imageData->n_gids; iidx++) {
-        if (imageData->gids[iidx] == actualGid)
+    /* the acl lists are kept sorted by _convert_to_list */
+    if (_id_in_list(actualUid, imageData->uids, imageData->n_uids))
+        return 1;
+    if (imageData->n_gids == 0)
+        return 0;
+    if (_id_in_list(actualGid, imageData->gids, imageData->n_gids))
+        return 1;
+    for (idx = 0; idx < naux_gids; idx++)
+        if (_id_in_list(aux_gids[idx], imageData->gids, imageData->n_gids))
             return 1;
-        for (jidx = 0; jidx < naux_gids; jidx++)
-            if (imageData->gids[iidx] == aux_gids[jidx])
-                return 1;
-    }
     return 0;
 }
@@ -69,8 +69,8 @@ typedef struct _ImageData {
     char *tag;              /*!< Image tag */
     char *type;             /*!< Image type */
     char *status;           /*!< Image status from gateway */
-    uid_t *uids;            /*!< list of user ids */
-    gid_t *gids;            /*!< list of group ids */
+    uid_t *uids;            /*!< sorted list of user ids */
+    gid_t *gids;            /*!< sorted list of group ids */
     size_t n_uids;
     size_t n_gids;
     size_t env_capacity;    /*!< Current # of allocated char* in env */
@@ -136,6 +136,9 @@ char *imageDesc_filterString(const char *target, const char *type);
 /**
  * check_image_permissions checks if an image can be used by a user
  *
+ * The image acl lists must be sorted, as parse_ImageData leaves them, so
+ * each of the user's groups costs one binary search of the group acl.
+ *
  * \param uid the numeric user id of the user
  * \param gid the numeric group id of the user
  * \param aux_gids array of auxiliary gids the user has access to
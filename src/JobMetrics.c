@@ -0,0 +1,495 @@
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "JobMetrics.h"
+#include "shifter_mem.h"
+#include "utility.h"
+
+void free_JobMetrics(JobMetrics *metrics, int freeStruct) {
+    if (metrics == NULL) return;
+    if (metrics->event != NULL) {
+        free(metrics->event);
+        metrics->event = NULL;
+    }
+    if (metrics->hostname != NULL) {
+        free(metrics->hostname);
+        metrics->hostname = NULL;
+    }
+    if (metrics->imageType != NULL) {
+        free(metrics->imageType);
+        metrics->imageType = NULL;
+    }
+    if (metrics->imageIdentifier != NULL) {
+        free(metrics->imageIdentifier);
+        metrics->imageIdentifier = NULL;
+    }
+    if (metrics->outcome != NULL) {
+        free(metrics->outcome);
+        metrics->outcome = NULL;
+    }
+    if (freeStruct) {
+        free(metrics);
+    }
+}
+
+int parse_JobMetrics_report(const char *line, JobMetrics *metrics) {
+    const char *ptr = NULL;
+    size_t tagLen = strlen(JOBMETRICS_REPORT_TAG);
+
+    if (line == NULL || metrics == NULL) return 1;
+    if (strncmp(line, JOBMETRICS_REPORT_TAG, tagLen) != 0) return 1;
+
+    for (ptr = line + tagLen; ptr && *ptr; ) {
+        while (*ptr == ' ' || *ptr == '\t') ptr++;
+        if (strncmp(ptr, "retries=", 8) == 0) {
+            metrics->retries += strtoul(ptr + 8, NULL, 10);
+        }
+        ptr = strchr(ptr, ' ');
+    }
+    return 0;
+}
+
+static char *_catJsonString(char *buffer, size_t *len, size_t *cap,
+        const char *key, const char *value)
+{
+    const char *ptr = NULL;
+    buffer = alloc_strcatf(buffer, len, cap, "\"%s\": \"", key);
+    for (ptr = value; ptr && *ptr; ptr++) {
+        if (*ptr == '"' || *ptr == '\\') {
+            buffer = alloc_strcatf(buffer, len, cap, "\\%c", *ptr);
+        } else if ((unsigned char) *ptr < 0x20) {
+            buffer = alloc_strcatf(buffer, len, cap, "\\u%04x",
+                    (unsigned char) *ptr);
+        } else {
+            buffer = alloc_strcatf(buffer, len, cap, "%c", *ptr);
+        }
+    }
+    return alloc_strcatf(buffer, len, cap, "\", ");
+}
+
+char *format_JobMetrics_json(JobMetrics *metrics) {
+    char *ret = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+
+    if (metrics == NULL) return NULL;
+
+    ret = alloc_strcatf(ret, &len, &cap, "{");
+    ret = _catJsonString(ret, &len, &cap, "event", metrics->event);
+    ret = alloc_strcatf(ret, &len, &cap, "\"jobid\": %u, \"uid\": %u, ",
+            metrics->jobid, (unsigned int) metrics->uid);
+    ret = _catJsonString(ret, &len, &cap, "host", metrics->hostname);
+    ret = _catJsonString(ret, &len, &cap, "image_type", metrics->imageType);
+    ret = _catJsonString(ret, &len, &cap, "image",
+            metrics->imageIdentifier);
+    ret = _catJsonString(ret, &len, &cap, "outcome", metrics->outcome);
+    ret = alloc_strcatf(ret, &len, &cap,
+            "\"status\": %d, \"timestamp\": %lu, \"duration_ms\": %lu, "
+            "\"helper_ms\": %lu, \"bytes_staged\": %lu, \"mounts\": %lu, "
+            "\"retries\": %lu}\n",
+            metrics->status,
+            (unsigned long) metrics->timestamp,
+            (unsigned long) metrics->duration_ms,
+            (unsigned long) metrics->helper_ms,
+            (unsigned long) metrics->bytesStaged,
+            (unsigned long) metrics->nMounts,
+            (unsigned long) metrics->retries);
+    return ret;
+}
+
+char *format_JobMetrics_statsd(JobMetrics *metrics, const char *prefix) {
+    const char *event = NULL;
+    if (metrics == NULL) return NULL;
+    if (prefix == NULL) prefix = JOBMETRICS_STATSD_PREFIX;
+    event = metrics->event != NULL ? metrics->event : "unknown";
+
+    return alloc_strgenf(
+            "%s.%s.duration_ms:%lu|ms\n"
+            "%s.%s.helper_ms:%lu|ms\n"
+            "%s.%s.mounts:%lu|g\n"
+            "%s.%s.bytes_staged:%lu|g\n"
+            "%s.%s.retries:%lu|c\n"
+            "%s.%s.%s:1|c",
+            prefix, event, (unsigned long) metrics->duration_ms,
+            prefix, event, (unsigned long) metrics->helper_ms,
+            prefix, event, (unsigned long) metrics->nMounts,
+            prefix, event, (unsigned long) metrics->bytesStaged,
+            prefix, event, (unsigned long) metrics->retries,
+            prefix, event,
+            metrics->outcome != NULL ? metrics->outcome : "unknown");
+}
+
+char *format_JobMetrics_comment(JobMetrics *metrics) {
+    if (metrics == NULL) return NULL;
+    return alloc_strgenf("shifter %s %s on %s: %lums (setup %lums), "
+            "%lu mounts, %lu MiB staged, %lu retries",
+            metrics->event != NULL ? metrics->event : "unknown",
+            metrics->outcome != NULL ? metrics->outcome : "unknown",
+            metrics->hostname != NULL ? metrics->hostname : "unknown",
+            (unsigned long) metrics->duration_ms,
+            (unsigned long) metrics->helper_ms,
+            (unsigned long) metrics->nMounts,
+            (unsigned long) (metrics->bytesStaged >> 20),
+            (unsigned long) metrics->retries);
+}
+
+static int _writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t bytes = write(fd, data, len);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        data += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
+
+int write_JobMetrics_jsonl(JobMetrics *metrics, const char *path) {
+    char *line = NULL;
+    int fd = -1;
+    int ret = 0;
+
+    if (metrics == NULL || path == NULL) return 1;
+    line = format_JobMetrics_json(metrics);
+    if (line == NULL) return 1;
+
+    fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0644);
+    if (fd < 0) {
+        free(line);
+        return 1;
+    }
+    ret = _writeAll(fd, line, strlen(line));
+    close(fd);
+    free(line);
+    return ret;
+}
+
+int send_JobMetrics_statsd(JobMetrics *metrics, const char *socketPath,
+        const char *prefix)
+{
+    struct sockaddr_un addr;
+    char *message = NULL;
+    int sock = -1;
+    int ret = 1;
+
+    if (metrics == NULL || socketPath == NULL) return 1;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) return 1;
+
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socketPath);
+
+    message = format_JobMetrics_statsd(metrics, prefix);
+    if (message == NULL) return 1;
+
+    sock = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+    if (sock < 0) goto _send_statsd_exit;
+    if (sendto(sock, message, strlen(message), 0,
+                (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) >= 0) {
+        ret = 0;
+    }
+
+_send_statsd_exit:
+    if (sock >= 0) close(sock);
+    free(message);
+    return ret;
+}
+
+static size_t _histBucket(uint64_t value) {
+    size_t bucket = 0;
+    while (value > 0 && bucket < JOBMETRICS_HIST_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void add_MetricsHistogram(MetricsHistogram **hist, size_t *n_hist,
+        const char *event, const char *metric, uint64_t value)
+{
+    MetricsHistogram *entry = NULL;
+    size_t idx = 0;
+
+    if (hist == NULL || n_hist == NULL || event == NULL || metric == NULL) {
+        return;
+    }
+    for (idx = 0; idx < *n_hist; idx++) {
+        if (strcmp((*hist)[idx].event, event) == 0 &&
+                strcmp((*hist)[idx].metric, metric) == 0) {
+            entry = &((*hist)[idx]);
+            break;
+        }
+    }
+    if (entry == NULL) {
+        if (*n_hist % JOBMETRICS_HIST_ALLOC_BLOCK == 0) {
+            *hist = (MetricsHistogram *) _realloc(*hist,
+                    sizeof(MetricsHistogram) *
+                    (*n_hist + JOBMETRICS_HIST_ALLOC_BLOCK));
+        }
+        entry = &((*hist)[(*n_hist)++]);
+        memset(entry, 0, sizeof(MetricsHistogram));
+        entry->event = _strdup(event);
+        entry->metric = _strdup(metric);
+        entry->min = value;
+    }
+    if (value < entry->min) entry->min = value;
+    if (value > entry->max) entry->max = value;
+    entry->count++;
+    entry->sum += value;
+    entry->buckets[_histBucket(value)]++;
+}
+
+/* parse histogram file contents; unparseable lines are skipped so a
+ * damaged file only loses the affected entries */
+static int _parse_MetricsHistogram(char *buffer, MetricsHistogram **hist,
+        size_t *n_hist)
+{
+    char *line = NULL;
+    char *savePtr = NULL;
+
+    for (line = strtok_r(buffer, "\n", &savePtr); line != NULL;
+            line = strtok_r(NULL, "\n", &savePtr)) {
+        MetricsHistogram entry;
+        char *tokPtr = NULL;
+        char *token = NULL;
+        size_t field = 0;
+
+        if (line[0] == '#' || line[0] == 0) continue;
+        memset(&entry, 0, sizeof(MetricsHistogram));
+        for (token = strtok_r(line, " ", &tokPtr); token != NULL;
+                token = strtok_r(NULL, " ", &tokPtr), field++) {
+            uint64_t value = strtoull(token, NULL, 10);
+            if (field == 0) entry.event = token;
+            else if (field == 1) entry.metric = token;
+            else if (field == 2) entry.count = value;
+            else if (field == 3) entry.sum = value;
+            else if (field == 4) entry.min = value;
+            else if (field == 5) entry.max = value;
+            else if (field - 6 < JOBMETRICS_HIST_BUCKETS) {
+                entry.buckets[field - 6] = value;
+            }
+        }
+        if (field != 6 + JOBMETRICS_HIST_BUCKETS) continue;
+
+        if (*n_hist % JOBMETRICS_HIST_ALLOC_BLOCK == 0) {
+            *hist = (MetricsHistogram *) _realloc(*hist,
+                    sizeof(MetricsHistogram) *
+                    (*n_hist + JOBMETRICS_HIST_ALLOC_BLOCK));
+        }
+        entry.event = _strdup(entry.event);
+        entry.metric = _strdup(entry.metric);
+        memcpy(&((*hist)[(*n_hist)++]), &entry, sizeof(MetricsHistogram));
+    }
+    return 0;
+}
+
+static char *_readFd(int fd) {
+    struct stat st;
+    char *buffer = NULL;
+    size_t len = 0;
+
+    if (fstat(fd, &st) != 0) return NULL;
+    buffer = (char *) _malloc(st.st_size + 1);
+    while (len < (size_t) st.st_size) {
+        ssize_t bytes = read(fd, buffer + len, st.st_size - len);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) break;
+        len += bytes;
+    }
+    buffer[len] = 0;
+    return buffer;
+}
+
+int read_MetricsHistogram(const char *path, MetricsHistogram **hist,
+        size_t *n_hist)
+{
+    char *buffer = NULL;
+    int fd = -1;
+
+    if (path == NULL || hist == NULL || n_hist == NULL) return 1;
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) return 1;
+    if (flock(fd, LOCK_SH) != 0) {
+        close(fd);
+        return 1;
+    }
+    buffer = _readFd(fd);
+    close(fd);
+    if (buffer == NULL) return 1;
+
+    _parse_MetricsHistogram(buffer, hist, n_hist);
+    free(buffer);
+    return 0;
+}
+
+int update_MetricsHistogram(const char *path, JobMetrics *metrics) {
+    MetricsHistogram *hist = NULL;
+    size_t n_hist = 0;
+    char *buffer = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    size_t idx = 0;
+    const char *event = NULL;
+    int fd = -1;
+    int ret = 1;
+
+    if (path == NULL || metrics == NULL) return 1;
+    event = metrics->event != NULL ? metrics->event : "unknown";
+
+    fd = open(path, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0644);
+    if (fd < 0) return 1;
+    if (flock(fd, LOCK_EX) != 0) goto _update_hist_exit;
+
+    buffer = _readFd(fd);
+    if (buffer == NULL) goto _update_hist_exit;
+    _parse_MetricsHistogram(buffer, &hist, &n_hist);
+    free(buffer);
+    buffer = NULL;
+
+    add_MetricsHistogram(&hist, &n_hist, event, "duration_ms",
+            metrics->duration_ms);
+    add_MetricsHistogram(&hist, &n_hist, event, "helper_ms",
+            metrics->helper_ms);
+    add_MetricsHistogram(&hist, &n_hist, event, "mounts", metrics->nMounts);
+    add_MetricsHistogram(&hist, &n_hist, event, "staged_mib",
+            metrics->bytesStaged >> 20);
+    add_MetricsHistogram(&hist, &n_hist, event, "retries", metrics->retries);
+    add_MetricsHistogram(&hist, &n_hist, event, "failed",
+            metrics->status != 0 ? 1 : 0);
+
+    buffer = alloc_strcatf(buffer, &len, &cap,
+            "# event metric count sum min max buckets[%d]\n",
+            JOBMETRICS_HIST_BUCKETS);
+    for (idx = 0; idx < n_hist; idx++) {
+        size_t bucket = 0;
+        MetricsHistogram *entry = &(hist[idx]);
+        buffer = alloc_strcatf(buffer, &len, &cap, "%s %s %lu %lu %lu %lu",
+                entry->event, entry->metric, (unsigned long) entry->count,
+                (unsigned long) entry->sum, (unsigned long) entry->min,
+                (unsigned long) entry->max);
+        for (bucket = 0; bucket < JOBMETRICS_HIST_BUCKETS; bucket++) {
+            buffer = alloc_strcatf(buffer, &len, &cap, " %lu",
+                    (unsigned long) entry->buckets[bucket]);
+        }
+        buffer = alloc_strcatf(buffer, &len, &cap, "\n");
+    }
+    if (buffer == NULL) goto _update_hist_exit;
+
+    if (lseek(fd, 0, SEEK_SET) != 0 || ftruncate(fd, 0) != 0) {
+        goto _update_hist_exit;
+    }
+    ret = _writeAll(fd, buffer, len);
+
+_update_hist_exit:
+    if (buffer != NULL) free(buffer);
+    free_MetricsHistogram(hist, n_hist);
+    close(fd);
+    return ret;
+}
+
+uint64_t quantile_MetricsHistogram(MetricsHistogram *hist, double quantile) {
+    uint64_t target = 0;
+    uint64_t cumulative = 0;
+    size_t bucket = 0;
+
+    if (hist == NULL || hist->count == 0) return 0;
+    target = (uint64_t) (quantile * hist->count + 0.5);
+    if (target == 0) target = 1;
+    for (bucket = 0; bucket < JOBMETRICS_HIST_BUCKETS; bucket++) {
+        cumulative += hist->buckets[bucket];
+        if (cumulative >= target) {
+            /* report the upper bound of the bucket, clamped to the
+             * observed range */
+            uint64_t upper = bucket == 0 ? 0 : (1ULL << bucket) - 1;
+            if (upper > hist->max) upper = hist->max;
+            if (upper < hist->min) upper = hist->min;
+            return upper;
+        }
+    }
+    return hist->max;
+}
+
+size_t fprint_MetricsHistogram(FILE *fp, MetricsHistogram *hist,
+        size_t n_hist, int showBuckets)
+{
+    size_t written = 0;
+    size_t idx = 0;
+
+    if (fp == NULL) return 0;
+    written += fprintf(fp, "%-8s %-12s %8s %10s %10s %10s %10s %10s %10s\n",
+            "EVENT", "METRIC", "COUNT", "MEAN", "MIN", "P50", "P90", "P99",
+            "MAX");
+    for (idx = 0; idx < n_hist; idx++) {
+        MetricsHistogram *entry = &(hist[idx]);
+        written += fprintf(fp,
+                "%-8s %-12s %8lu %10.1f %10lu %10lu %10lu %10lu %10lu\n",
+                entry->event, entry->metric, (unsigned long) entry->count,
+                entry->count > 0 ? (double) entry->sum / entry->count : 0.0,
+                (unsigned long) entry->min,
+                (unsigned long) quantile_MetricsHistogram(entry, 0.5),
+                (unsigned long) quantile_MetricsHistogram(entry, 0.9),
+                (unsigned long) quantile_MetricsHistogram(entry, 0.99),
+                (unsigned long) entry->max);
+        if (showBuckets) {
+            size_t bucket = 0;
+            for (bucket = 0; bucket < JOBMETRICS_HIST_BUCKETS; bucket++) {
+                uint64_t lower = bucket == 0 ? 0 : 1ULL << (bucket - 1);
+                if (entry->buckets[bucket] == 0) continue;
+                if (bucket == JOBMETRICS_HIST_BUCKETS - 1) {
+                    written += fprintf(fp, "    >= %-10lu %lu\n",
+                            (unsigned long) lower,
+                            (unsigned long) entry->buckets[bucket]);
+                } else {
+                    written += fprintf(fp, "    %-10lu %lu\n",
+                            (unsigned long) lower,
+                            (unsigned long) entry->buckets[bucket]);
+                }
+            }
+        }
+    }
+    return written;
+}
+
+void free_MetricsHistogram(MetricsHistogram *hist, size_t n_hist) {
+    size_t idx = 0;
+    if (hist == NULL) return;
+    for (idx = 0; idx < n_hist; idx++) {
+        free(hist[idx].event);
+        free(hist[idx].metric);
+    }
+    free(hist);
+}
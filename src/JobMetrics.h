@@ -0,0 +1,128 @@
+/** @file JobMetrics.h
+ *  @brief Per-job container setup/teardown metrics and per-node histograms
+ *
+ *  A JobMetrics record describes one prolog or epilog invocation.  Records
+ *  can be formatted as a JSON line, as statsd datagrams or as a short job
+ *  comment, and are folded into a per-node histogram file which can be
+ *  inspected with the shifter_metrics command.
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef __SHFTR_JOBMETRICS_INCLUDE
+#define __SHFTR_JOBMETRICS_INCLUDE
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JOBMETRICS_HIST_BUCKETS 32
+#define JOBMETRICS_HIST_ALLOC_BLOCK 8
+#define JOBMETRICS_STATSD_PREFIX "shifter"
+
+/* line printed on stdout by setupRoot/unsetupRoot when run with -M */
+#define JOBMETRICS_REPORT_TAG "shifter_metrics:"
+
+typedef struct _JobMetrics {
+    char *event;            /*! "prolog" or "epilog" */
+    uint32_t jobid;
+    uid_t uid;
+    char *hostname;
+    char *imageType;
+    char *imageIdentifier;
+    char *outcome;          /*! "success", "failure" or "skipped" */
+    int status;             /*! exit status of setupRoot/unsetupRoot */
+    uint64_t timestamp;     /*! start time, seconds since epoch */
+    uint64_t duration_ms;   /*! whole prolog/epilog hook */
+    uint64_t helper_ms;     /*! setupRoot/unsetupRoot run time */
+    uint64_t bytesStaged;   /*! size of the image file mounted */
+    size_t nMounts;         /*! mounts under udiMount after setup */
+    size_t retries;         /*! retry sleeps reported by the helper */
+} JobMetrics;
+
+/** MetricsHistogram
+ * log2-bucketed histogram of one metric of one event type; bucket 0 counts
+ * zero values, bucket i counts values in [2^(i-1), 2^i) and the last bucket
+ * is open-ended
+ */
+typedef struct _MetricsHistogram {
+    char *event;
+    char *metric;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[JOBMETRICS_HIST_BUCKETS];
+} MetricsHistogram;
+
+void free_JobMetrics(JobMetrics *metrics, int freeStruct);
+
+/** parse_JobMetrics_report
+ * fold a JOBMETRICS_REPORT_TAG line (from setupRoot/unsetupRoot) into
+ * metrics; returns 0 if the line was a report, 1 otherwise
+ */
+int parse_JobMetrics_report(const char *line, JobMetrics *metrics);
+
+char *format_JobMetrics_json(JobMetrics *metrics);
+char *format_JobMetrics_statsd(JobMetrics *metrics, const char *prefix);
+char *format_JobMetrics_comment(JobMetrics *metrics);
+
+/** write_JobMetrics_jsonl
+ * append one JSON line to path with a single write(2) on an O_APPEND
+ * descriptor so concurrent writers do not interleave
+ */
+int write_JobMetrics_jsonl(JobMetrics *metrics, const char *path);
+
+/** send_JobMetrics_statsd
+ * send the statsd-formatted record as one datagram to the unix socket at
+ * socketPath; never blocks
+ */
+int send_JobMetrics_statsd(JobMetrics *metrics, const char *socketPath,
+        const char *prefix);
+
+/** update_MetricsHistogram
+ * add the values in metrics to the histogram file at path, holding an
+ * exclusive flock while the file is rewritten
+ */
+int update_MetricsHistogram(const char *path, JobMetrics *metrics);
+
+int read_MetricsHistogram(const char *path, MetricsHistogram **hist,
+        size_t *n_hist);
+void add_MetricsHistogram(MetricsHistogram **hist, size_t *n_hist,
+        const char *event, const char *metric, uint64_t value);
+uint64_t quantile_MetricsHistogram(MetricsHistogram *hist, double quantile);
+size_t fprint_MetricsHistogram(FILE *fp, MetricsHistogram *hist,
+        size_t n_hist, int showBuckets);
+void free_MetricsHistogram(MetricsHistogram *hist, size_t n_hist);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
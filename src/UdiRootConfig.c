@@ -111,6 +111,10 @@ void free_ShifterModule(ShifterModule *module, int free_struct) {
         free(module->copyPath);
         module->copyPath = NULL;
     }
+    if (module->gpuSupport != NULL) {
+        free(module->gpuSupport);
+        module->gpuSupport = NULL;
+    }
     if (module->conflict_str != NULL) {
         for (ptr = module->conflict_str; ptr && *ptr; ptr++) {
             free(*ptr);
@@ -118,6 +122,28 @@ void free_ShifterModule(ShifterModule *module, int free_struct) {
         free(module->conflict_str);
         module->conflict_str = NULL;
     }
+    if (module->conflict != NULL) {
+        free(module->conflict);
+        module->conflict = NULL;
+    }
+    if (module->after_str != NULL) {
+        for (ptr = module->after_str; ptr && *ptr; ptr++) {
+            free(*ptr);
+        }
+        free(module->after_str);
+        module->after_str = NULL;
+    }
+    if (module->after != NULL) {
+        free(module->after);
+        module->after = NULL;
+    }
+    if (module->libraryPath != NULL) {
+        for (ptr = module->libraryPath; ptr && *ptr; ptr++) {
+            free(*ptr);
+        }
+        free(module->libraryPath);
+        module->libraryPath = NULL;
+    }
     if (free_struct) {
         free(module);
     }
@@ -237,40 +263,107 @@ int parse_UdiRootConfig(const char *configFile, UdiRootConfig *config, int valid
     return ret;
 }
 
+/** _resolveModuleNames
+ * translate the module names in names into pointers to the parsed modules,
+ * returning a newly allocated NULL-terminated array in *modules
+ *
+ * Returns 0 on success, 1 if any name is not a configured module
+ */
+static int _resolveModuleNames(UdiRootConfig *config, ShifterModule *module,
+        char **names, size_t n_names, const char *kind,
+        ShifterModule ***modules)
+{
+    size_t alloc_size = sizeof(ShifterModule *) * (n_names + 1);
+    size_t found_n = 0;
+    char **ptr = NULL;
+    int j = 0;
+
+    *modules = _malloc(alloc_size);
+    memset(*modules, 0, alloc_size);
+    for (ptr = names; ptr && *ptr; ptr++) {
+        int found = 0;
+        for (j = 0; j < config->n_modules; j++) {
+            if (strcmp(*ptr, config->modules[j].name) == 0) {
+                (*modules)[found_n] = &(config->modules[j]);
+                found_n++;
+                found++;
+                break;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "FAILED to find %s %s for module %s\n",
+                    *ptr, kind, module->name);
+            return 1;
+        }
+    }
+    if (found_n != n_names) {
+        fprintf(stderr, "FAILED To find all %ss for module %s\n",
+                kind, module->name);
+        return 1;
+    }
+    return 0;
+}
+
+/** _checkModuleOrdering
+ * depth-first walk of the "after" graph from module; state is 0 for
+ * unvisited, 1 while on the current path and 2 once fully explored
+ *
+ * Returns 0 if no cycle is reachable, 1 otherwise
+ */
+static int _checkModuleOrdering(UdiRootConfig *config, ShifterModule *module,
+        int *state)
+{
+    size_t idx = 0;
+    int self = module - config->modules;
+
+    if (state[self] == 2) {
+        return 0;
+    }
+    if (state[self] == 1) {
+        fprintf(stderr, "FAILED module %s depends on itself through "
+                "module_*_after\n", module->name);
+        return 1;
+    }
+    state[self] = 1;
+    for (idx = 0; idx < module->n_after; idx++) {
+        if (_checkModuleOrdering(config, module->after[idx], state) != 0) {
+            return 1;
+        }
+    }
+    state[self] = 2;
+    return 0;
+}
+
 int ShifterModule_postprocessing(UdiRootConfig *config) {
+    int *state = NULL;
     int i = 0;
-    int j = 0;
-    char **ptr = NULL;
+    int rc = 0;
     for (i = 0; i < config->n_modules; i++) {
-        int found_n_conflicts = 0;
-        size_t alloc_size = 0;
-        if (config->modules[i].n_conflict == 0) {
-            continue;
-        }
-        alloc_size = sizeof(ShifterModule *) *
-                           (config->modules[i].n_conflict + 1);
-        config->modules[i].conflict = _malloc(alloc_size);
-        memset(config->modules[i].conflict, 0, alloc_size);
-        for (ptr = config->modules[i].conflict_str; ptr && *ptr; ptr++) {
-            int found = 0;
-            for (j = 0; j < config->n_modules; j++) {
-                if (strcmp(*ptr, config->modules[j].name) == 0) {
-                    config->modules[i].conflict[found_n_conflicts] =
-                            &(config->modules[j]);
-                    found_n_conflicts++;
-                    found++;
-                    break;
-                }
+        ShifterModule *module = &(config->modules[i]);
+        if (module->n_conflict > 0 && module->conflict == NULL) {
+            if (_resolveModuleNames(config, module, module->conflict_str,
+                        module->n_conflict, "conflict",
+                        &(module->conflict)) != 0)
+            {
+                return 1;
             }
-            if (!found) {
-                fprintf(stderr, "FAILED to find %s conflict for module %s\n",
-                        *ptr, config->modules[i].name);
+        }
+        if (module->n_after > 0 && module->after == NULL) {
+            if (_resolveModuleNames(config, module, module->after_str,
+                        module->n_after, "after", &(module->after)) != 0)
+            {
                 return 1;
             }
         }
-        if (found_n_conflicts != config->modules[i].n_conflict) {
-            fprintf(stderr, "FAILED To find all conflicts for module %s\n",
-                    config->modules[i].name);
+    }
+    if (config->n_modules > 0) {
+        state = _malloc(sizeof(int) * config->n_modules);
+        memset(state, 0, sizeof(int) * config->n_modules);
+        for (i = 0; i < config->n_modules && rc == 0; i++) {
+            rc = _checkModuleOrdering(config, &(config->modules[i]), state);
+        }
+        free(state);
+        if (rc != 0) {
             return 1;
         }
     }
@@ -361,10 +454,34 @@ void free_UdiRootConfig(UdiRootConfig *config, int freeStruct) {
         free(config->mkfsXfsPath);
         config->mkfsXfsPath = NULL;
     }
+    if (config->mksquashfsPath != NULL) {
+        free(config->mksquashfsPath);
+        config->mksquashfsPath = NULL;
+    }
+    if (config->volumePackCacheDir != NULL) {
+        free(config->volumePackCacheDir);
+        config->volumePackCacheDir = NULL;
+    }
+    if (config->hugetlbfsPageSizes != NULL) {
+        free(config->hugetlbfsPageSizes);
+        config->hugetlbfsPageSizes = NULL;
+    }
     if (config->rootfsType != NULL) {
         free(config->rootfsType);
         config->rootfsType = NULL;
     }
+    if (config->traceDir != NULL) {
+        free(config->traceDir);
+        config->traceDir = NULL;
+    }
+    if (config->executorSocketDir != NULL) {
+        free(config->executorSocketDir);
+        config->executorSocketDir = NULL;
+    }
+    if (config->udiRunDir != NULL) {
+        free(config->udiRunDir);
+        config->udiRunDir = NULL;
+    }
     if (config->siteFs != NULL) {
         free_VolumeMap(config->siteFs, 1);
         config->siteFs = NULL;
@@ -457,6 +574,11 @@ size_t fprint_UdiRootConfig(FILE *fp, UdiRootConfig *config) {
         written += fprintf(fp, " %s", ptr);
     }
     fprintf(fp, "\n");
+    written += fprintf(fp, "shmSizeLimit = %lu\n", config->shmSizeLimit);
+    written += fprintf(fp, "hugetlbfsSizeLimit = %lu\n",
+        config->hugetlbfsSizeLimit);
+    written += fprintf(fp, "hugetlbfsPageSizes = %s\n",
+        (config->hugetlbfsPageSizes != NULL ? config->hugetlbfsPageSizes : ""));
     written += fprintf(fp, "sitePreMountHook = %s\n",
         (config->sitePreMountHook != NULL ? config->sitePreMountHook : ""));
     written += fprintf(fp, "sitePostMountHook = %s\n",
@@ -471,11 +593,28 @@ size_t fprint_UdiRootConfig(FILE *fp, UdiRootConfig *config) {
             config->allowLibcPwdCalls);
     written += fprintf(fp, "populateEtcDynamically = %d\n",
             config->populateEtcDynamically);
+    written += fprintf(fp, "usePivotRoot = %d\n", config->usePivotRoot);
+    written += fprintf(fp, "useOverlayRoot = %d\n", config->useOverlayRoot);
+    written += fprintf(fp, "perJobUdi = %d\n", config->perJobUdi);
+    written += fprintf(fp, "udiKeepWarmTimeout = %d\n", config->udiKeepWarmTimeout);
+    written += fprintf(fp, "volumeStageWorkers = %d\n", config->volumeStageWorkers);
     written += fprintf(fp, "mountPropagationStyle = %s\n",
         (config->mountPropagationStyle == VOLMAP_FLAG_SLAVE ?
          "slave" : "private"));
     written += fprintf(fp, "rootfsType = %s\n",
         (config->rootfsType != NULL ? config->rootfsType : ""));
+    written += fprintf(fp, "traceDir = %s\n",
+        (config->traceDir != NULL ? config->traceDir : ""));
+    written += fprintf(fp, "traceAlways = %d\n", config->traceAlways);
+    written += fprintf(fp, "executorSocketDir = %s\n",
+        (config->executorSocketDir != NULL ? config->executorSocketDir : ""));
+    written += fprintf(fp, "executorIdleTimeout = %d\n",
+            config->executorIdleTimeout);
+    written += fprintf(fp, "udiRunDir = %s\n",
+        (config->udiRunDir != NULL ? config->udiRunDir : ""));
+    written += fprintf(fp, "udiLockTimeout = %d\n", config->udiLockTimeout);
+    written += fprintf(fp, "moduleRoothookWorkers = %d\n",
+            config->moduleRoothookWorkers);
     written += fprintf(fp, "modprobePath = %s\n",
         (config->modprobePath != NULL ? config->modprobePath : ""));
     written += fprintf(fp, "insmodPath = %s\n",
@@ -490,6 +629,10 @@ size_t fprint_UdiRootConfig(FILE *fp, UdiRootConfig *config) {
         (config->ddPath != NULL ? config->ddPath : ""));
     written += fprintf(fp, "mkfsXfsPath = %s\n",
         (config->mkfsXfsPath != NULL ? config->mkfsXfsPath : ""));
+    written += fprintf(fp, "mksquashfsPath = %s\n",
+        (config->mksquashfsPath != NULL ? config->mksquashfsPath : ""));
+    written += fprintf(fp, "volumePackCacheDir = %s\n",
+        (config->volumePackCacheDir != NULL ? config->volumePackCacheDir : ""));
     written += fprintf(fp, "Image Gateway Servers = %lu servers\n", config->gwUrl_size);
     for (idx = 0; idx < config->gwUrl_size; idx++) {
         char *gwUrl = config->gwUrl[idx];
@@ -604,6 +747,13 @@ int validate_UdiRootConfig(UdiRootConfig *config, int validateFlags) {
                 VAL_ERROR("Specified \"mkfsXfsPath\" is not executable.", UDIROOT_VAL_FILEVAL);
             }
         }
+        if (config->mksquashfsPath) {
+            if (stat(config->mksquashfsPath, &statData) != 0) {
+                VAL_ERROR("Specified \"mksquashfsPath\" doesn't appear to exist.", UDIROOT_VAL_FILEVAL);
+            } else if (!(statData.st_mode & S_IXUSR)) {
+                VAL_ERROR("Specified \"mksquashfsPath\" is not executable.", UDIROOT_VAL_FILEVAL);
+            }
+        }
     }
     return 0;
 }
@@ -626,6 +776,15 @@ static int _assign(const char *key, const char *value, void *t_config) {
         config->perNodeCachePath = _strdup(value);
     } else if (strcmp(key, "perNodeCacheSizeLimit") == 0) {
         config->perNodeCacheSizeLimit = parseBytes(value);
+    } else if (strcmp(key, "shmSizeLimit") == 0) {
+        ssize_t limit = parseBytes(value);
+        config->shmSizeLimit = limit > 0 ? limit : 0;
+    } else if (strcmp(key, "hugetlbfsSizeLimit") == 0) {
+        ssize_t limit = parseBytes(value);
+        config->hugetlbfsSizeLimit = limit > 0 ? limit : 0;
+    } else if (strcmp(key, "hugetlbfsPageSizes") == 0) {
+        if (config->hugetlbfsPageSizes != NULL) free(config->hugetlbfsPageSizes);
+        config->hugetlbfsPageSizes = _strdup(value);
     } else if (strcmp(key, "perNodeCacheAllowedFsType") == 0) {
         char *valueDup = _strdup(value);
         char *search = valueDup;
@@ -675,6 +834,22 @@ static int _assign(const char *key, const char *value, void *t_config) {
         }
     } else if (strcmp(key, "mountUdiRootWritable") == 0) {
         config->mountUdiRootWritable = strtol(value, NULL, 10) != 0;
+    } else if (strcmp(key, "usePivotRoot") == 0) {
+        config->usePivotRoot = strtol(value, NULL, 10) != 0;
+    } else if (strcmp(key, "useOverlayRoot") == 0) {
+        config->useOverlayRoot = strtol(value, NULL, 10) != 0;
+    } else if (strcmp(key, "perJobUdi") == 0) {
+        config->perJobUdi = strtol(value, NULL, 10) != 0;
+    } else if (strcmp(key, "udiKeepWarmTimeout") == 0) {
+        config->udiKeepWarmTimeout = strtol(value, NULL, 10);
+        if (config->udiKeepWarmTimeout < 0) {
+            config->udiKeepWarmTimeout = 0;
+        }
+    } else if (strcmp(key, "volumeStageWorkers") == 0) {
+        config->volumeStageWorkers = strtol(value, NULL, 10);
+        if (config->volumeStageWorkers < 0) {
+            config->volumeStageWorkers = 0;
+        }
     } else if (strcmp(key, "maxGroupCount") == 0) {
         config->maxGroupCount = strtoul(value, NULL, 10);
     } else if (strcmp(key, "modprobePath") == 0) {
@@ -691,8 +866,26 @@ static int _assign(const char *key, const char *value, void *t_config) {
         config->ddPath = _strdup(value);
     } else if (strcmp(key, "mkfsXfsPath") == 0) {
         config->mkfsXfsPath = _strdup(value);
+    } else if (strcmp(key, "mksquashfsPath") == 0) {
+        config->mksquashfsPath = _strdup(value);
+    } else if (strcmp(key, "volumePackCacheDir") == 0) {
+        config->volumePackCacheDir = _strdup(value);
     } else if (strcmp(key, "rootfsType") == 0) {
         config->rootfsType = _strdup(value);
+    } else if (strcmp(key, "traceDir") == 0) {
+        config->traceDir = _strdup(value);
+    } else if (strcmp(key, "traceAlways") == 0) {
+        config->traceAlways = strtol(value, NULL, 10) != 0;
+    } else if (strcmp(key, "executorSocketDir") == 0) {
+        config->executorSocketDir = _strdup(value);
+    } else if (strcmp(key, "executorIdleTimeout") == 0) {
+        config->executorIdleTimeout = strtol(value, NULL, 10);
+    } else if (strcmp(key, "udiRunDir") == 0) {
+        config->udiRunDir = _strdup(value);
+    } else if (strcmp(key, "udiLockTimeout") == 0) {
+        config->udiLockTimeout = strtol(value, NULL, 10);
+    } else if (strcmp(key, "moduleRoothookWorkers") == 0) {
+        config->moduleRoothookWorkers = strtol(value, NULL, 10);
     } else if (strcmp(key, "gatewayTimeout") == 0) {
         config->gatewayTimeout = strtoul(value, NULL, 10);
     } else if (strcmp(key, "kmodBasePath") == 0) {
@@ -855,13 +1048,19 @@ int parse_ShifterModule_key(UdiRootConfig *config, const char *key,
     /* populate module based on subkey and value */
     if (strcmp(subkey, "userhook") == 0) {
         module->userhook = _strdup(value);
+    } else if (strcmp(subkey, "userhookEnv") == 0) {
+        module->userhookEnv = strtol(value, NULL, 10) != 0;
     } else if (strcmp(subkey, "roothook") == 0) {
         module->roothook = _strdup(value);
+    } else if (strcmp(subkey, "roothookTimeout") == 0) {
+        module->roothookTimeout = strtol(value, NULL, 10);
     } else if (strcmp(subkey, "siteEnv") == 0 ||
                 strcmp(subkey, "siteEnvPrepend") == 0 ||
                 strcmp(subkey, "siteEnvAppend") == 0 ||
                 strcmp(subkey, "siteEnvUnset") == 0 ||
-                strcmp(subkey, "conflict") == 0)
+                strcmp(subkey, "conflict") == 0 ||
+                strcmp(subkey, "after") == 0 ||
+                strcmp(subkey, "libraryPath") == 0)
     {
         tmpvalue = _strdup(value);
         search = tmpvalue;
@@ -893,6 +1092,22 @@ int parse_ShifterModule_key(UdiRootConfig *config, const char *key,
         } else if (strcmp(subkey, "conflict") == 0) {
             module->conflict_str = ptrarray;
             module->n_conflict = count;
+        } else if (strcmp(subkey, "after") == 0) {
+            module->after_str = ptrarray;
+            module->n_after = count;
+        } else if (strcmp(subkey, "libraryPath") == 0) {
+            module->libraryPath = ptrarray;
+            module->n_libraryPath = count;
+            for (idx = 0; idx < (int) count; idx++) {
+                if (ptrarray[idx][0] != '/' ||
+                        strstr(ptrarray[idx], "..") != NULL)
+                {
+                    fprintf(stderr, "FAILED module libraryPath entries must "
+                            "be absolute paths in the container\n");
+                    rc = 1;
+                    goto cleanup;
+                }
+            }
         }
     } else if (strcmp(subkey, "siteFs") == 0) {
         if (module->siteFs == NULL) {
@@ -906,6 +1121,14 @@ int parse_ShifterModule_key(UdiRootConfig *config, const char *key,
         }
     } else if (strcmp(subkey, "copyPath") == 0) {
         module->copyPath = _strdup(value);
+    } else if (strcmp(subkey, "gpuSupport") == 0) {
+        if (value[0] != '/' || strstr(value, "..") != NULL) {
+            fprintf(stderr, "FAILED module gpuSupport must be an absolute "
+                    "path in the container\n");
+            rc = 1;
+            goto cleanup;
+        }
+        module->gpuSupport = _strdup(value);
     } else if (strcmp(subkey, "enabled") == 0) {
         module->enabled = strtol(value, NULL, 10) != 0;
     }
@@ -932,7 +1155,9 @@ size_t fprint_ShifterModule(FILE *fp, ShifterModule *module) {
     written += fprintf(fp, "Shifter Module: %s\n", module->name);
     written += fprintf(fp, "====================================\n");
     written += fprintf(fp, "userhook: %s\n", module->userhook);
+    written += fprintf(fp, "userhookEnv: %d\n", module->userhookEnv);
     written += fprintf(fp, "roothook: %s\n", module->roothook);
+    written += fprintf(fp, "roothookTimeout: %d\n", module->roothookTimeout);
     written += fprintf(fp, "siteEnv:\n");
     for (ptr = module->siteEnv; ptr && *ptr; ptr++) {
         written += fprintf(fp, "        %s\n", *ptr);
@@ -953,10 +1178,19 @@ size_t fprint_ShifterModule(FILE *fp, ShifterModule *module) {
     for (ptr = module->conflict_str; ptr && *ptr; ptr++) {
         written += fprintf(fp, "        %s\n", *ptr);
     }
+    written += fprintf(fp, "after:\n");
+    for (ptr = module->after_str; ptr && *ptr; ptr++) {
+        written += fprintf(fp, "        %s\n", *ptr);
+    }
+    written += fprintf(fp, "libraryPath:\n");
+    for (ptr = module->libraryPath; ptr && *ptr; ptr++) {
+        written += fprintf(fp, "        %s\n", *ptr);
+    }
     written += fprintf(fp, "VolumeMap: ");
     written += fprint_VolumeMap(fp, module->siteFs);
     written += fprintf(fp, "\n");
     written += fprintf(fp, "copyPath: %s\n", module->copyPath);
+    written += fprintf(fp, "gpuSupport: %s\n", module->gpuSupport);
     written += fprintf(fp, "enabled: %d\n", module->enabled);
     written += fprintf(fp, "====================================\n\n");
     return 0;
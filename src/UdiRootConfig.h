@@ -81,14 +81,22 @@ typedef struct _ShifterModule {
     char **siteEnvAppend;
     char **siteEnvUnset;
     char **conflict_str;
+    char **after_str;
+    char **libraryPath;
     struct _ShifterModule **conflict;
+    struct _ShifterModule **after;
     size_t n_siteEnv;
     size_t n_siteEnvPrepend;
     size_t n_siteEnvAppend;
     size_t n_siteEnvUnset;
     size_t n_conflict;
+    size_t n_after;
+    size_t n_libraryPath;
     VolumeMap *siteFs;
     char *copyPath;
+    char *gpuSupport;
+    int roothookTimeout;
+    int userhookEnv;
     int enabled;
 } ShifterModule;
 
@@ -104,6 +112,9 @@ typedef struct _UdiRootConfig {
     char *perNodeCachePath;
     size_t perNodeCacheSizeLimit;
     char **perNodeCacheAllowedFsType;
+    size_t shmSizeLimit;
+    size_t hugetlbfsSizeLimit;
+    char *hugetlbfsPageSizes;
     char *sitePreMountHook;
     char *sitePostMountHook;
     char *optUdiImage;
@@ -124,10 +135,22 @@ typedef struct _UdiRootConfig {
     int allowLibcPwdCalls;
     int populateEtcDynamically;
     int mountUdiRootWritable;
+    int usePivotRoot;
+    int useOverlayRoot;
+    int perJobUdi;
+    int udiKeepWarmTimeout;
+    int volumeStageWorkers;
     int optionalSshdAsRoot;
     size_t maxGroupCount;
     size_t gatewayTimeout;
     size_t mountPropagationStyle;
+    char *traceDir;
+    int traceAlways;
+    char *executorSocketDir;
+    int executorIdleTimeout;
+    char *udiRunDir;
+    int udiLockTimeout;
+    int moduleRoothookWorkers;
 
     char *modprobePath;
     char *insmodPath;
@@ -136,6 +159,8 @@ typedef struct _UdiRootConfig {
     char *chmodPath;
     char *ddPath;
     char *mkfsXfsPath;
+    char *mksquashfsPath;
+    char *volumePackCacheDir;
 
     /* support variables for above */
     size_t siteEnv_capacity;
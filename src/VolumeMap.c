@@ -53,8 +53,81 @@
 
 
 static int _cmpFlags(const void *va, const void *vb);
+static char *_allocVolumeMapArena(VolumeMap *volMap, size_t len);
+static int _appendVolumeMap(VolumeMap *volMap, const char *raw, size_t rawLen,
+        const char *to, const char *from, VolumeMapFlag *flags);
+static void _truncateVolumeMap(VolumeMap *volMap, size_t n,
+        VolumeMapArena *arena, size_t arenaUsed);
+
+static const char *userToStartsWithDisallowed[] = {
+    "/etc", "/var", "etc", "var", "/opt/udiImage", "opt/udiImage", NULL
+};
+static const char *userToExactDisallowed[] = {"/opt", "opt", NULL};
+static const char *siteToExactDisallowed[] = {
+    "/opt", "opt",
+    "/etc", "etc",
+    "/var", "var",
+    "/etc/passwd", "etc/passwd",
+    "/etc/group", "etc/group",
+    "/etc/nsswitch.conf", "etc/nsswitch.conf",
+    NULL
+};
+static const char *emptyDisallowed[] = { NULL };
+
+/* the policies are compiled into tries on first use and kept for the life of
+ * the process */
+static const VolumeMapPolicy *_getUserRequestPolicy(void) {
+    static VolumeMapPolicy policy;
+    static int compiled = 0;
+    if (!compiled) {
+        if (compile_VolumeMapPolicy(&policy,
+                userToStartsWithDisallowed, userToExactDisallowed,
+                emptyDisallowed, emptyDisallowed,
+                VOLMAP_FLAG_READONLY | VOLMAP_FLAG_PERNODECACHE
+                | VOLMAP_FLAG_STAGEIN | VOLMAP_FLAG_STAGEOUT
+                | VOLMAP_FLAG_PACKED | VOLMAP_FLAG_SHM
+                | VOLMAP_FLAG_HUGETLBFS) != 0)
+        {
+            return NULL;
+        }
+        compiled = 1;
+    }
+    return &policy;
+}
+
+static const VolumeMapPolicy *_getSiteRequestPolicy(void) {
+    static VolumeMapPolicy policy;
+    static int compiled = 0;
+    if (!compiled) {
+        if (compile_VolumeMapPolicy(&policy,
+                emptyDisallowed, siteToExactDisallowed,
+                emptyDisallowed, emptyDisallowed,
+                VOLMAP_FLAG_READONLY
+                | VOLMAP_FLAG_RECURSIVE
+                | VOLMAP_FLAG_PERNODECACHE
+                | VOLMAP_FLAG_SLAVE
+                | VOLMAP_FLAG_PRIVATE
+                | VOLMAP_FLAG_STAGEIN
+                | VOLMAP_FLAG_STAGEOUT
+                | VOLMAP_FLAG_PACKED
+                | VOLMAP_FLAG_SHM
+                | VOLMAP_FLAG_HUGETLBFS) != 0)
+        {
+            return NULL;
+        }
+        compiled = 1;
+    }
+    return &policy;
+}
 
+/**
+ * parseVolumeMap - parse user-requested volume maps
+ * Each entry is validated on its own; once all of the user's inputs are
+ * parsed the complete map must be checked with validateVolumeMap_targets.
+ * On failure the map is left as it was before the call.
+ */
 int parseVolumeMap(const char *input, VolumeMap *volMap) {
+    if (input == NULL || volMap == NULL) return 1;
     return _parseVolumeMap(input, volMap, validateVolumeMap_userRequest, 1);
 }
 
@@ -67,18 +140,7 @@ int validateVolumeMap_userRequest(
         const char *to,
         VolumeMapFlag *flags)
 {
-    const char *toStartsWithDisallowed[] = {
-        "/etc", "/var", "etc", "var", "/opt/udiImage", "opt/udiImage", NULL
-    };
-    const char *toExactDisallowed[] = {"/opt", "opt", NULL};
-    const char *fromStartsWithDisallowed[] = { NULL };
-    const char *fromExactDisallowed[] = { NULL };
-    size_t allowedFlags = VOLMAP_FLAG_READONLY | VOLMAP_FLAG_PERNODECACHE;
-
-    return _validateVolumeMap(
-            from, to, flags, toStartsWithDisallowed, toExactDisallowed,
-            fromStartsWithDisallowed, fromExactDisallowed, allowedFlags
-    );
+    return _validateVolumeMap(from, to, flags, _getUserRequestPolicy());
 }
 
 int validateVolumeMap_siteRequest(
@@ -86,28 +148,7 @@ int validateVolumeMap_siteRequest(
         const char *to,
         VolumeMapFlag *flags)
 {
-    const char *toStartsWithDisallowed[] = { NULL };
-    const char *toExactDisallowed[] = {
-        "/opt", "opt",
-        "/etc", "etc",
-        "/var", "var",
-        "/etc/passwd", "etc/passwd",
-        "/etc/group", "etc/group",
-        "/etc/nsswitch.conf", "etc/nsswitch.conf",
-        NULL
-    };
-    const char *fromStartsWithDisallowed[] = { NULL };
-    const char *fromExactDisallowed[] = { NULL };
-    size_t allowedFlags = VOLMAP_FLAG_READONLY
-        | VOLMAP_FLAG_RECURSIVE
-        | VOLMAP_FLAG_PERNODECACHE
-        | VOLMAP_FLAG_SLAVE
-        | VOLMAP_FLAG_PRIVATE;
-
-    return _validateVolumeMap(
-            from, to, flags, toStartsWithDisallowed, toExactDisallowed,
-            fromStartsWithDisallowed, fromExactDisallowed, allowedFlags
-    );
+    return _validateVolumeMap(from, to, flags, _getSiteRequestPolicy());
 }
 
 const char *_findEndVolumeMapString(const char *basePtr) {
@@ -120,53 +161,6 @@ const char *_findEndVolumeMapString(const char *basePtr) {
     return ptr;
 }
 
-char **_tokenizeVolumeMapInput(char *input) {
-    if (input == NULL) return NULL;
-
-    char **tokens = _malloc(sizeof(char *) * 4);
-    char **tk_ptr = NULL;
-    char **tk_end = tokens + 3;
-    char *ptr = NULL;
-    char *sptr = NULL;
-    char *limit = input + strlen(input);
-    if (tokens == NULL) {
-        fprintf(stderr, "FAILED to allocate memory\n");
-        goto __tokenizeVolumeMapInput_unclean_exit;
-    }
-
-    /* set all tokens to NULL */
-    memset(tokens, 0, sizeof(char *) * 4);
-
-    /* parse the tokens */
-    tk_ptr = tokens;
-    for (ptr = input, sptr = input; sptr < limit; ptr++) {
-        /* delimiter */
-        if (*ptr == ':' || *ptr == '\0') {
-
-            /* extract the token */
-            *ptr = 0;
-            *tk_ptr = _strdup(sptr);
-
-            /* advance to the next token */
-            sptr = ptr + 1;
-            tk_ptr++;
-
-            /* allocate and move memory if need be */
-            if (tk_ptr >= tk_end) {
-                char **tmp = _realloc(tokens, sizeof(char *) * ((tk_ptr - tokens) + 4));
-                tk_ptr = tmp + (tk_ptr - tokens);
-                tokens = tmp;
-                tk_end = tk_ptr + 3;
-                memset(tk_ptr, 0, sizeof(char *) * 4);
-            }
-        }
-    }
-
-    return tokens;
-__tokenizeVolumeMapInput_unclean_exit:
-    return NULL;
-}
-
 ssize_t parseBytes(const char *input) {
     const char *scale = "bkmgtpe";
     char *ptr = NULL;
@@ -209,6 +203,7 @@ int _parseFlag(char *flagStr, VolumeMapFlag **flags, size_t *flagCapacity) {
     char *limit = flagStr + strlen(flagStr);
     char *flagName = NULL;
     VolMapPerNodeCacheConfig *cache = NULL;
+    VolMapMemFsConfig *memFs = NULL;
     char **kvArray = NULL;
     size_t kvCount = 0;
 
@@ -344,6 +339,110 @@ int _parseFlag(char *flagStr, VolumeMapFlag **flags, size_t *flagCapacity) {
             fprintf(stderr, "Flag private takes no arguments, failed to parse.\n");
             goto __parseFlags_exit_unclean;
         }
+    } else if (strcasecmp(flagName, "packed") == 0) {
+        flag.type = VOLMAP_FLAG_PACKED;
+        if (kvCount > 0) {
+            fprintf(stderr, "Flag packed takes no arguments, failed to parse.\n");
+            goto __parseFlags_exit_unclean;
+        }
+    } else if (strcasecmp(flagName, "shm") == 0 ||
+            strcasecmp(flagName, "hugetlbfs") == 0)
+    {
+        size_t kvIdx = 0;
+        flag.type = strcasecmp(flagName, "shm") == 0 ?
+                VOLMAP_FLAG_SHM : VOLMAP_FLAG_HUGETLBFS;
+        memFs = _malloc(sizeof(VolMapMemFsConfig));
+        memset(memFs, 0, sizeof(VolMapMemFsConfig));
+
+        for (kvIdx = 0; kvIdx < kvCount; kvIdx += 2) {
+            char *key = kvArray[kvIdx];
+            char *value = kvArray[kvIdx + 1];
+
+            if (key == NULL || value == NULL) {
+                fprintf(stderr, "Failed to parse volmap flag value\n");
+                goto __parseFlags_exit_unclean;
+            }
+            if (strcasecmp(key, "size") == 0) {
+                memFs->size = parseBytes(value);
+                if (memFs->size <= 0) {
+                    fprintf(stderr, "Invalid size for %s: %s\n", flagName, value);
+                    goto __parseFlags_exit_unclean;
+                }
+            } else if (strcasecmp(key, "pagesize") == 0 &&
+                    flag.type == VOLMAP_FLAG_HUGETLBFS)
+            {
+                memFs->pageSize = parseBytes(value);
+                if (memFs->pageSize <= 0) {
+                    fprintf(stderr, "Invalid pagesize for hugetlbfs: %s\n", value);
+                    goto __parseFlags_exit_unclean;
+                }
+            } else if (strcasecmp(key, "mpol") == 0 &&
+                    flag.type == VOLMAP_FLAG_SHM)
+            {
+                const char *policies[] = {
+                    "default", "local", "prefer", "bind", "interleave", NULL
+                };
+                const char **policy = NULL;
+                for (policy = policies; *policy != NULL; policy++) {
+                    if (strcasecmp(value, *policy) == 0) break;
+                }
+                if (*policy == NULL) {
+                    fprintf(stderr, "Invalid mpol for shm: %s\n", value);
+                    goto __parseFlags_exit_unclean;
+                }
+                if (memFs->mpol != NULL) free(memFs->mpol);
+                memFs->mpol = _strdup(*policy);
+            } else if (strcasecmp(key, "nodes") == 0 &&
+                    flag.type == VOLMAP_FLAG_SHM)
+            {
+                if (value[0] == 0 || strspn(value, "0123456789-") != strlen(value)) {
+                    fprintf(stderr, "Invalid nodes for shm: %s\n", value);
+                    goto __parseFlags_exit_unclean;
+                }
+                if (memFs->nodes != NULL) free(memFs->nodes);
+                memFs->nodes = _strdup(value);
+            } else {
+                fprintf(stderr, "Unknown option for %s: %s\n", flagName, key);
+                goto __parseFlags_exit_unclean;
+            }
+        }
+        if (memFs->size <= 0) {
+            fprintf(stderr, "Flag %s requires a size, failed to parse.\n", flagName);
+            goto __parseFlags_exit_unclean;
+        }
+        /* default and local take no node list, the others require one
+         * except interleave, which defaults to all nodes */
+        if (memFs->nodes != NULL && (memFs->mpol == NULL ||
+                strcmp(memFs->mpol, "default") == 0 ||
+                strcmp(memFs->mpol, "local") == 0))
+        {
+            fprintf(stderr, "Flag shm nodes requires mpol prefer, bind or "
+                    "interleave\n");
+            goto __parseFlags_exit_unclean;
+        }
+        if (memFs->nodes == NULL && memFs->mpol != NULL &&
+                (strcmp(memFs->mpol, "prefer") == 0 ||
+                 strcmp(memFs->mpol, "bind") == 0))
+        {
+            fprintf(stderr, "Flag shm mpol %s requires nodes\n", memFs->mpol);
+            goto __parseFlags_exit_unclean;
+        }
+        flag.value = memFs;
+        memFs = NULL;
+    } else if (strcasecmp(flagName, "stagein") == 0 ||
+            strcasecmp(flagName, "stageout") == 0)
+    {
+        /* stagein=<path>: a bare value is parsed as a key without value */
+        flag.type = strcasecmp(flagName, "stagein") == 0 ?
+                VOLMAP_FLAG_STAGEIN : VOLMAP_FLAG_STAGEOUT;
+        if (kvCount != 2 || kvArray[0] == NULL || kvArray[1] != NULL ||
+                kvArray[0][0] != '/' || strstr(kvArray[0], "..") != NULL)
+        {
+            fprintf(stderr, "Flag %s requires an absolute path, failed to "
+                    "parse.\n", flagName);
+            goto __parseFlags_exit_unclean;
+        }
+        flag.value = _strdup(kvArray[0]);
     } else {
         fprintf(stderr, "Unknown flag: %s\n", sptr);
         goto __parseFlags_exit_unclean;
@@ -379,6 +478,10 @@ __parseFlags_exit_unclean:
          free_VolMapPerNodeCacheConfig(cache);
          cache = NULL;
     }
+    if (memFs != NULL) {
+        free_VolMapMemFsConfig(memFs);
+        memFs = NULL;
+    }
     return 1;
 }
 
@@ -389,66 +492,88 @@ int _parseVolumeMap(
         short requireTo
 ) {
     if (input == NULL || volMap == NULL) return 1;
-    char **rawPtr = volMap->raw + volMap->n;
-    char **toPtr = volMap->to + volMap->n;
-    char **fromPtr = volMap->from + volMap->n;
-    VolumeMapFlag **flagPtr = volMap->flags + volMap->n;
 
     const char *ptr = input;
+    const char *limit = input + strlen(input);
+    const char *sptr = NULL;
     const char *eptr = NULL;
-    char *tmp = NULL;
-    size_t len = strlen(input);
-    int ret = 0;
+    char *buffer = NULL;
+    size_t bufferCapacity = 0;
+    char **tokens = NULL;
+    size_t tokensCapacity = 0;
+    size_t ntokens = 0;
+    size_t tokenIdx = 0;
     char *to = NULL;
     char *from = NULL;
     VolumeMapFlag *flags = NULL;
     size_t flagsCapacity = 0;
     char *raw = NULL;
-    char **tokens = NULL;
-    char **tk_ptr = NULL;
-    size_t tokenIdx = 0;
     size_t rawLen = 0;
     size_t rawCapacity = 0;
     size_t flagIdx = 0;
     size_t flagCnt = 0;
+    size_t startN = volMap->n;
+    VolumeMapArena *startArena = volMap->arena;
+    size_t startArenaUsed = startArena != NULL ? startArena->used : 0;
+    int ret = 0;
+
+    /* each entry is copied once into a reused buffer and tokenized in place;
+     * the resulting strings are appended to the volume map arena */
+    while (ptr < limit) {
+        char *wptr = NULL;
+        char *tptr = NULL;
+        size_t segLen = 0;
 
-    while (ptr < input + len) {
-        size_t ntokens = 0;
         eptr = _findEndVolumeMapString(ptr);
-        if (eptr == ptr && eptr != NULL) {
+        if (eptr == ptr) {
             ptr++;
             continue;
         }
-        if (eptr == NULL) {
-            break;
-        }
-
-        /* make copy for parsing */
-        tmp = _malloc(sizeof(char) * (eptr - ptr + 1));
-        strncpy(tmp, ptr, eptr - ptr);
-        tmp[eptr - ptr] = '\0';
+        sptr = ptr;
+        ptr = eptr + 1;
 
-        char *volMapStr = tmp;
-        if (*volMapStr == '"' && *(volMapStr + (eptr - ptr) - 1) == '"') {
-            *(volMapStr + (eptr - ptr) - 1) = 0;
-            volMapStr++;
+        segLen = eptr - sptr;
+        if (segLen >= 2 && *sptr == '"' && *(eptr - 1) == '"') {
+            segLen -= 2;
+            if (segLen + 1 > bufferCapacity) {
+                bufferCapacity = (segLen + 1) * 2;
+                buffer = (char *) _realloc(buffer, sizeof(char) * bufferCapacity);
+            }
+            memcpy(buffer, sptr + 1, segLen);
+        } else {
+            if (segLen + 1 > bufferCapacity) {
+                bufferCapacity = (segLen + 1) * 2;
+                buffer = (char *) _realloc(buffer, sizeof(char) * bufferCapacity);
+            }
+            memcpy(buffer, sptr, segLen);
         }
-
-        /* tokenize the the input string */
-        tokens = _tokenizeVolumeMapInput(volMapStr);
-
-        /* count how many non-NULL tokens there are */
-        for (ntokens = 0; tokens && tokens[ntokens]; ntokens++) {
+        buffer[segLen] = '\0';
+
+        /* split on ':', a trailing delimiter does not produce a token */
+        ntokens = 0;
+        for (wptr = buffer, tptr = buffer; ; wptr++) {
+            char delim = *wptr;
+            if (delim != ':' && delim != '\0') continue;
+            if (delim == '\0' && tptr == wptr) break;
+            if (ntokens >= tokensCapacity) {
+                tokensCapacity = tokensCapacity > 0 ? tokensCapacity * 2 : 4;
+                tokens = (char **) _realloc(tokens, sizeof(char *) * tokensCapacity);
+            }
+            *wptr = '\0';
+            tokens[ntokens++] = tptr;
+            tptr = wptr + 1;
+            if (delim == '\0') break;
         }
 
-        if (tokens == NULL || ntokens == 0) {
-            fprintf(stderr, "Failed to parse VolumeMap tokens from \"%s\","
-                    " aborting!\n", tmp);
+        if (ntokens == 0) {
+            fprintf(stderr, "Failed to parse VolumeMap tokens from \"%.*s\","
+                    " aborting!\n", (int) (eptr - sptr), sptr);
             goto _parseVolumeMap_unclean;
         }
 
-        from = userInputPathFilter(tokens[0], 1);
-        to = userInputPathFilter(tokens[1], 1);
+        /* tokens point into the scratch buffer, so filter them in place */
+        from = userInputPathFilterInPlace(tokens[0], 1);
+        to = ntokens > 1 ? userInputPathFilterInPlace(tokens[1], 1) : NULL;
 
         for (tokenIdx = 2; tokenIdx < ntokens; tokenIdx++) {
             if (_parseFlag(tokens[tokenIdx], &flags, &flagsCapacity) != 0) {
@@ -461,22 +586,22 @@ int _parseVolumeMap(
            assume we are binding a path from outside the container
            and to can be set to from */
         if (from && ntokens == 1 && !requireTo) {
-            to = _strdup(from);
+            to = from;
         }
 
         /* ensure the user is asking for a legal mapping */
         if ((ret = _validate_fp(from, to, flags)) != 0) {
             fprintf(stderr, "Invalid Volume Map: %.*s, aborting! %d\n",
-                (int) (eptr - ptr),
-                ptr, ret
+                (int) (eptr - sptr),
+                sptr, ret
             );
             goto _parseVolumeMap_unclean;
         }
 
         if (to == NULL || from == NULL) {
             fprintf(stderr, "INVALID format for volume map %.*s\n",
-                (int) (eptr - ptr),
-                ptr
+                (int) (eptr - sptr),
+                sptr
             );
             goto _parseVolumeMap_unclean;
         }
@@ -487,10 +612,8 @@ int _parseVolumeMap(
         }
 
         /* generate a new "raw" string from the filtered values */
-        rawLen = 2 + strlen(from) + strlen(to);
-        raw = _malloc(sizeof(char) * rawLen);
-        rawCapacity = sizeof(char) * rawLen;
-        rawLen = snprintf(raw, rawLen, "%s:%s", from, to);
+        rawLen = 0;
+        raw = alloc_strcatf(raw, &rawLen, &rawCapacity, "%s:%s", from, to);
 
         for (flagIdx = 0; flagIdx < flagCnt; flagIdx++) {
             if (flags[flagIdx].type == VOLMAP_FLAG_READONLY) {
@@ -501,6 +624,34 @@ int _parseVolumeMap(
                 raw = alloc_strcatf(raw, &rawLen, &rawCapacity, ":slave");
             } else if (flags[flagIdx].type == VOLMAP_FLAG_PRIVATE) {
                 raw = alloc_strcatf(raw, &rawLen, &rawCapacity, ":private");
+            } else if (flags[flagIdx].type == VOLMAP_FLAG_STAGEIN) {
+                raw = alloc_strcatf(raw, &rawLen, &rawCapacity, ":stagein=%s",
+                        (char *) flags[flagIdx].value);
+            } else if (flags[flagIdx].type == VOLMAP_FLAG_STAGEOUT) {
+                raw = alloc_strcatf(raw, &rawLen, &rawCapacity, ":stageout=%s",
+                        (char *) flags[flagIdx].value);
+            } else if (flags[flagIdx].type == VOLMAP_FLAG_PACKED) {
+                raw = alloc_strcatf(raw, &rawLen, &rawCapacity, ":packed");
+            } else if (flags[flagIdx].type == VOLMAP_FLAG_SHM) {
+                VolMapMemFsConfig *memFs = (VolMapMemFsConfig *) flags[flagIdx].value;
+                raw = alloc_strcatf(raw, &rawLen, &rawCapacity, ":shm=size=%ld",
+                        memFs->size);
+                if (memFs->mpol != NULL) {
+                    raw = alloc_strcatf(raw, &rawLen, &rawCapacity, ",mpol=%s",
+                            memFs->mpol);
+                }
+                if (memFs->nodes != NULL) {
+                    raw = alloc_strcatf(raw, &rawLen, &rawCapacity, ",nodes=%s",
+                            memFs->nodes);
+                }
+            } else if (flags[flagIdx].type == VOLMAP_FLAG_HUGETLBFS) {
+                VolMapMemFsConfig *memFs = (VolMapMemFsConfig *) flags[flagIdx].value;
+                raw = alloc_strcatf(raw, &rawLen, &rawCapacity,
+                        ":hugetlbfs=size=%ld", memFs->size);
+                if (memFs->pageSize > 0) {
+                    raw = alloc_strcatf(raw, &rawLen, &rawCapacity,
+                            ",pagesize=%ld", memFs->pageSize);
+                }
             } else if (flags[flagIdx].type == VOLMAP_FLAG_PERNODECACHE) {
                 VolMapPerNodeCacheConfig *cache = (VolMapPerNodeCacheConfig *) flags[flagIdx].value;
                 if (cache == NULL) {
@@ -510,90 +661,142 @@ int _parseVolumeMap(
                 raw = alloc_strcatf(raw, &rawLen, &rawCapacity, ":perNodeCache=size=%lu,bs=%lu,method=%s,fstype=%s", cache->cacheSize, cache->blockSize, cache->method, cache->fstype);
             }
         }
-
-        /* append to raw array */
-        ret = strncpy_StringArray(raw, rawLen, &rawPtr, &(volMap->raw),
-                &(volMap->rawCapacity), VOLUME_ALLOC_BLOCK);
-        if (ret != 0) goto _parseVolumeMap_unclean;
-
-        ret = strncpy_StringArray(to, strlen(to), &toPtr, &(volMap->to),
-                &(volMap->toCapacity), VOLUME_ALLOC_BLOCK);
-        if (ret != 0) goto _parseVolumeMap_unclean;
-
-        ret = strncpy_StringArray(from, strlen(from), &fromPtr, &(volMap->from),
-                &(volMap->fromCapacity), VOLUME_ALLOC_BLOCK);
-        if (ret != 0) goto _parseVolumeMap_unclean;
-
-        if (volMap->n >= volMap->flagsCapacity) {
-            volMap->flags = (VolumeMapFlag **) _realloc(volMap->flags, sizeof(VolumeMapFlag *) * (volMap->flagsCapacity + VOLUME_ALLOC_BLOCK + 1));
-            flagPtr = volMap->flags + volMap->n;
-            volMap->flagsCapacity += VOLUME_ALLOC_BLOCK;
-            memset(flagPtr, 0, sizeof(VolumeMapFlag *) * (volMap->flagsCapacity - volMap->n));
+        if (raw == NULL) {
+            fprintf(stderr, "FAILED to generate volume map string\n");
+            goto _parseVolumeMap_unclean;
         }
 
-        *flagPtr = flags;
-        flagPtr++;
-        *flagPtr = NULL;
-        flagsCapacity = 0;
-
-        if (from != NULL) free(from);
-        if (to != NULL) free(to);
-        if (raw != NULL) free(raw);
-        from = NULL;
-        to = NULL;
-        raw = NULL;
-        flags = NULL;
-
-        ptr = eptr + 1;
-        volMap->n += 1;
-        free(tmp);
-        tmp = NULL;
-
-        for (tk_ptr = tokens; tk_ptr && *tk_ptr; tk_ptr++) {
-            free(*tk_ptr);
+        if (_appendVolumeMap(volMap, raw, rawLen, to, from, flags) != 0) {
+            goto _parseVolumeMap_unclean;
         }
-        if (tokens != NULL) free(tokens);
-        tokens = NULL;
+        flags = NULL;
+        flagsCapacity = 0;
     }
+
+    if (buffer != NULL) free(buffer);
+    if (tokens != NULL) free(tokens);
+    if (raw != NULL) free(raw);
     return 0;
 _parseVolumeMap_unclean:
     {
-        char *freeArray[] = {tmp, from, to, raw, NULL};
-        char **freePtr = NULL;
-        for (freePtr = freeArray; *freePtr != NULL; freePtr++) {
-            if (*freePtr != NULL) {
-                free(*freePtr);
+        char *freeArray[] = {buffer, raw, (char *) tokens};
+        size_t freeIdx = 0;
+        for (freeIdx = 0; freeIdx < sizeof(freeArray) / sizeof(char *); freeIdx++) {
+            if (freeArray[freeIdx] != NULL) {
+                free(freeArray[freeIdx]);
             }
         }
 
-        for (tk_ptr = tokens; tk_ptr && *tk_ptr; tk_ptr++) {
-            free(*tk_ptr);
-        }
-        if (tokens != NULL) free(tokens);
-        tokens = NULL;
-
         if (flags != NULL) {
             free_VolumeMapFlag(flags, 1);
             flags = NULL;
         }
+
+        /* discard any entries appended by this call */
+        _truncateVolumeMap(volMap, startN, startArena, startArenaUsed);
     }
     return 1;
 }
 
+/* _allocVolumeMapArena: reserve len bytes of string storage owned by volMap */
+static char *_allocVolumeMapArena(VolumeMap *volMap, size_t len) {
+    VolumeMapArena *block = volMap->arena;
+    char *ret = NULL;
+
+    if (block == NULL || block->capacity - block->used < len) {
+        size_t capacity = len > VOLUME_ARENA_BLOCK ? len : VOLUME_ARENA_BLOCK;
+        block = (VolumeMapArena *) _malloc(sizeof(VolumeMapArena) + capacity);
+        block->prev = volMap->arena;
+        block->data = (char *) (block + 1);
+        block->used = 0;
+        block->capacity = capacity;
+        volMap->arena = block;
+    }
+    ret = block->data + block->used;
+    block->used += len;
+    return ret;
+}
+
+/* _appendVolumeMap: add an entry to volMap, taking ownership of flags; the
+ * raw, to and from arrays share a single capacity and grow geometrically */
+static int _appendVolumeMap(VolumeMap *volMap, const char *raw, size_t rawLen,
+        const char *to, const char *from, VolumeMapFlag *flags)
+{
+    size_t toLen = strlen(to);
+    size_t fromLen = strlen(from);
+    size_t n = volMap->n;
+    char *storage = NULL;
+
+    if (n >= volMap->capacity) {
+        size_t capacity = volMap->capacity * 2;
+        if (capacity < VOLUME_ALLOC_BLOCK) capacity = VOLUME_ALLOC_BLOCK;
+
+        volMap->raw = (char **) _realloc(volMap->raw, sizeof(char *) * (capacity + 1));
+        volMap->to = (char **) _realloc(volMap->to, sizeof(char *) * (capacity + 1));
+        volMap->from = (char **) _realloc(volMap->from, sizeof(char *) * (capacity + 1));
+        volMap->flags = (VolumeMapFlag **) _realloc(volMap->flags, sizeof(VolumeMapFlag *) * (capacity + 1));
+        volMap->capacity = capacity;
+    }
+
+    storage = _allocVolumeMapArena(volMap, rawLen + toLen + fromLen + 3);
+    if (storage == NULL) {
+        fprintf(stderr, "FAILED to allocate memory for volume map\n");
+        return 1;
+    }
+    memcpy(storage, raw, rawLen + 1);
+    volMap->raw[n] = storage;
+    storage += rawLen + 1;
+    memcpy(storage, to, toLen + 1);
+    volMap->to[n] = storage;
+    storage += toLen + 1;
+    memcpy(storage, from, fromLen + 1);
+    volMap->from[n] = storage;
+    volMap->flags[n] = flags;
+
+    volMap->n = ++n;
+    volMap->raw[n] = NULL;
+    volMap->to[n] = NULL;
+    volMap->from[n] = NULL;
+    volMap->flags[n] = NULL;
+    return 0;
+}
+
+/* _truncateVolumeMap: drop entries from index n onwards, releasing arena
+ * blocks allocated after the given arena position */
+static void _truncateVolumeMap(VolumeMap *volMap, size_t n,
+        VolumeMapArena *arena, size_t arenaUsed)
+{
+    size_t idx = 0;
+    if (volMap->n <= n) return;
+
+    for (idx = n; idx < volMap->n; idx++) {
+        if (volMap->flags[idx] != NULL) {
+            free_VolumeMapFlag(volMap->flags[idx], 1);
+        }
+        volMap->raw[idx] = NULL;
+        volMap->to[idx] = NULL;
+        volMap->from[idx] = NULL;
+        volMap->flags[idx] = NULL;
+    }
+    volMap->n = n;
+
+    while (volMap->arena != NULL && volMap->arena != arena) {
+        VolumeMapArena *prev = volMap->arena->prev;
+        free(volMap->arena);
+        volMap->arena = prev;
+    }
+    if (volMap->arena != NULL) {
+        volMap->arena->used = arenaUsed;
+    }
+}
 
 int _validateVolumeMap(
         const char *from,
         const char *to,
         VolumeMapFlag *flags,
-        const char **toStartsWithDisallowed,
-        const char **toExactDisallowed,
-        const char **fromStartsWithDisallowed,
-        const char **fromExactDisallowed,
-        size_t allowedFlags)
+        const VolumeMapPolicy *policy)
 {
-    const char **ptr = NULL;
-
-    if (from == NULL || to == NULL) return 1;
+    if (from == NULL || to == NULL || policy == NULL) return 1;
 
     /* prevent bind mounts using relative paths */
     if (strstr(from, "..") != NULL) {
@@ -614,7 +817,7 @@ int _validateVolumeMap(
     if (flags != NULL) {
         size_t idx = 0;
         while (flags[idx].type != 0) {
-            if ((flags[idx].type & allowedFlags) == 0) return 2;
+            if ((flags[idx].type & policy->allowedFlags) == 0) return 2;
             if ((flags[idx].type & alreadySeenFlags) != 0) return 3;
             alreadySeenFlags |= flags[idx].type;
             idx++;
@@ -628,30 +831,259 @@ int _validateVolumeMap(
         return 4;
     }
 
-    for (ptr = toStartsWithDisallowed; *ptr != NULL; ptr++) {
-        size_t len = strlen(*ptr);
-        if (strncmp(to, *ptr, len) == 0) {
-            return 1;
+    /* staging copies into and out of the per-node cache only */
+    if ((alreadySeenFlags & (VOLMAP_FLAG_STAGEIN | VOLMAP_FLAG_STAGEOUT)) &&
+            !(alreadySeenFlags & VOLMAP_FLAG_PERNODECACHE))
+    {
+        return 5;
+    }
+
+    /* a packed volume is a snapshot of an existing directory */
+    if ((alreadySeenFlags & VOLMAP_FLAG_PACKED) &&
+            (alreadySeenFlags & VOLMAP_FLAG_PERNODECACHE))
+    {
+        return 6;
+    }
+
+    /* shm and hugetlbfs mount a new filesystem instead of the source */
+    if ((alreadySeenFlags & (VOLMAP_FLAG_SHM | VOLMAP_FLAG_HUGETLBFS)) &&
+            ((alreadySeenFlags & (VOLMAP_FLAG_PERNODECACHE | VOLMAP_FLAG_PACKED
+                    | VOLMAP_FLAG_RECURSIVE)) ||
+             ((alreadySeenFlags & VOLMAP_FLAG_SHM) &&
+              (alreadySeenFlags & VOLMAP_FLAG_HUGETLBFS))))
+    {
+        return 7;
+    }
+
+    if (match_VolumeMapTrie(&(policy->to), to)) {
+        return 1;
+    }
+    if (match_VolumeMapTrie(&(policy->from), from)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * compile_VolumeMapPolicy
+ * Build the tries used by _validateVolumeMap from NULL-terminated lists of
+ * disallowed paths.  Matching then costs one walk of the path regardless of
+ * how many paths are disallowed.
+ */
+int compile_VolumeMapPolicy(VolumeMapPolicy *policy,
+        const char **toStartsWithDisallowed,
+        const char **toExactDisallowed,
+        const char **fromStartsWithDisallowed,
+        const char **fromExactDisallowed,
+        size_t allowedFlags)
+{
+    const char **ptr = NULL;
+    if (policy == NULL) return 1;
+
+    memset(policy, 0, sizeof(VolumeMapPolicy));
+    for (ptr = toStartsWithDisallowed; ptr && *ptr; ptr++) {
+        if (insert_VolumeMapTrie(&(policy->to), *ptr, VOLMAP_MATCH_PREFIX) != 0) goto _compile_unclean;
+    }
+    for (ptr = toExactDisallowed; ptr && *ptr; ptr++) {
+        if (insert_VolumeMapTrie(&(policy->to), *ptr, VOLMAP_MATCH_EXACT) != 0) goto _compile_unclean;
+    }
+    for (ptr = fromStartsWithDisallowed; ptr && *ptr; ptr++) {
+        if (insert_VolumeMapTrie(&(policy->from), *ptr, VOLMAP_MATCH_PREFIX) != 0) goto _compile_unclean;
+    }
+    for (ptr = fromExactDisallowed; ptr && *ptr; ptr++) {
+        if (insert_VolumeMapTrie(&(policy->from), *ptr, VOLMAP_MATCH_EXACT) != 0) goto _compile_unclean;
+    }
+    policy->allowedFlags = allowedFlags;
+    return 0;
+_compile_unclean:
+    free_VolumeMapPolicy(policy, 0);
+    return 1;
+}
+
+void free_VolumeMapPolicy(VolumeMapPolicy *policy, int freeStruct) {
+    if (policy == NULL) return;
+    if (policy->to.nodes != NULL) free(policy->to.nodes);
+    if (policy->from.nodes != NULL) free(policy->from.nodes);
+    memset(policy, 0, sizeof(VolumeMapPolicy));
+    if (freeStruct) {
+        free(policy);
+    }
+}
+
+int insert_VolumeMapTrie(VolumeMapTrie *trie, const char *path, int match) {
+    const char *ptr = NULL;
+    size_t node = 0;
+
+    if (trie == NULL || path == NULL) return 1;
+    if (trie->nodes == NULL) {
+        trie->capacity = VOLUME_ALLOC_BLOCK;
+        trie->nodes = (VolumeMapTrieNode *) _malloc(sizeof(VolumeMapTrieNode) * trie->capacity);
+        memset(trie->nodes, 0, sizeof(VolumeMapTrieNode));
+        trie->n = 1;
+    }
+
+    for (ptr = path; *ptr != 0; ptr++) {
+        size_t child = trie->nodes[node].child;
+        while (child != 0 && trie->nodes[child].ch != *ptr) {
+            child = trie->nodes[child].sibling;
+        }
+        if (child == 0) {
+            if (trie->n >= trie->capacity) {
+                trie->capacity *= 2;
+                trie->nodes = (VolumeMapTrieNode *) _realloc(trie->nodes, sizeof(VolumeMapTrieNode) * trie->capacity);
+            }
+            child = trie->n++;
+            trie->nodes[child].ch = *ptr;
+            trie->nodes[child].match = 0;
+            trie->nodes[child].child = 0;
+            trie->nodes[child].sibling = trie->nodes[node].child;
+            trie->nodes[node].child = child;
         }
+        node = child;
     }
-    for (ptr = toExactDisallowed; *ptr != NULL; ptr++) {
-        if (strcmp(to, *ptr) == 0) {
-            return 1;
+    trie->nodes[node].match |= match;
+    return 0;
+}
+
+/**
+ * match_VolumeMapTrie
+ * Returns 1 if path equals an exact entry or starts with a prefix entry of
+ * the trie, 0 otherwise.
+ */
+int match_VolumeMapTrie(const VolumeMapTrie *trie, const char *path) {
+    const char *ptr = NULL;
+    size_t node = 0;
+
+    if (trie == NULL || trie->nodes == NULL || path == NULL) return 0;
+
+    for (ptr = path; ; ptr++) {
+        size_t child = 0;
+        if (trie->nodes[node].match & VOLMAP_MATCH_PREFIX) return 1;
+        if (*ptr == 0) break;
+
+        child = trie->nodes[node].child;
+        while (child != 0 && trie->nodes[child].ch != *ptr) {
+            child = trie->nodes[child].sibling;
         }
+        if (child == 0) return 0;
+        node = child;
     }
-    for (ptr = fromStartsWithDisallowed; *ptr != NULL; ptr++) {
-        size_t len = strlen(*ptr);
-        if (strncmp(from, *ptr, len) == 0) {
-            return 1;
+    return (trie->nodes[node].match & VOLMAP_MATCH_EXACT) != 0;
+}
+
+typedef struct {
+    const char *key;
+    size_t len;
+    size_t idx;
+} VolumeMapTarget;
+
+/* _makeVolumeMapTargetKey: write a sort key for path into key, dropping
+ * repeated and trailing slashes and replacing '/' with '\1' so that it sorts
+ * before any other character; every target is then immediately followed by
+ * the targets nested beneath it.  Returns the key length. */
+static size_t _makeVolumeMapTargetKey(const char *path, char *key) {
+    char *wptr = key;
+    for ( ; *path != 0; path++) {
+        if (*path == '/') {
+            if (path[1] == '/' || path[1] == 0) continue;
+            *wptr++ = '\1';
+        } else {
+            *wptr++ = *path;
         }
     }
-    for (ptr = fromExactDisallowed; *ptr != NULL; ptr++) {
-        if (strcmp(from, *ptr) == 0) {
-            return 1;
+    *wptr = 0;
+    return wptr - key;
+}
+
+static int _cmpVolumeMapTarget(const void *va, const void *vb) {
+    const VolumeMapTarget *a = (const VolumeMapTarget *) va;
+    const VolumeMapTarget *b = (const VolumeMapTarget *) vb;
+    int ret = strcmp(a->key, b->key);
+    if (ret != 0) return ret;
+    if (a->idx < b->idx) return -1;
+    return a->idx > b->idx;
+}
+
+/* _isNestedVolumeMapTarget: returns 1 if child lies beneath parent */
+static int _isNestedVolumeMapTarget(const VolumeMapTarget *parent,
+        const VolumeMapTarget *child)
+{
+    return parent->len < child->len
+        && child->key[parent->len] == '\1'
+        && memcmp(parent->key, child->key, parent->len) == 0;
+}
+
+/**
+ * validateVolumeMap_targets
+ * Rejects maps which mount more than once onto the same target, or which
+ * mount onto a path beneath the target of a later entry (the earlier mount
+ * would be hidden since entries are mounted in order).  Runs in O(n log n),
+ * so call it once on the complete map rather than after every input.
+ *
+ * Returns 0 if the targets are acceptable, 1 for duplicates, 2 for hidden
+ * mounts.
+ */
+int validateVolumeMap_targets(VolumeMap *volMap) {
+    VolumeMapTarget *targets = NULL;
+    char *keys = NULL;
+    char *wptr = NULL;
+    size_t *stack = NULL;
+    size_t depth = 0;
+    size_t keysLen = 0;
+    size_t idx = 0;
+    int ret = 0;
+
+    if (volMap == NULL) return 1;
+    if (volMap->n < 2) return 0;
+
+    for (idx = 0; idx < volMap->n; idx++) {
+        keysLen += strlen(volMap->to[idx]) + 1;
+    }
+    keys = (char *) _malloc(sizeof(char) * keysLen);
+    targets = (VolumeMapTarget *) _malloc(sizeof(VolumeMapTarget) * volMap->n);
+    stack = (size_t *) _malloc(sizeof(size_t) * volMap->n);
+    for (idx = 0, wptr = keys; idx < volMap->n; idx++) {
+        targets[idx].key = wptr;
+        targets[idx].len = _makeVolumeMapTargetKey(volMap->to[idx], wptr);
+        targets[idx].idx = idx;
+        wptr += targets[idx].len + 1;
+    }
+    qsort(targets, volMap->n, sizeof(VolumeMapTarget), _cmpVolumeMapTarget);
+
+    /* stack holds the chain of targets enclosing the current one; each is
+     * only pushed if it is mounted after all of its ancestors, so the top of
+     * the stack is always the latest-mounted ancestor */
+    for (idx = 0; idx < volMap->n; idx++) {
+        VolumeMapTarget *curr = &(targets[idx]);
+        VolumeMapTarget *parent = NULL;
+
+        if (idx > 0 && strcmp(targets[idx - 1].key, curr->key) == 0) {
+            fprintf(stderr, "Volume map target %s specified more than once\n",
+                    volMap->to[curr->idx]);
+            ret = 1;
+            break;
+        }
+        while (depth > 0 &&
+                !_isNestedVolumeMapTarget(&(targets[stack[depth - 1]]), curr))
+        {
+            depth--;
         }
+        parent = depth > 0 ? &(targets[stack[depth - 1]]) : NULL;
+        if (parent != NULL && parent->idx > curr->idx) {
+            fprintf(stderr, "Volume map target %s would be hidden by the later "
+                    "mount on %s\n", volMap->to[curr->idx],
+                    volMap->to[parent->idx]);
+            ret = 2;
+            break;
+        }
+        stack[depth++] = idx;
     }
 
-    return 0;
+    free(keys);
+    free(targets);
+    free(stack);
+    return ret;
 }
 
 /** fprint_volumeMap - write formatted output to specified FILE pointer */
@@ -683,6 +1115,27 @@ size_t fprint_VolumeMap(FILE *fp, VolumeMap *volMap) {
                     nBytes += fprintf(fp, "%sslave", (flagIdx > 0 ? ", ": ""));
                 } else if (flags[flagIdx].type == VOLMAP_FLAG_PRIVATE) {
                     nBytes += fprintf(fp, "%sprivate", (flagIdx > 0 ? ", ": ""));
+                } else if (flags[flagIdx].type == VOLMAP_FLAG_STAGEIN) {
+                    nBytes += fprintf(fp, "%sstagein (from=%s)",
+                            (flagIdx > 0 ? ", ": ""),
+                            (char *) flags[flagIdx].value);
+                } else if (flags[flagIdx].type == VOLMAP_FLAG_STAGEOUT) {
+                    nBytes += fprintf(fp, "%sstageout (to=%s)",
+                            (flagIdx > 0 ? ", ": ""),
+                            (char *) flags[flagIdx].value);
+                } else if (flags[flagIdx].type == VOLMAP_FLAG_PACKED) {
+                    nBytes += fprintf(fp, "%spacked", (flagIdx > 0 ? ", ": ""));
+                } else if (flags[flagIdx].type == VOLMAP_FLAG_SHM) {
+                    VolMapMemFsConfig *memFs = (VolMapMemFsConfig *) flags[flagIdx].value;
+                    nBytes += fprintf(fp, "%sshm (size=%ld, mpol=%s, nodes=%s)",
+                            (flagIdx > 0 ? ", ": ""), memFs->size,
+                            memFs->mpol != NULL ? memFs->mpol : "default",
+                            memFs->nodes != NULL ? memFs->nodes : "all");
+                } else if (flags[flagIdx].type == VOLMAP_FLAG_HUGETLBFS) {
+                    VolMapMemFsConfig *memFs = (VolMapMemFsConfig *) flags[flagIdx].value;
+                    nBytes += fprintf(fp, "%shugetlbfs (size=%ld, pagesize=%ld)",
+                            (flagIdx > 0 ? ", ": ""), memFs->size,
+                            memFs->pageSize);
                 } else if (flags[flagIdx].type == VOLMAP_FLAG_PERNODECACHE) {
                     VolMapPerNodeCacheConfig *cache = (VolMapPerNodeCacheConfig *) flags[flagIdx].value;
                     nBytes += fprintf(fp,
@@ -716,36 +1169,45 @@ static int _cmpFlags(const void *va, const void *vb) {
 }
 
 char *getVolMapSignature(VolumeMap *volMap) {
-    char **ptr = NULL;
+    char **sorted = NULL;
+    size_t *lens = NULL;
     size_t len = 0;
+    size_t idx = 0;
     char *ret = NULL;
     char *wptr = NULL;
-    char *limit = NULL;
 
     if (volMap == NULL || volMap->raw == NULL || volMap->n == 0) {
         return NULL;
     }
 
     /* sort the volmaps to ensure different invocations of the same
-       request are seen as identical */
-    qsort(volMap->raw, volMap->n, sizeof(char *), _vstrcmp);
+       request are seen as identical; a copy is sorted so that raw stays
+       aligned with to, from and flags */
+    sorted = (char **) _malloc(sizeof(char *) * volMap->n);
+    lens = (size_t *) _malloc(sizeof(size_t) * volMap->n);
+    memcpy(sorted, volMap->raw, sizeof(char *) * volMap->n);
+    qsort(sorted, volMap->n, sizeof(char *), _vstrcmp);
 
     /* sum strlens to get full summary string capacity
-       add volMap->n characters to cover commas and final null byte */
-    for (ptr = volMap->raw; *ptr != NULL; ptr++) {
-        len += strlen(*ptr);
+       add volMap->n characters to cover separators and final null byte */
+    for (idx = 0; idx < volMap->n; idx++) {
+        lens[idx] = strlen(sorted[idx]);
+        len += lens[idx] + 1;
     }
-    ret = _malloc(sizeof(char) * (len + volMap->n));
+    ret = _malloc(sizeof(char) * len);
 
     /* construct summary sig string */
     wptr = ret;
-    limit = ret + (len + volMap->n);
-    for (ptr = volMap->raw; *ptr != NULL; ptr++) {
-        wptr += snprintf(wptr, (limit - wptr), "%s;", *ptr);
+    for (idx = 0; idx < volMap->n; idx++) {
+        memcpy(wptr, sorted[idx], lens[idx]);
+        wptr += lens[idx];
+        *wptr++ = ';';
     }
     wptr--;
     *wptr = 0;
 
+    free(sorted);
+    free(lens);
     return ret;
 }
 
@@ -757,21 +1219,18 @@ char *getVolMapSignature(VolumeMap *volMap) {
  */
 void free_VolumeMap(VolumeMap *volMap, int freeStruct) {
     if (volMap == NULL) return;
-    char **arrays[] = {
-        volMap->raw,
-        volMap->to,
-        volMap->from,
-        NULL
-    };
-
-    char ***ptr = NULL;
-    for (ptr = arrays; *ptr != NULL; ptr++) {
-        char **iptr = NULL;
-        for (iptr = *ptr; *iptr != NULL; iptr++) {
-            free(*iptr);
-        }
-        free(*ptr);
-        *ptr = NULL;
+
+    /* the strings themselves live in the arena */
+    if (volMap->raw != NULL) free(volMap->raw);
+    if (volMap->to != NULL) free(volMap->to);
+    if (volMap->from != NULL) free(volMap->from);
+    volMap->raw = NULL;
+    volMap->to = NULL;
+    volMap->from = NULL;
+    while (volMap->arena != NULL) {
+        VolumeMapArena *prev = volMap->arena->prev;
+        free(volMap->arena);
+        volMap->arena = prev;
     }
     if (volMap->flags != NULL) {
         size_t idx = 0;
@@ -784,6 +1243,8 @@ void free_VolumeMap(VolumeMap *volMap, int freeStruct) {
         free(volMap->flags);
         volMap->flags = NULL;
     }
+    volMap->n = 0;
+    volMap->capacity = 0;
     if (freeStruct == 1) {
         free(volMap);
     }
@@ -798,6 +1259,16 @@ void free_VolumeMapFlag(VolumeMapFlag *flagArr, int freeStruct) {
             VolMapPerNodeCacheConfig *cconfig = (VolMapPerNodeCacheConfig *) flagArr[idx].value;
             free_VolMapPerNodeCacheConfig(cconfig);
             flagArr[idx].value = NULL;
+        } else if ((flagArr[idx].type == VOLMAP_FLAG_SHM
+                    || flagArr[idx].type == VOLMAP_FLAG_HUGETLBFS)
+                && flagArr[idx].value != NULL) {
+            free_VolMapMemFsConfig((VolMapMemFsConfig *) flagArr[idx].value);
+            flagArr[idx].value = NULL;
+        } else if ((flagArr[idx].type == VOLMAP_FLAG_STAGEIN
+                    || flagArr[idx].type == VOLMAP_FLAG_STAGEOUT)
+                && flagArr[idx].value != NULL) {
+            free(flagArr[idx].value);
+            flagArr[idx].value = NULL;
         }
     }
     if (freeStruct) {
@@ -812,6 +1283,13 @@ void free_VolMapPerNodeCacheConfig(VolMapPerNodeCacheConfig *cacheConfig) {
     free(cacheConfig);
 }
 
+void free_VolMapMemFsConfig(VolMapMemFsConfig *memFsConfig) {
+    if (memFsConfig == NULL) return;
+    if (memFsConfig->mpol != NULL) free(memFsConfig->mpol);
+    if (memFsConfig->nodes != NULL) free(memFsConfig->nodes);
+    free(memFsConfig);
+}
+
 int validate_VolMapPerNodeCacheConfig(VolMapPerNodeCacheConfig *cacheConfig) {
     if (cacheConfig == NULL) return 1;
     if (cacheConfig->cacheSize <= 0) return 2;
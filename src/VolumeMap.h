@@ -54,29 +54,46 @@ extern "C" {
 #endif
 
 #define VOLUME_ALLOC_BLOCK 10
+#define VOLUME_ARENA_BLOCK 8192
 
 #define VOLMAP_FLAG_READONLY 1
 #define VOLMAP_FLAG_RECURSIVE 2
 #define VOLMAP_FLAG_PERNODECACHE 4
 #define VOLMAP_FLAG_SLAVE 8
 #define VOLMAP_FLAG_PRIVATE 16
+#define VOLMAP_FLAG_STAGEIN 32
+#define VOLMAP_FLAG_STAGEOUT 64
+#define VOLMAP_FLAG_PACKED 128
+#define VOLMAP_FLAG_SHM 256
+#define VOLMAP_FLAG_HUGETLBFS 512
+
+#define VOLMAP_MATCH_EXACT 1
+#define VOLMAP_MATCH_PREFIX 2
 
 typedef struct {
     int type;
     void *value;
 } VolumeMapFlag;
 
+/* block of string storage owned by a VolumeMap; the raw, to and from strings
+ * of each entry point into these blocks rather than being allocated
+ * individually */
+typedef struct _VolumeMapArena {
+    struct _VolumeMapArena *prev;
+    char *data;
+    size_t used;
+    size_t capacity;
+} VolumeMapArena;
+
 typedef struct _VolumeMap {
     char **raw;
     char **to;
     char **from;
     VolumeMapFlag **flags;
     size_t n;
+    size_t capacity;
 
-    size_t rawCapacity;
-    size_t toCapacity;
-    size_t fromCapacity;
-    size_t flagsCapacity;
+    VolumeMapArena *arena;
 } VolumeMap;
 
 typedef struct {
@@ -86,6 +103,37 @@ typedef struct {
     char *fstype;
 } VolMapPerNodeCacheConfig;
 
+/* private tmpfs (shm) or hugetlbfs mounted on the volume target; the source
+ * of such volumes is ignored */
+typedef struct {
+    ssize_t size;
+    ssize_t pageSize;
+    char *mpol;
+    char *nodes;
+} VolMapMemFsConfig;
+
+/* character trie of disallowed paths; node 0 is the root and a child or
+ * sibling index of 0 means none */
+typedef struct {
+    char ch;
+    unsigned char match;
+    size_t child;
+    size_t sibling;
+} VolumeMapTrieNode;
+
+typedef struct {
+    VolumeMapTrieNode *nodes;
+    size_t n;
+    size_t capacity;
+} VolumeMapTrie;
+
+/* compiled form of the path and flag restrictions applied to a volume map */
+typedef struct {
+    VolumeMapTrie to;
+    VolumeMapTrie from;
+    size_t allowedFlags;
+} VolumeMapPolicy;
+
 
 int parseVolumeMap(const char *input, VolumeMap *volMap);
 int parseVolumeMapSiteFs(const char *input, VolumeMap *volMap);
@@ -94,10 +142,22 @@ size_t fprint_VolumeMap(FILE *fp, VolumeMap *volMap);
 void free_VolumeMap(VolumeMap *volMap, int freeStruct);
 int validateVolumeMap_userRequest(const char *from, const char *to, VolumeMapFlag *flags);
 int validateVolumeMap_siteRequest(const char *from, const char *to, VolumeMapFlag *flags);
+int validateVolumeMap_targets(VolumeMap *volMap);
+
+int compile_VolumeMapPolicy(VolumeMapPolicy *policy,
+        const char **toStartsWithDisallowed,
+        const char **toExactDisallowed,
+        const char **fromStartsWithDisallowed,
+        const char **fromExactDisallowed,
+        size_t allowedFlags);
+void free_VolumeMapPolicy(VolumeMapPolicy *policy, int freeStruct);
+int insert_VolumeMapTrie(VolumeMapTrie *trie, const char *path, int match);
+int match_VolumeMapTrie(const VolumeMapTrie *trie, const char *path);
 
 void free_VolumeMapFlag(VolumeMapFlag *flag, int freeStruct);
 void free_VolMapPerNodeCacheConfig(VolMapPerNodeCacheConfig *cacheConfig);
 int validate_VolMapPerNodeCacheConfig(VolMapPerNodeCacheConfig *cacheConfig);
+void free_VolMapMemFsConfig(VolMapMemFsConfig *memFsConfig);
 ssize_t parseBytes(const char *input);
 
 /* semi-private methods */
@@ -105,17 +165,12 @@ int _validateVolumeMap(
         const char *from,
         const char *to,
         VolumeMapFlag *flags,
-        const char **toStartsWithDisallowed, 
-        const char **toExactDisallowed,
-        const char **fromStartsWithDisallowed,
-        const char **fromExactDisallowed,
-        size_t allowedFlags);
+        const VolumeMapPolicy *policy);
 
 int _parseVolumeMap(const char *input, VolumeMap *volMap,
         int (*_validate_fp)(const char *, const char *, VolumeMapFlag *),
         short requireTo);
 const char *_findEndVolumeMapString(const char *basePtr);
-char **_tokenizeVolumeMapInput(char *input);
 int _parseFlag(char *flagStr, VolumeMapFlag **flags, size_t *flagCapacity);
 
 #ifdef __cplusplus
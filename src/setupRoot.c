@@ -68,6 +68,8 @@
 #include "shifter_core.h"
 #include "shifter_mem.h"
 #include "VolumeMap.h"
+#include "shifter_trace.h"
+#include "JobMetrics.h"
 
 #include "config.h"
 
@@ -82,9 +84,11 @@ typedef struct _SetupRootConfig {
     uid_t uid;
     gid_t gid;
     char *minNodeSpec;
+    char *jobIdentifier;
     VolumeMap volumeMap;
 
     int verbose;
+    int reportMetrics;
 } SetupRootConfig;
 
 static void _usage(int);
@@ -93,15 +97,31 @@ void free_SetupRootConfig(SetupRootConfig *config);
 void fprint_SetupRootConfig(FILE *, SetupRootConfig *config);
 int getImage(ImageData *, SetupRootConfig *, UdiRootConfig *);
 
+static pid_t metricsPid = 0;
+
+/* runs on every exit path so failed setups are reported as well; forked
+ * children (hooks, sshd) inherit the handler and must stay quiet */
+static void _reportMetrics(void) {
+    if (getpid() != metricsPid) return;
+    printf("%s retries=%lu\n", JOBMETRICS_REPORT_TAG,
+            (unsigned long) shifter_getRetryCount());
+}
+
 int main(int argc, char **argv) {
     UdiRootConfig udiConfig;
     SetupRootConfig config;
     ImageData image;
+    uint64_t traceStart = shifter_trace_now();
+    int traceRequested = shifter_trace_requested();
+    char *jobIdentifier = NULL;
 
     memset(&udiConfig, 0, sizeof(UdiRootConfig));
     memset(&config, 0, sizeof(SetupRootConfig));
     memset(&image, 0, sizeof(ImageData));
 
+    if (getenv("SLURM_JOB_ID") != NULL) {
+        jobIdentifier = _strdup(getenv("SLURM_JOB_ID"));
+    }
     clearenv();
     setenv("PATH", "/usr/bin:/usr/sbin:/bin:/sbin", 1);
 
@@ -109,10 +129,28 @@ int main(int argc, char **argv) {
         fprintf(stderr, "FAILED to parse command line arguments. Exiting.\n");
         _usage(1);
     }
+    if (config.reportMetrics) {
+        metricsPid = getpid();
+        atexit(_reportMetrics);
+    }
     if (parse_UdiRootConfig(CONFIG_FILE, &udiConfig, UDIROOT_VAL_ALL) != 0) {
         fprintf(stderr, "FAILED to parse udiRoot configuration. Exiting.\n");
         exit(1);
     }
+    if ((traceRequested || udiConfig.traceAlways) && udiConfig.traceDir != NULL) {
+        shifter_trace_open("setupRoot", udiConfig.traceDir, jobIdentifier);
+    }
+    if (jobIdentifier != NULL) {
+        free(jobIdentifier);
+        jobIdentifier = NULL;
+    }
+    shifter_trace_event("phase", "parseConfig", NULL, traceStart);
+
+    if (selectUdiInstance(&udiConfig, config.jobIdentifier, 1) != 0) {
+        fprintf(stderr, "FAILED to setup UDI instance for job %s. Exiting.\n",
+                config.jobIdentifier);
+        exit(1);
+    }
 
     udiConfig.target_uid = config.uid;
     udiConfig.target_gid = config.gid;
@@ -135,10 +173,12 @@ int main(int argc, char **argv) {
         fprint_UdiRootConfig(stdout, &udiConfig);
     }
 
+    traceStart = SHIFTER_TRACE_START();
     if (getImage(&image, &config, &udiConfig) != 0) {
         fprintf(stderr, "FAILED to get image %s of type %s\n", config.imageIdentifier, config.imageType);
         exit(1);
     }
+    shifter_trace_event("phase", "getImage", config.imageIdentifier, traceStart);
     if (!check_image_permissions(config.uid, config.gid,
                                 udiConfig.auxiliary_gids,
                                 udiConfig.nauxiliary_gids,
@@ -151,20 +191,42 @@ int main(int argc, char **argv) {
     if (config.verbose) {
         fprint_ImageData(stdout, &image);
     }
+
+    /* a UDI kept warm by the previous job only needs its per-job parts */
+    if (isUdiParked(&udiConfig)) {
+        traceStart = SHIFTER_TRACE_START();
+        if (udiConfig.udiKeepWarmTimeout > 0 &&
+                reclaimParkedUDI(config.user, &image, &(config.volumeMap),
+                    config.minNodeSpec, config.sshPubKey, config.uid,
+                    config.gid, &udiConfig) == 0)
+        {
+            shifter_trace_event("phase", "reclaimParkedUDI", NULL, traceStart);
+            return 0;
+        }
+        if (isUdiParked(&udiConfig) && destructUDI(&udiConfig, 1) != 0) {
+            fprintf(stderr, "FAILED to tear down idle UDI\n");
+            exit(1);
+        }
+    }
     if (image.useLoopMount) {
+        traceStart = SHIFTER_TRACE_START();
         if (mountImageLoop(&image, &udiConfig) != 0) {
             fprintf(stderr, "FAILED to mount image on loop device.\n");
             exit(1);
         }
+        shifter_trace_event("phase", "mountImageLoop", NULL, traceStart);
     }
+    traceStart = SHIFTER_TRACE_START();
     if (mountImageVFS(&image, config.user, 0, config.minNodeSpec, &udiConfig) != 0) {
         fprintf(stderr, "FAILED to mount image into UDI\n");
         exit(1);
     }
+    shifter_trace_event("phase", "mountImageVFS", NULL, traceStart);
 
     if (config.sshPubKey != NULL && strlen(config.sshPubKey) > 0
             && config.user != NULL && strlen(config.user) > 0
             && config.uid != 0) {
+        traceStart = SHIFTER_TRACE_START();
         if (setupImageSsh(config.sshPubKey, config.user, config.uid, config.gid, &udiConfig) != 0) {
             fprintf(stderr, "FAILED to setup ssh configuration\n");
             exit(1);
@@ -173,23 +235,30 @@ int main(int argc, char **argv) {
             fprintf(stderr, "FAILED to start sshd\n");
             exit(1);
         }
+        shifter_trace_event("phase", "setupSsh", NULL, traceStart);
     }
 
+    traceStart = SHIFTER_TRACE_START();
     if (setupUserMounts(&(config.volumeMap), &udiConfig) != 0) {
         fprintf(stderr, "FAILED to setup user-requested mounts.\n");
         exit(1);
     }
+    shifter_trace_event("phase", "setupUserMounts", NULL, traceStart);
 
+    traceStart = SHIFTER_TRACE_START();
     if (saveShifterConfig(config.user, &image, &(config.volumeMap), &udiConfig) != 0) {
         fprintf(stderr, "FAILED to writeout shifter configuration file\n");
         exit(1);
     }
+    shifter_trace_event("phase", "saveShifterConfig", NULL, traceStart);
 
     if (!udiConfig.mountUdiRootWritable) {
+        traceStart = SHIFTER_TRACE_START();
         if (remountUdiRootReadonly(&udiConfig) != 0) {
             fprintf(stderr, "FAILED to remount udiRoot readonly, fail!\n");
             exit(1);
         }
+        shifter_trace_event("phase", "remountReadonly", NULL, traceStart);
     }
 
     return 0;
@@ -203,9 +272,10 @@ int parse_SetupRootConfig(int argc, char **argv, SetupRootConfig *config) {
     int opt = 0;
     optind = 1;
 
-    while ((opt = getopt(argc, argv, "v:s:u:U:G:N:m:V")) != -1) {
+    while ((opt = getopt(argc, argv, "v:s:u:U:G:N:m:j:VM")) != -1) {
         switch (opt) {
             case 'V': config->verbose = 1; break;
+            case 'M': config->reportMetrics = 1; break;
             case 'v':
                 if (parseVolumeMap(optarg, &(config->volumeMap)) != 0) {
                     fprintf(stderr, "Failed to parse volume map request: %s\n", optarg);
@@ -231,6 +301,9 @@ int parse_SetupRootConfig(int argc, char **argv, SetupRootConfig *config) {
             case 'm':
                 config->modules = _strdup(optarg);
                 break;
+            case 'j':
+                config->jobIdentifier = _strdup(optarg);
+                break;
             case '?':
                 fprintf(stderr, "Missing an argument!\n");
                 _usage(1);
@@ -239,6 +312,11 @@ int parse_SetupRootConfig(int argc, char **argv, SetupRootConfig *config) {
                 break;
         }
     }
+    /* the targets of all -v options are checked together */
+    if (validateVolumeMap_targets(&(config->volumeMap)) != 0) {
+        fprintf(stderr, "Invalid volume map targets\n");
+        _usage(1);
+    }
 
     int remaining = argc - optind;
     if (remaining != 2) {
@@ -266,6 +344,9 @@ void free_SetupRootConfig(SetupRootConfig *config) {
     if (config->minNodeSpec != NULL) {
         free(config->minNodeSpec);
     }
+    if (config->jobIdentifier != NULL) {
+        free(config->jobIdentifier);
+    }
     free_VolumeMap(&(config->volumeMap), 0);
     free(config);
 }
@@ -279,6 +360,7 @@ void fprint_SetupRootConfig(FILE *fp, SetupRootConfig *config) {
     fprintf(fp, "user: %s\n", (config->user ? config->user : ""));
     fprintf(fp, "uid: %d\n", config->uid);
     fprintf(fp, "minNodeSpec: %s\n", (config->minNodeSpec ? config->minNodeSpec : ""));
+    fprintf(fp, "jobIdentifier: %s\n", (config->jobIdentifier ? config->jobIdentifier : ""));
     fprintf(fp, "volumeMap: %lu maps\n", config->volumeMap.n);
     fprint_VolumeMap(fp, &(config->volumeMap));
     fprintf(fp, "***** END SetupRootConfig *****\n");
@@ -45,6 +45,8 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/prctl.h>
+#include <fcntl.h>
+#include <dirent.h>
 
 #include "UdiRootConfig.h"
 #include "shifter_core.h"
@@ -52,6 +54,9 @@
 #include "ImageData.h"
 #include "utility.h"
 #include "VolumeMap.h"
+#include "shifter_trace.h"
+#include "shifter_hash.h"
+#include "shifter_executor.h"
 #include "config.h"
 
 #define VOLUME_ALLOC_BLOCK 10
@@ -90,28 +95,48 @@ int fprint_options(FILE *, struct options *);
 void free_options(struct options *, int freeStruct);
 int isImageLoaded(ImageData *, struct options *, UdiRootConfig *);
 int loadImage(ImageData *, struct options *, UdiRootConfig *);
+int setupImage(ImageData *, struct options *, UdiRootConfig *);
 int adoptPATH(char **environ);
 
 #ifndef _TESTHARNESS_SHIFTER
 
+typedef struct _ExecutorState {
+    struct options *opts;
+    UdiRootConfig *udiConfig;
+    ImageData *imageData;
+} ExecutorState;
+
+static sighandler_t sighupHndlr = SIG_DFL;
+static sighandler_t sigintHndlr = SIG_DFL;
+static sighandler_t sigstopHndlr = SIG_DFL;
+static sighandler_t sigtermHndlr = SIG_DFL;
+
+static int execContainer(struct options *, UdiRootConfig *, ImageData *,
+        char **run_args, char **environ_copy);
+static int runInExecutor(const char *, struct options *, UdiRootConfig *,
+        ImageData *, char **run_args, char **environ_copy);
+static void startExecutor(const char *, struct options *, UdiRootConfig *,
+        ImageData *);
+
 int main(int argc, char **argv) {
-    sighandler_t sighupHndlr = signal(SIGHUP, SIG_IGN);
-    sighandler_t sigintHndlr = signal(SIGINT, SIG_IGN);
-    sighandler_t sigstopHndlr = signal(SIGSTOP, SIG_IGN);
-    sighandler_t sigtermHndlr = signal(SIGTERM, SIG_IGN);
+    uint64_t traceStart = shifter_trace_now();
+
+    sighupHndlr = signal(SIGHUP, SIG_IGN);
+    sigintHndlr = signal(SIGINT, SIG_IGN);
+    sigstopHndlr = signal(SIGSTOP, SIG_IGN);
+    sigtermHndlr = signal(SIGTERM, SIG_IGN);
 
     /* save a copy of the environment for the exec */
     char **environ_copy = shifter_copyenv();
 
     /* declare needed variables */
     char *wd = _malloc(sizeof(char) * PATH_MAX);
-    char *udiRoot = _malloc(sizeof(char) * PATH_MAX);
+    char *executorPath = NULL;
     char **run_args = NULL;
     uid_t actualUid = 0;
     uid_t actualGid = 0;
     uid_t eUid = 0;
     gid_t eGid = 0;
-    int idx = 0;
     struct options *opts = _malloc(sizeof(struct options));
     UdiRootConfig *udiConfig = _malloc(sizeof(UdiRootConfig));
     ImageData *imageData = _malloc(sizeof(ImageData));
@@ -127,6 +152,25 @@ int main(int argc, char **argv) {
         fprintf(stderr, "FAILED to parse environment\n");
         exit(1);
     }
+    /* use this job's UDI instance if the prolog set one up, 2 means it did
+     * not and the node-wide UDI is used */
+    if (selectUdiInstance(udiConfig, getenv("SLURM_JOB_ID"), 0) == 1) {
+        fprintf(stderr, "FAILED to select UDI instance\n");
+        exit(1);
+    }
+    /* trace file must be opened before chroot and privilege drop */
+    if ((shifter_trace_requested() || udiConfig->traceAlways)
+            && udiConfig->traceDir != NULL) {
+        shifter_trace_open("shifter", udiConfig->traceDir,
+                getenv("SLURM_JOB_ID"));
+    }
+    /* the executor only serves batch ranks of a job step; interactive
+     * sessions need job control and PMI_FD cannot be forwarded */
+    if (!isatty(STDIN_FILENO) && getenv("PMI_FD") == NULL) {
+        executorPath = shifter_executor_socketPath(
+                udiConfig->executorSocketDir, getuid(),
+                getenv("SLURM_JOB_ID"), getenv("SLURM_STEP_ID"));
+    }
     /* destroy this environment */
     clearenv();
 
@@ -135,12 +179,16 @@ int main(int argc, char **argv) {
         fprintf(stderr, "FAILED to parse command line arguments.\n");
         exit(1);
     }
+    shifter_trace_event("phase", "parseConfig", NULL, traceStart);
 
     /* discover information about this image */
+    traceStart = SHIFTER_TRACE_START();
     if (parse_ImageData(opts->imageType, opts->imageIdentifier, udiConfig, imageData) != 0) {
         fprintf(stderr, "FAILED to find requested image.\n");
         exit(1);
     }
+    shifter_trace_event("phase", "parseImageData", opts->imageIdentifier,
+            traceStart);
 
     run_args = calculate_args(opts->useEntryPoint, opts->args, opts->entrypoint,
                               imageData);
@@ -158,15 +206,11 @@ int main(int argc, char **argv) {
         }
     }
 
-    snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
-    udiRoot[PATH_MAX - 1] = 0;
-
     /* figure out who we are and who we want to be */
     eUid = geteuid();
     eGid = getegid();
     actualUid = getuid();
     actualGid = getgid();
-    udiConfig->auxiliary_gids = shifter_getgrouplist(opts->username, opts->tgtGid, &(udiConfig->nauxiliary_gids));
 
     if (eUid != 0 && eGid != 0) {
         fprintf(stderr, "%s\n", "Not running with root privileges, will fail.");
@@ -180,14 +224,6 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Failed to correctly identify uid/gid, exiting.\n");
         exit(1);
     }
-    if (!check_image_permissions(opts->tgtUid, opts->tgtGid,
-                                udiConfig->auxiliary_gids,
-                                udiConfig->nauxiliary_gids,
-                                imageData))
-    {
-        fprintf(stderr,"FAILED permission denied to image\n");
-        exit(1);
-    }
 
     /* keep cwd to switch back to it (if possible), after chroot */
     if (getcwd(wd, PATH_MAX) == NULL) {
@@ -199,27 +235,77 @@ int main(int argc, char **argv) {
         opts->workdir = _strdup(wd);
     }
 
+    /* the executor holds a UDI with the same fingerprint and checks image
+     * permissions for this rank's uid and gid, hand the rank over */
+    if (executorPath != NULL) {
+        runInExecutor(executorPath, opts, udiConfig, imageData, run_args,
+                environ_copy);
+    }
+
+    udiConfig->auxiliary_gids = shifter_getgrouplist(opts->username, opts->tgtGid, &(udiConfig->nauxiliary_gids));
+    if (!check_image_permissions(opts->tgtUid, opts->tgtGid,
+                                udiConfig->auxiliary_gids,
+                                udiConfig->nauxiliary_gids,
+                                imageData))
+    {
+        fprintf(stderr,"FAILED permission denied to image\n");
+        exit(1);
+    }
+
+    traceStart = SHIFTER_TRACE_START();
     if (isImageLoaded(imageData, opts, udiConfig) == 0) {
-        if (loadImage(imageData, opts, udiConfig) != 0) {
+        shifter_trace_event("phase", "isImageLoaded", "no", traceStart);
+        if (setupImage(imageData, opts, udiConfig) != 0) {
             fprintf(stderr, "FAILED to setup image.\n");
             exit(1);
         }
+    } else {
+        shifter_trace_event("phase", "isImageLoaded", "yes", traceStart);
     }
 
-    /* switch to new / to prevent the chroot jail from being leaky */
-    if (chdir(udiRoot) != 0) {
-        perror("Failed to switch to root path: ");
-        exit(1);
+    if (executorPath != NULL) {
+        traceStart = SHIFTER_TRACE_START();
+        startExecutor(executorPath, opts, udiConfig, imageData);
+        shifter_trace_event("phase", "startExecutor", NULL, traceStart);
     }
 
-    /* chroot into the jail */
-    if (chroot(udiRoot) != 0) {
-        perror("Could not chroot: ");
-        exit(1);
-    }
-    if (chdir("/") != 0) {
-        perror("Could not chdir to new root: ");
-        abort();
+    return execContainer(opts, udiConfig, imageData, run_args, environ_copy);
+}
+
+/**
+ * execContainer
+ * chroot into the UDI, drop privileges, setup the container environment,
+ * run module userhooks and exec run_args.  Only returns if the exec fails.
+ */
+static int execContainer(struct options *opts, UdiRootConfig *udiConfig,
+        ImageData *imageData, char **run_args, char **environ_copy)
+{
+    uint64_t traceStart = 0;
+    int idx = 0;
+
+    traceStart = SHIFTER_TRACE_START();
+    if (udiConfig->usePivotRoot) {
+        /* make the UDI the root of a private namespace without host mounts */
+        if (pivotIntoUdi(udiConfig->udiMountPoint) != 0) {
+            fprintf(stderr, "FAILED to pivot_root into the UDI\n");
+            exit(1);
+        }
+    } else {
+        /* switch to new / to prevent the chroot jail from being leaky */
+        if (chdir(udiConfig->udiMountPoint) != 0) {
+            perror("Failed to switch to root path: ");
+            exit(1);
+        }
+
+        /* chroot into the jail */
+        if (chroot(udiConfig->udiMountPoint) != 0) {
+            perror("Could not chroot: ");
+            exit(1);
+        }
+        if (chdir("/") != 0) {
+            perror("Could not chdir to new root: ");
+            abort();
+        }
     }
 
     /* attempt to prevent this process and its heirs from ever gaining any
@@ -251,6 +337,7 @@ int main(int argc, char **argv) {
         abort();
     }
 #endif
+    shifter_trace_event("phase", "chrootDropPrivileges", NULL, traceStart);
 
     /* chdir (within chroot) to where we belong again */
     if (chdir(opts->workdir) != 0) {
@@ -281,20 +368,37 @@ int main(int argc, char **argv) {
     }
 
     /* set the environment variables */
+    traceStart = SHIFTER_TRACE_START();
     if (shifter_setupenv(&environ_copy, imageData, opts->envfile, opts->env, udiConfig) != 0) {
         fprintf(stderr, "Failed to setup container environment variables\n");
         exit(1);
     }
+    shifter_trace_event("phase", "setupenv", NULL, traceStart);
 
     /* run any user hooks */
     for (idx = 0; idx < udiConfig->n_active_modules; idx++) {
-        if (udiConfig->active_modules[idx]->userhook == NULL)
+        ShifterModule *module = udiConfig->active_modules[idx];
+        int rc = 0;
+        if (module->userhook == NULL)
             continue;
 
-        char *args[] = { "/bin/sh", udiConfig->active_modules[idx]->userhook, NULL };
-        int rc = forkAndExecv(args);
+        traceStart = SHIFTER_TRACE_START();
+        if (module->userhookEnv) {
+            /* environment-only hook: the first rank on the UDI runs it and
+             * stores the result for the rest */
+            char *cacheFile = alloc_strgenf("%s/%s.env", USERHOOK_ENV_DIR,
+                    module->name);
+            rc = shifter_userhookenv(&environ_copy, module->userhook,
+                    access(USERHOOK_ENV_DIR, W_OK) == 0 ? cacheFile : NULL);
+            free(cacheFile);
+        } else {
+            char *args[] = { "/bin/sh", module->userhook, NULL };
+            rc = forkAndExecv(args);
+        }
+        shifter_trace_event("phase", "moduleUserhook", module->name,
+                traceStart);
         if (rc != 0) {
-            fprintf(stderr, "Failed to setup module %s\n", udiConfig->active_modules[idx]->name);
+            fprintf(stderr, "Failed to setup module %s\n", module->name);
             exit(1);
         }
     }
@@ -308,13 +412,206 @@ int main(int argc, char **argv) {
     signal(SIGSTOP, sigstopHndlr);
     signal(SIGTERM, sigtermHndlr);
 
+    /* exec replaces this process, write out the trace first */
+    shifter_trace_close();
+
     /* attempt to execute user-requested exectuable */
     execvpe(run_args[0], run_args, environ_copy);
 
     /* doh! how did we get here? return the error */
-    fprintf(stderr, "%s: %s: %s\n", argv[0], run_args[0], strerror(errno));
+    fprintf(stderr, "shifter: %s: %s\n", run_args[0], strerror(errno));
     return 127;
 }
+
+/**
+ * runInExecutor
+ * Submit the rank to the node-local executor at path.  Does not return if
+ * the executor ran the command; returns 1 if there is no usable executor
+ * and the rank should be launched directly.
+ */
+static int runInExecutor(const char *path, struct options *opts,
+        UdiRootConfig *udiConfig, ImageData *imageData, char **run_args,
+        char **environ_copy)
+{
+    ShifterExecutorRequest request;
+    char fingerprint[SHIFTER_HASH_HEX_SIZE + 1];
+    uint64_t traceStart = SHIFTER_TRACE_START();
+    int status = 0;
+    int rc = 0;
+    int idx = 0;
+
+    if (generateShifterConfigFingerprint(opts->username, imageData,
+                &(opts->volumeMap), udiConfig, fingerprint) != 0)
+    {
+        return 1;
+    }
+    memset(&request, 0, sizeof(ShifterExecutorRequest));
+    request.fingerprint = fingerprint;
+    request.workdir = opts->workdir;
+    request.request = opts->request;
+    request.envfile = opts->envfile;
+    request.clearenv = opts->clearenv;
+    request.args = run_args;
+    request.env = environ_copy;
+    request.userEnv = opts->env;
+    for (idx = 0; idx < SHIFTER_EXECUTOR_NFDS; idx++) {
+        request.fds[idx] = idx;
+    }
+
+    /* the executor identifies the rank by its effective ids */
+    if (setegid(getgid()) != 0 || seteuid(getuid()) != 0) {
+        return 1;
+    }
+    rc = shifter_executor_run(path, 0, &request, &status);
+    if (seteuid(0) != 0 || setegid(0) != 0) {
+        fprintf(stderr, "FAILED to regain privileges\n");
+        exit(1);
+    }
+    if (rc == 1) {
+        shifter_trace_event("phase", "executor", "unavailable", traceStart);
+        return 1;
+    }
+    shifter_trace_event("phase", "executor", NULL, traceStart);
+    shifter_trace_close();
+    if (rc != 0) {
+        fprintf(stderr, "FAILED, lost connection to shifter executor\n");
+        exit(1);
+    }
+
+    /* exit the same way the rank did */
+    if (WIFSIGNALED(status)) {
+        signal(WTERMSIG(status), SIG_DFL);
+        raise(WTERMSIG(status));
+        exit(128 + WTERMSIG(status));
+    }
+    exit(WEXITSTATUS(status));
+}
+
+/* runs in a child of the executor before the request is accepted: the
+ * rank's groups and image permissions are checked for the peer, not for
+ * whoever started the executor */
+static int executorAdmit(ShifterExecutorRequest *request, void *data) {
+    ExecutorState *state = (ExecutorState *) data;
+    struct options *opts = state->opts;
+    UdiRootConfig *udiConfig = state->udiConfig;
+
+    if (request->peer.uid != opts->tgtUid || request->peer.gid == 0) {
+        return EXECUTOR_REJECT_PERMISSION;
+    }
+    opts->tgtGid = request->peer.gid;
+    if (udiConfig->auxiliary_gids != NULL) {
+        free(udiConfig->auxiliary_gids);
+    }
+    udiConfig->auxiliary_gids = shifter_getgrouplist(opts->username,
+            opts->tgtGid, &(udiConfig->nauxiliary_gids));
+    if (!check_image_permissions(opts->tgtUid, opts->tgtGid,
+                                udiConfig->auxiliary_gids,
+                                udiConfig->nauxiliary_gids,
+                                state->imageData))
+    {
+        return EXECUTOR_REJECT_PERMISSION;
+    }
+    return 0;
+}
+
+/* runs in a child of the executor with the request's stdio on fds 0-2 */
+static void executorLaunch(ShifterExecutorRequest *request, void *data) {
+    ExecutorState *state = (ExecutorState *) data;
+    struct options *opts = state->opts;
+
+    /* identity and UDI come from the executor, the rest from the rank */
+    opts->workdir = request->workdir != NULL ? request->workdir : "/";
+    opts->request = request->request;
+    opts->envfile = request->envfile;
+    opts->env = request->userEnv;
+    opts->clearenv = request->clearenv;
+
+    execContainer(opts, state->udiConfig, state->imageData, request->args,
+            request->env);
+}
+
+static void closeInheritedFds(void) {
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *entry = NULL;
+    if (dir == NULL) return;
+    while ((entry = readdir(dir)) != NULL) {
+        int fd = atoi(entry->d_name);
+        if (fd > 2 && fd != dirfd(dir)) {
+            close(fd);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * startExecutor
+ * Start the node-local executor for this job step, holding the UDI (and
+ * mount namespace) that was just prepared.  The daemon is fully detached
+ * so the rank never waits on it; it exits after executorIdleTimeout
+ * seconds without requests.  If another executor is already serving path
+ * the new daemon exits immediately.
+ */
+static void startExecutor(const char *path, struct options *opts,
+        UdiRootConfig *udiConfig, ImageData *imageData)
+{
+    ExecutorState state;
+    char fingerprint[SHIFTER_HASH_HEX_SIZE + 1];
+    pid_t pid = 0;
+    int devNull = -1;
+    int listenFd = -1;
+    int idx = 0;
+
+    if (generateShifterConfigFingerprint(opts->username, imageData,
+                &(opts->volumeMap), udiConfig, fingerprint) != 0)
+    {
+        return;
+    }
+    pid = fork();
+    if (pid < 0) {
+        return;
+    }
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+        return;
+    }
+
+    /* detach from the rank's session and process tree */
+    if (setsid() < 0 || fork() != 0) {
+        _exit(0);
+    }
+    shifter_trace_close();
+    closeInheritedFds();
+    devNull = open("/dev/null", O_RDWR);
+    for (idx = 0; idx < 3 && devNull >= 0; idx++) {
+        dup2(devNull, idx);
+    }
+    if (devNull > 2) {
+        close(devNull);
+    }
+    if (chdir("/") != 0 || setresgid(0, 0, 0) != 0 ||
+            setresuid(0, 0, 0) != 0)
+    {
+        _exit(1);
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    sighupHndlr = SIG_DFL;
+    sigintHndlr = SIG_DFL;
+    sigstopHndlr = SIG_DFL;
+    sigtermHndlr = SIG_DFL;
+
+    listenFd = shifter_executor_listen(path, opts->tgtUid);
+    if (listenFd < 0) {
+        _exit(0);
+    }
+    state.opts = opts;
+    state.udiConfig = udiConfig;
+    state.imageData = imageData;
+    shifter_executor_serve(listenFd, path, opts->tgtUid, fingerprint,
+            udiConfig->executorIdleTimeout, executorAdmit, executorLaunch,
+            &state);
+    _exit(0);
+}
 #endif /* TESTHARNESS */
 
 
@@ -524,7 +821,9 @@ int parse_options(int argc, char **argv, struct options *config, UdiRootConfig *
     }
     /* validate and organize any user-requested bind-mounts */
     if (config->rawVolumes != NULL) {
-        if (parseVolumeMap(config->rawVolumes, &(config->volumeMap)) != 0) {
+        if (parseVolumeMap(config->rawVolumes, &(config->volumeMap)) != 0 ||
+                validateVolumeMap_targets(&(config->volumeMap)) != 0)
+        {
             fprintf(stderr, "Failed to parse volume map options\n");
             _usage(1);
         }
@@ -774,11 +1073,95 @@ int isImageLoaded(ImageData *image, struct options *options, UdiRootConfig *udiC
     return 0;
 }
 
+/**
+ * Enter the UDI published under lockFd if it matches this configuration,
+ * otherwise stay in (or return to) the current mount namespace.
+ */
+static int joinImage(int lockFd, ImageData *image, struct options *opts,
+        UdiRootConfig *udiConfig)
+{
+    uint64_t traceStart = SHIFTER_TRACE_START();
+    int origNs = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+    if (origNs < 0) {
+        return 1;
+    }
+    if (joinPublishedUdi(lockFd) != 0) {
+        close(origNs);
+        return 1;
+    }
+    if (isImageLoaded(image, opts, udiConfig)) {
+        close(origNs);
+        shifter_trace_event("phase", "joinImage", NULL, traceStart);
+        return 0;
+    }
+    if (setns(origNs, CLONE_NEWNS) != 0) {
+        fprintf(stderr, "FAILED to return to original mount namespace\n");
+        abort();
+    }
+    close(origNs);
+    return 1;
+}
+
+/**
+ * Provide the UDI for this configuration, building it at most once per
+ * node: if udiRunDir is configured, concurrent shifter instances with the
+ * same configuration fingerprint serialize on a build lock, the first one
+ * builds and publishes its namespace, and the others join it.
+ */
+int setupImage(ImageData *image, struct options *opts, UdiRootConfig *udiConfig) {
+    char fingerprint[SHIFTER_HASH_HEX_SIZE + 1];
+    uint64_t traceStart = 0;
+    int lockFd = -1;
+    int rc = 0;
+
+    if (udiConfig->udiRunDir != NULL &&
+            generateShifterConfigFingerprint(opts->username, image,
+                &(opts->volumeMap), udiConfig, fingerprint) == 0)
+    {
+        lockFd = openUdiBuildLock(udiConfig, fingerprint);
+    }
+    if (lockFd >= 0) {
+        if (joinImage(lockFd, image, opts, udiConfig) == 0) {
+            close(lockFd);
+            return 0;
+        }
+        traceStart = SHIFTER_TRACE_START();
+        if (acquireUdiBuildLock(lockFd, udiConfig->udiLockTimeout) != 0) {
+            fprintf(stderr, "WARNING: timed out waiting for the UDI build "
+                    "lock, setting up a private UDI\n");
+            close(lockFd);
+            lockFd = -1;
+        }
+        shifter_trace_event("phase", "udiBuildLock", NULL, traceStart);
+
+        /* the previous holder may have just published it */
+        if (lockFd >= 0 && joinImage(lockFd, image, opts, udiConfig) == 0) {
+            close(lockFd);
+            return 0;
+        }
+    }
+
+    traceStart = SHIFTER_TRACE_START();
+    rc = loadImage(image, opts, udiConfig);
+    shifter_trace_event("phase", "loadImage", NULL, traceStart);
+    if (rc == 0 && lockFd >= 0 && publishUdi(lockFd) != 0) {
+        fprintf(stderr, "WARNING: failed to publish UDI for other shifter "
+                "instances\n");
+    }
+
+    /* closing releases the build lock */
+    if (lockFd >= 0) {
+        close(lockFd);
+    }
+    return rc;
+}
+
 /**
  * Loads the needed image
  */
 int loadImage(ImageData *image, struct options *opts, UdiRootConfig *udiConfig) {
     int retryCnt = 0;
+    uint64_t traceStart = 0;
     char chrootPath[PATH_MAX];
     snprintf(chrootPath, PATH_MAX, "%s", udiConfig->udiMountPoint);
     chrootPath[PATH_MAX - 1] = 0;
@@ -816,42 +1199,54 @@ int loadImage(ImageData *image, struct options *opts, UdiRootConfig *udiConfig)
     }
 
     /* remove access to any preexisting mounts in the global namespace to this area */
+    traceStart = SHIFTER_TRACE_START();
     destructUDI(udiConfig, 0);
     for (retryCnt = 0; retryCnt < 10; retryCnt++) {
         if (validateUnmounted(chrootPath, 1) == 0) break;
         usleep(300000); /* sleep for 0.3s */
     }
+    shifter_trace_event("phase", "destructUDI", NULL, traceStart);
     if (retryCnt == 10) {
         fprintf(stderr, "FAILED to unmount old image in this namespace, cannot conintue.\n");
         goto _loadImage_error;
     }
 
     if (image->useLoopMount) {
+        traceStart = SHIFTER_TRACE_START();
         if (mountImageLoop(image, udiConfig) != 0) {
             fprintf(stderr, "FAILED to mount image on loop device.\n");
             goto _loadImage_error;
         }
+        shifter_trace_event("phase", "mountImageLoop", NULL, traceStart);
     }
+    traceStart = SHIFTER_TRACE_START();
     if (mountImageVFS(image, opts->username, opts->verbose, NULL, udiConfig) != 0) {
         fprintf(stderr, "FAILED to mount image into UDI\n");
         goto _loadImage_error;
     }
+    shifter_trace_event("phase", "mountImageVFS", NULL, traceStart);
 
+    traceStart = SHIFTER_TRACE_START();
     if (setupUserMounts(&(opts->volumeMap), udiConfig) != 0) {
         fprintf(stderr, "FAILED to setup user-requested mounts.\n");
         goto _loadImage_error;
     }
+    shifter_trace_event("phase", "setupUserMounts", NULL, traceStart);
 
+    traceStart = SHIFTER_TRACE_START();
     if (saveShifterConfig(opts->username, image, &(opts->volumeMap), udiConfig) != 0) {
         fprintf(stderr, "FAILED to writeout shifter configuration file\n");
         goto _loadImage_error;
     }
+    shifter_trace_event("phase", "saveShifterConfig", NULL, traceStart);
 
     if (!udiConfig->mountUdiRootWritable) {
+        traceStart = SHIFTER_TRACE_START();
         if (remountUdiRootReadonly(udiConfig) != 0) {
             fprintf(stderr, "FAILED to remount udiRoot readonly, fail!\n");
             goto _loadImage_error;
         }
+        shifter_trace_event("phase", "remountReadonly", NULL, traceStart);
     }
 
     return 0;
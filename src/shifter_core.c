@@ -38,16 +38,21 @@
 #include <signal.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <grp.h>
 #include <pwd.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mount.h>
+#include <sys/file.h>
 #include <sys/types.h>
 #include <sys/prctl.h>
 #include <sys/capability.h>
+#include <sys/syscall.h>
+#include <sys/statvfs.h>
 
 #include "ImageData.h"
 #include "UdiRootConfig.h"
@@ -58,6 +63,12 @@
 #include "MountList.h"
 #include "config.h"
 #include "PathList.h"
+#include "shifter_trace.h"
+#include "shifter_hash.h"
+#include "shifter_gpu.h"
+#include "shifter_ldcache.h"
+#include "shifter_stage.h"
+#include "shifter_pack.h"
 
 #ifndef BINDMOUNT_OVERWRITE_UNMOUNT_RETRY
 #define BINDMOUNT_OVERWRITE_UNMOUNT_RETRY 3
@@ -71,6 +82,42 @@ int _shifterCore_bindMount(UdiRootConfig *confg, MountList *mounts,
         const char *from, const char *to, size_t flags, int overwrite);
 int _shifterCore_copyFile(const char *cpPath, const char *source, const char *dest, int keepLink, uid_t owner, gid_t group, mode_t mode);
 int _shifterCore_copyUdiImage(UdiRootConfig *config);
+static char **_listUdiInstanceMounts(UdiRootConfig *udiConfig);
+static int _unmountTreeExcept(MountList *mounts, const char *base,
+        char **keep);
+static int _validateUnmountedExcept(const char *path, int subtree,
+        char **keep);
+static int _expireParkedUDI(UdiRootConfig *udiConfig);
+
+/* thin wrappers so that every mount syscall and retry delay is recorded in
+ * the startup trace (see shifter_trace.h); these add only a flag test when
+ * tracing is disabled */
+static int _shifterCore_mount(const char *source, const char *target,
+        const char *fstype, unsigned long flags, const void *data)
+{
+    uint64_t traceStart = SHIFTER_TRACE_START();
+    int ret = mount(source, target, fstype, flags, data);
+    shifter_trace_event("mount", ret == 0 ? "mount" : "mount_failed",
+            target, traceStart);
+    return ret;
+}
+
+static int _shifterCore_umount(const char *target, int flags) {
+    uint64_t traceStart = SHIFTER_TRACE_START();
+    int ret = umount2(target, flags);
+    shifter_trace_event("mount", ret == 0 ? "umount" : "umount_failed",
+            target, traceStart);
+    return ret;
+}
+
+static size_t shifterCore_retryCount = 0;
+
+static void _shifterCore_retrySleep(useconds_t usec, const char *reason) {
+    uint64_t traceStart = SHIFTER_TRACE_START();
+    shifterCore_retryCount++;
+    usleep(usec);
+    shifter_trace_event("retry", "sleep", reason, traceStart);
+}
 
 /*! Bind subtree of static image into UDI rootfs */
 /*!
@@ -537,6 +584,190 @@ _fail:
     return 1;
 }
 
+/* states of a module roothook in runModuleRoothooks */
+#define ROOTHOOK_PENDING 0
+#define ROOTHOOK_RUNNING 1
+#define ROOTHOOK_DONE 2
+
+typedef struct _RoothookJob {
+    ShifterModule *module;
+    pid_t pid;
+    uint64_t start;
+    int state;
+    int killed;
+} RoothookJob;
+
+/** _roothookReady
+ * a roothook may start once the roothooks of all the active modules it is
+ * declared to run after have completed
+ */
+static int _roothookReady(RoothookJob *jobs, size_t n_jobs, RoothookJob *job) {
+    size_t idx = 0;
+    size_t jdx = 0;
+
+    for (idx = 0; idx < job->module->n_after; idx++) {
+        for (jdx = 0; jdx < n_jobs; jdx++) {
+            if (jobs[jdx].module == job->module->after[idx] &&
+                    jobs[jdx].state != ROOTHOOK_DONE)
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static pid_t _startRoothook(ShifterModule *module) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        fprintf(stderr, "FAILED to fork! Exiting.\n");
+        return -1;
+    }
+    if (pid == 0) {
+        char *args[] = { "/bin/sh", module->roothook, NULL };
+
+        /* own process group so that a timeout takes out the whole hook */
+        setpgid(0, 0);
+        execv(args[0], args);
+        fprintf(stderr, "FAILED to execvp! Exiting.\n");
+        exit(127);
+    }
+    setpgid(pid, pid);
+    return pid;
+}
+
+static void _killRoothook(RoothookJob *job) {
+    if (job->state == ROOTHOOK_RUNNING && !job->killed) {
+        kill(-1 * job->pid, SIGKILL);
+        kill(job->pid, SIGKILL);
+        job->killed = 1;
+    }
+}
+
+/*! Run the roothooks of the active modules */
+/*!
+  Roothooks are started as soon as the roothooks of all the active modules
+  they are declared to run after (module_<name>_after) have completed, with
+  at most moduleRoothookWorkers running at once.  A roothook exceeding its
+  module's roothookTimeout is killed.  On the first failure no further
+  roothooks are started and those still running are killed.
+
+  \param udiConfig global configuration for udiRoot
+  \return 0 if all roothooks succeeded, 1 otherwise
+*/
+int runModuleRoothooks(UdiRootConfig *udiConfig) {
+    RoothookJob *jobs = NULL;
+    size_t n_jobs = 0;
+    size_t remaining = 0;
+    size_t running = 0;
+    size_t idx = 0;
+    int workers = 1;
+    int failed = 0;
+
+    if (udiConfig == NULL) {
+        return 1;
+    }
+    if (udiConfig->moduleRoothookWorkers > 1) {
+        workers = udiConfig->moduleRoothookWorkers;
+    }
+    for (idx = 0; idx < (size_t) udiConfig->n_active_modules; idx++) {
+        if (udiConfig->active_modules[idx]->roothook == NULL) {
+            continue;
+        }
+        jobs = (RoothookJob *) _realloc(jobs,
+                sizeof(RoothookJob) * (n_jobs + 1));
+        memset(&(jobs[n_jobs]), 0, sizeof(RoothookJob));
+        jobs[n_jobs].module = udiConfig->active_modules[idx];
+        n_jobs++;
+    }
+    remaining = n_jobs;
+
+    while (remaining > 0) {
+        int progress = 0;
+
+        /* start every runnable roothook the worker limit allows, in
+         * module selection order */
+        for (idx = 0; idx < n_jobs && !failed; idx++) {
+            if (running >= (size_t) workers) {
+                break;
+            }
+            if (jobs[idx].state != ROOTHOOK_PENDING ||
+                    !_roothookReady(jobs, n_jobs, &(jobs[idx])))
+            {
+                continue;
+            }
+            jobs[idx].start = shifter_trace_now();
+            jobs[idx].pid = _startRoothook(jobs[idx].module);
+            if (jobs[idx].pid < 0) {
+                failed = 1;
+                break;
+            }
+            jobs[idx].state = ROOTHOOK_RUNNING;
+            running++;
+        }
+        if (running == 0) {
+            /* failed, or nothing left that can run */
+            break;
+        }
+
+        for (idx = 0; idx < n_jobs; idx++) {
+            RoothookJob *job = &(jobs[idx]);
+            int status = 0;
+            pid_t ret = 0;
+
+            if (job->state != ROOTHOOK_RUNNING) {
+                continue;
+            }
+            ret = waitpid(job->pid, &status, WNOHANG);
+            if (ret == 0) {
+                int timeout = job->module->roothookTimeout;
+                if (timeout > 0 && !job->killed &&
+                        shifter_trace_now() - job->start >=
+                        (uint64_t) timeout * 1000000ULL)
+                {
+                    fprintf(stderr, "%s module roothook timed out after %d "
+                            "seconds.\n", job->module->name, timeout);
+                    _killRoothook(job);
+                    failed = 1;
+                }
+                continue;
+            }
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            shifter_trace_event("phase", "moduleRoothook", job->module->name,
+                    job->start);
+            job->state = ROOTHOOK_DONE;
+            running--;
+            remaining--;
+            progress = 1;
+            if (ret < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                if (!job->killed) {
+                    fprintf(stderr, "%s module roothook failed. Exiting.\n",
+                            job->module->name);
+                }
+                failed = 1;
+            }
+        }
+        if (failed) {
+            for (idx = 0; idx < n_jobs; idx++) {
+                _killRoothook(&(jobs[idx]));
+            }
+        }
+        if (!progress) {
+            usleep(ROOTHOOK_POLL_INTERVAL);
+        }
+    }
+
+    free(jobs);
+    if (remaining > 0 && !failed) {
+        fprintf(stderr, "FAILED to order module roothooks\n");
+        failed = 1;
+    }
+    return failed;
+}
+
 /*! Setup all required files/paths for site mods to the image */
 /*!
   Setup all required files/paths for site mods to the image.  This should be
@@ -568,6 +799,7 @@ int prepareSiteModifications(const char *username,
     struct stat statData;
     dev_t udiMountDev = 0;
     MountList mountCache;
+    uint64_t traceStart = 0;
 
     const char *mandatorySiteEtcFiles[4] = {
         "passwd", "group", "nsswitch.conf", NULL
@@ -626,6 +858,23 @@ int prepareSiteModifications(const char *username,
     _MKDIR("var/spool", 0755);
     _MKDIR("var/run", 0755);
     _MKDIR("var/empty", 0700);
+    for (idx = 0; idx < udiConfig->n_active_modules; idx++) {
+        ShifterModule *module = udiConfig->active_modules[idx];
+        if (module->userhook != NULL && module->userhookEnv) {
+            break;
+        }
+    }
+    if (idx < udiConfig->n_active_modules && udiConfig->target_uid != 0) {
+        /* results of environment-only userhooks, written by the user */
+        _MKDIR(USERHOOK_ENV_DIR + 1, 0700);
+        if (chown(USERHOOK_ENV_DIR + 1, udiConfig->target_uid,
+                    udiConfig->target_gid) != 0)
+        {
+            fprintf(stderr, "FAILED to chown %s\n", USERHOOK_ENV_DIR);
+            ret = 1;
+            goto _prepSiteMod_unclean;
+        }
+    }
     _MKDIR("proc", 0755);
     _MKDIR("sys", 0755);
     _MKDIR("dev", 0755);
@@ -649,10 +898,12 @@ int prepareSiteModifications(const char *username,
     }
 
     /* do site-defined mount activities */
+    traceStart = SHIFTER_TRACE_START();
     if (setupVolumeMapMounts(&mountCache, udiConfig->siteFs, 0, udiMountDev, udiConfig) != 0) {
         fprintf(stderr, "FAILED to mount siteFs volumes\n");
         goto _prepSiteMod_unclean;
     }
+    shifter_trace_event("phase", "siteFs", NULL, traceStart);
 
     /* run site-defined post-mount procedure */
     if (udiConfig->sitePostMountHook && strlen(udiConfig->sitePostMountHook) > 0) {
@@ -674,10 +925,23 @@ int prepareSiteModifications(const char *username,
     /* do active modules site-defined mount activities */
     for (idx = 0; idx < udiConfig->n_active_modules; idx++) {
         if (udiConfig->active_modules[idx]->siteFs) {
+            traceStart = SHIFTER_TRACE_START();
             if (setupVolumeMapMounts(&mountCache, udiConfig->active_modules[idx]->siteFs, 0, udiMountDev, udiConfig) != 0) {
                 fprintf(stderr, "FAILED to mount siteFs volumes for active modules.\n");
                 goto _prepSiteMod_unclean;
             }
+            shifter_trace_event("phase", "moduleSiteFs",
+                    udiConfig->active_modules[idx]->name, traceStart);
+        }
+        if (udiConfig->active_modules[idx]->gpuSupport) {
+            traceStart = SHIFTER_TRACE_START();
+            if (setupGpuSupport(&mountCache, udiConfig->active_modules[idx], udiMountDev, udiConfig) != 0) {
+                fprintf(stderr, "FAILED to setup GPU support for module %s.\n",
+                        udiConfig->active_modules[idx]->name);
+                goto _prepSiteMod_unclean;
+            }
+            shifter_trace_event("phase", "moduleGpu",
+                    udiConfig->active_modules[idx]->name, traceStart);
         }
     }
 
@@ -689,6 +953,7 @@ int prepareSiteModifications(const char *username,
     }
 
     /* copy needed local files */
+    traceStart = SHIFTER_TRACE_START();
     for (fnamePtr = copyLocalEtcFiles; *fnamePtr != NULL; fnamePtr++) {
         snprintf(source, PATH_MAX, "/etc/%s", *fnamePtr);
         snprintf(dest, PATH_MAX, "%s/etc/%s", udiRoot, *fnamePtr);
@@ -890,11 +1155,14 @@ _fail_copy_etcPath:
             goto _prepSiteMod_unclean;
         }
     }
+    shifter_trace_event("phase", "siteEtc", NULL, traceStart);
 
+    traceStart = SHIFTER_TRACE_START();
     if (_shifterCore_copyUdiImage(udiConfig) != 0) {
         fprintf(stderr, "FAILED to setup udiImage local content.\n");
         goto _prepSiteMod_unclean;
     }
+    shifter_trace_event("phase", "copyUdiImage", NULL, traceStart);
 
     /* setup hostlist for current allocation
        format of minNodeSpec is "host1/16 host2/16" for 16 copies each of host1 and host2 */
@@ -906,29 +1174,18 @@ _fail_copy_etcPath:
     }
 
     /* run active-module roothooks */
-    for (idx = 0; idx < udiConfig->n_active_modules; idx++) {
-        if (udiConfig->active_modules[idx]->roothook) {
-            char *args[] = {
-                _strdup("/bin/sh"), _strdup(udiConfig->active_modules[idx]->roothook), NULL
-            };
-            char **argsPtr = NULL;
-            ret = forkAndExecv(args);
-            for (argsPtr = args; *argsPtr != NULL; argsPtr++) {
-                free(*argsPtr);
-            }
-            if (ret != 0) {
-                fprintf(stderr, "%s module roothook failed. Exiting.\n", udiConfig->active_modules[idx]->name);
-                ret = 1;
-                goto _prepSiteMod_unclean;
-            }
-        }
+    traceStart = SHIFTER_TRACE_START();
+    if (runModuleRoothooks(udiConfig) != 0) {
+        ret = 1;
+        goto _prepSiteMod_unclean;
     }
+    shifter_trace_event("phase", "moduleRoothooks", NULL, traceStart);
 
     /***** setup linux needs ******/
     /* mount /proc */
     snprintf(mntBuffer, PATH_MAX, "%s/proc", udiRoot);
     mntBuffer[PATH_MAX-1] = 0;
-    if (mount(NULL, mntBuffer, "proc", MS_NOSUID|MS_NOEXEC|MS_NODEV, NULL) != 0) {
+    if (_shifterCore_mount(NULL, mntBuffer, "proc", MS_NOSUID|MS_NOEXEC|MS_NODEV, NULL) != 0) {
         fprintf(stderr, "FAILED to mount /proc\n");
         goto _prepSiteMod_unclean;
     }
@@ -1064,6 +1321,107 @@ _writeHostFile_error:
     return 1;
 }
 
+/** _composeOverlayRoot
+ *  Mount the image root (lower) and the site tree prepared in
+ *  siteRoot/upper (upper) as a single overlayfs on the UDI mount point, in
+ *  place of one bind mount per image entry.  The mounts made while preparing
+ *  the site tree (proc, sys, dev, siteFs, ...) are moved onto the overlay
+ *  and the site rootfs is detached; the overlay keeps its own reference to
+ *  the upper layer.
+ */
+static int _composeOverlayRoot(const char *siteRoot, const char *imageRoot,
+        UdiRootConfig *udiConfig)
+{
+    MountList mounts;
+    MountList moved;
+    struct stat statData;
+    char *upper = alloc_strgenf("%s/upper", siteRoot);
+    char *options = NULL;
+    char **ptr = NULL;
+    size_t upperLen = strlen(upper);
+    int rc = 1;
+
+    memset(&mounts, 0, sizeof(MountList));
+    memset(&moved, 0, sizeof(MountList));
+
+    /* the overlay option syntax cannot express these */
+    if (strpbrk(siteRoot, ",:") != NULL || strpbrk(imageRoot, ",:") != NULL) {
+        fprintf(stderr, "FAILED overlay paths may not contain ',' or ':'\n");
+        goto _composeOverlayRoot_exit;
+    }
+    options = alloc_strgenf("lowerdir=%s,upperdir=%s,workdir=%s/work",
+            imageRoot, upper, siteRoot);
+    if (_shifterCore_mount("overlay", udiConfig->udiMountPoint, "overlay",
+                MS_NOSUID|MS_NODEV, options) != 0)
+    {
+        fprintf(stderr, "FAILED to mount overlay on %s: %s\n",
+                udiConfig->udiMountPoint, strerror(errno));
+        goto _composeOverlayRoot_exit;
+    }
+    if (makeUdiMountPrivate(udiConfig) != 0) {
+        goto _composeOverlayRoot_exit;
+    }
+
+    /* move the outermost site mounts, nested ones travel with them */
+    if (parse_MountList(&mounts) != 0) {
+        fprintf(stderr, "FAILED to read existing mounts.\n");
+        goto _composeOverlayRoot_exit;
+    }
+    setSort_MountList(&mounts, MOUNT_SORT_FORWARD);
+    for (ptr = mounts.mountPointList; ptr && *ptr; ptr++) {
+        char **mPtr = NULL;
+        char *target = NULL;
+        int nested = 0;
+
+        if (strncmp(*ptr, upper, upperLen) != 0 || (*ptr)[upperLen] != '/') {
+            continue;
+        }
+        for (mPtr = moved.mountPointList; mPtr && *mPtr; mPtr++) {
+            size_t len = strlen(*mPtr);
+            if (strncmp(*ptr, *mPtr, len) == 0 && (*ptr)[len] == '/') {
+                nested = 1;
+                break;
+            }
+        }
+        if (nested) {
+            continue;
+        }
+        target = alloc_strgenf("%s%s", udiConfig->udiMountPoint,
+                *ptr + upperLen);
+        if (_shifterCore_mount(*ptr, target, NULL, MS_MOVE, NULL) != 0) {
+            fprintf(stderr, "FAILED to move %s to %s: %s\n", *ptr, target,
+                    strerror(errno));
+            free(target);
+            goto _composeOverlayRoot_exit;
+        }
+        free(target);
+        insert_MountList(&moved, *ptr);
+    }
+    if (_shifterCore_umount(siteRoot, MNT_DETACH) != 0) {
+        fprintf(stderr, "FAILED to detach %s\n", siteRoot);
+        goto _composeOverlayRoot_exit;
+    }
+
+    /* later mounts and mount points are made on the overlay */
+    if (lstat(udiConfig->udiMountPoint, &statData) != 0) {
+        fprintf(stderr, "FAILED to stat %s\n", udiConfig->udiMountPoint);
+        goto _composeOverlayRoot_exit;
+    }
+    udiConfig->bindMountAllowedDevices = (dev_t *) _realloc(
+            udiConfig->bindMountAllowedDevices,
+            (udiConfig->bindMountAllowedDevices_sz + 1) * sizeof(dev_t));
+    udiConfig->bindMountAllowedDevices[
+            udiConfig->bindMountAllowedDevices_sz++] = statData.st_dev;
+    rc = 0;
+
+_composeOverlayRoot_exit:
+    free_MountList(&mounts, 0);
+    free_MountList(&moved, 0);
+    free(options);
+    free(upper);
+    return rc;
+}
+
 int mountImageVFS(ImageData *imageData,
                   const char *username,
                   int verbose,
@@ -1072,9 +1430,13 @@ int mountImageVFS(ImageData *imageData,
     struct stat statData;
     char *udiRoot = _malloc(sizeof(char) * PATH_MAX);
     char *sshPath = NULL;
+    char *siteRoot = NULL;
+    char *udiMountPoint = NULL;
+    int useOverlay = 0;
     dev_t destRootDev = 0;
     dev_t srcRootDev = 0;
     dev_t tmpDev = 0;
+    uint64_t traceStart = 0;
 
     umask(022);
 
@@ -1099,20 +1461,50 @@ int mountImageVFS(ImageData *imageData,
     }
 
 #define BIND_IMAGE_INTO_UDI(subtree, img, udiConfig, copyFlag) \
+    traceStart = SHIFTER_TRACE_START(); \
     if (bindImageIntoUDI(subtree, img, udiConfig, copyFlag) > 1) { \
         fprintf(stderr, "FAILED To setup \"%s\" in %s\n", subtree, udiRoot); \
         goto _mountImgVfs_unclean; \
-    }
-
-    /* mount a new rootfs to work in */
-    if (mount(NULL, udiRoot, udiConfig->rootfsType, MS_NOSUID|MS_NODEV, NULL) != 0) {
-        fprintf(stderr, "FAILED to mount rootfs on %s\n", udiRoot);
-        perror("   --- REASON: ");
-        goto _mountImgVfs_unclean;
-    }
-    if (makeUdiMountPrivate(udiConfig) != 0) {
-        fprintf(stderr, "FAILED to mark the udi as a private mount\n");
-        goto _mountImgVfs_unclean;
+    } \
+    shifter_trace_event("phase", "bindImageIntoUDI", subtree, traceStart);
+
+    /* only loop mounted images are composed with overlayfs, a local path
+     * may contain the UDI itself */
+    useOverlay = udiConfig->useOverlayRoot && imageData->useLoopMount;
+
+    if (useOverlay) {
+        /* prepare the site tree on its own rootfs, it becomes the upper layer
+         * of the overlay once complete */
+        siteRoot = alloc_strgenf("%s.site", udiRoot);
+        if (lstat(siteRoot, &statData) != 0) {
+            _MKDIR(siteRoot, 0700);
+        }
+        if (_shifterCore_mount(NULL, siteRoot, udiConfig->rootfsType, MS_NOSUID|MS_NODEV, NULL) != 0) {
+            fprintf(stderr, "FAILED to mount rootfs on %s\n", siteRoot);
+            perror("   --- REASON: ");
+            goto _mountImgVfs_unclean;
+        }
+        if (_shifterCore_mount(NULL, siteRoot, NULL, MS_PRIVATE|MS_REC, NULL) != 0) {
+            fprintf(stderr, "FAILED to mark %s as a private mount\n", siteRoot);
+            goto _mountImgVfs_unclean;
+        }
+        snprintf(udiRoot, PATH_MAX, "%s/work", siteRoot);
+        _MKDIR(udiRoot, 0700);
+        snprintf(udiRoot, PATH_MAX, "%s/upper", siteRoot);
+        _MKDIR(udiRoot, 0755);
+        udiMountPoint = udiConfig->udiMountPoint;
+        udiConfig->udiMountPoint = _strdup(udiRoot);
+    } else {
+        /* mount a new rootfs to work in */
+        if (_shifterCore_mount(NULL, udiRoot, udiConfig->rootfsType, MS_NOSUID|MS_NODEV, NULL) != 0) {
+            fprintf(stderr, "FAILED to mount rootfs on %s\n", udiRoot);
+            perror("   --- REASON: ");
+            goto _mountImgVfs_unclean;
+        }
+        if (makeUdiMountPrivate(udiConfig) != 0) {
+            fprintf(stderr, "FAILED to mark the udi as a private mount\n");
+            goto _mountImgVfs_unclean;
+        }
     }
 
     if (chmod(udiRoot, 0755) != 0) {
@@ -1157,37 +1549,72 @@ int mountImageVFS(ImageData *imageData,
 
 
     /* get our needs injected first */
+    traceStart = SHIFTER_TRACE_START();
     if (prepareSiteModifications(username, minNodeSpec, udiConfig) != 0) {
         fprintf(stderr, "FAILED to properly setup site modifications\n");
         goto _mountImgVfs_unclean;
     }
+    shifter_trace_event("phase", "prepareSiteModifications", NULL, traceStart);
+
+    if (useOverlay) {
+        free(udiConfig->udiMountPoint);
+        udiConfig->udiMountPoint = udiMountPoint;
+        udiMountPoint = NULL;
+        snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
 
-    /* copy/bind mount pieces into prepared site */
-    BIND_IMAGE_INTO_UDI("/", imageData, udiConfig, 0);
-    BIND_IMAGE_INTO_UDI("/var", imageData, udiConfig, 0);
-    BIND_IMAGE_INTO_UDI("/opt", imageData, udiConfig, 0);
+        traceStart = SHIFTER_TRACE_START();
+        if (_composeOverlayRoot(siteRoot, udiConfig->loopMountPoint, udiConfig) != 0) {
+            fprintf(stderr, "FAILED to compose image and site tree\n");
+            goto _mountImgVfs_unclean;
+        }
+        shifter_trace_event("phase", "composeOverlayRoot", NULL, traceStart);
+    } else {
+        /* copy/bind mount pieces into prepared site */
+        BIND_IMAGE_INTO_UDI("/", imageData, udiConfig, 0);
+        BIND_IMAGE_INTO_UDI("/var", imageData, udiConfig, 0);
+        BIND_IMAGE_INTO_UDI("/opt", imageData, udiConfig, 0);
+    }
 
     /* setup sshd configuration */
     sshPath = alloc_strgenf("%s/etc/ssh", udiRoot);
     if (sshPath != NULL) {
-        _MKDIR(sshPath, 0755);
+        /* the image's /etc is already merged in with overlayfs */
+        if (!useOverlay || lstat(sshPath, &statData) != 0) {
+            _MKDIR(sshPath, 0755);
+        }
         free(sshPath);
         sshPath = NULL;
     }
 
     /* copy image /etc into place */
-    BIND_IMAGE_INTO_UDI("/etc", imageData, udiConfig, 1);
+    if (!useOverlay) {
+        BIND_IMAGE_INTO_UDI("/etc", imageData, udiConfig, 1);
+    }
+
+    /* index module libraries alongside the image's own */
+    traceStart = SHIFTER_TRACE_START();
+    if (setupContainerLdCache(udiConfig) != 0) {
+        fprintf(stderr, "FAILED to setup container ld.so.cache\n");
+        goto _mountImgVfs_unclean;
+    }
+    shifter_trace_event("phase", "containerLdCache", NULL, traceStart);
 
 #undef BIND_IMAGE_INTO_UDI
 #undef _MKDIR
 
+    free(siteRoot);
     free(udiRoot);
     return 0;
 
 _mountImgVfs_unclean:
+    if (udiMountPoint != NULL) {
+        free(udiConfig->udiMountPoint);
+        udiConfig->udiMountPoint = udiMountPoint;
+    }
     if (sshPath != NULL) {
         free(sshPath);
     }
+    free(siteRoot);
     free(udiRoot);
     return 1;
 }
@@ -1205,7 +1632,7 @@ _mountImgVfs_unclean:
 int makeUdiMountPrivate(UdiRootConfig *udiConfig) {
     char *buffer = _malloc(sizeof(char) * PATH_MAX);
     snprintf(buffer, PATH_MAX, "%s", udiConfig->udiMountPoint);
-    if (mount(NULL, buffer, NULL, MS_PRIVATE|MS_REC, NULL) != 0) {
+    if (_shifterCore_mount(NULL, buffer, NULL, MS_PRIVATE|MS_REC, NULL) != 0) {
         perror("Failed to remount non-shared.");
         free(buffer);
         return 1;
@@ -1214,6 +1641,49 @@ int makeUdiMountPrivate(UdiRootConfig *udiConfig) {
     return 0;
 }
 
+/** pivotIntoUdi
+ *  Make udiRoot the root of a new mount namespace private to this process
+ *  and its heirs, and lazily detach everything else.  The container then
+ *  sees only its own mounts instead of every host mount, which keeps
+ *  /proc/self/mountinfo short and mount-table walks cheap.  A UDI namespace
+ *  shared with other shifter instances is left untouched.  On success the
+ *  working directory is the new "/".
+ */
+int pivotIntoUdi(const char *udiRoot) {
+    if (udiRoot == NULL) {
+        return 1;
+    }
+    if (chdir(udiRoot) != 0) {
+        fprintf(stderr, "FAILED to chdir to %s: %s\n", udiRoot,
+                strerror(errno));
+        return 1;
+    }
+    if (unshare(CLONE_NEWNS) != 0) {
+        perror("Failed to unshare the filesystem namespace.");
+        return 1;
+    }
+    /* keep receiving host unmounts, but never send our detach back */
+    if (_shifterCore_mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL) != 0) {
+        perror("Failed to remount \"/\" non-shared.");
+        return 1;
+    }
+    /* new and old root in the same place: the old root is stacked on top of
+     * the UDI and can be detached without needing a directory for it */
+    if (syscall(SYS_pivot_root, ".", ".") != 0) {
+        fprintf(stderr, "FAILED to pivot_root into %s: %s\n", udiRoot,
+                strerror(errno));
+        return 1;
+    }
+    if (_shifterCore_umount(".", MNT_DETACH) != 0) {
+        fprintf(stderr, "FAILED to detach host mounts: %s\n", strerror(errno));
+        return 1;
+    }
+    if (chdir("/") != 0) {
+        return 1;
+    }
+    return 0;
+}
+
 int remountUdiRootReadonly(UdiRootConfig *udiConfig) {
     char *udiRoot = _malloc(sizeof(char) * PATH_MAX);
 
@@ -1223,7 +1693,7 @@ int remountUdiRootReadonly(UdiRootConfig *udiConfig) {
     }
     snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
 
-    if (mount(udiRoot, udiRoot, udiConfig->rootfsType, MS_REMOUNT|MS_NOSUID|MS_NODEV|MS_RDONLY, NULL) != 0) {
+    if (_shifterCore_mount(udiRoot, udiRoot, udiConfig->rootfsType, MS_REMOUNT|MS_NOSUID|MS_NODEV|MS_RDONLY, NULL) != 0) {
         fprintf(stderr, "FAILED to remount rootfs readonly on %s\n", udiRoot);
         perror("   --- REASON: ");
         goto _remountUdiRootReadonly_unclean;
@@ -1603,51 +2073,396 @@ int setupPerNodeCacheBackingStore(VolMapPerNodeCacheConfig *cache, const char *b
     return 0;
 }
 
-int setupVolumeMapMounts(
-        MountList *mountCache,
-        VolumeMap *map,
-        int userRequested,
-        dev_t createToDev,
-        UdiRootConfig *udiConfig
-) {
-    char *filtered_from = NULL;
-    char *filtered_to = NULL;
-    char *to_real = NULL;
-    char *from_real = NULL;
-    VolumeMapFlag *flags = NULL;
-    int (*_validate_fp)(const char *, const char *, VolumeMapFlag *);
+/**
+ * _packFingerprint
+ * fingerprint the tree at path for a packed volume.  For user volumes this
+ * runs in a child with the target user's identity, so that the walk fails
+ * on anything the user could not read through a bind mount.
+ */
+static int _packFingerprint(const char *path, int asUser, char *hex,
+        UdiRootConfig *udiConfig)
+{
+    int pipeFd[2] = { -1, -1 };
+    pid_t pid = 0;
+    int status = 0;
+    ssize_t nread = 0;
+    size_t got = 0;
 
-    size_t mapIdx = 0;
-    size_t udiMountLen = 0;
+    if (!asUser) {
+        return shifter_pack_fingerprint(path, hex);
+    }
+    if (udiConfig->target_uid == 0 || udiConfig->target_gid == 0) {
+        fprintf(stderr, "Insufficient information about target user to "
+                "pack %s\n", path);
+        return 1;
+    }
+    if (pipe2(pipeFd, O_CLOEXEC) != 0) {
+        fprintf(stderr, "FAILED to create pipe to pack %s\n", path);
+        return 1;
+    }
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0) {
+        close(pipeFd[0]);
+        if (setgroups(udiConfig->nauxiliary_gids, udiConfig->auxiliary_gids) != 0 ||
+                setresgid(udiConfig->target_gid, udiConfig->target_gid,
+                    udiConfig->target_gid) != 0 ||
+                setresuid(udiConfig->target_uid, udiConfig->target_uid,
+                    udiConfig->target_uid) != 0)
+        {
+            fprintf(stderr, "FAILED to assume user identity to pack %s\n", path);
+            _exit(1);
+        }
+        if (shifter_pack_fingerprint(path, hex) != 0 ||
+                write(pipeFd[1], hex, SHIFTER_HASH_HEX_SIZE) != SHIFTER_HASH_HEX_SIZE)
+        {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(pipeFd[1]);
+    while (pid > 0 && got < SHIFTER_HASH_HEX_SIZE) {
+        nread = read(pipeFd[0], hex + got, SHIFTER_HASH_HEX_SIZE - got);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            break;
+        }
+        got += nread;
+    }
+    close(pipeFd[0]);
+    hex[got] = 0;
+    if (pid > 0) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) { }
+    }
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+            got != SHIFTER_HASH_HEX_SIZE)
+    {
+        fprintf(stderr, "FAILED to fingerprint %s for packing\n", path);
+        return 1;
+    }
+    return 0;
+}
 
-    char *from_buffer = _malloc(sizeof(char) * PATH_MAX);
-    char *to_buffer = _malloc(sizeof(char) * PATH_MAX);
+/**
+ * _mountPackedVolume
+ * mount a squashfs snapshot of from_real read-only on to_real in place of a
+ * bind mount, building it in volumePackCacheDir if no snapshot of the
+ * current tree exists yet.  A tree that changes while it is being packed
+ * is refused rather than mounted inconsistently.
+ */
+static int _mountPackedVolume(UdiRootConfig *udiConfig, MountList *mountCache,
+        const char *from_real, const char *to_real, int userRequested)
+{
+    char fingerprint[SHIFTER_HASH_HEX_SIZE + 1];
+    char after[SHIFTER_HASH_HEX_SIZE + 1];
+    const char *keyPath = from_real;
+    char *image = NULL;
     struct stat statData;
+    int built = 0;
+    int ret = 1;
+    uint64_t traceStart = SHIFTER_TRACE_START();
 
-    if (udiConfig == NULL) {
-        free(from_buffer);
-        free(to_buffer);
+    if (udiConfig->volumePackCacheDir == NULL ||
+            udiConfig->mksquashfsPath == NULL)
+    {
+        fprintf(stderr, "Packed volumes require volumePackCacheDir and "
+                "mksquashfsPath in udiRoot configuration\n");
         return 1;
     }
-
-    if (map == NULL || map->n == 0) {
-        free(from_buffer);
-        free(to_buffer);
-        return 0;
+    if (lstat(from_real, &statData) != 0) {
+        fprintf(stderr, "FAILED to find volume \"from\": %s\n", from_real);
+        return 1;
     }
 
-    if (userRequested == 0) {
-        _validate_fp = validateVolumeMap_siteRequest;
-    } else {
-        _validate_fp = validateVolumeMap_userRequest;
+    /* key user volumes on the path seen in the container, which is the same
+     * on every node and for every UDI instance */
+    if (userRequested != 0) {
+        size_t udiMountLen = strlen(udiConfig->udiMountPoint);
+        if (strncmp(from_real, udiConfig->udiMountPoint, udiMountLen) == 0) {
+            keyPath = from_real + udiMountLen;
+        }
     }
-
-    udiMountLen = strlen(udiConfig->udiMountPoint);
-
-    for (mapIdx = 0; mapIdx < map->n; mapIdx++) {
-        size_t flagsInEffect = 0;
-        size_t flagIdx = 0;
-        int backingStoreExists = 0;
+    if (_packFingerprint(from_real, userRequested, fingerprint, udiConfig) != 0) {
+        return 1;
+    }
+    image = shifter_pack_imagePath(udiConfig->volumePackCacheDir, keyPath,
+            statData.st_uid, fingerprint);
+    built = shifter_pack_build(udiConfig->mksquashfsPath, from_real, image,
+            SHIFTER_PACK_LOCK_TIMEOUT);
+    if (built < 0) {
+        goto _mountPackedVolume_done;
+    }
+    if (built == 1) {
+        if (_packFingerprint(from_real, userRequested, after, udiConfig) != 0 ||
+                strcmp(fingerprint, after) != 0)
+        {
+            fprintf(stderr, "FAILED %s changed while it was being packed\n",
+                    from_real);
+            unlink(image);
+            goto _mountPackedVolume_done;
+        }
+    }
+    if (loopMount(image, to_real, FORMAT_SQUASHFS, udiConfig, 1) != 0) {
+        fprintf(stderr, "FAILED to mount packed volume %s\n", image);
+        goto _mountPackedVolume_done;
+    }
+    insert_MountList(mountCache, to_real);
+    ret = 0;
+
+_mountPackedVolume_done:
+    shifter_trace_event("volume", "packed", from_real, traceStart);
+    free(image);
+    return ret;
+}
+
+/**
+ * _mountMemFs
+ * mount a private tmpfs (shm flag) or hugetlbfs on to_real with the size,
+ * memory policy and page size requested in the volume map.  User requests
+ * are held to the shmSizeLimit, hugetlbfsSizeLimit and hugetlbfsPageSizes
+ * of the site; a zero limit disables the flag for users.
+ */
+static int _mountMemFs(UdiRootConfig *udiConfig, MountList *mountCache,
+        VolumeMapFlag *flag, const char *to_real, int userRequested)
+{
+    VolMapMemFsConfig *memFs = (VolMapMemFsConfig *) flag->value;
+    const char *fsType = flag->type == VOLMAP_FLAG_SHM ? "tmpfs" : "hugetlbfs";
+    size_t sizeLimit = flag->type == VOLMAP_FLAG_SHM ?
+            udiConfig->shmSizeLimit : udiConfig->hugetlbfsSizeLimit;
+    char **fstypes = NULL;
+    char *options = NULL;
+    size_t optLen = 0;
+    size_t optCapacity = 0;
+    char **ptr = NULL;
+    int ret = 1;
+
+    if (memFs == NULL || memFs->size <= 0) {
+        fprintf(stderr, "FAILED to find %s volume config\n", fsType);
+        return 1;
+    }
+    if (userRequested != 0 && (size_t) memFs->size > sizeLimit) {
+        fprintf(stderr, "FAILED %s volume of %ld bytes exceeds the site limit "
+                "of %lu bytes\n", fsType, memFs->size, sizeLimit);
+        return 1;
+    }
+
+    if (flag->type == VOLMAP_FLAG_SHM) {
+        options = alloc_strcatf(options, &optLen, &optCapacity,
+                "size=%ld,mode=1777", memFs->size);
+        if (memFs->mpol != NULL && memFs->nodes != NULL) {
+            options = alloc_strcatf(options, &optLen, &optCapacity,
+                    ",mpol=%s:%s", memFs->mpol, memFs->nodes);
+        } else if (memFs->mpol != NULL) {
+            options = alloc_strcatf(options, &optLen, &optCapacity,
+                    ",mpol=%s", memFs->mpol);
+        }
+    } else {
+        fstypes = getSupportedFilesystems();
+        if (supportsFilesystem(fstypes, "hugetlbfs") != 0) {
+            fprintf(stderr, "ERROR: no apparent support for hugetlbfs!\n");
+            goto _mountMemFs_done;
+        }
+        if (userRequested != 0 && memFs->pageSize > 0) {
+            char *sizes = udiConfig->hugetlbfsPageSizes != NULL ?
+                    _strdup(udiConfig->hugetlbfsPageSizes) : NULL;
+            char *search = sizes;
+            char *svPtr = NULL;
+            char *tok = NULL;
+            int allowed = 0;
+            while (sizes != NULL &&
+                    (tok = strtok_r(search, " ", &svPtr)) != NULL)
+            {
+                search = NULL;
+                if (parseBytes(tok) == memFs->pageSize) {
+                    allowed = 1;
+                    break;
+                }
+            }
+            free(sizes);
+            if (!allowed) {
+                fprintf(stderr, "FAILED hugetlbfs page size %ld is not "
+                        "allowed\n", memFs->pageSize);
+                goto _mountMemFs_done;
+            }
+        }
+        options = alloc_strcatf(options, &optLen, &optCapacity,
+                "size=%ld,uid=%d,gid=%d,mode=0700", memFs->size,
+                udiConfig->target_uid, udiConfig->target_gid);
+        if (memFs->pageSize > 0) {
+            options = alloc_strcatf(options, &optLen, &optCapacity,
+                    ",pagesize=%ld", memFs->pageSize);
+        }
+    }
+    if (options == NULL) {
+        goto _mountMemFs_done;
+    }
+
+    if (_shifterCore_mount(flag->type == VOLMAP_FLAG_SHM ? "shm" : "hugetlbfs",
+                to_real, fsType, MS_NOSUID|MS_NODEV, options) != 0)
+    {
+        fprintf(stderr, "FAILED to mount %s on %s (%s): %s\n", fsType,
+                to_real, options, strerror(errno));
+        goto _mountMemFs_done;
+    }
+    insert_MountList(mountCache, to_real);
+    ret = 0;
+
+_mountMemFs_done:
+    if (fstypes != NULL) {
+        for (ptr = fstypes; *ptr; ptr++) {
+            free(*ptr);
+        }
+        free(fstypes);
+    }
+    free(options);
+    return ret;
+}
+
+/**
+ * _stageIntoCache
+ * copy src into the freshly mounted per-node cache at dst.  The copy runs in
+ * a child with the target user's identity, so only data the user can read
+ * is staged, and a tree larger than the free space of the cache is refused
+ * before anything is copied.
+ */
+static int _stageIntoCache(const char *src, const char *dst,
+        UdiRootConfig *udiConfig)
+{
+    pid_t pid = 0;
+    int status = 0;
+
+    if (udiConfig->target_uid == 0 || udiConfig->target_gid == 0) {
+        fprintf(stderr, "Insufficient information about target user to "
+                "stage %s\n", src);
+        return 1;
+    }
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "FAILED to fork to stage %s\n", src);
+        return 1;
+    }
+    if (pid == 0) {
+        struct statvfs fsData;
+        ssize_t size = 0;
+        int nWorkers = udiConfig->volumeStageWorkers > 0 ?
+                udiConfig->volumeStageWorkers : SHIFTER_STAGE_DEFAULT_WORKERS;
+
+        if (setgroups(udiConfig->nauxiliary_gids, udiConfig->auxiliary_gids) != 0 ||
+                setresgid(udiConfig->target_gid, udiConfig->target_gid,
+                    udiConfig->target_gid) != 0 ||
+                setresuid(udiConfig->target_uid, udiConfig->target_uid,
+                    udiConfig->target_uid) != 0)
+        {
+            fprintf(stderr, "FAILED to assume user identity to stage %s\n", src);
+            _exit(1);
+        }
+        size = shifter_stage_treeSize(src);
+        if (size < 0) {
+            fprintf(stderr, "FAILED to read stagein source %s\n", src);
+            _exit(1);
+        }
+        if (statvfs(dst, &fsData) != 0 ||
+                (size_t) size > fsData.f_bavail * fsData.f_frsize)
+        {
+            fprintf(stderr, "FAILED stagein source %s (%ld bytes) does not "
+                    "fit in the per-node cache\n", src, (long) size);
+            _exit(1);
+        }
+        _exit(shifter_stage_copyTree("stagein", src, dst, nWorkers, NULL) != 0);
+    }
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) { }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "FAILED to stage %s into per-node cache\n", src);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * _recordVolumeStage
+ * note a per-node cache in the UDI so unsetupRoot can copy it out with
+ * startVolumeStageOut.  dst is NULL for caches without stageout and for shm
+ * and hugetlbfs volumes, which are recorded only to keep the UDI from being
+ * parked with their contents.
+ */
+static int _recordVolumeStage(UdiRootConfig *udiConfig, const char *src,
+        const char *dst)
+{
+    char *path = alloc_strgenf("%s%s", udiConfig->udiMountPoint,
+            VOLUME_STAGE_FILE);
+    FILE *fp = fopen(path, "a");
+    int ret = 0;
+
+    if (fp == NULL) {
+        fprintf(stderr, "FAILED to open %s: %s\n", path, strerror(errno));
+        free(path);
+        return 1;
+    }
+    if (dst != NULL && fprintf(fp, "%d %d %s %s\n", udiConfig->target_uid,
+                udiConfig->target_gid, src, dst) < 0)
+    {
+        ret = 1;
+    }
+    if (fclose(fp) != 0) {
+        ret = 1;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "FAILED to record stageout of %s\n", src);
+    }
+    free(path);
+    return ret;
+}
+
+int setupVolumeMapMounts(
+        MountList *mountCache,
+        VolumeMap *map,
+        int userRequested,
+        dev_t createToDev,
+        UdiRootConfig *udiConfig
+) {
+    char *filtered_from = NULL;
+    char *filtered_to = NULL;
+    char *to_real = NULL;
+    char *from_real = NULL;
+    VolumeMapFlag *flags = NULL;
+    int (*_validate_fp)(const char *, const char *, VolumeMapFlag *);
+    const size_t noSourceFlags = VOLMAP_FLAG_PERNODECACHE | VOLMAP_FLAG_SHM
+            | VOLMAP_FLAG_HUGETLBFS;
+
+    size_t mapIdx = 0;
+    size_t udiMountLen = 0;
+
+    char *from_buffer = _malloc(sizeof(char) * PATH_MAX);
+    char *to_buffer = _malloc(sizeof(char) * PATH_MAX);
+    struct stat statData;
+
+    if (udiConfig == NULL) {
+        free(from_buffer);
+        free(to_buffer);
+        return 1;
+    }
+
+    if (map == NULL || map->n == 0) {
+        free(from_buffer);
+        free(to_buffer);
+        return 0;
+    }
+
+    if (userRequested == 0) {
+        _validate_fp = validateVolumeMap_siteRequest;
+    } else {
+        _validate_fp = validateVolumeMap_userRequest;
+    }
+
+    udiMountLen = strlen(udiConfig->udiMountPoint);
+
+    for (mapIdx = 0; mapIdx < map->n; mapIdx++) {
+        size_t flagsInEffect = 0;
+        size_t flagIdx = 0;
+        int backingStoreExists = 0;
         filtered_from = userInputPathFilter(map->from[mapIdx], 1);
         filtered_to = userInputPathFilter(map->to[mapIdx], 1);
         flags = map->flags[mapIdx];
@@ -1699,10 +2514,10 @@ int setupVolumeMapMounts(
             }
         }
 
-        /* if this is not a per-node cache (i.e., is a standand volume mount),
-         * then validate the user has permissions to view the content, by
-         * performing realpath() and lstat() as the user */
-        if (!(flagsInEffect & VOLMAP_FLAG_PERNODECACHE)) {
+        /* if this is not a per-node cache or memory filesystem (i.e., is a
+         * standand volume mount), then validate the user has permissions to
+         * view the content, by performing realpath() and lstat() as the user */
+        if (!(flagsInEffect & noSourceFlags)) {
             uid_t orig_euid = geteuid();
             gid_t orig_egid = getegid();
             gid_t *orig_auxgids = NULL;
@@ -1822,6 +2637,9 @@ _pass_check_fromvol:
                 free(orig_auxgids);
                 orig_auxgids = NULL;
             }
+        } else if (flagsInEffect & (VOLMAP_FLAG_SHM | VOLMAP_FLAG_HUGETLBFS)) {
+            /* the source is only a label, nothing is read from it */
+            from_real = _strdup(from_buffer);
         } else {
             from_real = realpath(from_buffer, NULL);
         }
@@ -1865,8 +2683,16 @@ _pass_check_fromvol:
             }
         }
         if (!S_ISDIR(statData.st_mode)) {
-            fprintf(stderr, "FAILED \"to\" location is not directory: %s\n", to_buffer);
-            goto _handleVolMountError;
+            struct stat fromStat;
+
+            /* site-defined maps may also bind a file onto a file */
+            if (userRequested != 0 || !S_ISREG(statData.st_mode) ||
+                    from_real == NULL || stat(from_real, &fromStat) != 0 ||
+                    !S_ISREG(fromStat.st_mode))
+            {
+                fprintf(stderr, "FAILED \"to\" location is not directory: %s\n", to_buffer);
+                goto _handleVolMountError;
+            }
         }
 
         to_real = realpath(to_buffer, NULL);
@@ -1895,7 +2721,7 @@ _pass_check_fromvol:
             }
 
             /* validate source mount point */
-            if (userRequested != 0 && !(flagsInEffect & VOLMAP_FLAG_PERNODECACHE)) {
+            if (userRequested != 0 && !(flagsInEffect & noSourceFlags)) {
                 if (from_len <= udiMountLen ||
                     strncmp(from_real, udiConfig->udiMountPoint, udiMountLen) != 0) {
 
@@ -1994,6 +2820,61 @@ _pass_check_fromvol:
                 goto _handleVolMountError;
             }
 
+            /* populate the cache and arrange for it to be copied out */
+            for (flagIdx = 0; flags && flags[flagIdx].type != 0; flagIdx++) {
+                char *stagePath = NULL;
+                int ret = 0;
+
+                if (flags[flagIdx].type != VOLMAP_FLAG_STAGEIN &&
+                        flags[flagIdx].type != VOLMAP_FLAG_STAGEOUT)
+                {
+                    continue;
+                }
+                filtered_to = userInputPathFilter(
+                        (char *) flags[flagIdx].value, 1);
+                stagePath = alloc_strgenf("%s/%s",
+                        (userRequested != 0 ? udiConfig->udiMountPoint : ""),
+                        filtered_to);
+                free(filtered_to);
+                filtered_to = NULL;
+
+                if (flags[flagIdx].type == VOLMAP_FLAG_STAGEIN) {
+                    ret = _stageIntoCache(stagePath, to_real, udiConfig);
+                } else {
+                    ret = _recordVolumeStage(udiConfig, to_real, stagePath);
+                }
+                free(stagePath);
+                if (ret != 0) {
+                    goto _handleVolMountError;
+                }
+            }
+            if (!(flagsInEffect & VOLMAP_FLAG_STAGEOUT) &&
+                    _recordVolumeStage(udiConfig, to_real, NULL) != 0)
+            {
+                goto _handleVolMountError;
+            }
+
+        } else if (flagsInEffect & (VOLMAP_FLAG_SHM | VOLMAP_FLAG_HUGETLBFS)) {
+            for (flagIdx = 0; flags && flags[flagIdx].type != 0; flagIdx++) {
+                if (flags[flagIdx].type & (VOLMAP_FLAG_SHM | VOLMAP_FLAG_HUGETLBFS)) {
+                    break;
+                }
+            }
+            if (_mountMemFs(udiConfig, mountCache, &(flags[flagIdx]), to_real,
+                        userRequested) != 0)
+            {
+                goto _handleVolMountError;
+            }
+            /* shm contents and reserved huge pages belong to this job */
+            if (_recordVolumeStage(udiConfig, to_real, NULL) != 0) {
+                goto _handleVolMountError;
+            }
+        } else if (flagsInEffect & VOLMAP_FLAG_PACKED) {
+            if (_mountPackedVolume(udiConfig, mountCache, from_real, to_real,
+                        userRequested) != 0)
+            {
+                goto _handleVolMountError;
+            }
         } else {
             int allowOverwriteBind = 1;
 
@@ -2037,1083 +2918,2564 @@ _setupVolumeMapMounts_unclean:
     return 1;
 }
 
-char *generateShifterConfigString(const char *user, ImageData *image,
-                                  VolumeMap *volumeMap, UdiRootConfig *config)
+/**
+ * _createGpuMountPoint
+ * create the empty file at path (relative to the UDI root) and any missing
+ * parent directories.  Symlinks are never followed, so links in the image
+ * cannot redirect the writes onto the host, and like other site mounts new
+ * entries may only be created on createToDev.
+ */
+static int _createGpuMountPoint(UdiRootConfig *udiConfig, const char *path,
+        dev_t createToDev)
 {
-    char *str = NULL;
-    char *volMapSig = NULL;
-    char *modules = NULL;
-    size_t modules_len = 0;
-    size_t modules_sz = 0;
-    int idx = 0;
-    if (image == NULL || volumeMap == NULL) return NULL;
+    char *tmpPath = _strdup(path);
+    char *svPtr = NULL;
+    char *ptr = NULL;
+    char *next = NULL;
+    struct stat statData;
+    int dirFd = open(udiConfig->udiMountPoint,
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int fd = -1;
+    int ret = 1;
+
+    if (dirFd < 0) {
+        goto _createGpuMountPoint_exit;
+    }
+    for (ptr = strtok_r(tmpPath, "/", &svPtr); ptr != NULL; ptr = next) {
+        next = strtok_r(NULL, "/", &svPtr);
+        if (fstatat(dirFd, ptr, &statData, AT_SYMLINK_NOFOLLOW) != 0) {
+            if (fstat(dirFd, &statData) != 0 ||
+                    statData.st_dev != createToDev)
+            {
+                fprintf(stderr, "FAILED to create GPU mount point %s, cannot "
+                        "create mount points in that location\n", path);
+                goto _createGpuMountPoint_exit;
+            }
+            if (next == NULL) {
+                fd = openat(dirFd, ptr, O_WRONLY | O_CREAT | O_EXCL |
+                        O_NOFOLLOW | O_CLOEXEC, 0644);
+                if (fd < 0) {
+                    fprintf(stderr, "FAILED to create GPU mount point %s: "
+                            "%s\n", path, strerror(errno));
+                    goto _createGpuMountPoint_exit;
+                }
+                close(fd);
+                break;
+            }
+            if (mkdirat(dirFd, ptr, 0755) != 0) {
+                fprintf(stderr, "FAILED to mkdir %s for %s: %s\n", ptr, path,
+                        strerror(errno));
+                goto _createGpuMountPoint_exit;
+            }
+        } else if (next == NULL) {
+            break;
+        }
+        fd = openat(dirFd, ptr, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "FAILED to open %s for %s: %s\n", ptr, path,
+                    strerror(errno));
+            goto _createGpuMountPoint_exit;
+        }
+        close(dirFd);
+        dirFd = fd;
+        fd = -1;
+    }
+    ret = 0;
 
-    volMapSig = getVolMapSignature(volumeMap);
-    for (idx = 0; idx < config->n_active_modules; idx++) {
-        modules = alloc_strcatf(modules, &modules_len, &modules_sz, "%s,",
-                                config->active_modules[idx]->name);
+_createGpuMountPoint_exit:
+    if (dirFd >= 0) {
+        close(dirFd);
     }
+    free(tmpPath);
+    return ret;
+}
 
-    str = alloc_strgenf(
-            "{\"identifier\":\"%s\","
-            "\"user\":\"%s\","
-            "\"volMap\":\"%s\","
-            "\"modules\":\"%s\"}",
-            image->identifier,
-            user,
-            (volMapSig == NULL ? "" : volMapSig),
-            (modules == NULL ? "" : modules)
-    );
+/**
+ * setupGpuSupport
+ * bind the host's NVIDIA libraries and binaries into the module's
+ * gpuSupport directory in the UDI.  The discovered map is cached in
+ * <udiRunDir>/gpu.<module>.cache keyed on the driver version, so the
+ * ld.so.cache walk only happens after a reboot or driver change.
+ */
+int setupGpuSupport(MountList *mountCache, ShifterModule *module,
+        dev_t createToDev, UdiRootConfig *udiConfig)
+{
+    char version[1024];
+    char *cacheFile = NULL;
+    char *siteFs = NULL;
+    char *modprobe = NULL;
+    VolumeMap map;
+    size_t idx = 0;
+    int ret = 1;
 
-    if (volMapSig != NULL) {
-        free(volMapSig);
+    memset(&map, 0, sizeof(VolumeMap));
+    if (mountCache == NULL || module == NULL || module->gpuSupport == NULL ||
+            udiConfig == NULL)
+    {
+        return 1;
     }
-    if (modules != NULL) {
-        free(modules);
+    if (shifter_gpu_driverVersion(SHIFTER_GPU_DRIVER_VERSION, version,
+                sizeof(version)) != 0)
+    {
+        fprintf(stderr, "FAILED to find NVIDIA driver version, is the "
+                "driver loaded?\n");
+        return 1;
     }
-    return str;
-}
-
-int saveShifterConfig(const char *user, ImageData *image, VolumeMap *volumeMap, UdiRootConfig *udiConfig) {
-    char *saveFilename = _malloc(sizeof(char) * PATH_MAX);
-    FILE *fp = NULL;
-    char *configString = generateShifterConfigString(user, image, volumeMap, udiConfig);
 
-    if (configString == NULL) {
-        goto _saveShifterConfig_error;
+    if (udiConfig->udiRunDir != NULL) {
+        cacheFile = alloc_strgenf("%s/gpu.%s.cache", udiConfig->udiRunDir,
+                module->name);
+        siteFs = shifter_gpu_loadCache(cacheFile, version, module->gpuSupport);
+    }
+    if (siteFs == NULL) {
+        siteFs = shifter_gpu_discover(SHIFTER_GPU_LDCACHE,
+                SHIFTER_GPU_BIN_PATH, module->gpuSupport);
+        if (siteFs == NULL) {
+            fprintf(stderr, "FAILED to discover GPU support files\n");
+            goto _setupGpuSupport_exit;
+        }
+        if (cacheFile != NULL &&
+                shifter_gpu_saveCache(cacheFile, version, module->gpuSupport,
+                    siteFs) != 0)
+        {
+            fprintf(stderr, "WARNING: failed to cache GPU support files in "
+                    "%s\n", cacheFile);
+        }
     }
 
-    snprintf(saveFilename, PATH_MAX, "%s/var/shifterConfig.json",
-            udiConfig->udiMountPoint);
-    fp = fopen(saveFilename, "w");
-    if (fp == NULL) {
-        goto _saveShifterConfig_error;
+    if (parseVolumeMapSiteFs(siteFs, &map) != 0) {
+        fprintf(stderr, "FAILED to parse GPU support volume map\n");
+        goto _setupGpuSupport_exit;
+    }
+    for (idx = 0; idx < map.n; idx++) {
+        if (_createGpuMountPoint(udiConfig, map.to[idx], createToDev) != 0) {
+            goto _setupGpuSupport_exit;
+        }
+    }
+    if (setupVolumeMapMounts(mountCache, &map, 0, createToDev,
+                udiConfig) != 0)
+    {
+        fprintf(stderr, "FAILED to mount GPU support files\n");
+        goto _setupGpuSupport_exit;
     }
-    fprintf(fp, "%s\n", configString);
-    fclose(fp);
-    fp = NULL;
 
-    free(configString);
-    configString = NULL;
-    free(saveFilename);
-    return 0;
-_saveShifterConfig_error:
-    if (configString != NULL) {
-        free(configString);
+    /* /dev/nvidia-uvm only exists once the UVM kernel module is loaded */
+    if (access(SHIFTER_GPU_UVM_DEVICE, F_OK) != 0) {
+        modprobe = shifter_gpu_findBinary(SHIFTER_GPU_BIN_PATH,
+                "nvidia-modprobe");
+        if (modprobe == NULL) {
+            fprintf(stderr, "FAILED to find nvidia-modprobe to create %s\n",
+                    SHIFTER_GPU_UVM_DEVICE);
+            goto _setupGpuSupport_exit;
+        }
+        char *args[] = { modprobe, (char *) "-u", (char *) "-c=0", NULL };
+        if (forkAndExecv(args) != 0) {
+            fprintf(stderr, "FAILED to run %s -u -c=0\n", modprobe);
+            goto _setupGpuSupport_exit;
+        }
     }
-    free(saveFilename);
-    return 1;
+    ret = 0;
+
+_setupGpuSupport_exit:
+    free_VolumeMap(&map, 0);
+    free(cacheFile);
+    free(siteFs);
+    free(modprobe);
+    return ret;
 }
 
-int compareShifterConfig(const char *user, ImageData *image, VolumeMap *volumeMap, UdiRootConfig *udiConfig) {
-    char *configFilename = _malloc(sizeof(char) * PATH_MAX);
-    FILE *fp = NULL;
-    char *configString = generateShifterConfigString(user, image, volumeMap, udiConfig);
-    char *buffer = NULL;
-    size_t len = 0;
-    size_t nread = 0;
-    int cmpVal = 0;
-
-    if (configString == NULL) {
-        goto _compareShifterConfig_error;
-    }
-    len = strlen(configString);
-    buffer = (char *) _malloc(sizeof(char) * len);
+typedef struct _LdCacheBuilder {
+    ShifterLdCacheEntry *entries;
+    size_t n;
+    size_t capacity;
+} LdCacheBuilder;
 
-    snprintf(configFilename, PATH_MAX, "%s/var/shifterConfig.json",
-            udiConfig->udiMountPoint);
+static void _addLdCacheEntry(LdCacheBuilder *builder, const char *name,
+        const char *path, int32_t flags, uint32_t osVersion, uint64_t hwcap)
+{
+    ShifterLdCacheEntry *entry = NULL;
+    if (builder->n == builder->capacity) {
+        builder->capacity = builder->capacity * 2 + 64;
+        builder->entries = (ShifterLdCacheEntry *) _realloc(builder->entries,
+                sizeof(ShifterLdCacheEntry) * builder->capacity);
+    }
+    entry = &(builder->entries[builder->n++]);
+    entry->name = _strdup(name);
+    entry->path = _strdup(path);
+    entry->flags = flags;
+    entry->osVersion = osVersion;
+    entry->hwcap = hwcap;
+}
 
-    fp = fopen(configFilename, "r");
-    if (fp == NULL) {
-        goto _compareShifterConfig_error;
+static int _visitImageLdCache(const ShifterLdCacheEntry *entry, void *data) {
+    /* glibc-hwcaps entries refer to an extension that is not rewritten; the
+     * loader falls back to the baseline entries for those libraries */
+    if (entry->hwcap & LDCACHE_HWCAP_EXTENSION) {
+        return 0;
     }
+    _addLdCacheEntry((LdCacheBuilder *) data, entry->name, entry->path,
+            entry->flags, entry->osVersion, entry->hwcap);
+    return 0;
+}
 
-    nread = fread(buffer, sizeof(char), len, fp);
-    fclose(fp);
-    fp = NULL;
-
-    if (nread == len) {
-        cmpVal = memcmp(configString, buffer, sizeof(char) * len);
-    } else {
-        cmpVal = -1;
-    }
+static int _compareNames(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
 
-    free(configString);
-    configString = NULL;
+/**
+ * _scanLdCacheDir
+ * add the shared objects in the container directory dir, keyed by soname
+ * as ldconfig would.  Only regular files are examined and dir must resolve
+ * inside the UDI, so nothing outside the container is read.
+ */
+static int _scanLdCacheDir(UdiRootConfig *udiConfig, const char *dir,
+        LdCacheBuilder *builder)
+{
+    char path[PATH_MAX];
+    char *real = NULL;
+    char **names = NULL;
+    size_t n_names = 0;
+    size_t udiMountLen = strlen(udiConfig->udiMountPoint);
+    const char *containerDir = NULL;
+    struct dirent *entry = NULL;
+    struct stat statData;
+    DIR *dirp = NULL;
+    int dirFd = -1;
+    size_t idx = 0;
 
-    free(buffer);
-    buffer = NULL;
-    free(configFilename);
-    return cmpVal;
-_compareShifterConfig_error:
-    if (configString != NULL) {
-        free(configString);
+    snprintf(path, PATH_MAX, "%s%s", udiConfig->udiMountPoint, dir);
+    real = realpath(path, NULL);
+    if (real == NULL || strncmp(real, udiConfig->udiMountPoint, udiMountLen) != 0 ||
+            (real[udiMountLen] != '/' && real[udiMountLen] != 0))
+    {
+        fprintf(stderr, "WARNING: library directory %s is not available in "
+                "the container\n", dir);
+        free(real);
+        return 0;
     }
-    if (buffer != NULL) {
-        free(buffer);
+    containerDir = real[udiMountLen] == 0 ? "" : real + udiMountLen;
+    if (strcmp(containerDir, "/") == 0) {
+        containerDir = "";
     }
-    free(configFilename);
-    return -1;
-}
-
-int setupImageSsh(char *sshPubKey, char *username, uid_t uid, gid_t gid, UdiRootConfig *udiConfig) {
-    struct stat statData;
-    char *udiImage = _malloc(sizeof(char) * PATH_MAX);
-    char *sshdConfigPath = _malloc(sizeof(char) * PATH_MAX);
-    char *sshdConfigPathNew = _malloc(sizeof(char) * PATH_MAX);
-    char *from = _malloc(sizeof(char) * PATH_MAX);
-    char *to = _malloc(sizeof(char) * PATH_MAX);
-    char *buffer = _malloc(sizeof(char) * PATH_MAX);
-    char *keygenExec = _malloc(sizeof(char) * PATH_MAX);
-    char *keyFileName = _malloc(sizeof(char) * PATH_MAX);
-    const char *keyType[5] = {"dsa", "ecdsa", "rsa","ed25519", NULL};
-    const char **keyPtr = NULL;
-    char *lineBuf = NULL;
-    size_t lineBuf_size = 0;
-    uid_t ownerUid = uid;
-    gid_t ownerGid = gid;
 
-    FILE *inputFile = NULL;
-    FILE *outputFile = NULL;
+    dirFd = open(real, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0 || (dirp = fdopendir(dirFd)) == NULL) {
+        fprintf(stderr, "FAILED to open library directory %s\n", dir);
+        if (dirFd >= 0) {
+            close(dirFd);
+        }
+        free(real);
+        return 1;
+    }
+    while ((entry = readdir(dirp)) != NULL) {
+        if (strstr(entry->d_name, ".so") == NULL) {
+            continue;
+        }
+        names = (char **) _realloc(names, sizeof(char *) * (n_names + 1));
+        names[n_names++] = _strdup(entry->d_name);
+    }
+    /* readdir order is arbitrary, keep the cache reproducible */
+    if (n_names > 0) {
+        qsort(names, n_names, sizeof(char *), _compareNames);
+    }
 
-    MountList mountCache;
-    memset(&mountCache, 0, sizeof(MountList));
+    for (idx = 0; idx < n_names; idx++) {
+        char *soname = NULL;
+        char *libPath = NULL;
+        int32_t flags = 0;
+        int fd = -1;
 
-    if (ownerUid == 0 || ownerGid == 0) {
-        fprintf(stderr, "FAILED to identify proper uid to run sshd\n");
-        goto _setupImageSsh_unclean;
+        if (fstatat(dirFd, names[idx], &statData, AT_SYMLINK_NOFOLLOW) != 0 ||
+                !S_ISREG(statData.st_mode))
+        {
+            continue;
+        }
+        fd = openat(dirFd, names[idx], O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        if (shifter_ldcache_elfInfo(fd, &flags, &soname) == 0) {
+            libPath = alloc_strgenf("%s/%s", containerDir, names[idx]);
+            _addLdCacheEntry(builder, soname != NULL ? soname : names[idx],
+                    libPath, flags, 0, 0);
+            free(libPath);
+            free(soname);
+        }
+        close(fd);
     }
 
-#define _BINDMOUNT(mounts, from, to, flags, overwrite) if (_shifterCore_bindMount(udiConfig, mounts, from, to, flags, overwrite) != 0) { \
-    fprintf(stderr, "BIND MOUNT FAILED from %s to %s\n", from, to); \
-    goto _setupImageSsh_unclean; \
+    for (idx = 0; idx < n_names; idx++) {
+        free(names[idx]);
+    }
+    free(names);
+    closedir(dirp);
+    free(real);
+    return 0;
 }
 
-    if (parse_MountList(&mountCache) != 0) {
-        fprintf(stderr, "FAILED to parse existing mounts\n");
-        goto _setupImageSsh_unclean;
-    }
+/**
+ * setupContainerLdCache
+ * rewrite the UDI's /etc/ld.so.cache (the image's copy, on the UDI tmpfs)
+ * so that it also lists the libraries in each active module's libraryPath
+ * and gpuSupport directories.  Module libraries take precedence over the
+ * image's, as they would with LD_LIBRARY_PATH, but without the loader
+ * probing every directory for every library.
+ */
+int setupContainerLdCache(UdiRootConfig *udiConfig) {
+    LdCacheBuilder builder;
+    char cachePath[PATH_MAX];
+    char dir[PATH_MAX];
+    struct stat statData;
+    size_t ndirs = 0;
+    size_t idx = 0;
+    int moduleIdx = 0;
+    int ret = 1;
 
-    snprintf(udiImage, PATH_MAX, "%s/opt/udiImage", udiConfig->udiMountPoint);
-    udiImage[PATH_MAX-1] = 0;
-    if (stat(udiImage, &statData) != 0) {
-        fprintf(stderr, "FAILED to find udiImage path, cannot setup sshd\n");
-        goto _setupImageSsh_unclean;
-    }
-    if (chdir(udiImage) != 0) {
-        fprintf(stderr, "FAILED to chdir to %s\n", udiImage);
-        goto _setupImageSsh_unclean;
+    if (udiConfig == NULL || udiConfig->udiMountPoint == NULL) {
+        return 1;
     }
+    memset(&builder, 0, sizeof(LdCacheBuilder));
 
-    /* generate ssh host keys */
-    for (keyPtr = keyType; *keyPtr != NULL; keyPtr++) {
-        char *args[8];
-        char **argPtr = NULL;
-        int ret = 0;
+    for (moduleIdx = 0; moduleIdx < udiConfig->n_active_modules; moduleIdx++) {
+        ShifterModule *module = udiConfig->active_modules[moduleIdx];
+        char **ptr = NULL;
 
-        snprintf(keygenExec, PATH_MAX, "%s/bin/ssh-keygen", udiImage);
-        keygenExec[PATH_MAX-1] = 0;
-        snprintf(keyFileName, PATH_MAX, "%s/etc/ssh_host_%s_key", udiImage, *keyPtr);
-        args[0] = _strdup(keygenExec);
-        args[1] = _strdup("-t");
-        args[2] = _strdup(*keyPtr);
-        args[3] = _strdup("-f");
-        args[4] = _strdup(keyFileName);
-        args[5] = _strdup("-N");
-        args[6] = _strdup("");
-        args[7] = NULL;
-        for (argPtr = args; argPtr - args < 7; argPtr++) {
-            if (argPtr == NULL || *argPtr == NULL) {
-                fprintf(stderr, "Memory allocation failed\n");
-                ret = 1;
+        for (ptr = module->libraryPath; ptr && *ptr; ptr++) {
+            if (_scanLdCacheDir(udiConfig, *ptr, &builder) != 0) {
+                goto _setupContainerLdCache_exit;
             }
+            ndirs++;
         }
-        if (ret == 0) {
-            ret = forkAndExecv(args);
-        }
-        for (argPtr = args; *argPtr != NULL; argPtr++) {
-            free(*argPtr);
+        if (module->gpuSupport != NULL) {
+            snprintf(dir, PATH_MAX, "%s/lib64", module->gpuSupport);
+            if (_scanLdCacheDir(udiConfig, dir, &builder) != 0) {
+                goto _setupContainerLdCache_exit;
+            }
+            snprintf(dir, PATH_MAX, "%s/lib", module->gpuSupport);
+            if (_scanLdCacheDir(udiConfig, dir, &builder) != 0) {
+                goto _setupContainerLdCache_exit;
+            }
+            ndirs += 2;
         }
+    }
+    if (ndirs == 0) {
+        ret = 0;
+        goto _setupContainerLdCache_exit;
+    }
 
-        if (ret != 0) {
-            fprintf(stderr, "Failed to generate key of type %s\n", *keyPtr);
-            goto _setupImageSsh_unclean;
+    snprintf(cachePath, PATH_MAX, "%s/etc/ld.so.cache",
+            udiConfig->udiMountPoint);
+    if (lstat(cachePath, &statData) == 0) {
+        if (!S_ISREG(statData.st_mode) ||
+                shifter_ldcache_parse(cachePath, _visitImageLdCache,
+                    &builder) != 0)
+        {
+            fprintf(stderr, "WARNING: ignoring unreadable image "
+                    "ld.so.cache\n");
         }
+    }
 
-        /* chown files to user */
-        if (chown(keyFileName, ownerUid, ownerGid) != 0) {
-            fprintf(stderr, "Failed to chown ssh host key to user: %s\n",
-                    keyFileName);
-            goto _setupImageSsh_unclean;
-        }
+    if (shifter_ldcache_write(cachePath, builder.entries, builder.n) != 0) {
+        fprintf(stderr, "FAILED to write container ld.so.cache\n");
+        goto _setupContainerLdCache_exit;
     }
+    ret = 0;
 
-    /* rewrite sshd_config */
-    snprintf(sshdConfigPath, PATH_MAX, "%s/etc/sshd_config", udiImage);
-    sshdConfigPath[PATH_MAX - 1] = 0;
-    snprintf(sshdConfigPathNew, PATH_MAX, "%s/etc/sshd_config.new", udiImage);
-    sshdConfigPathNew[PATH_MAX - 1] = 0;
+_setupContainerLdCache_exit:
+    for (idx = 0; idx < builder.n; idx++) {
+        free((char *) builder.entries[idx].name);
+        free((char *) builder.entries[idx].path);
+    }
+    free(builder.entries);
+    return ret;
+}
 
-    inputFile = fopen(sshdConfigPath, "r");
-    outputFile = fopen(sshdConfigPathNew, "w");
+char *generateShifterConfigString(const char *user, ImageData *image,
+                                  VolumeMap *volumeMap, UdiRootConfig *config)
+{
+    char *str = NULL;
+    char *volMapSig = NULL;
+    char *modules = NULL;
+    size_t modules_len = 0;
+    size_t modules_sz = 0;
+    int idx = 0;
+    if (image == NULL || volumeMap == NULL) return NULL;
 
-    if (inputFile == NULL || outputFile == NULL) {
-        fprintf(stderr, "Could not open sshd_config for reading or writing\n");
-        goto _setupImageSsh_unclean;
+    volMapSig = getVolMapSignature(volumeMap);
+    for (idx = 0; idx < config->n_active_modules; idx++) {
+        modules = alloc_strcatf(modules, &modules_len, &modules_sz, "%s,",
+                                config->active_modules[idx]->name);
     }
 
-    while (!feof(inputFile) && !ferror(inputFile)) {
-        size_t nbytes = getline(&lineBuf, &lineBuf_size, inputFile);
-        char *ptr = NULL;
-        if (nbytes == 0) break;
-        ptr = shifter_trim(lineBuf);
-        if (strcmp(ptr, "AllowUsers ToBeReplaced") == 0) {
-            fprintf(outputFile, "AllowUsers %s\n", username);
-        } else {
-            fprintf(outputFile, "%s\n", ptr);
-        }
-    }
-    fclose(inputFile);
-    fclose(outputFile);
-    inputFile = NULL;
-    outputFile = NULL;
-    if (lineBuf != NULL) {
-        free(lineBuf);
-        lineBuf = NULL;
-    }
-    if (stat(sshdConfigPathNew, &statData) != 0) {
-        fprintf(stderr, "FAILED to find new sshd_config file, cannot setup sshd\n");
-        goto _setupImageSsh_unclean;
-    } else {
-        char *moveCmd[] = { _strdup(udiConfig->mvPath),
-            _strdup(sshdConfigPathNew),
-            _strdup(sshdConfigPath),
-            NULL
-        };
-        char **argsPtr = NULL;
-        int ret = forkAndExecv(moveCmd);
-        for (argsPtr = moveCmd; *argsPtr != NULL; argsPtr++) {
-            free(*argsPtr);
-        }
-        if (ret != 0) {
-            fprintf(stderr, "FAILED to replace sshd_config with configured version.\n");
-            goto _setupImageSsh_unclean;
-        }
+    str = alloc_strgenf(
+            "{\"identifier\":\"%s\","
+            "\"user\":\"%s\","
+            "\"volMap\":\"%s\","
+            "\"modules\":\"%s\"}",
+            image->identifier,
+            user,
+            (volMapSig == NULL ? "" : volMapSig),
+            (modules == NULL ? "" : modules)
+    );
+
+    if (volMapSig != NULL) {
+        free(volMapSig);
     }
-    if (chown(sshdConfigPath, ownerUid, ownerGid) != 0) {
-        fprintf(stderr, "FAILED to chown sshd config path %s\n", sshdConfigPath);
-        perror("   errno: ");
-        goto _setupImageSsh_unclean;
+    if (modules != NULL) {
+        free(modules);
     }
-    if (chmod(sshdConfigPath, S_IRUSR | S_IROTH) != 0) {
-        fprintf(stderr, "FAILED to set sshd config permissions to 0600\n");
-        perror("   errno: ");
-        goto _setupImageSsh_unclean;
+    return str;
+}
+
+static void _hashStringArray(ShifterHash *hash, const char *name, char **array) {
+    char **ptr = NULL;
+    shifter_hash_field(hash, name, NULL, 0);
+    for (ptr = array; ptr && *ptr; ptr++) {
+        shifter_hash_string(hash, name, *ptr);
     }
+}
 
-    if (sshPubKey != NULL && strlen(sshPubKey) > 0) {
-        snprintf(buffer, PATH_MAX, "%s/etc/user_auth_keys", udiImage);
-        buffer[PATH_MAX - 1] = 0;
-        outputFile = fopen(buffer, "w");
-        if (outputFile == NULL) {
-            fprintf(stderr, "FAILED to open user_auth_keys for writing\n");
-            goto _setupImageSsh_unclean;
-        }
-        fprintf(outputFile, "%s\n", sshPubKey);
-        fclose(outputFile);
-        outputFile = NULL;
-        if (chown(buffer, uid, 0) != 0) {
-            fprintf(stderr, "FAILED to chown ssh pub key to uid %d\n", uid);
-            perror("   errno: ");
-            goto _setupImageSsh_unclean;
-        }
-        if (chmod(buffer, S_IRUSR) != 0) {
-            fprintf(stderr, "FAILED to set ssh pub key permissions to 0600\n");
-            perror("   errno: ");
-            goto _setupImageSsh_unclean;
-        }
+static void _hashInt(ShifterHash *hash, const char *name, int64_t value) {
+    shifter_hash_field(hash, name, &value, sizeof(int64_t));
+}
+
+static void _hashVolumeMap(ShifterHash *hash, const char *name, VolumeMap *volMap) {
+    char *sig = getVolMapSignature(volMap);
+    shifter_hash_string(hash, name, sig);
+    if (sig != NULL) {
+        free(sig);
     }
+}
 
+/**
+ * generateShifterConfigFingerprint
+ * Digest of everything that determines the content of a UDI: the user, the
+ * image identifier and the identity of its backing file (device, inode,
+ * size, mtime, ctime), the site configuration, the normalized user volume
+ * map and the active modules.  fingerprint must hold
+ * SHIFTER_HASH_HEX_SIZE + 1 bytes.
+ *
+ * Returns 0 on success, 1 on invalid input, 2 if the image backing file
+ * cannot be stat'd.
+ */
+int generateShifterConfigFingerprint(const char *user, ImageData *image,
+        VolumeMap *volumeMap, UdiRootConfig *config, char *fingerprint)
+{
+    ShifterHash hash;
+    unsigned char digest[SHIFTER_HASH_SIZE];
+    struct stat imageStat;
+    int idx = 0;
+
+    if (image == NULL || volumeMap == NULL || config == NULL ||
+            fingerprint == NULL || image->filename == NULL)
     {
-        snprintf(from, PATH_MAX, "%s/bin/ssh", udiImage);
-        snprintf(to, PATH_MAX, "%s/usr/bin/ssh", udiConfig->udiMountPoint);
-        from[PATH_MAX-1] = 0;
-        to[PATH_MAX-1] = 0;
-        if (stat(to, &statData) == 0) {
-            _BINDMOUNT(&mountCache, from, to, VOLMAP_FLAG_READONLY, 1);
-        }
-        snprintf(from, PATH_MAX, "%s/bin/ssh", udiImage);
-        snprintf(to, PATH_MAX, "%s/bin/ssh", udiConfig->udiMountPoint);
-        from[PATH_MAX - 1] = 0;
-        to[PATH_MAX - 1] = 0;
-        if (stat(to, &statData) == 0) {
-            _BINDMOUNT(&mountCache, from, to, VOLMAP_FLAG_READONLY, 1);
-        }
-        snprintf(from, PATH_MAX, "%s/etc/ssh_config", udiImage);
-        snprintf(to, PATH_MAX, "%s/etc/ssh/ssh_config", udiConfig->udiMountPoint);
-        if (_shifterCore_copyFile(udiConfig->cpPath, from, to, 0, 0, 0, 0) != 0) {
-            fprintf(stderr, "FAILED to copy ssh_config to %s\n", to);
-            goto _setupImageSsh_unclean;
-        }
-        /* rely on var/empty created earlier in the setup process */
+        return 1;
     }
-#undef _BINDMOUNT
-    free(udiImage);
-    free(sshdConfigPath);
-    free(sshdConfigPathNew);
-    free(from);
-    free(to);
-    free(buffer);
-    free(keygenExec);
-    free(keyFileName);
+    if (stat(image->filename, &imageStat) != 0) {
+        return 2;
+    }
+
+    shifter_hash_init(&hash);
+    shifter_hash_string(&hash, "version", "1");
+    shifter_hash_string(&hash, "user", user);
+
+    shifter_hash_string(&hash, "image.identifier", image->identifier);
+    shifter_hash_string(&hash, "image.type", image->type);
+    shifter_hash_string(&hash, "image.filename", image->filename);
+    _hashInt(&hash, "image.format", image->format);
+    _hashInt(&hash, "image.useLoopMount", image->useLoopMount);
+    _hashInt(&hash, "image.dev", imageStat.st_dev);
+    _hashInt(&hash, "image.ino", imageStat.st_ino);
+    _hashInt(&hash, "image.size", imageStat.st_size);
+    _hashInt(&hash, "image.mode", imageStat.st_mode);
+    _hashInt(&hash, "image.mtime", imageStat.st_mtim.tv_sec);
+    _hashInt(&hash, "image.mtime_ns", imageStat.st_mtim.tv_nsec);
+    _hashInt(&hash, "image.ctime", imageStat.st_ctim.tv_sec);
+    _hashInt(&hash, "image.ctime_ns", imageStat.st_ctim.tv_nsec);
+
+    shifter_hash_string(&hash, "udiMountPoint", config->udiMountPoint);
+    shifter_hash_string(&hash, "loopMountPoint", config->loopMountPoint);
+    shifter_hash_string(&hash, "imageBasePath", config->imageBasePath);
+    shifter_hash_string(&hash, "udiRootPath", config->udiRootPath);
+    shifter_hash_string(&hash, "optUdiImage", config->optUdiImage);
+    shifter_hash_string(&hash, "etcPath", config->etcPath);
+    shifter_hash_string(&hash, "rootfsType", config->rootfsType);
+    shifter_hash_string(&hash, "sitePreMountHook", config->sitePreMountHook);
+    shifter_hash_string(&hash, "sitePostMountHook", config->sitePostMountHook);
+    shifter_hash_string(&hash, "perNodeCachePath", config->perNodeCachePath);
+    _hashInt(&hash, "perNodeCacheSizeLimit", config->perNodeCacheSizeLimit);
+    _hashStringArray(&hash, "perNodeCacheAllowedFsType", config->perNodeCacheAllowedFsType);
+    _hashInt(&hash, "shmSizeLimit", config->shmSizeLimit);
+    _hashInt(&hash, "hugetlbfsSizeLimit", config->hugetlbfsSizeLimit);
+    shifter_hash_string(&hash, "hugetlbfsPageSizes", config->hugetlbfsPageSizes);
+    _hashVolumeMap(&hash, "siteFs", config->siteFs);
+    _hashStringArray(&hash, "siteEnv", config->siteEnv);
+    _hashStringArray(&hash, "siteEnvAppend", config->siteEnvAppend);
+    _hashStringArray(&hash, "siteEnvPrepend", config->siteEnvPrepend);
+    _hashStringArray(&hash, "siteEnvUnset", config->siteEnvUnset);
+    _hashInt(&hash, "allowLocalChroot", config->allowLocalChroot);
+    _hashInt(&hash, "allowLibcPwdCalls", config->allowLibcPwdCalls);
+    _hashInt(&hash, "populateEtcDynamically", config->populateEtcDynamically);
+    _hashInt(&hash, "mountUdiRootWritable", config->mountUdiRootWritable);
+    _hashInt(&hash, "useOverlayRoot", config->useOverlayRoot);
+    _hashInt(&hash, "optionalSshdAsRoot", config->optionalSshdAsRoot);
+    _hashInt(&hash, "maxGroupCount", config->maxGroupCount);
+    _hashInt(&hash, "mountPropagationStyle", config->mountPropagationStyle);
+    _hashInt(&hash, "target_uid", config->target_uid);
+    _hashInt(&hash, "target_gid", config->target_gid);
+
+    _hashVolumeMap(&hash, "volMap", volumeMap);
+
+    for (idx = 0; idx < config->n_active_modules; idx++) {
+        ShifterModule *module = config->active_modules[idx];
+        shifter_hash_string(&hash, "module", module->name);
+        shifter_hash_string(&hash, "module.userhook", module->userhook);
+        _hashInt(&hash, "module.userhookEnv", module->userhookEnv);
+        shifter_hash_string(&hash, "module.roothook", module->roothook);
+        shifter_hash_string(&hash, "module.copyPath", module->copyPath);
+        shifter_hash_string(&hash, "module.gpuSupport", module->gpuSupport);
+        _hashVolumeMap(&hash, "module.siteFs", module->siteFs);
+        _hashStringArray(&hash, "module.siteEnv", module->siteEnv);
+        _hashStringArray(&hash, "module.siteEnvAppend", module->siteEnvAppend);
+        _hashStringArray(&hash, "module.siteEnvPrepend", module->siteEnvPrepend);
+        _hashStringArray(&hash, "module.siteEnvUnset", module->siteEnvUnset);
+        _hashStringArray(&hash, "module.libraryPath", module->libraryPath);
+        _hashStringArray(&hash, "module.after", module->after_str);
+    }
+
+    shifter_hash_final(&hash, digest);
+    shifter_hash_hex(digest, fingerprint);
     return 0;
-_setupImageSsh_unclean:
-    if (inputFile != NULL) {
-        fclose(inputFile);
-        inputFile = NULL;
+}
+
+/**
+ * saveShifterConfig
+ * Record the configuration of the UDI in var/shifterConfig.json.  The
+ * fingerprint is written first so that compareShifterConfig only needs to
+ * read a fixed-size prefix of the file.  If no fingerprint can be generated
+ * the file is written without one and the UDI will never be reused.
+ */
+int saveShifterConfig(const char *user, ImageData *image, VolumeMap *volumeMap, UdiRootConfig *udiConfig) {
+    char *saveFilename = _malloc(sizeof(char) * PATH_MAX);
+    char fingerprint[SHIFTER_HASH_HEX_SIZE + 1];
+    FILE *fp = NULL;
+    char *configString = generateShifterConfigString(user, image, volumeMap, udiConfig);
+    int haveFingerprint = 0;
+
+    if (configString == NULL) {
+        goto _saveShifterConfig_error;
     }
-    if (outputFile != NULL) {
-        fclose(outputFile);
-        outputFile = NULL;
+    haveFingerprint = generateShifterConfigFingerprint(user, image, volumeMap,
+            udiConfig, fingerprint) == 0;
+
+    snprintf(saveFilename, PATH_MAX, "%s/var/shifterConfig.json",
+            udiConfig->udiMountPoint);
+    fp = fopen(saveFilename, "w");
+    if (fp == NULL) {
+        goto _saveShifterConfig_error;
     }
-    free(udiImage);
-    free(sshdConfigPath);
-    free(sshdConfigPathNew);
-    free(from);
-    free(to);
-    free(buffer);
-    free(keygenExec);
-    free(keyFileName);
+    if (haveFingerprint) {
+        fprintf(fp, "{\"fingerprint\":\"%s\",%s\n", fingerprint,
+                configString + 1);
+    } else {
+        fprintf(fp, "%s\n", configString);
+    }
+    fclose(fp);
+    fp = NULL;
+
+    free(configString);
+    configString = NULL;
+    free(saveFilename);
+    return 0;
+_saveShifterConfig_error:
+    if (configString != NULL) {
+        free(configString);
+    }
+    free(saveFilename);
     return 1;
 }
 
-gid_t *shifter_getgrouplist(const char *user, gid_t group, int *ngroups) {
-    int ret = 0;
-    int idx = 0;
-    gid_t *ret_groups = NULL;
-    int nret_groups = 0;
+/**
+ * compareShifterConfig
+ * Determine whether the UDI currently set up matches the requested
+ * configuration by comparing fingerprints.  Costs one stat of the image
+ * backing file and a fixed-size read of var/shifterConfig.json.
+ *
+ * Returns 0 if the configurations match, non-zero otherwise.
+ */
+int compareShifterConfig(const char *user, ImageData *image, VolumeMap *volumeMap, UdiRootConfig *udiConfig) {
+    char configFilename[PATH_MAX];
+    char expected[SHIFTER_HASH_HEX_SIZE + 32];
+    char buffer[SHIFTER_HASH_HEX_SIZE + 32];
+    char fingerprint[SHIFTER_HASH_HEX_SIZE + 1];
+    size_t len = 0;
+    ssize_t nread = 0;
+    int fd = -1;
 
-    if (user == NULL || group == 0 || ngroups == NULL) {
-        goto _getgrlist_err;
+    if (udiConfig == NULL || udiConfig->udiMountPoint == NULL) {
+        return -1;
     }
-    if (strcmp(user, "root") == 0) {
-        fprintf(stderr, "FAILED: refuse to lookup groups for root\n");
-        goto _getgrlist_err;
+    if (generateShifterConfigFingerprint(user, image, volumeMap, udiConfig,
+                fingerprint) != 0)
+    {
+        return -1;
     }
+    len = snprintf(expected, sizeof(expected), "{\"fingerprint\":\"%s\",",
+            fingerprint);
 
-    ret = getgrouplist(user, group, NULL, &nret_groups);
-    if (ret < 0 && nret_groups > 0) {
-        if (nret_groups > 512) {
-            fprintf(stderr, "FAILED to get groups, seriously 512 groups is enough!\n");
-            goto _getgrlist_err;
-        }
+    snprintf(configFilename, PATH_MAX, "%s/var/shifterConfig.json",
+            udiConfig->udiMountPoint);
+    fd = open(configFilename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    nread = read(fd, buffer, len);
+    close(fd);
 
-        /* allocate and initialize memory to be populated by getgrouplist */
-        ret_groups = (gid_t *) _malloc(sizeof(gid_t) * (nret_groups + 1));
-        memset(ret_groups, 0, sizeof(gid_t) * (nret_groups + 1));
+    if (nread != (ssize_t) len) {
+        return -1;
+    }
+    return memcmp(expected, buffer, len);
+}
 
-        ret = getgrouplist(user, group, ret_groups, &nret_groups);
-        if (ret < 0) {
-            fprintf(stderr, "FAILED to get groups correctly\n");
-            goto _getgrlist_err;
-        }
+static int _getProcessStartTime(pid_t pid, unsigned long long *startTime) {
+    char path[PATH_MAX];
+    char buffer[1024];
+    char *ptr = NULL;
+    ssize_t nread = 0;
+    int field = 0;
+    int fd = -1;
+
+    snprintf(path, PATH_MAX, "/proc/%d/stat", (int) pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    nread = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (nread <= 0) {
+        return 1;
     }
+    buffer[nread] = 0;
 
-    /* set default group list if none are found */
-    if (nret_groups <= 0) {
-        if (ret_groups != NULL) {
-            free(ret_groups);
-            ret_groups = NULL;
-        }
-        ret_groups = (gid_t *) _malloc(sizeof(gid_t) * 2);
-        ret_groups[0] = group;
-        ret_groups[1] = 0;
-        nret_groups = 1;
+    /* comm may contain spaces, fields are counted from the closing paren;
+     * starttime is field 22 */
+    ptr = strrchr(buffer, ')');
+    if (ptr == NULL) {
+        return 1;
     }
-    if (ret_groups == NULL) {
-        fprintf(stderr, "FAILED: no auxilliary groups found!\n");
-        goto _getgrlist_err;
+    for (field = 2; field < 22 && ptr != NULL; field++) {
+        ptr = strchr(ptr + 1, ' ');
+    }
+    if (ptr == NULL) {
+        return 1;
     }
+    *startTime = strtoull(ptr + 1, NULL, 10);
+    return 0;
+}
 
-    /* just make sure no zeros snuck in */
-    for (idx = 0; idx < nret_groups; idx++) {
-        if (ret_groups[idx] == 0) {
-            ret_groups[idx] = group;
-        }
+/**
+ * openUdiBuildLock
+ * Open (creating if needed) the node-level build lock for a UDI
+ * configuration, <udiRunDir>/udi.<fingerprint>.lock.  The lock file also
+ * records which process holds the published mount namespace.
+ *
+ * Returns the open fd, or -1 if udiRunDir is unset or the lock file is
+ * unusable (not a regular file owned by the effective user).
+ */
+int openUdiBuildLock(UdiRootConfig *udiConfig, const char *fingerprint) {
+    char path[PATH_MAX];
+    struct stat statData;
+    int fd = -1;
+
+    if (udiConfig == NULL || udiConfig->udiRunDir == NULL ||
+            fingerprint == NULL)
+    {
+        return -1;
     }
-    *ngroups = nret_groups;
-    return ret_groups;
+    snprintf(path, PATH_MAX, "%s/udi.%s.lock", udiConfig->udiRunDir,
+            fingerprint);
+    fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "FAILED to open UDI build lock %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &statData) != 0 || !S_ISREG(statData.st_mode) ||
+            statData.st_uid != geteuid())
+    {
+        fprintf(stderr, "FAILED to use UDI build lock %s, invalid "
+                "ownership or type\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-_getgrlist_err:
-    if (ret_groups != NULL) {
-        free(ret_groups);
-        ret_groups = NULL;
+static void _udiBuildLockAlarm(int signum) {
+    (void) signum;
+}
+
+/**
+ * acquireUdiBuildLock
+ * Wait up to timeout seconds (UDI_BUILD_LOCK_TIMEOUT if not positive) for
+ * the exclusive build lock.  The kernel drops the lock if its holder dies,
+ * so a crashed builder never blocks others; a hung one only delays them
+ * until the timeout.
+ *
+ * Returns 0 if the lock is held, 1 otherwise
+ */
+int acquireUdiBuildLock(int lockFd, int timeout) {
+    struct sigaction action;
+    struct sigaction saved;
+    int rc = 0;
+
+    if (lockFd < 0) {
+        return 1;
     }
-    if (ngroups != NULL) {
-        *ngroups = 0;
+    if (flock(lockFd, LOCK_EX | LOCK_NB) == 0) {
+        return 0;
     }
-    return NULL;
+    if (errno != EWOULDBLOCK) {
+        return 1;
+    }
+    if (timeout <= 0) {
+        timeout = UDI_BUILD_LOCK_TIMEOUT;
+    }
+
+    /* no SA_RESTART so that the alarm interrupts flock */
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = _udiBuildLockAlarm;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGALRM, &action, &saved);
+    alarm(timeout);
+    rc = flock(lockFd, LOCK_EX);
+    alarm(0);
+    sigaction(SIGALRM, &saved, NULL);
+    return rc == 0 ? 0 : 1;
 }
 
 /**
-  * startSshd
-  * chroots into image and runs the secured sshd
-  */
-int startSshd(const char *user, UdiRootConfig *udiConfig) {
-    char *chrootPath = _malloc(sizeof(char) * PATH_MAX);
-    pid_t pid = 0;
+ * publishUdi
+ * Record the calling process as holder of the mount namespace containing
+ * the UDI built under lockFd, so that other shifter instances can join it.
+ */
+int publishUdi(int lockFd) {
+    char record[128];
+    struct stat nsStat;
+    unsigned long long startTime = 0;
+    pid_t pid = getpid();
+    int len = 0;
 
-    snprintf(chrootPath, PATH_MAX, "%s", udiConfig->udiMountPoint);
-    chrootPath[PATH_MAX - 1] = 0;
+    if (lockFd < 0) {
+        return 1;
+    }
+    if (stat("/proc/self/ns/mnt", &nsStat) != 0 ||
+            _getProcessStartTime(pid, &startTime) != 0)
+    {
+        return 1;
+    }
+    len = snprintf(record, sizeof(record), "%d %llu %llu\n", (int) pid,
+            startTime, (unsigned long long) nsStat.st_ino);
+    if (ftruncate(lockFd, 0) != 0 || pwrite(lockFd, record, len, 0) != len) {
+        return 1;
+    }
+    return 0;
+}
 
-    if (chdir(chrootPath) != 0) {
-        fprintf(stderr, "FAILED to chdir to %s while attempted to start sshd\n", chrootPath);
-        goto _startSshd_unclean;
+/**
+ * joinPublishedUdi
+ * Enter the mount namespace recorded by publishUdi.  A record whose
+ * process has exited (or whose pid was reused) is stale and ignored.
+ *
+ * Returns 0 if the namespace was joined, 1 if nothing valid is published,
+ * 2 if the namespace could not be entered
+ */
+int joinPublishedUdi(int lockFd) {
+    char record[128];
+    char nsPath[PATH_MAX];
+    struct stat nsStat;
+    unsigned long long startTime = 0;
+    unsigned long long procStartTime = 0;
+    unsigned long long nsInode = 0;
+    ssize_t nread = 0;
+    int pid = 0;
+    int nsFd = -1;
+
+    if (lockFd < 0) {
+        return 1;
     }
-    if (udiConfig->target_uid == 0 || udiConfig->target_gid == 0) {
-        fprintf(stderr, "FAILED to start sshd, will not start as root\n");
-        goto _startSshd_unclean;
+    nread = pread(lockFd, record, sizeof(record) - 1, 0);
+    if (nread <= 0) {
+        return 1;
+    }
+    record[nread] = 0;
+    if (sscanf(record, "%d %llu %llu", &pid, &startTime, &nsInode) != 3 ||
+            pid <= 0)
+    {
+        return 1;
+    }
+    if (_getProcessStartTime(pid, &procStartTime) != 0 ||
+            procStartTime != startTime)
+    {
+        return 1;
     }
 
-    pid = fork();
-    if (pid < 0) {
-        fprintf(stderr, "FAILED to fork while attempting to start sshd\n");
-        goto _startSshd_unclean;
+    snprintf(nsPath, PATH_MAX, "/proc/%d/ns/mnt", pid);
+    nsFd = open(nsPath, O_RDONLY | O_CLOEXEC);
+    if (nsFd < 0) {
+        return 1;
     }
-    if (pid == 0) {
-        /* get grouplist in the external environment */
-        int nGroups = 0;
-        gid_t *gidList = shifter_getgrouplist(user, udiConfig->target_gid, &nGroups);
-        if (gidList == NULL) {
-            fprintf(stderr, "FAILED to correctly get grouplist for sshd\n");
-            exit(1);
-        }
+    if (fstat(nsFd, &nsStat) != 0 || nsStat.st_ino != nsInode) {
+        close(nsFd);
+        return 1;
+    }
+    if (setns(nsFd, CLONE_NEWNS) != 0) {
+        close(nsFd);
+        return 2;
+    }
+    close(nsFd);
+    return 0;
+}
 
-        if (chdir(chrootPath) != 0) {
-            fprintf(stderr, "FAILED to chdir to %s while attempting to start sshd\n", chrootPath);
-            exit(1);
-        }
-        if (chroot(chrootPath) != 0) {
-            fprintf(stderr, "FAILED to chroot to %s while attempting to start sshd\n", chrootPath);
-            exit(1);
-        }
-        if (chdir("/") != 0) {
-            fprintf(stderr, "FAILED to chdir following chroot\n");
-            exit(1);
-        }
-        if (gidList == NULL) {
-            fprintf(stderr, "FAILED to get groupllist for sshd, exiting!\n");
-            exit(1);
-        }
-        if (shifter_set_capability_boundingset_null() != 0) {
-            fprintf(stderr, "FAILED to restrict future capabilities\n");
-            exit(1);
-        }
-        if (setgroups(nGroups, gidList) != 0) {
-            fprintf(stderr, "FAILED to setgroups(): %s\n", strerror(errno));
-            exit(1);
+/**
+ * setupImageSshKeys
+ * Generate the sshd host keys and install the user's public key in the
+ * udiImage.  These are the per-job parts of the sshd setup, scrubbed when a
+ * UDI is kept warm and regenerated for the next job.
+ */
+int setupImageSshKeys(char *sshPubKey, uid_t uid, gid_t gid, UdiRootConfig *udiConfig) {
+    char *udiImage = alloc_strgenf("%s/opt/udiImage", udiConfig->udiMountPoint);
+    char *keygenExec = alloc_strgenf("%s/bin/ssh-keygen", udiImage);
+    char *keyFileName = _malloc(sizeof(char) * PATH_MAX);
+    char *buffer = _malloc(sizeof(char) * PATH_MAX);
+    const char *keyType[5] = {"dsa", "ecdsa", "rsa","ed25519", NULL};
+    const char **keyPtr = NULL;
+    FILE *outputFile = NULL;
+
+    if (uid == 0 || gid == 0) {
+        fprintf(stderr, "FAILED to identify proper uid to run sshd\n");
+        goto _setupImageSshKeys_unclean;
+    }
+
+    /* generate ssh host keys */
+    for (keyPtr = keyType; *keyPtr != NULL; keyPtr++) {
+        char *args[8];
+        char **argPtr = NULL;
+        int ret = 0;
+
+        snprintf(keyFileName, PATH_MAX, "%s/etc/ssh_host_%s_key", udiImage, *keyPtr);
+        args[0] = _strdup(keygenExec);
+        args[1] = _strdup("-t");
+        args[2] = _strdup(*keyPtr);
+        args[3] = _strdup("-f");
+        args[4] = _strdup(keyFileName);
+        args[5] = _strdup("-N");
+        args[6] = _strdup("");
+        args[7] = NULL;
+        for (argPtr = args; argPtr - args < 7; argPtr++) {
+            if (argPtr == NULL || *argPtr == NULL) {
+                fprintf(stderr, "Memory allocation failed\n");
+                ret = 1;
+            }
         }
-        if (setresgid(udiConfig->target_gid, udiConfig->target_gid,
-                      udiConfig->target_gid) != 0) {
-            fprintf(stderr, "FAILED to setresgid(): %s\n", strerror(errno));
-            exit(1);
+        if (ret == 0) {
+            ret = forkAndExecv(args);
         }
-        if (setresuid(udiConfig->target_uid, udiConfig->target_uid,
-                      udiConfig->target_uid) != 0) {
-            fprintf(stderr, "FAILED to setresuid(): %s\n", strerror(errno));
-            exit(1);
+        for (argPtr = args; *argPtr != NULL; argPtr++) {
+            free(*argPtr);
         }
-#if HAVE_DECL_PR_SET_NO_NEW_PRIVS == 1
-        /* ensure this process and its heirs cannot gain privilege */
-        /* see https://www.kernel.org/doc/Documentation/prctl/no_new_privs.txt */
-        if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0) {
-            fprintf(stderr, "Failed to fully drop privileges: %s",
-                    strerror(errno));
-            exit(1);
+
+        if (ret != 0) {
+            fprintf(stderr, "Failed to generate key of type %s\n", *keyPtr);
+            goto _setupImageSshKeys_unclean;
         }
-#endif
-        char **sshdArgs = (char **) _malloc(sizeof(char *) * 2);
-        sshdArgs[0] = _strdup("/opt/udiImage/sbin/sshd");
-        sshdArgs[1] = NULL;
-        execv(sshdArgs[0], sshdArgs);
-        fprintf(stderr, "FAILED to exec sshd!\n");
 
-        /* if we fell through to here, there is a problem */
-        exit(1);
-    } else {
-        int status = 0;
-        do {
-            pid_t ret = waitpid(pid, &status, 0);
-            if (ret != pid) {
-                fprintf(stderr, "waited for wrong pid: %d != %d\n", pid, ret);
-                goto _startSshd_unclean;
-            }
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-        if (WIFEXITED(status)) {
-            status = WEXITSTATUS(status);
-        } else {
-            status = 1;
+        /* chown files to user */
+        if (chown(keyFileName, uid, gid) != 0) {
+            fprintf(stderr, "Failed to chown ssh host key to user: %s\n",
+                    keyFileName);
+            goto _setupImageSshKeys_unclean;
         }
-        free(chrootPath);
-        return status;
     }
-    free(chrootPath);
-    return 0;
-_startSshd_unclean:
-    free(chrootPath);
-    return 1;
-}
-
-int _forkAndExecv(char *const *args, int silent) {
-    pid_t pid = 0;
 
-    pid = fork();
-    if (pid < 0) {
-        fprintf(stderr, "FAILED to fork! Exiting.\n");
-        return 1;
-    }
-    if (pid > 0) {
-        /* this is the parent */
-        int status = 0;
-        do {
-            pid_t ret = waitpid(pid, &status, 0);
-            if (ret != pid) {
-                fprintf(stderr, "This might be impossible: forked by couldn't wait, FAIL!\n");
-                return 1;
-            }
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-        if (WIFEXITED(status)) {
-            status = WEXITSTATUS(status);
-        } else {
-            status = 1;
+    if (sshPubKey != NULL && strlen(sshPubKey) > 0) {
+        snprintf(buffer, PATH_MAX, "%s/etc/user_auth_keys", udiImage);
+        buffer[PATH_MAX - 1] = 0;
+        outputFile = fopen(buffer, "w");
+        if (outputFile == NULL) {
+            fprintf(stderr, "FAILED to open user_auth_keys for writing\n");
+            goto _setupImageSshKeys_unclean;
         }
-        return status;
-    }
-    /* this is the child */
-    if (silent) {
-        int devNull = open("/dev/null", O_WRONLY);
-        if (devNull < 0) {
-            fprintf(stderr, "FAILED to open /dev/null: %s", strerror(errno));
-            exit(1);
+        fprintf(outputFile, "%s\n", sshPubKey);
+        fclose(outputFile);
+        outputFile = NULL;
+        if (chown(buffer, uid, 0) != 0) {
+            fprintf(stderr, "FAILED to chown ssh pub key to uid %d\n", uid);
+            perror("   errno: ");
+            goto _setupImageSshKeys_unclean;
+        }
+        if (chmod(buffer, S_IRUSR) != 0) {
+            fprintf(stderr, "FAILED to set ssh pub key permissions to 0600\n");
+            perror("   errno: ");
+            goto _setupImageSshKeys_unclean;
         }
-        dup2(devNull, STDOUT_FILENO);
-        dup2(devNull, STDERR_FILENO);
-        close(devNull);
     }
-    execv(args[0], args);
-    fprintf(stderr, "FAILED to execvp! Exiting.\n");
-    exit(127);
+    free(udiImage);
+    free(keygenExec);
+    free(keyFileName);
+    free(buffer);
+    return 0;
+_setupImageSshKeys_unclean:
+    free(udiImage);
+    free(keygenExec);
+    free(keyFileName);
+    free(buffer);
+    return 1;
 }
 
-int forkAndExecv(char *const *args) {
-    return _forkAndExecv(args, 0);
-}
+int setupImageSsh(char *sshPubKey, char *username, uid_t uid, gid_t gid, UdiRootConfig *udiConfig) {
+    struct stat statData;
+    char *udiImage = _malloc(sizeof(char) * PATH_MAX);
+    char *sshdConfigPath = _malloc(sizeof(char) * PATH_MAX);
+    char *sshdConfigPathNew = _malloc(sizeof(char) * PATH_MAX);
+    char *from = _malloc(sizeof(char) * PATH_MAX);
+    char *to = _malloc(sizeof(char) * PATH_MAX);
+    char *lineBuf = NULL;
+    size_t lineBuf_size = 0;
+    uid_t ownerUid = uid;
+    gid_t ownerGid = gid;
 
-int forkAndExecvSilent(char *const *args) {
-    return _forkAndExecv(args, 1);
-}
+    FILE *inputFile = NULL;
+    FILE *outputFile = NULL;
 
-int _shifterCore_bindMount(UdiRootConfig *udiConfig, MountList *mountCache,
-        const char *from, const char *to, size_t flags, int overwriteMounts)
-{
-    int ret = 0;
-    char **ptr = NULL;
-    char *to_real = NULL;
-    unsigned long mountFlags = MS_BIND;
-    unsigned long remountFlags = MS_REMOUNT|MS_BIND|MS_NOSUID;
-    unsigned long privateRemountFlags = 0;
+    MountList mountCache;
+    memset(&mountCache, 0, sizeof(MountList));
 
-    if (udiConfig == NULL) {
-        fprintf(stderr, "FAILED to provide udiConfig!\n");
-        return 1;
+    if (ownerUid == 0 || ownerGid == 0) {
+        fprintf(stderr, "FAILED to identify proper uid to run sshd\n");
+        goto _setupImageSsh_unclean;
     }
 
-    privateRemountFlags =
-        udiConfig->mountPropagationStyle == VOLMAP_FLAG_SLAVE ?
-        MS_SLAVE : MS_PRIVATE;
+#define _BINDMOUNT(mounts, from, to, flags, overwrite) if (_shifterCore_bindMount(udiConfig, mounts, from, to, flags, overwrite) != 0) { \
+    fprintf(stderr, "BIND MOUNT FAILED from %s to %s\n", from, to); \
+    goto _setupImageSsh_unclean; \
+}
 
-    if (flags & VOLMAP_FLAG_SLAVE) {
-        privateRemountFlags = MS_SLAVE;
-    } else if (flags & VOLMAP_FLAG_PRIVATE) {
-        privateRemountFlags = MS_PRIVATE;
+    if (parse_MountList(&mountCache) != 0) {
+        fprintf(stderr, "FAILED to parse existing mounts\n");
+        goto _setupImageSsh_unclean;
     }
 
-    if (from == NULL || to == NULL || mountCache == NULL) {
-        fprintf(stderr, "INVALID input to bind-mount. Fail\n");
-        return 1;
+    snprintf(udiImage, PATH_MAX, "%s/opt/udiImage", udiConfig->udiMountPoint);
+    udiImage[PATH_MAX-1] = 0;
+    if (stat(udiImage, &statData) != 0) {
+        fprintf(stderr, "FAILED to find udiImage path, cannot setup sshd\n");
+        goto _setupImageSsh_unclean;
     }
-
-    to_real = realpath(to, NULL);
-    if (to_real == NULL) {
-        fprintf(stderr, "Couldn't lookup path %s, fail.\n", to);
-        return 1;
+    if (chdir(udiImage) != 0) {
+        fprintf(stderr, "FAILED to chdir to %s\n", udiImage);
+        goto _setupImageSsh_unclean;
     }
 
-    /* not interested in mounting over existing mounts, prevents
-       things from getting into a weird state later. */
-    ptr = find_MountList(mountCache, to_real);
-    if (ptr != NULL) {
-        if (overwriteMounts) {
-            int retry = 0;
-            for (retry = 0; retry < BINDMOUNT_OVERWRITE_UNMOUNT_RETRY; retry++) {
-                if (unmountTree(mountCache, to_real) != 0) {
-                    fprintf(stderr, "%s was already mounted, failed to unmount existing, fail.\n", to_real);
-                    ret = 1;
-                    goto _bindMount_exit;
-                }
-                if (validateUnmounted(to_real, 0) == 0) {
-                    break;
-                }
-                usleep(300000); /* sleep for 0.3s */
-            }
-        } else {
-            fprintf(stderr, "%s was already mounted, not allowed to unmount existing, fail.\n", to_real);
-            ret = 1;
-            goto _bindMount_exit;
-        }
+    /* generate ssh host keys and install the user's key */
+    if (setupImageSshKeys(sshPubKey, uid, gid, udiConfig) != 0) {
+        goto _setupImageSsh_unclean;
     }
 
-    if (strcmp(from, "/dev") == 0 || (flags & VOLMAP_FLAG_RECURSIVE)) {
-        mountFlags |= MS_REC;
-        remountFlags |= MS_REC;
-        privateRemountFlags = MS_PRIVATE|MS_REC;
+    /* rewrite sshd_config */
+    snprintf(sshdConfigPath, PATH_MAX, "%s/etc/sshd_config", udiImage);
+    sshdConfigPath[PATH_MAX - 1] = 0;
+    snprintf(sshdConfigPathNew, PATH_MAX, "%s/etc/sshd_config.new", udiImage);
+    sshdConfigPathNew[PATH_MAX - 1] = 0;
+
+    inputFile = fopen(sshdConfigPath, "r");
+    outputFile = fopen(sshdConfigPathNew, "w");
+
+    if (inputFile == NULL || outputFile == NULL) {
+        fprintf(stderr, "Could not open sshd_config for reading or writing\n");
+        goto _setupImageSsh_unclean;
+    }
+
+    while (!feof(inputFile) && !ferror(inputFile)) {
+        size_t nbytes = getline(&lineBuf, &lineBuf_size, inputFile);
+        char *ptr = NULL;
+        if (nbytes == 0) break;
+        ptr = shifter_trim(lineBuf);
+        if (strcmp(ptr, "AllowUsers ToBeReplaced") == 0) {
+            fprintf(outputFile, "AllowUsers %s\n", username);
+        } else {
+            fprintf(outputFile, "%s\n", ptr);
+        }
+    }
+    fclose(inputFile);
+    fclose(outputFile);
+    inputFile = NULL;
+    outputFile = NULL;
+    if (lineBuf != NULL) {
+        free(lineBuf);
+        lineBuf = NULL;
+    }
+    if (stat(sshdConfigPathNew, &statData) != 0) {
+        fprintf(stderr, "FAILED to find new sshd_config file, cannot setup sshd\n");
+        goto _setupImageSsh_unclean;
+    } else {
+        char *moveCmd[] = { _strdup(udiConfig->mvPath),
+            _strdup(sshdConfigPathNew),
+            _strdup(sshdConfigPath),
+            NULL
+        };
+        char **argsPtr = NULL;
+        int ret = forkAndExecv(moveCmd);
+        for (argsPtr = moveCmd; *argsPtr != NULL; argsPtr++) {
+            free(*argsPtr);
+        }
+        if (ret != 0) {
+            fprintf(stderr, "FAILED to replace sshd_config with configured version.\n");
+            goto _setupImageSsh_unclean;
+        }
+    }
+    if (chown(sshdConfigPath, ownerUid, ownerGid) != 0) {
+        fprintf(stderr, "FAILED to chown sshd config path %s\n", sshdConfigPath);
+        perror("   errno: ");
+        goto _setupImageSsh_unclean;
+    }
+    if (chmod(sshdConfigPath, S_IRUSR | S_IROTH) != 0) {
+        fprintf(stderr, "FAILED to set sshd config permissions to 0600\n");
+        perror("   errno: ");
+        goto _setupImageSsh_unclean;
+    }
+
+    {
+        snprintf(from, PATH_MAX, "%s/bin/ssh", udiImage);
+        snprintf(to, PATH_MAX, "%s/usr/bin/ssh", udiConfig->udiMountPoint);
+        from[PATH_MAX-1] = 0;
+        to[PATH_MAX-1] = 0;
+        if (stat(to, &statData) == 0) {
+            _BINDMOUNT(&mountCache, from, to, VOLMAP_FLAG_READONLY, 1);
+        }
+        snprintf(from, PATH_MAX, "%s/bin/ssh", udiImage);
+        snprintf(to, PATH_MAX, "%s/bin/ssh", udiConfig->udiMountPoint);
+        from[PATH_MAX - 1] = 0;
+        to[PATH_MAX - 1] = 0;
+        if (stat(to, &statData) == 0) {
+            _BINDMOUNT(&mountCache, from, to, VOLMAP_FLAG_READONLY, 1);
+        }
+        snprintf(from, PATH_MAX, "%s/etc/ssh_config", udiImage);
+        snprintf(to, PATH_MAX, "%s/etc/ssh/ssh_config", udiConfig->udiMountPoint);
+        if (_shifterCore_copyFile(udiConfig->cpPath, from, to, 0, 0, 0, 0) != 0) {
+            fprintf(stderr, "FAILED to copy ssh_config to %s\n", to);
+            goto _setupImageSsh_unclean;
+        }
+        /* rely on var/empty created earlier in the setup process */
+    }
+#undef _BINDMOUNT
+    free(udiImage);
+    free(sshdConfigPath);
+    free(sshdConfigPathNew);
+    free(from);
+    free(to);
+    return 0;
+_setupImageSsh_unclean:
+    if (inputFile != NULL) {
+        fclose(inputFile);
+        inputFile = NULL;
+    }
+    if (outputFile != NULL) {
+        fclose(outputFile);
+        outputFile = NULL;
+    }
+    free(udiImage);
+    free(sshdConfigPath);
+    free(sshdConfigPathNew);
+    free(from);
+    free(to);
+    return 1;
+}
+
+gid_t *shifter_getgrouplist(const char *user, gid_t group, int *ngroups) {
+    int ret = 0;
+    int idx = 0;
+    gid_t *ret_groups = NULL;
+    int nret_groups = 0;
+
+    if (user == NULL || group == 0 || ngroups == NULL) {
+        goto _getgrlist_err;
+    }
+    if (strcmp(user, "root") == 0) {
+        fprintf(stderr, "FAILED: refuse to lookup groups for root\n");
+        goto _getgrlist_err;
+    }
+
+    ret = getgrouplist(user, group, NULL, &nret_groups);
+    if (ret < 0 && nret_groups > 0) {
+        if (nret_groups > 512) {
+            fprintf(stderr, "FAILED to get groups, seriously 512 groups is enough!\n");
+            goto _getgrlist_err;
+        }
+
+        /* allocate and initialize memory to be populated by getgrouplist */
+        ret_groups = (gid_t *) _malloc(sizeof(gid_t) * (nret_groups + 1));
+        memset(ret_groups, 0, sizeof(gid_t) * (nret_groups + 1));
+
+        ret = getgrouplist(user, group, ret_groups, &nret_groups);
+        if (ret < 0) {
+            fprintf(stderr, "FAILED to get groups correctly\n");
+            goto _getgrlist_err;
+        }
+    }
+
+    /* set default group list if none are found */
+    if (nret_groups <= 0) {
+        if (ret_groups != NULL) {
+            free(ret_groups);
+            ret_groups = NULL;
+        }
+        ret_groups = (gid_t *) _malloc(sizeof(gid_t) * 2);
+        ret_groups[0] = group;
+        ret_groups[1] = 0;
+        nret_groups = 1;
+    }
+    if (ret_groups == NULL) {
+        fprintf(stderr, "FAILED: no auxilliary groups found!\n");
+        goto _getgrlist_err;
+    }
+
+    /* just make sure no zeros snuck in */
+    for (idx = 0; idx < nret_groups; idx++) {
+        if (ret_groups[idx] == 0) {
+            ret_groups[idx] = group;
+        }
+    }
+    *ngroups = nret_groups;
+    return ret_groups;
+
+_getgrlist_err:
+    if (ret_groups != NULL) {
+        free(ret_groups);
+        ret_groups = NULL;
+    }
+    if (ngroups != NULL) {
+        *ngroups = 0;
+    }
+    return NULL;
+}
+
+/**
+  * startSshd
+  * chroots into image and runs the secured sshd
+  */
+int startSshd(const char *user, UdiRootConfig *udiConfig) {
+    char *chrootPath = _malloc(sizeof(char) * PATH_MAX);
+    pid_t pid = 0;
+
+    snprintf(chrootPath, PATH_MAX, "%s", udiConfig->udiMountPoint);
+    chrootPath[PATH_MAX - 1] = 0;
+
+    if (chdir(chrootPath) != 0) {
+        fprintf(stderr, "FAILED to chdir to %s while attempted to start sshd\n", chrootPath);
+        goto _startSshd_unclean;
+    }
+    if (udiConfig->target_uid == 0 || udiConfig->target_gid == 0) {
+        fprintf(stderr, "FAILED to start sshd, will not start as root\n");
+        goto _startSshd_unclean;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "FAILED to fork while attempting to start sshd\n");
+        goto _startSshd_unclean;
+    }
+    if (pid == 0) {
+        /* get grouplist in the external environment */
+        int nGroups = 0;
+        gid_t *gidList = shifter_getgrouplist(user, udiConfig->target_gid, &nGroups);
+        if (gidList == NULL) {
+            fprintf(stderr, "FAILED to correctly get grouplist for sshd\n");
+            exit(1);
+        }
+
+        if (chdir(chrootPath) != 0) {
+            fprintf(stderr, "FAILED to chdir to %s while attempting to start sshd\n", chrootPath);
+            exit(1);
+        }
+        if (chroot(chrootPath) != 0) {
+            fprintf(stderr, "FAILED to chroot to %s while attempting to start sshd\n", chrootPath);
+            exit(1);
+        }
+        if (chdir("/") != 0) {
+            fprintf(stderr, "FAILED to chdir following chroot\n");
+            exit(1);
+        }
+        if (gidList == NULL) {
+            fprintf(stderr, "FAILED to get groupllist for sshd, exiting!\n");
+            exit(1);
+        }
+        if (shifter_set_capability_boundingset_null() != 0) {
+            fprintf(stderr, "FAILED to restrict future capabilities\n");
+            exit(1);
+        }
+        if (setgroups(nGroups, gidList) != 0) {
+            fprintf(stderr, "FAILED to setgroups(): %s\n", strerror(errno));
+            exit(1);
+        }
+        if (setresgid(udiConfig->target_gid, udiConfig->target_gid,
+                      udiConfig->target_gid) != 0) {
+            fprintf(stderr, "FAILED to setresgid(): %s\n", strerror(errno));
+            exit(1);
+        }
+        if (setresuid(udiConfig->target_uid, udiConfig->target_uid,
+                      udiConfig->target_uid) != 0) {
+            fprintf(stderr, "FAILED to setresuid(): %s\n", strerror(errno));
+            exit(1);
+        }
+#if HAVE_DECL_PR_SET_NO_NEW_PRIVS == 1
+        /* ensure this process and its heirs cannot gain privilege */
+        /* see https://www.kernel.org/doc/Documentation/prctl/no_new_privs.txt */
+        if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0) {
+            fprintf(stderr, "Failed to fully drop privileges: %s",
+                    strerror(errno));
+            exit(1);
+        }
+#endif
+        char **sshdArgs = (char **) _malloc(sizeof(char *) * 2);
+        sshdArgs[0] = _strdup("/opt/udiImage/sbin/sshd");
+        sshdArgs[1] = NULL;
+        execv(sshdArgs[0], sshdArgs);
+        fprintf(stderr, "FAILED to exec sshd!\n");
+
+        /* if we fell through to here, there is a problem */
+        exit(1);
+    } else {
+        int status = 0;
+        do {
+            pid_t ret = waitpid(pid, &status, 0);
+            if (ret != pid) {
+                fprintf(stderr, "waited for wrong pid: %d != %d\n", pid, ret);
+                goto _startSshd_unclean;
+            }
+        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+        if (WIFEXITED(status)) {
+            status = WEXITSTATUS(status);
+        } else {
+            status = 1;
+        }
+        free(chrootPath);
+        return status;
+    }
+    free(chrootPath);
+    return 0;
+_startSshd_unclean:
+    free(chrootPath);
+    return 1;
+}
+
+int _forkAndExecv(char *const *args, int silent) {
+    pid_t pid = 0;
+    uint64_t traceStart = SHIFTER_TRACE_START();
+
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "FAILED to fork! Exiting.\n");
+        return 1;
+    }
+    if (pid > 0) {
+        /* this is the parent */
+        int status = 0;
+        do {
+            pid_t ret = waitpid(pid, &status, 0);
+            if (ret != pid) {
+                fprintf(stderr, "This might be impossible: forked by couldn't wait, FAIL!\n");
+                return 1;
+            }
+        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+        if (WIFEXITED(status)) {
+            status = WEXITSTATUS(status);
+        } else {
+            status = 1;
+        }
+        shifter_trace_event("exec", args[0], args[1], traceStart);
+        return status;
+    }
+    /* this is the child */
+    if (silent) {
+        int devNull = open("/dev/null", O_WRONLY);
+        if (devNull < 0) {
+            fprintf(stderr, "FAILED to open /dev/null: %s", strerror(errno));
+            exit(1);
+        }
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        close(devNull);
+    }
+    execv(args[0], args);
+    fprintf(stderr, "FAILED to execvp! Exiting.\n");
+    exit(127);
+}
+
+/**
+ * shifter_getRetryCount
+ * number of mount/unmount retry delays taken by this process so far
+ */
+size_t shifter_getRetryCount(void) {
+    return shifterCore_retryCount;
+}
+
+int forkAndExecv(char *const *args) {
+    return _forkAndExecv(args, 0);
+}
+
+int forkAndExecvSilent(char *const *args) {
+    return _forkAndExecv(args, 1);
+}
+
+int _shifterCore_bindMount(UdiRootConfig *udiConfig, MountList *mountCache,
+        const char *from, const char *to, size_t flags, int overwriteMounts)
+{
+    int ret = 0;
+    char **ptr = NULL;
+    char *to_real = NULL;
+    unsigned long mountFlags = MS_BIND;
+    unsigned long remountFlags = MS_REMOUNT|MS_BIND|MS_NOSUID;
+    unsigned long privateRemountFlags = 0;
+    uint64_t traceStart = SHIFTER_TRACE_START();
+
+    if (udiConfig == NULL) {
+        fprintf(stderr, "FAILED to provide udiConfig!\n");
+        return 1;
+    }
+
+    privateRemountFlags =
+        udiConfig->mountPropagationStyle == VOLMAP_FLAG_SLAVE ?
+        MS_SLAVE : MS_PRIVATE;
+
+    if (flags & VOLMAP_FLAG_SLAVE) {
+        privateRemountFlags = MS_SLAVE;
+    } else if (flags & VOLMAP_FLAG_PRIVATE) {
+        privateRemountFlags = MS_PRIVATE;
+    }
+
+    if (from == NULL || to == NULL || mountCache == NULL) {
+        fprintf(stderr, "INVALID input to bind-mount. Fail\n");
+        return 1;
+    }
+
+    to_real = realpath(to, NULL);
+    if (to_real == NULL) {
+        fprintf(stderr, "Couldn't lookup path %s, fail.\n", to);
+        return 1;
+    }
+
+    /* not interested in mounting over existing mounts, prevents
+       things from getting into a weird state later. */
+    ptr = find_MountList(mountCache, to_real);
+    if (ptr != NULL) {
+        if (overwriteMounts) {
+            int retry = 0;
+            for (retry = 0; retry < BINDMOUNT_OVERWRITE_UNMOUNT_RETRY; retry++) {
+                if (unmountTree(mountCache, to_real) != 0) {
+                    fprintf(stderr, "%s was already mounted, failed to unmount existing, fail.\n", to_real);
+                    ret = 1;
+                    goto _bindMount_exit;
+                }
+                if (validateUnmounted(to_real, 0) == 0) {
+                    break;
+                }
+                _shifterCore_retrySleep(300000, to_real); /* sleep for 0.3s */
+            }
+        } else {
+            fprintf(stderr, "%s was already mounted, not allowed to unmount existing, fail.\n", to_real);
+            ret = 1;
+            goto _bindMount_exit;
+        }
+    }
+
+    if (strcmp(from, "/dev") == 0 || (flags & VOLMAP_FLAG_RECURSIVE)) {
+        mountFlags |= MS_REC;
+        remountFlags |= MS_REC;
+        privateRemountFlags = MS_PRIVATE|MS_REC;
     }
 
     /* perform the initial bind-mount */
-    ret = mount(from, to_real, "bind", mountFlags, NULL);
+    ret = _shifterCore_mount(from, to_real, "bind", mountFlags, NULL);
+    if (ret != 0) {
+        goto _bindMount_unclean;
+    }
+    insert_MountList(mountCache, to_real);
+
+    /* if the source is exactly /dev or starts with /dev/ then
+       ALLOW device entires, otherwise remount with noDev */
+    if (strcmp(from, "/dev") != 0 && strncmp(from, "/dev/", 5) != 0) {
+        remountFlags |= MS_NODEV;
+    }
+
+    if (flags & VOLMAP_FLAG_READONLY) {
+        remountFlags |= MS_RDONLY;
+    }
+
+    /* remount the bind-mount to get the needed mount flags */
+    ret = _shifterCore_mount(from, to_real, "bind", remountFlags, NULL);
     if (ret != 0) {
         goto _bindMount_unclean;
     }
-    insert_MountList(mountCache, to_real);
+    if (_shifterCore_mount(NULL, to_real, NULL, privateRemountFlags, NULL) != 0) {
+        perror("Failed to remount non-shared: ");
+        goto _bindMount_unclean;
+    }
+_bindMount_exit:
+    shifter_trace_event("mount", "bindMount", to, traceStart);
+    if (to_real != NULL) {
+        free(to_real);
+        to_real = NULL;
+    }
+    return ret;
+_bindMount_unclean:
+    shifter_trace_event("mount", "bindMount_failed", to, traceStart);
+    if (to_real != NULL) {
+        ret = _shifterCore_umount(to_real, UMOUNT_NOFOLLOW|MNT_DETACH);
+        remove_MountList(mountCache, to_real);
+        free(to_real);
+        to_real = NULL;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: unclean exit from bind-mount routine. %s may still be mounted.\n", to);
+    }
+    return 1;
+}
+
+
+/**
+ * isSharedMount
+ * Determine if the string " shared:" exists in /proc/<pid>/mountinfo for the
+ * specified mountpoint.
+ *
+ * \param mountPoint the mountpoint to consider
+ *
+ * Returns:
+ * 0: not shared
+ * 1: shared
+ * -1: error
+ */
+int isSharedMount(const char *mountPoint) {
+    char *filename = _malloc(sizeof(char) * PATH_MAX);
+    char *lineBuffer = NULL;
+    size_t lineBuffer_size = 0;
+    FILE *fp = NULL;
+    pid_t pid = getpid();
+    int rc = 0;
+
+    snprintf(filename, PATH_MAX, "/proc/%d/mountinfo", pid);
+    fp = fopen(filename, "r");
+
+    if (fp == NULL) {
+        goto _err_valid_args;
+    }
+    while (!feof(fp) && !ferror(fp)) {
+        char *ptr = NULL;
+        char *svptr = NULL;
+        size_t n = getline(&lineBuffer, &lineBuffer_size, fp);
+        if (n == 0 || feof(fp) || ferror(fp) || lineBuffer == NULL) {
+            break;
+        }
+        ptr = strtok_r(lineBuffer, " ", &svptr);
+        if (ptr == NULL) goto _err_valid_args;
+        ptr = strtok_r(NULL, " ", &svptr);
+        if (ptr == NULL) goto _err_valid_args;
+        ptr = strtok_r(NULL, " ", &svptr);
+        if (ptr == NULL) goto _err_valid_args;
+        ptr = strtok_r(NULL, " ", &svptr);
+        if (ptr == NULL) goto _err_valid_args;
+        ptr = strtok_r(NULL, " ", &svptr);
+        if (ptr == NULL) goto _err_valid_args;
+
+        if (strcmp(ptr, mountPoint) == 0) {
+            ptr = strtok_r(NULL, "\0", &svptr); /* get rest of line */
+            if (strstr(ptr, " shared:") != NULL) {
+                rc = 1;
+            }
+            break;
+        }
+    }
+    fclose(fp);
+    fp = NULL;
+    if (lineBuffer != NULL) {
+        free(lineBuffer);
+    }
+    free(filename);
+    return rc;
+_err_valid_args:
+    if (lineBuffer != NULL) {
+        free(lineBuffer);
+        lineBuffer = NULL;
+    }
+    if (fp != NULL) {
+        fclose(fp);
+        fp = NULL;
+    }
+    free(filename);
+    return -1;
+}
+
+/** shifter_getpwuid
+ *  Lookup user information based on information in shifter passwd cache.
+ *  This is useful to avoid making remote getpwuid() calls on Cray systems
+ *  or other systems where access to LDAP may be slow, difficult, or impossible
+ *  on compute nodes.
+ *
+ *  If UdiRootConfig parameter allowLibcPwdCalls is set to 1, this function
+ *  will simply call the regular getpwuid
+ *
+ */
+struct passwd *shifter_getpwuid(uid_t tgtuid, UdiRootConfig *config) {
+    FILE *input = NULL;
+    char *buffer = _malloc(sizeof(char) * PATH_MAX);
+    struct passwd *pw = NULL;
+    int found = 0;
+
+    if (config == NULL) {
+        free(buffer);
+        return NULL;
+    }
 
-    /* if the source is exactly /dev or starts with /dev/ then
-       ALLOW device entires, otherwise remount with noDev */
-    if (strcmp(from, "/dev") != 0 && strncmp(from, "/dev/", 5) != 0) {
-        remountFlags |= MS_NODEV;
+    if (config->allowLibcPwdCalls == 1) {
+        free(buffer);
+        return getpwuid(tgtuid);
+    }
+
+    snprintf(buffer, PATH_MAX, "%s/passwd", config->etcPath);
+    input = fopen(buffer, "r");
+
+    if (input == NULL) {
+        fprintf(stderr, "FAILED to find shifter passwd file at %s", buffer);
+        goto _shifter_getpwuid_unclean;
+    }
+    while ((pw = fgetpwent(input)) != NULL) {
+        if (pw->pw_uid == tgtuid) {
+            found = 1;
+            break;
+        }
+    }
+    fclose(input);
+    input = NULL;
+
+    free(buffer);
+    if (found) return pw;
+    return NULL;
+
+_shifter_getpwuid_unclean:
+    free(buffer);
+    return NULL;
+}
+
+struct passwd *shifter_getpwnam(const char *tgtnam, UdiRootConfig *config) {
+    FILE *input = NULL;
+    char *buffer = _malloc(sizeof(char) * PATH_MAX);
+    struct passwd *pw = NULL;
+    int found = 0;
+
+    if (config == NULL) {
+        free(buffer);
+        return NULL;
+    }
+    if (config->allowLibcPwdCalls == 1) {
+        free(buffer);
+        return getpwnam(tgtnam);
+    }
+
+    snprintf(buffer, PATH_MAX, "%s/passwd", config->etcPath);
+    input = fopen(buffer, "r");
+
+    if (input == NULL) {
+        fprintf(stderr, "FAILED to find shifter passwd file at %s", buffer);
+        goto _shifter_getpwnam_unclean;
+    }
+    while ((pw = fgetpwent(input)) != NULL) {
+        if (strcmp(pw->pw_name, tgtnam) == 0) {
+            found = 1;
+            break;
+        }
+    }
+    fclose(input);
+    input = NULL;
+
+    free(buffer);
+    if (found) return pw;
+    return NULL;
+
+_shifter_getpwnam_unclean:
+    free(buffer);
+    return NULL;
+}
+
+/** filterEtcGroup
+ *  many implementations of initgroups() do not deal with huge /etc/group
+ *  files due to a variety of limitations (like per-line limits).  this
+ *  function reads a given etcgroup file and filters the content to only
+ *  include the specified user.  Additionally some services are unwilling
+ *  to allow more than, for example, 31 groups from a group file, thus an
+ *  upperbound to explicitly include users in is included.  Stub entries
+ *  for all remaining groups will be added to provide useful group metadata
+ *
+ *  \param group_dest_fname filename of filtered group file
+ *  \param group_source_fname filename of to-be-filtered group file
+ *  \param username user to identify
+ *  \param maxGroups maximum number of groups to write out for user, 0 for unlimited
+ */
+int filterEtcGroup(const char *group_dest_fname, const char *group_source_fname, const char *username, size_t maxGroups) {
+    FILE *input = NULL;
+    FILE *output = NULL;
+    char *linePtr = NULL;
+    size_t linePtr_size = 0;
+    size_t foundGroups = 0;
+
+    if (group_dest_fname == NULL || strlen(group_dest_fname) == 0
+            || group_source_fname == NULL || strlen(group_source_fname) == 0
+            || username == NULL || strlen(username) == 0) {
+        fprintf(stderr, "Invalid arguments, cannot filter group file.\n");
+        goto _filterEtcGroup_unclean;
+    }
+
+    input = fopen(group_source_fname, "r");
+    output = fopen(group_dest_fname, "w");
+
+    if (input == NULL || output == NULL) {
+        fprintf(stderr, "Failed to open files, cannot filter group file.\n");
+        goto _filterEtcGroup_unclean;
+    }
+
+    while (!feof(input) && !ferror(input)) {
+        size_t nread = getline(&linePtr, &linePtr_size, input);
+        char *ptr = NULL;
+        char *svptr = NULL;
+        char *group_name = NULL;
+
+        char *token = NULL;
+        gid_t gid = 0;
+        size_t counter = 0;
+        int foundUsername = 0;
+        if (nread == 0 || linePtr == NULL) break;
+        ptr = shifter_trim(linePtr);
+        for (token = strtok_r(ptr, ":,", &svptr);
+             token != NULL;
+             token = strtok_r(NULL, ":,", &svptr)) {
+
+            switch (counter) {
+                case 0: group_name = _strdup(token);
+                        if (strcmp(group_name, username) == 0) {
+                            foundUsername = 1;
+                        }
+                        break;
+                case 1: break;
+                case 2: gid = strtoul(token, NULL, 10);
+                        break;
+                default: if (strcmp(username, token) == 0) {
+                            foundUsername = 1;
+                        }
+                        break;
+            }
+            counter++;
+            if (foundUsername && gid != 0) break;
+        }
+        if (group_name != NULL && gid != 0) {
+            if (foundUsername == 1 && foundGroups < maxGroups) {
+                fprintf(output, "%s:x:%d:%s\n", group_name, gid, username);
+                foundGroups++;
+            } else {
+                fprintf(output, "%s:x:%d:\n", group_name, gid);
+            }
+        }
+        if (group_name != NULL) {
+            free(group_name);
+            group_name = NULL;
+        }
+    }
+    fclose(input);
+    fclose(output);
+    input = NULL;
+    output = NULL;
+
+    if (linePtr != NULL) {
+        free(linePtr);
+    }
+    return 0;
+_filterEtcGroup_unclean:
+    if (input != NULL) {
+        fclose(input);
+        input = NULL;
+    }
+    if (output != NULL) {
+        fclose(output);
+        output = NULL;
+    }
+    return 1;
+}
+
+pid_t findSshd(void) {
+    return shifter_find_process_by_cmdline("/opt/udiImage/sbin/sshd");
+}
+
+pid_t shifter_find_process_by_cmdline(const char *command) {
+    DIR *proc = NULL;
+    struct dirent *dirEntry = NULL;
+    char buffer[1024];
+    pid_t found = 0;
+
+    if (command == NULL || strlen(command) == 0) {
+        return -1;
+    }
+
+    proc = opendir("/proc");
+
+    if (proc == NULL) {
+        return -1;
+    }
+    while ((dirEntry = readdir(proc)) != NULL) {
+        size_t nread = 0;
+        FILE *cmdlineFile = NULL;
+        char *filename = NULL;
+        pid_t pid = (pid_t) strtol(dirEntry->d_name, NULL, 10);
+        if (pid == 0) {
+            continue;
+        }
+        filename = alloc_strgenf("/proc/%d/cmdline", pid);
+        if (filename != NULL) {
+            cmdlineFile = fopen(filename, "r");
+            free(filename);
+            filename = NULL;
+        }
+        if (cmdlineFile == NULL) {
+            continue;
+        } else if (feof(cmdlineFile) || ferror(cmdlineFile)) {
+            fclose(cmdlineFile);
+            cmdlineFile = NULL;
+            continue;
+        }
+        nread = fread(buffer, sizeof(char), 1024, cmdlineFile);
+        fclose(cmdlineFile);
+        cmdlineFile = NULL;
+
+        if (nread > 0) {
+            buffer[nread-1] = 0;
+            if (strcmp(buffer, command) == 0) {
+                found = pid;
+                break;
+            }
+        }
+    }
+    closedir(proc);
+    proc = NULL;
+    return found;
+}
+
+int killSshd(void) {
+    pid_t sshdPid = findSshd();
+    if (sshdPid > 2) {
+        kill(sshdPid, SIGTERM);
+        return 0;
     }
+    return 1;
+}
 
-    if (flags & VOLMAP_FLAG_READONLY) {
-        remountFlags |= MS_RDONLY;
-    }
+/** _killInstanceSshd
+ *  Other jobs' UDI instances may be running an sshd too, stop every sshd
+ *  that was started in udiRoot and leave the others alone.
+ */
+static int _killInstanceSshd(const char *udiRoot) {
+    const char *command = "/opt/udiImage/sbin/sshd";
+    DIR *proc = NULL;
+    struct dirent *dirEntry = NULL;
+    char buffer[1024];
+    char link[PATH_MAX];
+    int rc = 1;
 
-    /* remount the bind-mount to get the needed mount flags */
-    ret = mount(from, to_real, "bind", remountFlags, NULL);
-    if (ret != 0) {
-        goto _bindMount_unclean;
-    }
-    if (mount(NULL, to_real, NULL, privateRemountFlags, NULL) != 0) {
-        perror("Failed to remount non-shared: ");
-        goto _bindMount_unclean;
-    }
-_bindMount_exit:
-    if (to_real != NULL) {
-        free(to_real);
-        to_real = NULL;
-    }
-    return ret;
-_bindMount_unclean:
-    if (to_real != NULL) {
-        ret = umount2(to_real, UMOUNT_NOFOLLOW|MNT_DETACH);
-        remove_MountList(mountCache, to_real);
-        free(to_real);
-        to_real = NULL;
+    proc = opendir("/proc");
+    if (proc == NULL) {
+        return 1;
     }
-    if (ret != 0) {
-        fprintf(stderr, "ERROR: unclean exit from bind-mount routine. %s may still be mounted.\n", to);
+    while ((dirEntry = readdir(proc)) != NULL) {
+        FILE *cmdlineFile = NULL;
+        char *filename = NULL;
+        size_t nread = 0;
+        ssize_t len = 0;
+        pid_t pid = (pid_t) strtol(dirEntry->d_name, NULL, 10);
+        if (pid <= 2) {
+            continue;
+        }
+        filename = alloc_strgenf("/proc/%d/cmdline", (int) pid);
+        cmdlineFile = fopen(filename, "r");
+        free(filename);
+        if (cmdlineFile == NULL) {
+            continue;
+        }
+        nread = fread(buffer, sizeof(char), sizeof(buffer), cmdlineFile);
+        fclose(cmdlineFile);
+        if (nread == 0) {
+            continue;
+        }
+        buffer[nread - 1] = 0;
+        if (strcmp(buffer, command) != 0) {
+            continue;
+        }
+
+        filename = alloc_strgenf("/proc/%d/root", (int) pid);
+        len = readlink(filename, link, PATH_MAX - 1);
+        free(filename);
+        if (len <= 0) {
+            continue;
+        }
+        link[len] = 0;
+        if (strcmp(link, udiRoot) == 0) {
+            kill(pid, SIGTERM);
+            rc = 0;
+        }
     }
-    return 1;
+    closedir(proc);
+    return rc;
 }
 
-
 /**
- * isSharedMount
- * Determine if the string " shared:" exists in /proc/<pid>/mountinfo for the
- * specified mountpoint.
- *
- * \param mountPoint the mountpoint to consider
+ * destructUDI
+ * Unmounts all aspects of the UDI, possibly killing the sshd running first.
+ * This is called in the unsetupRoot program when dealing with the global
+ * linux namespace.  It should also be called when trying to get rid of an
+ * existing UDI before setting up a new one in a private linux namespace.
  *
- * Returns:
- * 0: not shared
- * 1: shared
- * -1: error
+ * \param udiConfig configuration
+ * \param killSsh flag to denote whether or not the udiRoot sshd should be killed
+ *     (1 for yes, 0 for no)
  */
-int isSharedMount(const char *mountPoint) {
-    char *filename = _malloc(sizeof(char) * PATH_MAX);
-    char *lineBuffer = NULL;
-    size_t lineBuffer_size = 0;
-    FILE *fp = NULL;
-    pid_t pid = getpid();
-    int rc = 0;
+int destructUDI(UdiRootConfig *udiConfig, int killSsh) {
+    char *udiRoot = _malloc(sizeof(char) * PATH_MAX);
+    char *loopMount = _malloc(sizeof(char) * PATH_MAX);
+    char *siteRoot = NULL;
+    char **keep = NULL;
+    char **ptr = NULL;
+    MountList mounts;
+    size_t idx = 0;
+    int rc = 1; /* assume failure */
 
-    snprintf(filename, PATH_MAX, "/proc/%d/mountinfo", pid);
-    fp = fopen(filename, "r");
+    memset(&mounts, 0, sizeof(MountList));
+    if (parse_MountList(&mounts) != 0) {
+        /*error*/
+    }
 
-    if (fp == NULL) {
-        goto _err_valid_args;
+    snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
+    udiRoot[PATH_MAX-1] = 0;
+    snprintf(loopMount, PATH_MAX, "%s", udiConfig->loopMountPoint);
+    loopMount[PATH_MAX-1] = 0;
+    /* left mounted only if composing the overlay root failed */
+    siteRoot = alloc_strgenf("%s.site", udiRoot);
+    if (udiConfig->perJobUdi && udiConfig->jobIdentifier == NULL) {
+        /* the per-job instances below the node-wide UDI are not ours */
+        keep = _listUdiInstanceMounts(udiConfig);
     }
-    while (!feof(fp) && !ferror(fp)) {
-        char *ptr = NULL;
-        char *svptr = NULL;
-        size_t n = getline(&lineBuffer, &lineBuffer_size, fp);
-        if (n == 0 || feof(fp) || ferror(fp) || lineBuffer == NULL) {
-            break;
+    for (idx = 0; idx < 10; idx++) {
+
+        if (idx > 0) {
+            _shifterCore_retrySleep(300000, udiRoot);
+        }
+        if (killSsh == 1 && udiConfig->jobIdentifier == NULL &&
+                !udiConfig->perJobUdi)
+        {
+            killSshd();
+        } else if (killSsh == 1) {
+            _killInstanceSshd(udiRoot);
         }
-        ptr = strtok_r(lineBuffer, " ", &svptr);
-        if (ptr == NULL) goto _err_valid_args;
-        ptr = strtok_r(NULL, " ", &svptr);
-        if (ptr == NULL) goto _err_valid_args;
-        ptr = strtok_r(NULL, " ", &svptr);
-        if (ptr == NULL) goto _err_valid_args;
-        ptr = strtok_r(NULL, " ", &svptr);
-        if (ptr == NULL) goto _err_valid_args;
-        ptr = strtok_r(NULL, " ", &svptr);
-        if (ptr == NULL) goto _err_valid_args;
 
-        if (strcmp(ptr, mountPoint) == 0) {
-            ptr = strtok_r(NULL, "\0", &svptr); /* get rest of line */
-            if (strstr(ptr, " shared:") != NULL) {
-                rc = 1;
-            }
-            break;
+        if (_unmountTreeExcept(&mounts, siteRoot, keep) != 0) {
+            continue;
         }
+        if (_validateUnmountedExcept(siteRoot, 1, keep) != 0) {
+            continue;
+        }
+        if (_unmountTreeExcept(&mounts, udiRoot, keep) != 0) {
+            continue;
+        }
+        if (_validateUnmountedExcept(udiRoot, 1, keep) != 0) {
+            continue;
+        }
+        if (_unmountTreeExcept(&mounts, loopMount, keep) != 0) {
+            continue;
+        }
+        if (validateUnmounted(loopMount, 0) != 0) {
+            continue;
+        }
+        rc = 0; /* mark success */
+        break;
     }
-    fclose(fp);
-    fp = NULL;
-    if (lineBuffer != NULL) {
-        free(lineBuffer);
-    }
-    free(filename);
-    return rc;
-_err_valid_args:
-    if (lineBuffer != NULL) {
-        free(lineBuffer);
-        lineBuffer = NULL;
+    if (rc == 0) {
+        /* nothing left to keep warm */
+        char *marker = alloc_strgenf("%s.warm", udiRoot);
+        unlink(marker);
+        free(marker);
     }
-    if (fp != NULL) {
-        fclose(fp);
-        fp = NULL;
+    shifter_trace_counter("destructUDI_attempts", (long) (idx < 10 ? idx + 1 : idx));
+    for (ptr = keep; ptr && *ptr; ptr++) {
+        free(*ptr);
     }
-    free(filename);
-    return -1;
+    free(keep);
+    free_MountList(&mounts, 0);
+    free(udiRoot);
+    free(loopMount);
+    free(siteRoot);
+    return rc;
 }
 
-/** shifter_getpwuid
- *  Lookup user information based on information in shifter passwd cache.
- *  This is useful to avoid making remote getpwuid() calls on Cray systems
- *  or other systems where access to LDAP may be slow, difficult, or impossible
- *  on compute nodes.
+/**
+ * selectUdiInstance
+ * With perJobUdi enabled, point the configuration at the UDI instance of
+ * jobIdentifier, <udiMountPoint>/<jobIdentifier>, with its own loop mount
+ * point <loopMountPoint>/<jobIdentifier>, so that several jobs sharing a
+ * node each get their own UDI in the global namespace.  Without perJobUdi
+ * or a job identifier the node-wide UDI is used.
  *
- *  If UdiRootConfig parameter allowLibcPwdCalls is set to 1, this function
- *  will simply call the regular getpwuid
+ * \param udiConfig configuration, udiMountPoint, loopMountPoint and
+ *     jobIdentifier are updated
+ * \param jobIdentifier job the instance belongs to
+ * \param create 1 to create the instance mount points (setupRoot), 0 to
+ *     only select an existing instance and otherwise keep the node-wide UDI
+ *
+ * Created instances are recorded in <udiMountPoint>.jobs so that tearing
+ * down the node-wide UDI leaves them alone.
  *
+ * Returns 0 on success, 1 if the job identifier is not usable in a path or
+ * the instance could not be created, 2 if create is 0 and the job has no
+ * instance (nothing was set up for it, the node-wide UDI stays selected)
  */
-struct passwd *shifter_getpwuid(uid_t tgtuid, UdiRootConfig *config) {
-    FILE *input = NULL;
-    char *buffer = _malloc(sizeof(char) * PATH_MAX);
-    struct passwd *pw = NULL;
-    int found = 0;
+int selectUdiInstance(UdiRootConfig *udiConfig, const char *jobIdentifier,
+        int create)
+{
+    struct stat statData;
+    char *udiRoot = NULL;
+    char *loopMount = NULL;
+    char *registry = NULL;
+    const char *ptr = NULL;
+    int fd = -1;
 
-    if (config == NULL) {
-        free(buffer);
-        return NULL;
+    if (udiConfig == NULL) {
+        return 1;
     }
-
-    if (config->allowLibcPwdCalls == 1) {
-        free(buffer);
-        return getpwuid(tgtuid);
+    if (!udiConfig->perJobUdi || jobIdentifier == NULL ||
+            udiConfig->jobIdentifier != NULL)
+    {
+        return 0;
     }
-
-    snprintf(buffer, PATH_MAX, "%s/passwd", config->etcPath);
-    input = fopen(buffer, "r");
-
-    if (input == NULL) {
-        fprintf(stderr, "FAILED to find shifter passwd file at %s", buffer);
-        goto _shifter_getpwuid_unclean;
+    if (jobIdentifier[0] == 0 || jobIdentifier[0] == '.' ||
+            strlen(jobIdentifier) > 64)
+    {
+        fprintf(stderr, "FAILED invalid job identifier for UDI instance\n");
+        return 1;
     }
-    while ((pw = fgetpwent(input)) != NULL) {
-        if (pw->pw_uid == tgtuid) {
-            found = 1;
-            break;
+    for (ptr = jobIdentifier; *ptr != 0; ptr++) {
+        if (!isalnum((unsigned char) *ptr) && *ptr != '.' && *ptr != '_' && *ptr != '-') {
+            fprintf(stderr, "FAILED invalid job identifier for UDI instance\n");
+            return 1;
         }
     }
-    fclose(input);
-    input = NULL;
 
-    free(buffer);
-    if (found) return pw;
-    return NULL;
+    udiRoot = alloc_strgenf("%s/%s", udiConfig->udiMountPoint, jobIdentifier);
+    loopMount = alloc_strgenf("%s/%s", udiConfig->loopMountPoint, jobIdentifier);
+    if (create) {
+        registry = alloc_strgenf("%s.jobs", udiConfig->udiMountPoint);
+        if (mkdir(registry, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "FAILED to create %s: %s\n", registry,
+                    strerror(errno));
+            goto _selectUdiInstance_error;
+        }
+        free(registry);
+        registry = alloc_strgenf("%s.jobs/%s", udiConfig->udiMountPoint,
+                jobIdentifier);
+        fd = open(registry, O_WRONLY|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "FAILED to record UDI instance %s: %s\n",
+                    registry, strerror(errno));
+            goto _selectUdiInstance_error;
+        }
+        close(fd);
+        if (mkdir(udiRoot, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "FAILED to create UDI instance %s: %s\n", udiRoot,
+                    strerror(errno));
+            goto _selectUdiInstance_error;
+        }
+        if (mkdir(loopMount, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "FAILED to create UDI instance %s: %s\n",
+                    loopMount, strerror(errno));
+            goto _selectUdiInstance_error;
+        }
+    } else if (lstat(udiRoot, &statData) != 0 || !S_ISDIR(statData.st_mode)) {
+        /* no instance was set up for this job */
+        free(udiRoot);
+        free(loopMount);
+        return 2;
+    }
 
-_shifter_getpwuid_unclean:
-    free(buffer);
-    return NULL;
+    free(registry);
+    free(udiConfig->udiMountPoint);
+    free(udiConfig->loopMountPoint);
+    udiConfig->udiMountPoint = udiRoot;
+    udiConfig->loopMountPoint = loopMount;
+    udiConfig->jobIdentifier = _strdup(jobIdentifier);
+    return 0;
+
+_selectUdiInstance_error:
+    free(udiRoot);
+    free(loopMount);
+    free(registry);
+    return 1;
 }
 
-struct passwd *shifter_getpwnam(const char *tgtnam, UdiRootConfig *config) {
-    FILE *input = NULL;
-    char *buffer = _malloc(sizeof(char) * PATH_MAX);
-    struct passwd *pw = NULL;
-    int found = 0;
+/** _listUdiInstanceMounts
+ *  Mount points of the per-job UDI instances recorded in
+ *  <udiMountPoint>.jobs of the node-wide configuration: each instance root,
+ *  its site root and its loop mount point.
+ *
+ *  Returns a NULL-terminated list (NULL if there are none) to be freed by
+ *  the caller
+ */
+static char **_listUdiInstanceMounts(UdiRootConfig *udiConfig) {
+    char *registry = alloc_strgenf("%s.jobs", udiConfig->udiMountPoint);
+    char **ret = NULL;
+    size_t count = 0;
+    DIR *dir = opendir(registry);
+    struct dirent *entry = NULL;
 
-    if (config == NULL) {
-        free(buffer);
+    free(registry);
+    if (dir == NULL) {
         return NULL;
     }
-    if (config->allowLibcPwdCalls == 1) {
-        free(buffer);
-        return getpwnam(tgtnam);
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        ret = (char **) _realloc(ret, sizeof(char *) * (count + 4));
+        ret[count++] = alloc_strgenf("%s/%s", udiConfig->udiMountPoint,
+                entry->d_name);
+        ret[count++] = alloc_strgenf("%s/%s.site", udiConfig->udiMountPoint,
+                entry->d_name);
+        ret[count++] = alloc_strgenf("%s/%s", udiConfig->loopMountPoint,
+                entry->d_name);
+        ret[count] = NULL;
     }
+    closedir(dir);
+    return ret;
+}
 
-    snprintf(buffer, PATH_MAX, "%s/passwd", config->etcPath);
-    input = fopen(buffer, "r");
-
-    if (input == NULL) {
-        fprintf(stderr, "FAILED to find shifter passwd file at %s", buffer);
-        goto _shifter_getpwnam_unclean;
+/**
+ * removeUdiInstance
+ * Remove the mount points and the record of the selected UDI instance once
+ * it has been destructed.  Does nothing for the node-wide UDI.
+ *
+ * Returns 0 on success
+ */
+int removeUdiInstance(UdiRootConfig *udiConfig) {
+    size_t len = 0;
+    char *registry = NULL;
+    int rc = 0;
+    if (udiConfig == NULL || udiConfig->jobIdentifier == NULL) {
+        return 0;
+    }
+    if (rmdir(udiConfig->udiMountPoint) != 0 && errno != ENOENT) {
+        fprintf(stderr, "FAILED to remove %s: %s\n", udiConfig->udiMountPoint,
+                strerror(errno));
+        rc = 1;
+    }
+    if (rmdir(udiConfig->loopMountPoint) != 0 && errno != ENOENT) {
+        fprintf(stderr, "FAILED to remove %s: %s\n",
+                udiConfig->loopMountPoint, strerror(errno));
+        rc = 1;
     }
-    while ((pw = fgetpwent(input)) != NULL) {
-        if (strcmp(pw->pw_name, tgtnam) == 0) {
-            found = 1;
-            break;
+    if (rc == 0) {
+        /* <udiMountPoint>/<jobIdentifier> -> <udiMountPoint>.jobs/<jobIdentifier> */
+        len = strlen(udiConfig->udiMountPoint) -
+                strlen(udiConfig->jobIdentifier) - 1;
+        registry = alloc_strgenf("%.*s.jobs/%s", (int) len,
+                udiConfig->udiMountPoint, udiConfig->jobIdentifier);
+        if (unlink(registry) != 0 && errno != ENOENT) {
+            fprintf(stderr, "FAILED to remove %s: %s\n", registry,
+                    strerror(errno));
+            rc = 1;
         }
+        free(registry);
     }
-    fclose(input);
-    input = NULL;
+    return rc;
+}
 
-    free(buffer);
-    if (found) return pw;
-    return NULL;
+/** _remountUdiRootWritable
+ *  Undo remountUdiRootReadonly so per-job files can be changed in place.
+ */
+static int _remountUdiRootWritable(UdiRootConfig *udiConfig) {
+    if (udiConfig->mountUdiRootWritable) {
+        return 0;
+    }
+    if (_shifterCore_mount(udiConfig->udiMountPoint, udiConfig->udiMountPoint,
+                udiConfig->rootfsType, MS_REMOUNT|MS_NOSUID|MS_NODEV, NULL) != 0)
+    {
+        fprintf(stderr, "FAILED to remount %s writable: %s\n",
+                udiConfig->udiMountPoint, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
 
-_shifter_getpwnam_unclean:
-    free(buffer);
-    return NULL;
+/**
+ * isUdiParked
+ * Returns 1 if the UDI was left in place by parkUDI and no job is using it
+ */
+int isUdiParked(UdiRootConfig *udiConfig) {
+    struct stat statData;
+    char *marker = NULL;
+    int ret = 0;
+
+    if (udiConfig == NULL || udiConfig->udiMountPoint == NULL) {
+        return 0;
+    }
+    marker = alloc_strgenf("%s.warm", udiConfig->udiMountPoint);
+    ret = lstat(marker, &statData) == 0 && S_ISREG(statData.st_mode);
+    free(marker);
+    return ret;
 }
 
-/** filterEtcGroup
- *  many implementations of initgroups() do not deal with huge /etc/group
- *  files due to a variety of limitations (like per-line limits).  this
- *  function reads a given etcgroup file and filters the content to only
- *  include the specified user.  Additionally some services are unwilling
- *  to allow more than, for example, 31 groups from a group file, thus an
- *  upperbound to explicitly include users in is included.  Stub entries
- *  for all remaining groups will be added to provide useful group metadata
+/**
+ * _lockParkedUDI
+ * Serialize parkUDI, reclaimParkedUDI and expireParkedUDI, which may run
+ * concurrently from a job's epilog, the next job's prolog and unsetupRoot
+ * -i, with an exclusive flock on <udiMountPoint>.warm.lock.  The lock file
+ * is never removed, unlike the .warm marker.  Release it by closing the fd.
  *
- *  \param group_dest_fname filename of filtered group file
- *  \param group_source_fname filename of to-be-filtered group file
- *  \param username user to identify
- *  \param maxGroups maximum number of groups to write out for user, 0 for unlimited
+ * Returns the locked fd, or -1 on failure
  */
-int filterEtcGroup(const char *group_dest_fname, const char *group_source_fname, const char *username, size_t maxGroups) {
-    FILE *input = NULL;
-    FILE *output = NULL;
-    char *linePtr = NULL;
-    size_t linePtr_size = 0;
-    size_t foundGroups = 0;
+static int _lockParkedUDI(UdiRootConfig *udiConfig) {
+    char *path = alloc_strgenf("%s.warm.lock", udiConfig->udiMountPoint);
+    int fd = open(path, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600);
 
-    if (group_dest_fname == NULL || strlen(group_dest_fname) == 0
-            || group_source_fname == NULL || strlen(group_source_fname) == 0
-            || username == NULL || strlen(username) == 0) {
-        fprintf(stderr, "Invalid arguments, cannot filter group file.\n");
-        goto _filterEtcGroup_unclean;
+    if (fd < 0) {
+        fprintf(stderr, "FAILED to open %s: %s\n", path, strerror(errno));
+        free(path);
+        return -1;
+    }
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "FAILED to lock %s: %s\n", path,
+                    strerror(errno));
+            close(fd);
+            free(path);
+            return -1;
+        }
     }
+    free(path);
+    return fd;
+}
 
-    input = fopen(group_source_fname, "r");
-    output = fopen(group_dest_fname, "w");
+/** _scrubUserhookEnv
+ *  Remove the userhook results the job's user cached in var/shifterEnv.
+ *  The directory belongs to the user, so entries are removed relative to it
+ *  without following links; a subdirectory means the UDI cannot be scrubbed.
+ */
+static int _scrubUserhookEnv(UdiRootConfig *udiConfig) {
+    char *path = alloc_strgenf("%s%s", udiConfig->udiMountPoint,
+            USERHOOK_ENV_DIR);
+    struct dirent *entry = NULL;
+    DIR *dir = NULL;
+    int fd = open(path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    int rc = 0;
 
-    if (input == NULL || output == NULL) {
-        fprintf(stderr, "Failed to open files, cannot filter group file.\n");
-        goto _filterEtcGroup_unclean;
+    if (fd < 0) {
+        rc = errno == ENOENT ? 0 : 1;
+        free(path);
+        return rc;
+    }
+    dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        free(path);
+        return 1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+                strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        if (unlinkat(fd, entry->d_name, 0) != 0) {
+            fprintf(stderr, "FAILED to remove %s/%s: %s\n", path,
+                    entry->d_name, strerror(errno));
+            rc = 1;
+        }
     }
+    closedir(dir);
+    free(path);
+    return rc;
+}
 
-    while (!feof(input) && !ferror(input)) {
-        size_t nread = getline(&linePtr, &linePtr_size, input);
-        char *ptr = NULL;
-        char *svptr = NULL;
-        char *group_name = NULL;
+/**
+ * parkUDI
+ * Keep the UDI warm for the next job instead of tearing it down: stop the
+ * sshd and scrub the per-job pieces (hostsfile, sshd host keys and the
+ * user's key, workload manager markers, cached userhook environments).  A
+ * UDI with per-node caches, shm or hugetlbfs volumes is not kept.  The mtime of <udiMountPoint>.warm
+ * records when the UDI became idle.
+ *
+ * Returns 0 on success, otherwise the UDI should be destructed
+ */
+int parkUDI(UdiRootConfig *udiConfig) {
+    const char *perJob[] = {
+        "var/hostsfile",
+        "var/shifterSlurm.jobid",
+        "var/shifterExtern.complete",
+        "opt/udiImage/etc/user_auth_keys",
+        "opt/udiImage/etc/ssh_host_dsa_key",
+        "opt/udiImage/etc/ssh_host_dsa_key.pub",
+        "opt/udiImage/etc/ssh_host_ecdsa_key",
+        "opt/udiImage/etc/ssh_host_ecdsa_key.pub",
+        "opt/udiImage/etc/ssh_host_rsa_key",
+        "opt/udiImage/etc/ssh_host_rsa_key.pub",
+        "opt/udiImage/etc/ssh_host_ed25519_key",
+        "opt/udiImage/etc/ssh_host_ed25519_key.pub",
+        NULL
+    };
+    const char **ptr = NULL;
+    char *marker = NULL;
+    int fd = -1;
+    int lockFd = -1;
+    int rc = 0;
 
-        char *token = NULL;
-        gid_t gid = 0;
-        size_t counter = 0;
-        int foundUsername = 0;
-        if (nread == 0 || linePtr == NULL) break;
-        ptr = shifter_trim(linePtr);
-        for (token = strtok_r(ptr, ":,", &svptr);
-             token != NULL;
-             token = strtok_r(NULL, ":,", &svptr)) {
+    struct stat statData;
 
-            switch (counter) {
-                case 0: group_name = _strdup(token);
-                        if (strcmp(group_name, username) == 0) {
-                            foundUsername = 1;
-                        }
-                        break;
-                case 1: break;
-                case 2: gid = strtoul(token, NULL, 10);
-                        break;
-                default: if (strcmp(username, token) == 0) {
-                            foundUsername = 1;
-                        }
-                        break;
-            }
-            counter++;
-            if (foundUsername && gid != 0) break;
-        }
-        if (group_name != NULL && gid != 0) {
-            if (foundUsername == 1 && foundGroups < maxGroups) {
-                fprintf(output, "%s:x:%d:%s\n", group_name, gid, username);
-                foundGroups++;
-            } else {
-                fprintf(output, "%s:x:%d:\n", group_name, gid);
-            }
-        }
-        if (group_name != NULL) {
-            free(group_name);
-            group_name = NULL;
+    if (udiConfig == NULL || udiConfig->udiMountPoint == NULL) {
+        return 1;
+    }
+    lockFd = _lockParkedUDI(udiConfig);
+    if (lockFd < 0) {
+        return 1;
+    }
+    /* only a completely set up UDI is worth keeping */
+    marker = alloc_strgenf("%s/var/shifterConfig.json", udiConfig->udiMountPoint);
+    rc = stat(marker, &statData);
+    free(marker);
+    marker = NULL;
+    if (rc != 0) {
+        rc = 1;
+        goto _parkUDI_exit;
+    }
+    /* per-node caches and memory filesystems hold data of this job only */
+    marker = alloc_strgenf("%s%s", udiConfig->udiMountPoint, VOLUME_STAGE_FILE);
+    rc = stat(marker, &statData);
+    free(marker);
+    marker = NULL;
+    if (rc == 0) {
+        rc = 1;
+        goto _parkUDI_exit;
+    }
+    rc = 0;
+    _killInstanceSshd(udiConfig->udiMountPoint);
+    if (_remountUdiRootWritable(udiConfig) != 0) {
+        rc = 1;
+        goto _parkUDI_exit;
+    }
+    for (ptr = perJob; *ptr != NULL; ptr++) {
+        char *path = alloc_strgenf("%s/%s", udiConfig->udiMountPoint, *ptr);
+        if (unlink(path) != 0 && errno != ENOENT) {
+            fprintf(stderr, "FAILED to remove %s: %s\n", path, strerror(errno));
+            rc = 1;
         }
+        free(path);
     }
-    fclose(input);
-    fclose(output);
-    input = NULL;
-    output = NULL;
-
-    if (linePtr != NULL) {
-        free(linePtr);
+    if (_scrubUserhookEnv(udiConfig) != 0) {
+        rc = 1;
     }
-    return 0;
-_filterEtcGroup_unclean:
-    if (input != NULL) {
-        fclose(input);
-        input = NULL;
+    if (!udiConfig->mountUdiRootWritable &&
+            remountUdiRootReadonly(udiConfig) != 0)
+    {
+        rc = 1;
     }
-    if (output != NULL) {
-        fclose(output);
-        output = NULL;
+    if (rc != 0) {
+        goto _parkUDI_exit;
     }
-    return 1;
-}
 
-pid_t findSshd(void) {
-    return shifter_find_process_by_cmdline("/opt/udiImage/sbin/sshd");
+    marker = alloc_strgenf("%s.warm", udiConfig->udiMountPoint);
+    fd = open(marker, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0600);
+    free(marker);
+    if (fd < 0) {
+        rc = 1;
+        goto _parkUDI_exit;
+    }
+    close(fd);
+
+_parkUDI_exit:
+    close(lockFd);
+    return rc;
 }
 
-pid_t shifter_find_process_by_cmdline(const char *command) {
-    DIR *proc = NULL;
-    struct dirent *dirEntry = NULL;
-    char buffer[1024];
-    pid_t found = 0;
+/**
+ * expireParkedUDI
+ * Destruct a parked UDI once it has been idle for udiKeepWarmTimeout
+ * seconds.
+ *
+ * Returns 0 if nothing needed to be done or the UDI was destructed
+ */
+int expireParkedUDI(UdiRootConfig *udiConfig) {
+    int lockFd = -1;
+    int rc = 0;
 
-    if (command == NULL || strlen(command) == 0) {
-        return -1;
+    if (!isUdiParked(udiConfig)) {
+        return 0;
+    }
+    lockFd = _lockParkedUDI(udiConfig);
+    if (lockFd < 0) {
+        return 1;
     }
+    rc = _expireParkedUDI(udiConfig);
+    close(lockFd);
+    return rc;
+}
 
-    proc = opendir("/proc");
+/** _expireParkedUDI
+ *  expireParkedUDI with the park lock already held
+ */
+static int _expireParkedUDI(UdiRootConfig *udiConfig) {
+    struct stat statData;
+    char *marker = NULL;
+    int expired = 0;
 
-    if (proc == NULL) {
-        return -1;
+    if (!isUdiParked(udiConfig)) {
+        return 0;
     }
-    while ((dirEntry = readdir(proc)) != NULL) {
-        size_t nread = 0;
-        FILE *cmdlineFile = NULL;
-        char *filename = NULL;
-        pid_t pid = (pid_t) strtol(dirEntry->d_name, NULL, 10);
-        if (pid == 0) {
-            continue;
-        }
-        filename = alloc_strgenf("/proc/%d/cmdline", pid);
-        if (filename != NULL) {
-            cmdlineFile = fopen(filename, "r");
-            free(filename);
-            filename = NULL;
-        }
-        if (cmdlineFile == NULL) {
-            continue;
-        } else if (feof(cmdlineFile) || ferror(cmdlineFile)) {
-            fclose(cmdlineFile);
-            cmdlineFile = NULL;
-            continue;
-        }
-        nread = fread(buffer, sizeof(char), 1024, cmdlineFile);
-        fclose(cmdlineFile);
-        cmdlineFile = NULL;
-
-        if (nread > 0) {
-            buffer[nread-1] = 0;
-            if (strcmp(buffer, command) == 0) {
-                found = pid;
-                break;
-            }
-        }
+    marker = alloc_strgenf("%s.warm", udiConfig->udiMountPoint);
+    if (stat(marker, &statData) == 0) {
+        expired = time(NULL) - statData.st_mtime >= udiConfig->udiKeepWarmTimeout;
     }
-    closedir(proc);
-    proc = NULL;
-    return found;
+    free(marker);
+    if (!expired) {
+        return 0;
+    }
+    return destructUDI(udiConfig, 1);
 }
 
-int killSshd(void) {
-    pid_t sshdPid = findSshd();
-    if (sshdPid > 2) {
-        kill(sshdPid, SIGTERM);
-        return 0;
+/**
+ * _runStageOut
+ * body of the detached stageout process: pin the per-node cache src as the
+ * working directory and the destination dst as the root directory so that
+ * both survive the lazy unmounts of destructUDI, then copy the cache as the
+ * user.  Readiness is signalled on readyFd once the log is open; from then
+ * on progress and errors go to dst/.shifter-stageout.log.
+ */
+static int _runStageOut(const char *src, const char *dst, uid_t uid,
+        gid_t gid, int nWorkers, int readyFd)
+{
+    struct passwd pwd;
+    struct passwd *pw = NULL;
+    char pwBuffer[4096];
+    char ready = 1;
+    int srcFd = -1;
+    int logFd = -1;
+
+    srcFd = open(src, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (srcFd < 0) {
+        fprintf(stderr, "FAILED to open per-node cache %s\n", src);
+        return 1;
+    }
+    if (getpwuid_r(uid, &pwd, pwBuffer, sizeof(pwBuffer), &pw) != 0 ||
+            pw == NULL || initgroups(pw->pw_name, gid) != 0)
+    {
+        fprintf(stderr, "FAILED to lookup groups of uid %d\n", uid);
+        return 1;
+    }
+
+    /* the destination is created and entered with the user's permissions */
+    if (setegid(gid) != 0 || seteuid(uid) != 0) {
+        fprintf(stderr, "FAILED to assume user identity for stageout\n");
+        return 1;
+    }
+    if ((mkdir(dst, 0700) != 0 && errno != EEXIST) || chdir(dst) != 0) {
+        fprintf(stderr, "FAILED to create stageout destination %s: %s\n",
+                dst, strerror(errno));
+        return 1;
+    }
+    if (seteuid(0) != 0 || chroot(".") != 0 ||
+            setresgid(gid, gid, gid) != 0 || setresuid(uid, uid, uid) != 0)
+    {
+        fprintf(stderr, "FAILED to enter stageout destination %s\n", dst);
+        return 1;
+    }
+    if (fchdir(srcFd) != 0) {
+        fprintf(stderr, "FAILED to enter per-node cache %s\n", src);
+        return 1;
+    }
+    close(srcFd);
+
+    logFd = open("/" VOLUME_STAGEOUT_LOG,
+            O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (logFd < 0) {
+        fprintf(stderr, "FAILED to open stageout log in %s\n", dst);
+        return 1;
     }
-    return 1;
+    if (write(readyFd, &ready, 1) != 1) {
+        return 1;
+    }
+    close(readyFd);
+    dup2(logFd, STDOUT_FILENO);
+    dup2(logFd, STDERR_FILENO);
+    close(STDIN_FILENO);
+
+    return shifter_stage_copyTree("stageout", ".", "", nWorkers, NULL) != 0;
 }
 
 /**
- * destructUDI
- * Unmounts all aspects of the UDI, possibly killing the sshd running first.
- * This is called in the unsetupRoot program when dealing with the global
- * linux namespace.  It should also be called when trying to get rid of an
- * existing UDI before setting up a new one in a private linux namespace.
+ * startVolumeStageOut
+ * Start copying every per-node cache volume with a stageout flag to its
+ * destination.  Each copy runs in its own detached process holding
+ * references to the cache and the destination, so the UDI can be destructed
+ * immediately while the copies finish in the background.
  *
- * \param udiConfig configuration
- * \param killSsh flag to denote whether or not the udiRoot sshd should be killed
- *     (1 for yes, 0 for no)
+ * Returns 0 if all stageouts were started (or none were requested)
  */
-int destructUDI(UdiRootConfig *udiConfig, int killSsh) {
-    char *udiRoot = _malloc(sizeof(char) * PATH_MAX);
-    char *loopMount = _malloc(sizeof(char) * PATH_MAX);
-    MountList mounts;
-    size_t idx = 0;
-    int rc = 1; /* assume failure */
+int startVolumeStageOut(UdiRootConfig *udiConfig) {
+    char *path = NULL;
+    char *line = NULL;
+    size_t lineSize = 0;
+    FILE *fp = NULL;
+    int nWorkers = 0;
+    int rc = 0;
 
-    memset(&mounts, 0, sizeof(MountList));
-    if (parse_MountList(&mounts) != 0) {
-        /*error*/
+    if (udiConfig == NULL || udiConfig->udiMountPoint == NULL) {
+        return 1;
     }
+    nWorkers = udiConfig->volumeStageWorkers > 0 ?
+            udiConfig->volumeStageWorkers : SHIFTER_STAGE_DEFAULT_WORKERS;
+    path = alloc_strgenf("%s%s", udiConfig->udiMountPoint, VOLUME_STAGE_FILE);
+    fp = fopen(path, "r");
+    free(path);
+    if (fp == NULL) {
+        return 0;
+    }
+    while (getline(&line, &lineSize, fp) > 0) {
+        char *svPtr = NULL;
+        char *uidStr = strtok_r(line, " \n", &svPtr);
+        char *gidStr = strtok_r(NULL, " \n", &svPtr);
+        char *src = strtok_r(NULL, " \n", &svPtr);
+        char *dst = strtok_r(NULL, " \n", &svPtr);
+        uid_t uid = 0;
+        gid_t gid = 0;
+        pid_t pid = 0;
+        int readyFd[2] = { -1, -1 };
+        int status = 0;
+        char ready = 0;
 
-    snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
-    udiRoot[PATH_MAX-1] = 0;
-    snprintf(loopMount, PATH_MAX, "%s", udiConfig->loopMountPoint);
-    loopMount[PATH_MAX-1] = 0;
-    for (idx = 0; idx < 10; idx++) {
-
-        if (idx > 0) {
-            usleep(300000);
-        }
-        if (killSsh == 1) {
-            killSshd();
-        }
-
-        if (unmountTree(&mounts, udiRoot) != 0) {
+        if (uidStr == NULL || gidStr == NULL || src == NULL || dst == NULL) {
             continue;
         }
-        if (validateUnmounted(udiRoot, 1) != 0) {
+        uid = strtoul(uidStr, NULL, 10);
+        gid = strtoul(gidStr, NULL, 10);
+        if (uid == 0 || gid == 0) {
+            fprintf(stderr, "FAILED refusing to stage out %s as root\n", src);
+            rc = 1;
             continue;
         }
-        if (unmountTree(&mounts, loopMount) != 0) {
+        if (pipe2(readyFd, O_CLOEXEC) != 0) {
+            fprintf(stderr, "FAILED to create pipe for stageout\n");
+            rc = 1;
             continue;
         }
-        if (validateUnmounted(loopMount, 0) != 0) {
+        fflush(stderr);
+        pid = fork();
+        if (pid == 0) {
+            close(readyFd[0]);
+            if (setsid() < 0 || fork() != 0) {
+                _exit(0);
+            }
+            _exit(_runStageOut(src, dst, uid, gid, nWorkers, readyFd[1]));
+        }
+        close(readyFd[1]);
+        while (read(readyFd[0], &ready, 1) < 0 && errno == EINTR) { }
+        close(readyFd[0]);
+        if (pid > 0) {
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR) { }
+        }
+        if (ready != 1) {
+            fprintf(stderr, "FAILED to start stageout of %s to %s\n", src, dst);
+            rc = 1;
             continue;
         }
-        rc = 0; /* mark success */
-        break;
+        fprintf(stderr, "Staging out %s to %s\n", src, dst);
     }
-    free_MountList(&mounts, 0);
-    free(udiRoot);
-    free(loopMount);
+    free(line);
+    fclose(fp);
     return rc;
 }
 
+/**
+ * reclaimParkedUDI
+ * Take over a parked UDI if its configuration fingerprint matches the
+ * request and it has not expired, then regenerate the per-job pieces
+ * parkUDI scrubbed.  A parked UDI that does not match is destructed.
+ *
+ * Returns 0 if the UDI is ready for the job, 1 if it must be set up from
+ * scratch
+ */
+int reclaimParkedUDI(const char *user, ImageData *image, VolumeMap *volumeMap,
+        const char *minNodeSpec, char *sshPubKey, uid_t uid, gid_t gid,
+        UdiRootConfig *udiConfig)
+{
+    char *marker = NULL;
+    int lockFd = -1;
+
+    if (!isUdiParked(udiConfig)) {
+        return 1;
+    }
+    lockFd = _lockParkedUDI(udiConfig);
+    if (lockFd < 0) {
+        return 1;
+    }
+    /* parked state may have changed while waiting for the lock */
+    if (_expireParkedUDI(udiConfig) != 0 || !isUdiParked(udiConfig)) {
+        close(lockFd);
+        return 1;
+    }
+    if (compareShifterConfig(user, image, volumeMap, udiConfig) != 0) {
+        destructUDI(udiConfig, 1);
+        close(lockFd);
+        return 1;
+    }
+
+    /* claim it before changing anything, a failure below tears it down */
+    marker = alloc_strgenf("%s.warm", udiConfig->udiMountPoint);
+    unlink(marker);
+    free(marker);
+
+    if (_remountUdiRootWritable(udiConfig) != 0) {
+        goto _reclaimParkedUDI_error;
+    }
+    if (minNodeSpec != NULL && writeHostFile(minNodeSpec, udiConfig) != 0) {
+        fprintf(stderr, "FAILED to write out hostsfile\n");
+        goto _reclaimParkedUDI_error;
+    }
+    if (sshPubKey != NULL && strlen(sshPubKey) > 0 && user != NULL &&
+            strlen(user) > 0 && uid != 0)
+    {
+        if (setupImageSshKeys(sshPubKey, uid, gid, udiConfig) != 0) {
+            fprintf(stderr, "FAILED to setup ssh keys\n");
+            goto _reclaimParkedUDI_error;
+        }
+        if (startSshd(user, udiConfig) != 0) {
+            fprintf(stderr, "FAILED to start sshd\n");
+            goto _reclaimParkedUDI_error;
+        }
+    }
+    if (!udiConfig->mountUdiRootWritable &&
+            remountUdiRootReadonly(udiConfig) != 0)
+    {
+        goto _reclaimParkedUDI_error;
+    }
+    close(lockFd);
+    return 0;
+
+_reclaimParkedUDI_error:
+    destructUDI(udiConfig, 1);
+    close(lockFd);
+    return 1;
+}
+
 /**
  * unmountTree
  * Unmount everything under a particular base path.  Uses a MountList assumed
@@ -3135,6 +5497,31 @@ int destructUDI(UdiRootConfig *udiConfig, int killSsh) {
  * 1 if some or none were unmounted
  */
 int unmountTree(MountList *mounts, const char *base) {
+    return _unmountTreeExcept(mounts, base, NULL);
+}
+
+/** _isKeptMount
+ *  Returns 1 if path is one of the paths in keep or below one of them
+ */
+static int _isKeptMount(const char *path, char **keep) {
+    char **ptr = NULL;
+    for (ptr = keep; ptr && *ptr; ptr++) {
+        size_t len = strlen(*ptr);
+        if (strncmp(path, *ptr, len) == 0 &&
+                (path[len] == 0 || path[len] == '/'))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** _unmountTreeExcept
+ *  unmountTree leaving the mounts at or below the paths in keep in place
+ */
+static int _unmountTreeExcept(MountList *mounts, const char *base,
+        char **keep)
+{
     MountList mountCache;
     size_t baseLen = 0;
     char **ptr = NULL;
@@ -3166,7 +5553,10 @@ int unmountTree(MountList *mounts, const char *base) {
             if (!next_slash && len > baseLen) {
                 continue;
             }
-            rc = umount2(*ptr, UMOUNT_NOFOLLOW|MNT_DETACH);
+            if (_isKeptMount(*ptr, keep)) {
+                continue;
+            }
+            rc = _shifterCore_umount(*ptr, UMOUNT_NOFOLLOW|MNT_DETACH);
             if (rc != 0) {
                 goto _unmountTree_exit;
             }
@@ -3187,13 +5577,29 @@ _unmountTree_exit:
  * not found, return 0 (success), otherwise return 1 (failure), -1 for error
  */
 int validateUnmounted(const char *path, int subtree) {
+    return _validateUnmountedExcept(path, subtree, NULL);
+}
+
+/*! validateUnmounted ignoring the mounts at or below the paths in keep */
+static int _validateUnmountedExcept(const char *path, int subtree,
+        char **keep)
+{
     MountList mounts;
+    char **ptr = NULL;
+    size_t len = strlen(path);
     int rc = 0;
     memset(&mounts, 0, sizeof(MountList));
     if (parse_MountList(&mounts) != 0) {
         goto _validateUnmounted_error;
     }
-    if (subtree) {
+    if (subtree && keep != NULL) {
+        for (ptr = mounts.mountPointList; ptr && *ptr; ptr++) {
+            if (strncmp(*ptr, path, len) == 0 && !_isKeptMount(*ptr, keep)) {
+                rc = 1;
+                break;
+            }
+        }
+    } else if (subtree) {
         if (findstartswith_MountList(&mounts, path) != NULL) {
             rc = 1;
         }
@@ -3551,6 +5957,345 @@ _fail:
     return 1;
 }
 
+/* variables the shell maintains itself, never part of a userhook's result */
+static const char *_userhookShellEnv[] = { "PWD", "OLDPWD", "SHLVL", "_", NULL };
+
+static int _isUserhookShellEnv(const char *var) {
+    size_t len = strcspn(var, "=");
+    int idx = 0;
+
+    for (idx = 0; _userhookShellEnv[idx] != NULL; idx++) {
+        if (strlen(_userhookShellEnv[idx]) == len &&
+                strncmp(var, _userhookShellEnv[idx], len) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** _splitEnvRecords
+ * split a buffer of NUL-terminated records into a newly allocated,
+ * NULL-terminated array of newly allocated strings
+ */
+static char **_splitEnvRecords(const char *buffer, size_t len) {
+    char **ret = NULL;
+    size_t count = 0;
+    size_t pos = 0;
+
+    ret = (char **) _malloc(sizeof(char *));
+    ret[0] = NULL;
+    while (pos < len) {
+        size_t recLen = strnlen(buffer + pos, len - pos);
+        if (recLen > 0) {
+            ret = (char **) _realloc(ret, sizeof(char *) * (count + 2));
+            ret[count++] = _strndup(buffer + pos, recLen);
+            ret[count] = NULL;
+        }
+        pos += recLen + 1;
+    }
+    return ret;
+}
+
+/** _readProcEnviron
+ * read the NUL-terminated records of /proc/<pid>/environ
+ *
+ * Returns 0 on success, the records in *output and *len
+ */
+static int _readProcEnviron(pid_t pid, char **output, size_t *len) {
+    char *path = alloc_strgenf("/proc/%d/environ", (int) pid);
+    size_t capacity = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    free(path);
+    if (fd < 0) {
+        return 1;
+    }
+    for ( ; ; ) {
+        ssize_t bytes = 0;
+        if (capacity - *len < 4096) {
+            capacity += 16384;
+            *output = (char *) _realloc(*output, capacity);
+        }
+        bytes = read(fd, *output + *len, capacity - *len);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
+            close(fd);
+            return 1;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        *len += bytes;
+    }
+    close(fd);
+    return 0;
+}
+
+/** _runUserhookEnv
+ * source hook in /bin/sh with environment env (hook output goes to stderr)
+ * and capture the resulting environment as NUL-terminated records.  Once
+ * the hook is sourced the shell re-executes /bin/sh with its exported
+ * environment and waits, so the records are read from /proc/<pid>/environ
+ * and the image needs no tool beyond /bin/sh.
+ *
+ * Returns 0 on success, the captured records in *output and *len
+ */
+static int _runUserhookEnv(const char *hook, char **env, char **output,
+        size_t *len)
+{
+    int readyPipe[2] = { -1, -1 };
+    int holdPipe[2] = { -1, -1 };
+    char ready = 0;
+    ssize_t bytes = 0;
+    int status = 0;
+    int ret = 1;
+    pid_t pid = 0;
+
+    *output = NULL;
+    *len = 0;
+    if (pipe2(readyPipe, O_CLOEXEC) != 0 || pipe2(holdPipe, O_CLOEXEC) != 0) {
+        fprintf(stderr, "FAILED to create pipe: %s\n", strerror(errno));
+        goto _runUserhookEnv_close;
+    }
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "FAILED to fork! Exiting.\n");
+        goto _runUserhookEnv_close;
+    }
+    if (pid == 0) {
+        /* the hook keeps the caller's stdin, only the final shell blocks
+         * on fd 3 until the environment has been read */
+        char *args[] = {
+            "/bin/sh", "-c",
+            ". \"$0\" >&2 && exec /bin/sh -c 'echo; read x; :' <&3",
+            (char *) hook, NULL
+        };
+        if (dup2(readyPipe[1], STDOUT_FILENO) < 0) {
+            exit(127);
+        }
+        if (holdPipe[0] == 3) {
+            if (fcntl(3, F_SETFD, 0) != 0) {
+                exit(127);
+            }
+        } else if (dup2(holdPipe[0], 3) < 0) {
+            exit(127);
+        }
+        execve(args[0], args, env);
+        fprintf(stderr, "FAILED to execvp! Exiting.\n");
+        exit(127);
+    }
+    close(readyPipe[1]);
+    readyPipe[1] = -1;
+    close(holdPipe[0]);
+    holdPipe[0] = -1;
+    while ((bytes = read(readyPipe[0], &ready, 1)) < 0 && errno == EINTR) { }
+    if (bytes == 1 && _readProcEnviron(pid, output, len) == 0) {
+        ret = 0;
+    }
+    close(holdPipe[1]);
+    holdPipe[1] = -1;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            status = 1;
+            break;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        ret = 1;
+    }
+
+_runUserhookEnv_close:
+    if (readyPipe[0] >= 0) close(readyPipe[0]);
+    if (readyPipe[1] >= 0) close(readyPipe[1]);
+    if (holdPipe[0] >= 0) close(holdPipe[0]);
+    if (holdPipe[1] >= 0) close(holdPipe[1]);
+    if (ret != 0) {
+        free(*output);
+        *output = NULL;
+        *len = 0;
+    }
+    return ret;
+}
+
+/** _loadUserhookEnv
+ * Returns the delta stored in cacheFile, or NULL if there is none usable:
+ * the file must be a regular file owned by the effective user and not
+ * writable by anyone else
+ */
+static char **_loadUserhookEnv(const char *cacheFile) {
+    struct stat statData;
+    char *buffer = NULL;
+    char **ret = NULL;
+    size_t len = 0;
+    int fd = -1;
+
+    fd = open(cacheFile, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &statData) != 0 || !S_ISREG(statData.st_mode) ||
+            statData.st_uid != geteuid() ||
+            (statData.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+            statData.st_size > FILE_SIZE_LIMIT)
+    {
+        close(fd);
+        return NULL;
+    }
+    buffer = (char *) _malloc(statData.st_size + 1);
+    while (len < (size_t) statData.st_size) {
+        ssize_t bytes = read(fd, buffer + len, statData.st_size - len);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            break;
+        }
+        len += bytes;
+    }
+    close(fd);
+    if (len == (size_t) statData.st_size) {
+        ret = _splitEnvRecords(buffer, len);
+    }
+    free(buffer);
+    return ret;
+}
+
+/** _saveUserhookEnv
+ * atomically replace cacheFile with delta
+ */
+static int _saveUserhookEnv(const char *cacheFile, char **delta) {
+    char *tmpFile = alloc_strgenf("%s.XXXXXX", cacheFile);
+    char **ptr = NULL;
+    FILE *fp = NULL;
+    int fd = mkostemp(tmpFile, O_CLOEXEC);
+
+    if (fd < 0) {
+        free(tmpFile);
+        return 1;
+    }
+    fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        close(fd);
+        goto _saveUserhookEnv_error;
+    }
+    for (ptr = delta; ptr && *ptr; ptr++) {
+        fwrite(*ptr, 1, strlen(*ptr) + 1, fp);
+    }
+    if (fclose(fp) != 0 || rename(tmpFile, cacheFile) != 0) {
+        goto _saveUserhookEnv_error;
+    }
+    free(tmpFile);
+    return 0;
+
+_saveUserhookEnv_error:
+    unlink(tmpFile);
+    free(tmpFile);
+    return 1;
+}
+
+/*! Compute the changes between two environments */
+/*!
+  \param before environment the userhook started with
+  \param after environment the userhook finished with
+  \return newly allocated NULL-terminated delta: "key=value" entries are set
+          and bare "key" entries are unset
+ */
+char **shifter_envdelta(char **before, char **after) {
+    char **delta = (char **) _malloc(sizeof(char *));
+    size_t count = 0;
+    char **ptr = NULL;
+
+    delta[0] = NULL;
+    for (ptr = after; ptr && *ptr; ptr++) {
+        char **found = NULL;
+        if (strchr(*ptr, '=') == NULL || _isUserhookShellEnv(*ptr)) {
+            continue;
+        }
+        found = _shifter_findenv(before, *ptr);
+        if (found != NULL && strcmp(*found, *ptr) == 0) {
+            continue;
+        }
+        delta = (char **) _realloc(delta, sizeof(char *) * (count + 2));
+        delta[count++] = _strdup(*ptr);
+        delta[count] = NULL;
+    }
+    for (ptr = before; ptr && *ptr; ptr++) {
+        if (strchr(*ptr, '=') == NULL || _isUserhookShellEnv(*ptr) ||
+                _shifter_findenv(after, *ptr) != NULL)
+        {
+            continue;
+        }
+        delta = (char **) _realloc(delta, sizeof(char *) * (count + 2));
+        delta[count++] = _strndup(*ptr, strchr(*ptr, '=') - *ptr);
+        delta[count] = NULL;
+    }
+    return delta;
+}
+
+/*! Apply changes computed by shifter_envdelta to an environment */
+/*!
+  \param env pointer to environment string array created by shifter_copyenv
+  \param delta changes to apply
+  \return 0 for success, nonzero for error
+ */
+int shifter_applyenvdelta(char ***env, char **delta) {
+    char **ptr = NULL;
+
+    for (ptr = delta; ptr && *ptr; ptr++) {
+        int ret = strchr(*ptr, '=') != NULL ?
+                shifter_putenv(env, *ptr) : shifter_unsetenv(env, *ptr);
+        if (ret != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*! Run an environment-only module userhook */
+/*!
+  The hook is sourced by /bin/sh and the changes it makes to the environment
+  are applied to env.  If cacheFile is not NULL, changes stored there by an
+  earlier run are applied instead of running the hook, and otherwise the
+  changes are stored there for later runs.
+
+  \param env pointer to environment string array created by shifter_copyenv
+  \param hook path to the userhook
+  \param cacheFile path of the stored changes, or NULL
+  \return 0 for success, nonzero if the hook failed
+ */
+int shifter_userhookenv(char ***env, const char *hook, const char *cacheFile) {
+    char **delta = NULL;
+    char **after = NULL;
+    char *output = NULL;
+    size_t len = 0;
+    int ret = 0;
+
+    if (env == NULL || *env == NULL || hook == NULL) {
+        return 1;
+    }
+    if (cacheFile != NULL) {
+        delta = _loadUserhookEnv(cacheFile);
+    }
+    if (delta == NULL) {
+        if (_runUserhookEnv(hook, *env, &output, &len) != 0) {
+            return 1;
+        }
+        after = _splitEnvRecords(output, len);
+        free(output);
+        delta = shifter_envdelta(*env, after);
+        free_string_array(after);
+        if (cacheFile != NULL) {
+            _saveUserhookEnv(cacheFile, delta);
+        }
+    }
+    ret = shifter_applyenvdelta(env, delta);
+    free_string_array(delta);
+    return ret;
+}
+
 /*
  * Create the args to mimic Docker's behaviour.
  */
@@ -55,6 +55,11 @@ extern "C" {
 #define INVALID_USER INT_MAX
 #define INVALID_GROUP INT_MAX
 #define FILE_SIZE_LIMIT 5242880
+#define UDI_BUILD_LOCK_TIMEOUT 300
+#define ROOTHOOK_POLL_INTERVAL 10000
+#define USERHOOK_ENV_DIR "/var/shifterEnv"
+#define VOLUME_STAGE_FILE "/var/shifterStageout"
+#define VOLUME_STAGEOUT_LOG ".shifter-stageout.log"
 
 typedef enum _env_putenv_mode {
     ENV_REPLACE,
@@ -65,6 +70,9 @@ typedef enum _env_putenv_mode {
 int setupUserMounts(VolumeMap *map, UdiRootConfig *udiConfig);
 int setupVolumeMapMounts(MountList *mountCache, VolumeMap *map,
         int userRequested, dev_t createTo, UdiRootConfig *udiConfig);
+int setupGpuSupport(MountList *mountCache, ShifterModule *module,
+        dev_t createToDev, UdiRootConfig *udiConfig);
+int setupContainerLdCache(UdiRootConfig *udiConfig);
 
 int userMountFilter(char *udiRoot, char *filtered_from, char *filtered_to, char *flags);
 int mountImageVFS(ImageData *imageData,
@@ -75,12 +83,22 @@ int mountImageVFS(ImageData *imageData,
 int mountImageLoop(ImageData *imageData, UdiRootConfig *udiConfig);
 int loopMount(const char *imagePath, const char *loopMountPath, ImageFormat format, UdiRootConfig *udiConfig, int readonly);
 int destructUDI(UdiRootConfig *udiConfig, int killSshd);
+int selectUdiInstance(UdiRootConfig *udiConfig, const char *jobIdentifier, int create);
+int removeUdiInstance(UdiRootConfig *udiConfig);
+int isUdiParked(UdiRootConfig *udiConfig);
+int parkUDI(UdiRootConfig *udiConfig);
+int expireParkedUDI(UdiRootConfig *udiConfig);
+int startVolumeStageOut(UdiRootConfig *udiConfig);
+int reclaimParkedUDI(const char *user, ImageData *image, VolumeMap *volumeMap, const char *minNodeSpec, char *sshPubKey, uid_t uid, gid_t gid, UdiRootConfig *udiConfig);
 int bindImageIntoUDI(const char *relpath, ImageData *imageData, UdiRootConfig *udiConfig, int copyFlag);
 int prepareSiteModifications(const char *username, const char *minNodeSpec, UdiRootConfig *udiConfig);
+int runModuleRoothooks(UdiRootConfig *udiConfig);
+int setupImageSshKeys(char *sshPubKey, uid_t uid, gid_t gid, UdiRootConfig *udiConfig);
 int setupImageSsh(char *sshPubKey, char *username, uid_t uid, gid_t gid, UdiRootConfig *udiConfig);
 int startSshd(const char *user, UdiRootConfig *udiConfig);
 int filterEtcGroup(const char *dest, const char *from, const char *username, size_t maxGroups);
 int remountUdiRootReadonly(UdiRootConfig *udiConfig);
+int pivotIntoUdi(const char *udiRoot);
 int forkAndExecv(char *const *argvs);
 int forkAndExecvSilent(char *const *argvs);
 pid_t findSshd(void);
@@ -89,10 +107,16 @@ char **parseMounts(size_t *n_mounts);
 char *generateShifterConfigString(const char *, ImageData *, VolumeMap *, UdiRootConfig *);
 int saveShifterConfig(const char *, ImageData *, VolumeMap *, UdiRootConfig *);
 int compareShifterConfig(const char *, ImageData*, VolumeMap *, UdiRootConfig *);
+int generateShifterConfigFingerprint(const char *, ImageData *, VolumeMap *, UdiRootConfig *, char *fingerprint);
+int openUdiBuildLock(UdiRootConfig *udiConfig, const char *fingerprint);
+int acquireUdiBuildLock(int lockFd, int timeout);
+int publishUdi(int lockFd);
+int joinPublishedUdi(int lockFd);
 int unmountTree(MountList *mounts, const char *base);
 int validateUnmounted(const char *path, int subtree);
 int isSharedMount(const char *);
 int writeHostFile(const char *minNodeSpec, UdiRootConfig *udiConfig);
+size_t shifter_getRetryCount(void);
 int forkAndExecv(char *const *args);
 int forkAndExecvSilent(char *const *args);
 char **calculate_args(int useEntry, char **clArgs, char *clEntry,
@@ -143,6 +167,9 @@ int shifter_prependenv(char ***env, const char *var);
 int shifter_unsetenv(char ***env, const char *var);
 int shifter_setupenv(char ***env, ImageData *image, const char *envfile, char **user_env, UdiRootConfig *udiConfig);
 int shifter_putenv_file(char ***env, const char *env_fname);
+char **shifter_envdelta(char **before, char **after);
+int shifter_applyenvdelta(char ***env, char **delta);
+int shifter_userhookenv(char ***env, const char *hook, const char *cacheFile);
 struct passwd *shifter_getpwuid(uid_t tgtuid, UdiRootConfig *config);
 struct passwd *shifter_getpwnam(const char *tgtnam, UdiRootConfig *config);
 
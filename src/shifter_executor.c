@@ -0,0 +1,971 @@
+/** @file shifter_executor.c
+ *  @brief node-local executor that launches ranks into a ready UDI
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "shifter_executor.h"
+#include "shifter_mem.h"
+#include "utility.h"
+
+#define EXECUTOR_MAGIC 0x53484558
+#define EXECUTOR_ALLOC_BLOCK 4096
+#define EXECUTOR_NULL_ARRAY UINT32_MAX
+#define EXECUTOR_CGROUP_ROOT "/sys/fs/cgroup"
+#define EXECUTOR_MAX_CGROUP_FILE 65536
+
+typedef struct _ExecutorHeader {
+    uint32_t magic;
+    uint32_t length;
+} ExecutorHeader;
+
+typedef struct _ExecutorBuffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+} ExecutorBuffer;
+
+static const int _executorSignals[] = {
+    SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2, SIGCONT, 0
+};
+static int _executorClientSock = -1;
+
+static ssize_t _executor_readAll(int fd, void *data, size_t len) {
+    char *ptr = (char *) data;
+    size_t total = 0;
+    while (total < len) {
+        ssize_t nread = read(fd, ptr + total, len - total);
+        if (nread < 0 && errno == EINTR) continue;
+        if (nread < 0) return -1;
+        if (nread == 0) break;
+        total += nread;
+    }
+    return total;
+}
+
+static int _executor_writeAll(int fd, const void *data, size_t len) {
+    const char *ptr = (const char *) data;
+    size_t total = 0;
+    while (total < len) {
+        ssize_t nwrite = send(fd, ptr + total, len - total, MSG_NOSIGNAL);
+        if (nwrite < 0 && errno == EINTR) continue;
+        if (nwrite <= 0) return 1;
+        total += nwrite;
+    }
+    return 0;
+}
+
+static int _executor_sendMessage(int sock, int32_t type, int32_t value) {
+    ShifterExecutorMessage msg;
+    msg.type = type;
+    msg.value = value;
+    return _executor_writeAll(sock, &msg, sizeof(ShifterExecutorMessage));
+}
+
+static void _buffer_append(ExecutorBuffer *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->capacity) {
+        size_t newCapacity = buf->capacity + EXECUTOR_ALLOC_BLOCK;
+        while (newCapacity < buf->len + len) {
+            newCapacity *= 2;
+        }
+        buf->data = (char *) _realloc(buf->data, newCapacity);
+        buf->capacity = newCapacity;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void _buffer_putUint(ExecutorBuffer *buf, uint32_t value) {
+    _buffer_append(buf, &value, sizeof(uint32_t));
+}
+
+/* strings are length-prefixed including the terminator, 0 encodes NULL */
+static void _buffer_putString(ExecutorBuffer *buf, const char *str) {
+    uint32_t len = str != NULL ? strlen(str) + 1 : 0;
+    _buffer_putUint(buf, len);
+    if (str != NULL) {
+        _buffer_append(buf, str, len);
+    }
+}
+
+static void _buffer_putArray(ExecutorBuffer *buf, char **array) {
+    char **ptr = NULL;
+    uint32_t count = 0;
+    if (array == NULL) {
+        _buffer_putUint(buf, EXECUTOR_NULL_ARRAY);
+        return;
+    }
+    for (ptr = array; *ptr != NULL; ptr++) {
+        count++;
+    }
+    _buffer_putUint(buf, count);
+    for (ptr = array; *ptr != NULL; ptr++) {
+        _buffer_putString(buf, *ptr);
+    }
+}
+
+static int _buffer_getUint(ExecutorBuffer *buf, uint32_t *value) {
+    if (buf->capacity - buf->len < sizeof(uint32_t)) return 1;
+    memcpy(value, buf->data + buf->len, sizeof(uint32_t));
+    buf->len += sizeof(uint32_t);
+    return 0;
+}
+
+static int _buffer_getBytes(ExecutorBuffer *buf, void *data, size_t len) {
+    if (buf->capacity - buf->len < len) return 1;
+    memcpy(data, buf->data + buf->len, len);
+    buf->len += len;
+    return 0;
+}
+
+static int _buffer_getString(ExecutorBuffer *buf, char **str) {
+    uint32_t len = 0;
+    *str = NULL;
+    if (_buffer_getUint(buf, &len) != 0) return 1;
+    if (len == 0) return 0;
+    if (buf->capacity - buf->len < len) return 1;
+    if (buf->data[buf->len + len - 1] != 0) return 1;
+    *str = _strndup(buf->data + buf->len, len - 1);
+    buf->len += len;
+    return 0;
+}
+
+static int _buffer_getArray(ExecutorBuffer *buf, char ***array) {
+    uint32_t count = 0;
+    uint32_t idx = 0;
+    *array = NULL;
+    if (_buffer_getUint(buf, &count) != 0) return 1;
+    if (count == EXECUTOR_NULL_ARRAY) return 0;
+    /* every entry needs at least its length prefix */
+    if (count > (buf->capacity - buf->len) / sizeof(uint32_t)) return 1;
+    *array = (char **) _malloc(sizeof(char *) * (count + 1));
+    memset(*array, 0, sizeof(char *) * (count + 1));
+    for (idx = 0; idx < count; idx++) {
+        if (_buffer_getString(buf, &((*array)[idx])) != 0) return 1;
+        if ((*array)[idx] == NULL) return 1;
+    }
+    return 0;
+}
+
+static int _executor_address(const char *path, struct sockaddr_un *addr) {
+    if (path == NULL || strlen(path) >= sizeof(addr->sun_path)) {
+        return 1;
+    }
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path);
+    return 0;
+}
+
+char *shifter_executor_socketPath(const char *socketDir, uid_t uid,
+        const char *jobId, const char *stepId)
+{
+    struct sockaddr_un addr;
+    char *job = NULL;
+    char *step = NULL;
+    char *path = NULL;
+
+    if (socketDir == NULL || socketDir[0] != '/' || jobId == NULL ||
+            stepId == NULL)
+    {
+        return NULL;
+    }
+    job = userInputPathFilter(jobId, 0);
+    step = userInputPathFilter(stepId, 0);
+    if (job != NULL && step != NULL && strlen(job) > 0 && strlen(step) > 0) {
+        path = alloc_strgenf("%s/executor.%d.%s.%s.sock", socketDir,
+                (int) uid, job, step);
+    }
+    if (path != NULL && strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "FAILED to use executor socket %s, path too long\n",
+                path);
+        free(path);
+        path = NULL;
+    }
+    if (job != NULL) free(job);
+    if (step != NULL) free(step);
+    return path;
+}
+
+int shifter_executor_listen(const char *path, uid_t uid) {
+    struct sockaddr_un addr;
+    struct stat statData;
+    mode_t oldMask = 0;
+    int fd = -1;
+    int probe = -1;
+    int attempt = 0;
+
+    if (_executor_address(path, &addr) != 0) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    oldMask = umask(077);
+    for (attempt = 0; attempt < 2; attempt++) {
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            break;
+        }
+        if (errno != EADDRINUSE || attempt > 0) {
+            goto _listen_error;
+        }
+
+        /* only replace a socket which nobody is listening on */
+        if (lstat(path, &statData) != 0 || !S_ISSOCK(statData.st_mode)) {
+            goto _listen_error;
+        }
+        probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe < 0) {
+            goto _listen_error;
+        }
+        if (connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == 0 ||
+                errno != ECONNREFUSED)
+        {
+            close(probe);
+            goto _listen_error;
+        }
+        close(probe);
+        unlink(path);
+    }
+    umask(oldMask);
+
+    if (chown(path, uid, 0) != 0 || chmod(path, 0600) != 0 ||
+            listen(fd, SOMAXCONN) != 0)
+    {
+        unlink(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+_listen_error:
+    umask(oldMask);
+    close(fd);
+    return -1;
+}
+
+int shifter_executor_connect(const char *path, uid_t serverUid) {
+    struct sockaddr_un addr;
+    struct ucred cred;
+    socklen_t credLen = sizeof(struct ucred);
+    int fd = -1;
+
+    if (_executor_address(path, &addr) != 0) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) != 0 ||
+            cred.uid != serverUid)
+    {
+        fprintf(stderr, "Ignoring executor socket %s, not served by uid %d\n",
+                path, (int) serverUid);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int shifter_executor_sendRequest(int sock, ShifterExecutorRequest *request) {
+    ExecutorBuffer buf;
+    ExecutorHeader header;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg = NULL;
+    char control[CMSG_SPACE(sizeof(int) * SHIFTER_EXECUTOR_NFDS)];
+    ssize_t nsent = 0;
+    int ret = 1;
+
+    if (sock < 0 || request == NULL) {
+        return 1;
+    }
+    memset(&buf, 0, sizeof(ExecutorBuffer));
+    _buffer_putString(&buf, request->fingerprint);
+    _buffer_putString(&buf, request->workdir);
+    _buffer_putString(&buf, request->request);
+    _buffer_putString(&buf, request->envfile);
+    _buffer_putUint(&buf, request->clearenv != 0);
+    _buffer_putArray(&buf, request->args);
+    _buffer_putArray(&buf, request->env);
+    _buffer_putArray(&buf, request->userEnv);
+    _buffer_putUint(&buf, request->umask);
+    _buffer_putUint(&buf, sizeof(cpu_set_t));
+    _buffer_append(&buf, &(request->affinity), sizeof(cpu_set_t));
+    _buffer_putUint(&buf, SHIFTER_EXECUTOR_NRLIMITS);
+    _buffer_append(&buf, request->rlimits, sizeof(request->rlimits));
+    if (buf.len > SHIFTER_EXECUTOR_MAX_REQUEST) {
+        goto _sendRequest_out;
+    }
+
+    header.magic = EXECUTOR_MAGIC;
+    header.length = buf.len;
+    memset(&msg, 0, sizeof(struct msghdr));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(ExecutorHeader);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * SHIFTER_EXECUTOR_NFDS);
+    memcpy(CMSG_DATA(cmsg), request->fds, sizeof(int) * SHIFTER_EXECUTOR_NFDS);
+
+    do {
+        nsent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (nsent < 0 && errno == EINTR);
+    if (nsent <= 0) {
+        goto _sendRequest_out;
+    }
+    if ((size_t) nsent < sizeof(ExecutorHeader) &&
+            _executor_writeAll(sock, (char *) &header + nsent,
+                sizeof(ExecutorHeader) - nsent) != 0)
+    {
+        goto _sendRequest_out;
+    }
+    ret = _executor_writeAll(sock, buf.data, buf.len);
+_sendRequest_out:
+    if (buf.data != NULL) {
+        free(buf.data);
+    }
+    return ret;
+}
+
+int shifter_executor_recvRequest(int sock, ShifterExecutorRequest *request,
+        struct ucred *peer)
+{
+    ExecutorBuffer buf;
+    ExecutorHeader header;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg = NULL;
+    char control[CMSG_SPACE(sizeof(int) * SHIFTER_EXECUTOR_NFDS)];
+    socklen_t credLen = sizeof(struct ucred);
+    uint32_t clearenv = 0;
+    uint32_t mask = 0;
+    uint32_t affinityLen = 0;
+    uint32_t nrlimits = 0;
+    ssize_t nread = 0;
+    int idx = 0;
+
+    if (sock < 0 || request == NULL || peer == NULL) {
+        return 1;
+    }
+    memset(request, 0, sizeof(ShifterExecutorRequest));
+    memset(&buf, 0, sizeof(ExecutorBuffer));
+    for (idx = 0; idx < SHIFTER_EXECUTOR_NFDS; idx++) {
+        request->fds[idx] = -1;
+    }
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, peer, &credLen) != 0) {
+        return 1;
+    }
+    request->peer = *peer;
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(ExecutorHeader);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    do {
+        nread = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (nread < 0 && errno == EINTR);
+    if (nread <= 0) {
+        return 1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        size_t nfds = 0;
+        int *fds = NULL;
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        fds = (int *) CMSG_DATA(cmsg);
+        for (idx = 0; (size_t) idx < nfds; idx++) {
+            if (idx < SHIFTER_EXECUTOR_NFDS && request->fds[idx] < 0) {
+                request->fds[idx] = fds[idx];
+            } else {
+                close(fds[idx]);
+            }
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+        goto _recvRequest_error;
+    }
+    for (idx = 0; idx < SHIFTER_EXECUTOR_NFDS; idx++) {
+        if (request->fds[idx] < 0) {
+            goto _recvRequest_error;
+        }
+    }
+    if ((size_t) nread < sizeof(ExecutorHeader) &&
+            _executor_readAll(sock, (char *) &header + nread,
+                sizeof(ExecutorHeader) - nread) !=
+            (ssize_t) (sizeof(ExecutorHeader) - nread))
+    {
+        goto _recvRequest_error;
+    }
+    if (header.magic != EXECUTOR_MAGIC ||
+            header.length > SHIFTER_EXECUTOR_MAX_REQUEST)
+    {
+        goto _recvRequest_error;
+    }
+
+    buf.data = (char *) _malloc(header.length + 1);
+    buf.capacity = header.length;
+    if (_executor_readAll(sock, buf.data, header.length) !=
+            (ssize_t) header.length)
+    {
+        goto _recvRequest_error;
+    }
+    if (_buffer_getString(&buf, &(request->fingerprint)) != 0 ||
+            _buffer_getString(&buf, &(request->workdir)) != 0 ||
+            _buffer_getString(&buf, &(request->request)) != 0 ||
+            _buffer_getString(&buf, &(request->envfile)) != 0 ||
+            _buffer_getUint(&buf, &clearenv) != 0 ||
+            _buffer_getArray(&buf, &(request->args)) != 0 ||
+            _buffer_getArray(&buf, &(request->env)) != 0 ||
+            _buffer_getArray(&buf, &(request->userEnv)) != 0 ||
+            _buffer_getUint(&buf, &mask) != 0 ||
+            _buffer_getUint(&buf, &affinityLen) != 0 ||
+            affinityLen != sizeof(cpu_set_t) ||
+            _buffer_getBytes(&buf, &(request->affinity), affinityLen) != 0 ||
+            _buffer_getUint(&buf, &nrlimits) != 0 ||
+            nrlimits != SHIFTER_EXECUTOR_NRLIMITS ||
+            _buffer_getBytes(&buf, request->rlimits,
+                sizeof(request->rlimits)) != 0 ||
+            buf.len != buf.capacity)
+    {
+        goto _recvRequest_error;
+    }
+    request->clearenv = clearenv != 0;
+    request->umask = mask & 0777;
+    free(buf.data);
+    return 0;
+_recvRequest_error:
+    if (buf.data != NULL) {
+        free(buf.data);
+    }
+    for (idx = 0; idx < SHIFTER_EXECUTOR_NFDS; idx++) {
+        if (request->fds[idx] >= 0) {
+            close(request->fds[idx]);
+        }
+    }
+    free_ShifterExecutorRequest(request, 0);
+    return 1;
+}
+
+void shifter_executor_captureContext(ShifterExecutorRequest *request) {
+    int idx = 0;
+
+    if (request == NULL) return;
+    request->umask = umask(0);
+    umask(request->umask);
+    CPU_ZERO(&(request->affinity));
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &(request->affinity)) != 0) {
+        CPU_ZERO(&(request->affinity));
+    }
+    for (idx = 0; idx < SHIFTER_EXECUTOR_NRLIMITS; idx++) {
+        if (getrlimit(idx, &(request->rlimits[idx])) != 0) {
+            /* capped at the executor's own limit */
+            request->rlimits[idx].rlim_cur = RLIM_INFINITY;
+            request->rlimits[idx].rlim_max = RLIM_INFINITY;
+        }
+    }
+}
+
+static char *_executor_readFile(const char *path) {
+    char *data = NULL;
+    ssize_t len = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    data = (char *) _malloc(EXECUTOR_MAX_CGROUP_FILE);
+    len = _executor_readAll(fd, data, EXECUTOR_MAX_CGROUP_FILE - 1);
+    close(fd);
+    if (len < 0) {
+        free(data);
+        return NULL;
+    }
+    data[len] = 0;
+    return data;
+}
+
+/* 1 if content has line (without its newline) as one of its lines */
+static int _executor_hasLine(const char *content, const char *line) {
+    size_t len = strlen(line);
+    const char *ptr = content;
+    while ((ptr = strstr(ptr, line)) != NULL) {
+        if ((ptr == content || ptr[-1] == '\n') &&
+                (ptr[len] == '\n' || ptr[len] == 0))
+        {
+            return 1;
+        }
+        ptr++;
+    }
+    return 0;
+}
+
+/* mount point of a hierarchy named in /proc/<pid>/cgroup: the unified
+ * hierarchy (no controllers) or one directory per v1 hierarchy */
+static char *_executor_cgroupDir(const char *controllers) {
+    if (controllers[0] == 0) {
+        if (access(EXECUTOR_CGROUP_ROOT "/cgroup.controllers", F_OK) == 0) {
+            return _strdup(EXECUTOR_CGROUP_ROOT);
+        }
+        return _strdup(EXECUTOR_CGROUP_ROOT "/unified");
+    }
+    if (strncmp(controllers, "name=", 5) == 0) {
+        controllers += 5;
+    }
+    return alloc_strgenf(EXECUTOR_CGROUP_ROOT "/%s", controllers);
+}
+
+/* move the calling process into every cgroup of pid it is not in yet */
+static int _executor_joinCgroups(pid_t pid) {
+    char *path = NULL;
+    char *peerCgroups = NULL;
+    char *ownCgroups = NULL;
+    char *line = NULL;
+    char *svPtr = NULL;
+    int rc = 0;
+
+    if (pid <= 0) {
+        return 1;
+    }
+    path = alloc_strgenf("/proc/%d/cgroup", (int) pid);
+    peerCgroups = _executor_readFile(path);
+    free(path);
+    ownCgroups = _executor_readFile("/proc/self/cgroup");
+    if (peerCgroups == NULL || ownCgroups == NULL) {
+        rc = 1;
+        goto _joinCgroups_out;
+    }
+    for (line = strtok_r(peerCgroups, "\n", &svPtr); line != NULL;
+            line = strtok_r(NULL, "\n", &svPtr))
+    {
+        char *controllers = strchr(line, ':');
+        char *cgroup = NULL;
+        char *dir = NULL;
+        char *procs = NULL;
+        int fd = -1;
+
+        if (_executor_hasLine(ownCgroups, line)) {
+            continue;
+        }
+        cgroup = controllers != NULL ? strchr(controllers + 1, ':') : NULL;
+        if (cgroup == NULL || cgroup[1] != '/') {
+            continue;
+        }
+        *cgroup++ = 0;
+        controllers++;
+        dir = _executor_cgroupDir(controllers);
+        if (access(dir, F_OK) != 0) {
+            /* hierarchy not mounted in the usual place */
+            free(dir);
+            continue;
+        }
+        procs = alloc_strgenf("%s%s/cgroup.procs", dir, cgroup);
+        fd = open(procs, O_WRONLY | O_CLOEXEC);
+        if (fd < 0 || dprintf(fd, "%d", (int) getpid()) < 0) {
+            fprintf(stderr, "FAILED to join cgroup %s: %s\n", procs,
+                    strerror(errno));
+            rc = 1;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(procs);
+        free(dir);
+    }
+_joinCgroups_out:
+    if (peerCgroups != NULL) free(peerCgroups);
+    if (ownCgroups != NULL) free(ownCgroups);
+    return rc;
+}
+
+int shifter_executor_applyContext(ShifterExecutorRequest *request) {
+    struct rlimit own;
+    int idx = 0;
+
+    if (request == NULL) {
+        return 1;
+    }
+    if (_executor_joinCgroups(request->peer.pid) != 0) {
+        return 1;
+    }
+    if (CPU_COUNT(&(request->affinity)) > 0 &&
+            sched_setaffinity(0, sizeof(cpu_set_t), &(request->affinity)) != 0)
+    {
+        fprintf(stderr, "FAILED to set CPU affinity: %s\n", strerror(errno));
+        return 1;
+    }
+    for (idx = 0; idx < SHIFTER_EXECUTOR_NRLIMITS; idx++) {
+        struct rlimit limit = request->rlimits[idx];
+        if (getrlimit(idx, &own) != 0) {
+            continue;
+        }
+        if (limit.rlim_max > own.rlim_max) {
+            limit.rlim_max = own.rlim_max;
+        }
+        if (limit.rlim_cur > limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+        }
+        if (setrlimit(idx, &limit) != 0) {
+            fprintf(stderr, "FAILED to set resource limit %d: %s\n", idx,
+                    strerror(errno));
+            return 1;
+        }
+    }
+    umask(request->umask & 0777);
+    return 0;
+}
+
+/* handle a single connection, runs in its own process */
+static int _executor_session(int sock, uid_t uid, const char *fingerprint,
+        ShifterExecutorAdmit admit, ShifterExecutorLaunch launch, void *data)
+{
+    ShifterExecutorRequest request;
+    ShifterExecutorMessage msg;
+    struct ucred peer;
+    sigset_t mask;
+    sigset_t oldMask;
+    int readyPipe[2] = { -1, -1 };
+    int sigFd = -1;
+    int status = 0;
+    int reject = 0;
+    int idx = 0;
+    pid_t child = -1;
+
+    if (shifter_executor_recvRequest(sock, &request, &peer) != 0) {
+        close(sock);
+        return 1;
+    }
+    if (peer.uid != uid) {
+        reject = EXECUTOR_REJECT_PERMISSION;
+    } else if (request.fingerprint == NULL ||
+            strcmp(request.fingerprint, fingerprint) != 0)
+    {
+        reject = EXECUTOR_REJECT_CONFIG;
+    } else if (request.args == NULL || request.args[0] == NULL) {
+        reject = EXECUTOR_REJECT_LAUNCH;
+    }
+
+    if (reject == 0) {
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, &oldMask);
+        sigFd = signalfd(-1, &mask, SFD_CLOEXEC);
+        if (sigFd >= 0 && pipe2(readyPipe, O_CLOEXEC) == 0) {
+            child = fork();
+        }
+        if (child == 0) {
+            /* the rank takes over the submitter's context before it is
+             * accepted, or the client launches it directly instead */
+            char result = 0;
+            sigprocmask(SIG_SETMASK, &oldMask, NULL);
+            close(readyPipe[0]);
+            setsid();
+            if (shifter_executor_applyContext(&request) != 0) {
+                result = EXECUTOR_REJECT_CONTEXT;
+            } else if (admit != NULL) {
+                result = (char) admit(&request, data);
+            }
+            if (write(readyPipe[1], &result, 1) != 1 || result != 0) {
+                _exit(127);
+            }
+            close(readyPipe[1]);
+            for (idx = 0; idx < SHIFTER_EXECUTOR_NFDS; idx++) {
+                if (dup2(request.fds[idx], idx) < 0) {
+                    _exit(127);
+                }
+            }
+            launch(&request, data);
+            _exit(127);
+        }
+        if (child < 0) {
+            reject = EXECUTOR_REJECT_LAUNCH;
+        } else {
+            char result = EXECUTOR_REJECT_LAUNCH;
+            close(readyPipe[1]);
+            readyPipe[1] = -1;
+            while (read(readyPipe[0], &result, 1) < 0 && errno == EINTR) { }
+            if (result != 0) {
+                reject = result;
+                waitpid(child, &status, 0);
+            }
+        }
+    }
+    for (idx = 0; idx < 2; idx++) {
+        if (readyPipe[idx] >= 0) {
+            close(readyPipe[idx]);
+        }
+    }
+    for (idx = 0; idx < SHIFTER_EXECUTOR_NFDS; idx++) {
+        close(request.fds[idx]);
+        request.fds[idx] = -1;
+    }
+    free_ShifterExecutorRequest(&request, 0);
+
+    if (reject != 0) {
+        _executor_sendMessage(sock, EXECUTOR_MSG_REJECT, reject);
+        close(sock);
+        return 1;
+    }
+    _executor_sendMessage(sock, EXECUTOR_MSG_ACCEPT, child);
+
+    for ( ; ; ) {
+        struct pollfd pfds[2];
+        pfds[0].fd = sock;
+        pfds[0].events = POLLIN;
+        pfds[0].revents = 0;
+        pfds[1].fd = sigFd;
+        pfds[1].events = POLLIN;
+        pfds[1].revents = 0;
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(sigFd, &info, sizeof(info)) < 0 && errno != EAGAIN) {
+                break;
+            }
+            if (waitpid(child, &status, WNOHANG) == child) {
+                child = -1;
+                break;
+            }
+        }
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (_executor_readAll(sock, &msg, sizeof(msg)) != sizeof(msg)) {
+                /* the client is gone, so is the rank */
+                break;
+            }
+            if (msg.type == EXECUTOR_MSG_SIGNAL && msg.value > 0 &&
+                    msg.value < NSIG)
+            {
+                kill(child, msg.value);
+            }
+        }
+    }
+    if (child > 0) {
+        kill(child, SIGKILL);
+        waitpid(child, &status, 0);
+        close(sigFd);
+        close(sock);
+        return 1;
+    }
+    _executor_sendMessage(sock, EXECUTOR_MSG_EXIT, status);
+    close(sigFd);
+    close(sock);
+    return 0;
+}
+
+int shifter_executor_serve(int listenFd, const char *path, uid_t uid,
+        const char *fingerprint, int idleTimeout,
+        ShifterExecutorAdmit admit, ShifterExecutorLaunch launch, void *data)
+{
+    struct stat listenStat;
+    struct stat pathStat;
+    time_t lastActive = time(NULL);
+    int sessions = 0;
+
+    if (listenFd < 0 || fingerprint == NULL || launch == NULL) {
+        return 1;
+    }
+    if (idleTimeout <= 0) {
+        idleTimeout = SHIFTER_EXECUTOR_IDLE_TIMEOUT;
+    }
+    memset(&listenStat, 0, sizeof(struct stat));
+    if (path != NULL && stat(path, &listenStat) != 0) {
+        path = NULL;
+    }
+
+    for ( ; ; ) {
+        struct pollfd pfd;
+        time_t now = 0;
+        pid_t pid = 0;
+        int sock = -1;
+        int rc = 0;
+
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            sessions--;
+            lastActive = time(NULL);
+        }
+        now = time(NULL);
+        if (sessions <= 0 && now - lastActive >= idleTimeout) {
+            break;
+        }
+
+        pfd.fd = listenFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        rc = poll(&pfd, 1, 1000);
+        if (rc < 0 && errno != EINTR) {
+            break;
+        }
+        if (rc <= 0) {
+            continue;
+        }
+        sock = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            continue;
+        }
+        pid = fork();
+        if (pid == 0) {
+            close(listenFd);
+            _exit(_executor_session(sock, uid, fingerprint, admit, launch,
+                    data));
+        }
+        close(sock);
+        if (pid > 0) {
+            sessions++;
+            lastActive = now;
+        }
+    }
+
+    /* a replacement daemon may have taken over the path */
+    if (path != NULL && stat(path, &pathStat) == 0 &&
+            pathStat.st_dev == listenStat.st_dev &&
+            pathStat.st_ino == listenStat.st_ino)
+    {
+        unlink(path);
+    }
+    close(listenFd);
+    return 0;
+}
+
+static void _executor_forwardSignal(int sig) {
+    ShifterExecutorMessage msg;
+    int saved_errno = errno;
+    msg.type = EXECUTOR_MSG_SIGNAL;
+    msg.value = sig;
+    if (_executorClientSock >= 0) {
+        send(_executorClientSock, &msg, sizeof(msg),
+                MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    errno = saved_errno;
+}
+
+int shifter_executor_run(const char *path, uid_t serverUid,
+        ShifterExecutorRequest *request, int *status)
+{
+    ShifterExecutorMessage msg;
+    struct sigaction action;
+    struct sigaction saved[sizeof(_executorSignals) / sizeof(int)];
+    int sock = -1;
+    int ret = 2;
+    int idx = 0;
+
+    if (path == NULL || request == NULL || status == NULL) {
+        return 1;
+    }
+    sock = shifter_executor_connect(path, serverUid);
+    if (sock < 0) {
+        return 1;
+    }
+    shifter_executor_captureContext(request);
+    if (shifter_executor_sendRequest(sock, request) != 0 ||
+            _executor_readAll(sock, &msg, sizeof(msg)) != sizeof(msg) ||
+            msg.type != EXECUTOR_MSG_ACCEPT)
+    {
+        close(sock);
+        return 1;
+    }
+
+    _executorClientSock = sock;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = _executor_forwardSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    for (idx = 0; _executorSignals[idx] != 0; idx++) {
+        sigaction(_executorSignals[idx], &action, &(saved[idx]));
+    }
+
+    while (_executor_readAll(sock, &msg, sizeof(msg)) == sizeof(msg)) {
+        if (msg.type == EXECUTOR_MSG_EXIT) {
+            *status = msg.value;
+            ret = 0;
+            break;
+        }
+    }
+
+    for (idx = 0; _executorSignals[idx] != 0; idx++) {
+        sigaction(_executorSignals[idx], &(saved[idx]), NULL);
+    }
+    _executorClientSock = -1;
+    close(sock);
+    return ret;
+}
+
+void free_ShifterExecutorRequest(ShifterExecutorRequest *request,
+        int freeStruct)
+{
+    if (request == NULL) return;
+    if (request->fingerprint != NULL) free(request->fingerprint);
+    if (request->workdir != NULL) free(request->workdir);
+    if (request->request != NULL) free(request->request);
+    if (request->envfile != NULL) free(request->envfile);
+    if (request->args != NULL) free_string_array(request->args);
+    if (request->env != NULL) free_string_array(request->env);
+    if (request->userEnv != NULL) free_string_array(request->userEnv);
+    request->fingerprint = NULL;
+    request->workdir = NULL;
+    request->request = NULL;
+    request->envfile = NULL;
+    request->args = NULL;
+    request->env = NULL;
+    request->userEnv = NULL;
+    if (freeStruct) {
+        free(request);
+    }
+}
@@ -0,0 +1,178 @@
+/** @file shifter_executor.h
+ *  @brief node-local executor that launches ranks into a ready UDI
+ *
+ *  The first shifter of a job step starts a root-owned daemon which holds
+ *  the prepared mount namespace.  Subsequent shifter invocations by the same
+ *  user pass their arguments, environment and stdio over a unix socket; the
+ *  daemon authenticates them with SO_PEERCRED and forks the rank directly
+ *  into the container.  The rank gets the cgroups, CPU affinity, resource
+ *  limits and umask of the shifter that submitted it, not the daemon's.
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef __SHFTR_EXECUTOR_INCLUDE
+#define __SHFTR_EXECUTOR_INCLUDE
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHIFTER_EXECUTOR_IDLE_TIMEOUT 300
+#define SHIFTER_EXECUTOR_MAX_REQUEST (8 * 1024 * 1024)
+#define SHIFTER_EXECUTOR_NFDS 3
+#define SHIFTER_EXECUTOR_NRLIMITS RLIM_NLIMITS
+
+#define EXECUTOR_MSG_ACCEPT 1
+#define EXECUTOR_MSG_REJECT 2
+#define EXECUTOR_MSG_EXIT 3
+#define EXECUTOR_MSG_SIGNAL 4
+
+#define EXECUTOR_REJECT_PERMISSION 1
+#define EXECUTOR_REJECT_CONFIG 2
+#define EXECUTOR_REJECT_LAUNCH 3
+#define EXECUTOR_REJECT_CONTEXT 4
+
+typedef struct _ShifterExecutorRequest {
+    char *fingerprint;
+    char *workdir;
+    char *request;
+    char *envfile;
+    int clearenv;
+    char **args;
+    char **env;
+    char **userEnv;
+    int fds[SHIFTER_EXECUTOR_NFDS];
+
+    /* process context of the submitting shifter, see
+     * shifter_executor_captureContext; an empty affinity is not applied */
+    mode_t umask;
+    cpu_set_t affinity;
+    struct rlimit rlimits[SHIFTER_EXECUTOR_NRLIMITS];
+
+    /* filled in by the executor from SO_PEERCRED */
+    struct ucred peer;
+} ShifterExecutorRequest;
+
+typedef struct _ShifterExecutorMessage {
+    int32_t type;
+    int32_t value;
+} ShifterExecutorMessage;
+
+/** ShifterExecutorLaunch
+ * called in a freshly forked child with the request's stdio already on fds
+ * 0-2; must exec the rank, returning means failure
+ */
+typedef void (*ShifterExecutorLaunch)(ShifterExecutorRequest *request,
+        void *data);
+
+/** ShifterExecutorAdmit
+ * called in the rank's child before the request is accepted, once the
+ * submitter's process context is applied; returns 0 to launch the rank or
+ * an EXECUTOR_REJECT_* code to send the client back to a direct launch
+ */
+typedef int (*ShifterExecutorAdmit)(ShifterExecutorRequest *request,
+        void *data);
+
+/** shifter_executor_socketPath
+ * path of the executor socket for this user and job step, or NULL if the
+ * executor is disabled (no socketDir) or shifter is not in a job step
+ */
+char *shifter_executor_socketPath(const char *socketDir, uid_t uid,
+        const char *jobId, const char *stepId);
+
+/** shifter_executor_listen
+ * bind and listen on path, owned by uid with mode 0600.  A stale socket
+ * left by a dead daemon is replaced; a live one is not.
+ *
+ * Returns the listening fd, or -1 on failure (including another daemon
+ * already serving path)
+ */
+int shifter_executor_listen(const char *path, uid_t uid);
+
+/** shifter_executor_serve
+ * accept requests on listenFd until no request has been active for
+ * idleTimeout seconds.  Each connection is handled in its own process: the
+ * peer must be uid and present a matching fingerprint, its process context
+ * must apply and admit (if not NULL) must accept it, otherwise the request
+ * is rejected and the client falls back to a direct launch.  Removes path
+ * on return if it still refers to listenFd's socket.
+ */
+int shifter_executor_serve(int listenFd, const char *path, uid_t uid,
+        const char *fingerprint, int idleTimeout,
+        ShifterExecutorAdmit admit, ShifterExecutorLaunch launch, void *data);
+
+/** shifter_executor_connect
+ * connect to the executor at path, verifying that it is run by serverUid
+ *
+ * Returns the connected fd, or -1
+ */
+int shifter_executor_connect(const char *path, uid_t serverUid);
+
+/** shifter_executor_captureContext
+ * record the umask, CPU affinity and resource limits of the calling process
+ * in request
+ */
+void shifter_executor_captureContext(ShifterExecutorRequest *request);
+
+/** shifter_executor_applyContext
+ * give the calling process the context recorded in request and move it into
+ * the cgroups of request->peer.pid.  Resource limits are capped at the
+ * calling process's hard limits.
+ *
+ * Returns 0 on success
+ */
+int shifter_executor_applyContext(ShifterExecutorRequest *request);
+
+int shifter_executor_sendRequest(int sock, ShifterExecutorRequest *request);
+int shifter_executor_recvRequest(int sock, ShifterExecutorRequest *request,
+        struct ucred *peer);
+
+/** shifter_executor_run
+ * submit request to the executor at path, with the process context of the
+ * caller, and wait for the rank to finish, forwarding signals received in
+ * the meantime.  The raw wait status of the rank is stored in status.
+ *
+ * Returns 0 if the rank ran, 1 if no executor is available or it rejected
+ * the request (the caller should launch directly), 2 if the executor was
+ * lost after accepting the request
+ */
+int shifter_executor_run(const char *path, uid_t serverUid,
+        ShifterExecutorRequest *request, int *status);
+
+void free_ShifterExecutorRequest(ShifterExecutorRequest *request,
+        int freeStruct);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,344 @@
+/** @file shifter_gpu.c
+ *  @brief discovery of the NVIDIA driver files injected by GPU modules
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "shifter_gpu.h"
+#include "shifter_ldcache.h"
+#include "shifter_mem.h"
+#include "utility.h"
+
+/* the NVIDIA compute libraries that will be bind mounted into the container */
+static const char *_gpuLibraries[] = {
+    "cuda",
+    "nvidia-compiler",
+    "nvidia-ptxjitcompiler",
+    "nvidia-encode",
+    "nvidia-ml",
+    "nvidia-fatbinaryloader",
+    "nvidia-opencl",
+    NULL
+};
+
+/* the NVIDIA binaries that will be bind mounted into the container */
+static const char *_gpuBinaries[] = {
+    "nvidia-cuda-mps-control",
+    "nvidia-cuda-mps-server",
+    "nvidia-debugdump",
+    "nvidia-persistenced",
+    "nvidia-smi",
+    NULL
+};
+
+int shifter_gpu_driverVersion(const char *path, char *version, size_t len) {
+    FILE *fp = NULL;
+    char *ptr = NULL;
+
+    if (path == NULL || version == NULL || len == 0) {
+        return 1;
+    }
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    ptr = fgets(version, len, fp);
+    fclose(fp);
+    if (ptr == NULL) {
+        return 1;
+    }
+    version[strcspn(version, "\n")] = 0;
+    return version[0] == 0;
+}
+
+/** _elfClass
+ * Returns 32 or 64 for the ELF class of path, 0 if it is not ELF
+ */
+static int _elfClass(const char *path) {
+    unsigned char ident[5];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t bytes = 0;
+
+    if (fd < 0) {
+        return 0;
+    }
+    bytes = read(fd, ident, sizeof(ident));
+    close(fd);
+    if (bytes != sizeof(ident) || memcmp(ident, "\177ELF", 4) != 0) {
+        return 0;
+    }
+    if (ident[4] == 1) return 32;
+    if (ident[4] == 2) return 64;
+    return 0;
+}
+
+typedef struct _GpuDiscovery {
+    const char *target;
+    char *siteFs;
+    size_t len;
+    size_t capacity;
+    char **mounted;
+    size_t n_mounted;
+    int found[sizeof(_gpuLibraries) / sizeof(_gpuLibraries[0])];
+} GpuDiscovery;
+
+static int _addGpuMount(GpuDiscovery *discovery, const char *from,
+        const char *subdir, const char *name)
+{
+    size_t idx = 0;
+    char *to = alloc_strgenf("%s/%s/%s", discovery->target, subdir, name);
+
+    /* the volume map syntax cannot express these */
+    if (strpbrk(from, ":;,") != NULL || strpbrk(to, ":;,") != NULL) {
+        fprintf(stderr, "WARNING: cannot map GPU support file %s\n", from);
+        free(to);
+        return 0;
+    }
+    for (idx = 0; idx < discovery->n_mounted; idx++) {
+        if (strcmp(discovery->mounted[idx], to) == 0) {
+            free(to);
+            return 0;
+        }
+    }
+    discovery->mounted = (char **) _realloc(discovery->mounted,
+            sizeof(char *) * (discovery->n_mounted + 1));
+    discovery->mounted[discovery->n_mounted++] = to;
+    discovery->siteFs = alloc_strcatf(discovery->siteFs, &(discovery->len),
+            &(discovery->capacity), "%s%s:%s:ro",
+            discovery->len > 0 ? ";" : "", from, to);
+    return 0;
+}
+
+static int _visitGpuLibrary(const ShifterLdCacheEntry *entry, void *data) {
+    GpuDiscovery *discovery = (GpuDiscovery *) data;
+    const char *name = entry->name;
+    const char *path = entry->path;
+    const char *basename = NULL;
+    int idx = 0;
+
+    if (strncmp(name, "lib", 3) != 0) {
+        return 0;
+    }
+    for (idx = 0; _gpuLibraries[idx] != NULL; idx++) {
+        size_t len = strlen(_gpuLibraries[idx]);
+        int elfClass = 0;
+
+        if (strncmp(name + 3, _gpuLibraries[idx], len) != 0 ||
+                strncmp(name + 3 + len, ".so", 3) != 0)
+        {
+            continue;
+        }
+        elfClass = _elfClass(path);
+        if (elfClass == 0) {
+            fprintf(stderr, "FAILED to determine architecture of %s\n", path);
+            return 1;
+        }
+        basename = strrchr(path, '/');
+        basename = basename != NULL ? basename + 1 : path;
+        discovery->found[idx] = 1;
+        return _addGpuMount(discovery, path,
+                elfClass == 32 ? "lib" : "lib64", basename);
+    }
+    return 0;
+}
+
+char *shifter_gpu_findBinary(const char *binPath, const char *name) {
+    const char *ptr = binPath;
+
+    if (binPath == NULL || name == NULL) {
+        return NULL;
+    }
+    while (*ptr != 0) {
+        const char *end = strchr(ptr, ':');
+        size_t len = end != NULL ? (size_t) (end - ptr) : strlen(ptr);
+        struct stat statData;
+        char *path = NULL;
+
+        if (len > 0) {
+            path = alloc_strgenf("%.*s/%s", (int) len, ptr, name);
+            if (stat(path, &statData) == 0 && S_ISREG(statData.st_mode) &&
+                    access(path, X_OK) == 0)
+            {
+                return path;
+            }
+            free(path);
+        }
+        if (end == NULL) {
+            break;
+        }
+        ptr = end + 1;
+    }
+    return NULL;
+}
+
+char *shifter_gpu_discover(const char *ldCache, const char *binPath,
+        const char *target)
+{
+    GpuDiscovery discovery;
+    size_t idx = 0;
+    int ret = 0;
+
+    if (ldCache == NULL || binPath == NULL || target == NULL ||
+            target[0] != '/')
+    {
+        return NULL;
+    }
+    memset(&discovery, 0, sizeof(GpuDiscovery));
+    discovery.target = target;
+
+    ret = shifter_ldcache_parse(ldCache, _visitGpuLibrary, &discovery);
+    if (ret != 0) {
+        fprintf(stderr, "FAILED to read GPU libraries from %s\n", ldCache);
+        goto _discover_error;
+    }
+    for (idx = 0; _gpuLibraries[idx] != NULL; idx++) {
+        if (!discovery.found[idx]) {
+            fprintf(stderr, "WARNING: Could not find library: %s\n",
+                    _gpuLibraries[idx]);
+        }
+    }
+
+    for (idx = 0; _gpuBinaries[idx] != NULL; idx++) {
+        char *path = shifter_gpu_findBinary(binPath, _gpuBinaries[idx]);
+        if (path == NULL) {
+            if (strcmp(_gpuBinaries[idx], "nvidia-smi") == 0) {
+                fprintf(stderr, "FAILED to find nvidia-smi on the host\n");
+                goto _discover_error;
+            }
+            fprintf(stderr, "WARNING: Could not find binary: %s\n",
+                    _gpuBinaries[idx]);
+            continue;
+        }
+        _addGpuMount(&discovery, path, "bin", _gpuBinaries[idx]);
+        free(path);
+    }
+
+    for (idx = 0; idx < discovery.n_mounted; idx++) {
+        free(discovery.mounted[idx]);
+    }
+    free(discovery.mounted);
+    return discovery.siteFs;
+
+_discover_error:
+    for (idx = 0; idx < discovery.n_mounted; idx++) {
+        free(discovery.mounted[idx]);
+    }
+    free(discovery.mounted);
+    free(discovery.siteFs);
+    return NULL;
+}
+
+/* cache file layout: driver version, target, map; one per line */
+char *shifter_gpu_loadCache(const char *cacheFile, const char *version,
+        const char *target)
+{
+    struct stat statData;
+    char *lines[3] = { NULL, NULL, NULL };
+    char *ret = NULL;
+    size_t len = 0;
+    FILE *fp = NULL;
+    int fd = -1;
+    int idx = 0;
+
+    if (cacheFile == NULL || version == NULL || target == NULL) {
+        return NULL;
+    }
+    fd = open(cacheFile, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &statData) != 0 || !S_ISREG(statData.st_mode) ||
+            statData.st_uid != geteuid() || (fp = fdopen(fd, "r")) == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    for (idx = 0; idx < 3; idx++) {
+        len = 0;
+        if (getline(&lines[idx], &len, fp) < 0) {
+            goto _loadCache_exit;
+        }
+        lines[idx][strcspn(lines[idx], "\n")] = 0;
+    }
+    if (strcmp(lines[0], version) == 0 && strcmp(lines[1], target) == 0 &&
+            lines[2][0] != 0)
+    {
+        ret = lines[2];
+        lines[2] = NULL;
+    }
+
+_loadCache_exit:
+    for (idx = 0; idx < 3; idx++) {
+        free(lines[idx]);
+    }
+    fclose(fp);
+    return ret;
+}
+
+int shifter_gpu_saveCache(const char *cacheFile, const char *version,
+        const char *target, const char *siteFs)
+{
+    char *tmpFile = NULL;
+    FILE *fp = NULL;
+    int fd = -1;
+
+    if (cacheFile == NULL || version == NULL || target == NULL ||
+            siteFs == NULL || strchr(version, '\n') != NULL ||
+            strchr(target, '\n') != NULL || strchr(siteFs, '\n') != NULL)
+    {
+        return 1;
+    }
+    tmpFile = alloc_strgenf("%s.XXXXXX", cacheFile);
+    fd = mkostemp(tmpFile, O_CLOEXEC);
+    if (fd < 0) {
+        free(tmpFile);
+        return 1;
+    }
+    fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        close(fd);
+        goto _saveCache_error;
+    }
+    fprintf(fp, "%s\n%s\n%s\n", version, target, siteFs);
+    if (fclose(fp) != 0) {
+        goto _saveCache_error;
+    }
+    if (rename(tmpFile, cacheFile) != 0) {
+        goto _saveCache_error;
+    }
+    free(tmpFile);
+    return 0;
+
+_saveCache_error:
+    unlink(tmpFile);
+    free(tmpFile);
+    return 1;
+}
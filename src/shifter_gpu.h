@@ -0,0 +1,94 @@
+/** @file shifter_gpu.h
+ *  @brief discovery of the NVIDIA driver files injected by GPU modules
+ *
+ *  Replaces the per-job contrib/gpu/activate_gpu_support.sh: the compute
+ *  libraries are looked up directly in ld.so.cache and the binaries in a
+ *  fixed search path, producing a siteFs-style volume map.  The map is
+ *  cached on the node keyed on the loaded driver version so that most jobs
+ *  do no discovery at all.
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef __SHFTR_GPU_INCLUDE
+#define __SHFTR_GPU_INCLUDE
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHIFTER_GPU_LDCACHE "/etc/ld.so.cache"
+#define SHIFTER_GPU_DRIVER_VERSION "/proc/driver/nvidia/version"
+#define SHIFTER_GPU_UVM_DEVICE "/dev/nvidia-uvm"
+#define SHIFTER_GPU_BIN_PATH "/usr/local/bin:/usr/bin:/bin:/sbin"
+
+/** shifter_gpu_driverVersion
+ * read the first line of the driver version file into version
+ *
+ * Returns 0 on success, 1 if no driver is loaded or the line is empty
+ */
+int shifter_gpu_driverVersion(const char *path, char *version, size_t len);
+
+/** shifter_gpu_discover
+ * locate the NVIDIA compute libraries via ldCache and the NVIDIA binaries
+ * in the colon-separated binPath, and return a siteFs volume map string
+ * mounting them read-only under target/lib (32-bit), target/lib64 (64-bit)
+ * and target/bin.  Missing libraries and optional binaries are warned
+ * about; a missing nvidia-smi is an error since the container's own copy
+ * would otherwise be used against the host driver.
+ *
+ * Returns the newly allocated map, or NULL on failure
+ */
+char *shifter_gpu_discover(const char *ldCache, const char *binPath,
+        const char *target);
+
+/** shifter_gpu_findBinary
+ * Returns the newly allocated path of the executable name in binPath, or
+ * NULL if it is not found
+ */
+char *shifter_gpu_findBinary(const char *binPath, const char *name);
+
+/** shifter_gpu_loadCache
+ * Returns the map stored in cacheFile if it was recorded for the same
+ * driver version and target, otherwise NULL.  The file must be a regular
+ * file owned by the effective user.
+ */
+char *shifter_gpu_loadCache(const char *cacheFile, const char *version,
+        const char *target);
+
+/** shifter_gpu_saveCache
+ * atomically replace cacheFile with the map for version and target
+ *
+ * Returns 0 on success
+ */
+int shifter_gpu_saveCache(const char *cacheFile, const char *version,
+        const char *target, const char *siteFs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
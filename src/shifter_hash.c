@@ -0,0 +1,202 @@
+/** @file shifter_hash.c
+ *  @brief SHA-256 digest used to fingerprint UDI configurations
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <string.h>
+#include "shifter_hash.h"
+
+static const uint32_t _sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void _sha256_block(ShifterHash *hash, const unsigned char *block) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    int idx = 0;
+
+    for (idx = 0; idx < 16; idx++) {
+        w[idx] = ((uint32_t) block[idx * 4] << 24)
+            | ((uint32_t) block[idx * 4 + 1] << 16)
+            | ((uint32_t) block[idx * 4 + 2] << 8)
+            | ((uint32_t) block[idx * 4 + 3]);
+    }
+    for (idx = 16; idx < 64; idx++) {
+        uint32_t s0 = ROTR(w[idx - 15], 7) ^ ROTR(w[idx - 15], 18) ^ (w[idx - 15] >> 3);
+        uint32_t s1 = ROTR(w[idx - 2], 17) ^ ROTR(w[idx - 2], 19) ^ (w[idx - 2] >> 10);
+        w[idx] = w[idx - 16] + s0 + w[idx - 7] + s1;
+    }
+
+    a = hash->state[0];
+    b = hash->state[1];
+    c = hash->state[2];
+    d = hash->state[3];
+    e = hash->state[4];
+    f = hash->state[5];
+    g = hash->state[6];
+    h = hash->state[7];
+
+    for (idx = 0; idx < 64; idx++) {
+        uint32_t S1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + S1 + ch + _sha256_k[idx] + w[idx];
+        uint32_t S0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = S0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    hash->state[0] += a;
+    hash->state[1] += b;
+    hash->state[2] += c;
+    hash->state[3] += d;
+    hash->state[4] += e;
+    hash->state[5] += f;
+    hash->state[6] += g;
+    hash->state[7] += h;
+}
+
+void shifter_hash_init(ShifterHash *hash) {
+    if (hash == NULL) return;
+    hash->state[0] = 0x6a09e667;
+    hash->state[1] = 0xbb67ae85;
+    hash->state[2] = 0x3c6ef372;
+    hash->state[3] = 0xa54ff53a;
+    hash->state[4] = 0x510e527f;
+    hash->state[5] = 0x9b05688c;
+    hash->state[6] = 0x1f83d9ab;
+    hash->state[7] = 0x5be0cd19;
+    hash->length = 0;
+    hash->buffered = 0;
+}
+
+void shifter_hash_update(ShifterHash *hash, const void *data, size_t len) {
+    const unsigned char *ptr = (const unsigned char *) data;
+    if (hash == NULL || (data == NULL && len > 0)) return;
+
+    hash->length += len;
+    if (hash->buffered > 0) {
+        size_t take = 64 - hash->buffered;
+        if (take > len) take = len;
+        memcpy(hash->buffer + hash->buffered, ptr, take);
+        hash->buffered += take;
+        ptr += take;
+        len -= take;
+        if (hash->buffered < 64) return;
+        _sha256_block(hash, hash->buffer);
+        hash->buffered = 0;
+    }
+    while (len >= 64) {
+        _sha256_block(hash, ptr);
+        ptr += 64;
+        len -= 64;
+    }
+    if (len > 0) {
+        memcpy(hash->buffer, ptr, len);
+        hash->buffered = len;
+    }
+}
+
+void shifter_hash_final(ShifterHash *hash, unsigned char *digest) {
+    uint64_t bits = 0;
+    int idx = 0;
+    if (hash == NULL || digest == NULL) return;
+
+    bits = hash->length * 8;
+    hash->buffer[hash->buffered++] = 0x80;
+    if (hash->buffered > 56) {
+        memset(hash->buffer + hash->buffered, 0, 64 - hash->buffered);
+        _sha256_block(hash, hash->buffer);
+        hash->buffered = 0;
+    }
+    memset(hash->buffer + hash->buffered, 0, 56 - hash->buffered);
+    for (idx = 0; idx < 8; idx++) {
+        hash->buffer[56 + idx] = (unsigned char) (bits >> (56 - 8 * idx));
+    }
+    _sha256_block(hash, hash->buffer);
+
+    for (idx = 0; idx < 8; idx++) {
+        digest[idx * 4] = (unsigned char) (hash->state[idx] >> 24);
+        digest[idx * 4 + 1] = (unsigned char) (hash->state[idx] >> 16);
+        digest[idx * 4 + 2] = (unsigned char) (hash->state[idx] >> 8);
+        digest[idx * 4 + 3] = (unsigned char) (hash->state[idx]);
+    }
+    shifter_hash_init(hash);
+}
+
+void shifter_hash_field(ShifterHash *hash, const char *name,
+        const void *value, size_t len)
+{
+    unsigned char prefix[9];
+    int idx = 0;
+    if (hash == NULL || name == NULL) return;
+
+    shifter_hash_update(hash, name, strlen(name) + 1);
+    prefix[0] = value != NULL;
+    for (idx = 0; idx < 8; idx++) {
+        prefix[1 + idx] = (unsigned char) ((uint64_t) len >> (56 - 8 * idx));
+    }
+    shifter_hash_update(hash, prefix, sizeof(prefix));
+    if (value != NULL) {
+        shifter_hash_update(hash, value, len);
+    }
+}
+
+void shifter_hash_string(ShifterHash *hash, const char *name,
+        const char *value)
+{
+    shifter_hash_field(hash, name, value, value != NULL ? strlen(value) : 0);
+}
+
+void shifter_hash_hex(const unsigned char *digest, char *hex) {
+    const char *digits = "0123456789abcdef";
+    int idx = 0;
+    if (digest == NULL || hex == NULL) return;
+    for (idx = 0; idx < SHIFTER_HASH_SIZE; idx++) {
+        hex[idx * 2] = digits[digest[idx] >> 4];
+        hex[idx * 2 + 1] = digits[digest[idx] & 0x0f];
+    }
+    hex[SHIFTER_HASH_HEX_SIZE] = 0;
+}
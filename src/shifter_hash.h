@@ -0,0 +1,74 @@
+/** @file shifter_hash.h
+ *  @brief SHA-256 digest used to fingerprint UDI configurations
+ *
+ *  Self-contained so that the setuid binaries and the slurm plugin do not
+ *  need to link a crypto library.
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef __SHFTR_HASH_INCLUDE
+#define __SHFTR_HASH_INCLUDE
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHIFTER_HASH_SIZE 32
+#define SHIFTER_HASH_HEX_SIZE (SHIFTER_HASH_SIZE * 2)
+
+typedef struct _ShifterHash {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char buffer[64];
+    size_t buffered;
+} ShifterHash;
+
+void shifter_hash_init(ShifterHash *hash);
+void shifter_hash_update(ShifterHash *hash, const void *data, size_t len);
+void shifter_hash_final(ShifterHash *hash, unsigned char *digest);
+
+/** shifter_hash_field
+ * add a named, length-prefixed field to the digest so that adjacent fields
+ * cannot run together; value may be NULL, which is distinct from ""
+ */
+void shifter_hash_field(ShifterHash *hash, const char *name,
+        const void *value, size_t len);
+void shifter_hash_string(ShifterHash *hash, const char *name,
+        const char *value);
+
+/** shifter_hash_hex
+ * write the lowercase hex form of digest into hex, which must hold
+ * SHIFTER_HASH_HEX_SIZE + 1 bytes
+ */
+void shifter_hash_hex(const unsigned char *digest, char *hex);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,560 @@
+/** @file shifter_ldcache.c
+ *  @brief reading and writing ld.so.cache files
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "shifter_ldcache.h"
+#include "shifter_mem.h"
+#include "utility.h"
+
+/* ld.so.cache layouts, see glibc sysdeps/generic/dl-cache.h */
+#define LDCACHE_MAGIC "ld.so-1.7.0"
+#define LDCACHE_MAGIC_NEW "glibc-ld.so.cache1.1"
+#define LDCACHE_HEADER_SIZE 16
+#define LDCACHE_ENTRY_SIZE 12
+#define LDCACHE_HEADER_SIZE_NEW 48
+#define LDCACHE_ENTRY_SIZE_NEW 24
+#define LDCACHE_MAX_SIZE (64 * 1024 * 1024)
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define LDCACHE_ENDIAN_FLAG 2
+#define ELF_HOST_DATA ELFDATA2LSB
+#else
+#define LDCACHE_ENDIAN_FLAG 3
+#define ELF_HOST_DATA ELFDATA2MSB
+#endif
+
+/* bound on the ELF sections read to find a soname */
+#define ELF_MAX_SECTION (1024 * 1024)
+
+static uint32_t _readUint32(const unsigned char *ptr) {
+    uint32_t value = 0;
+    memcpy(&value, ptr, sizeof(uint32_t));
+    return value;
+}
+
+static uint64_t _readUint64(const unsigned char *ptr) {
+    uint64_t value = 0;
+    memcpy(&value, ptr, sizeof(uint64_t));
+    return value;
+}
+
+static void _writeUint32(unsigned char *ptr, uint32_t value) {
+    memcpy(ptr, &value, sizeof(uint32_t));
+}
+
+static void _writeUint64(unsigned char *ptr, uint64_t value) {
+    memcpy(ptr, &value, sizeof(uint64_t));
+}
+
+static int _ldcacheVisitTable(const unsigned char *cache, size_t size,
+        size_t entries, uint32_t nlibs, size_t entrySize, size_t strings,
+        ShifterLdCacheVisit visit, void *data)
+{
+    ShifterLdCacheEntry entry;
+    uint32_t idx = 0;
+
+    if (entries > size || nlibs > (size - entries) / entrySize ||
+            strings > size)
+    {
+        return -1;
+    }
+    for (idx = 0; idx < nlibs; idx++) {
+        const unsigned char *ptr = cache + entries + idx * entrySize;
+        size_t key = strings + _readUint32(ptr + 4);
+        size_t value = strings + _readUint32(ptr + 8);
+        int ret = 0;
+
+        /* the final byte of the buffer is NUL, so bounded strings are safe */
+        if (key >= size || value >= size) {
+            return -1;
+        }
+        memset(&entry, 0, sizeof(ShifterLdCacheEntry));
+        entry.name = (const char *) cache + key;
+        entry.path = (const char *) cache + value;
+        entry.flags = (int32_t) _readUint32(ptr);
+        if (entrySize == LDCACHE_ENTRY_SIZE_NEW) {
+            entry.osVersion = _readUint32(ptr + 12);
+            entry.hwcap = _readUint64(ptr + 16);
+        }
+        ret = visit(&entry, data);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int shifter_ldcache_parse(const char *path, ShifterLdCacheVisit visit,
+        void *data)
+{
+    unsigned char *cache = NULL;
+    struct stat statData;
+    size_t size = 0;
+    size_t nread = 0;
+    size_t newOffset = 0;
+    int fd = -1;
+    int ret = -1;
+
+    if (path == NULL || visit == NULL) {
+        return -1;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &statData) != 0 || !S_ISREG(statData.st_mode) ||
+            statData.st_size <= 0 || statData.st_size > LDCACHE_MAX_SIZE)
+    {
+        goto _ldcache_exit;
+    }
+    size = (size_t) statData.st_size;
+    cache = (unsigned char *) _malloc(size + 1);
+    while (nread < size) {
+        ssize_t bytes = read(fd, cache + nread, size - nread);
+        if (bytes <= 0) {
+            goto _ldcache_exit;
+        }
+        nread += (size_t) bytes;
+    }
+    cache[size] = 0;
+    size++;
+
+    if (size > LDCACHE_HEADER_SIZE_NEW && memcmp(cache, LDCACHE_MAGIC_NEW,
+                strlen(LDCACHE_MAGIC_NEW)) == 0)
+    {
+        /* new format strings are relative to the start of its header */
+        ret = _ldcacheVisitTable(cache, size, LDCACHE_HEADER_SIZE_NEW,
+                _readUint32(cache + 20), LDCACHE_ENTRY_SIZE_NEW, 0, visit,
+                data);
+    } else if (size > LDCACHE_HEADER_SIZE && memcmp(cache, LDCACHE_MAGIC,
+                strlen(LDCACHE_MAGIC)) == 0)
+    {
+        uint32_t nlibs = _readUint32(cache + 12);
+        size_t strings = LDCACHE_HEADER_SIZE +
+                (size_t) nlibs * LDCACHE_ENTRY_SIZE;
+
+        /* a new-format table may follow, 8-byte aligned, in the strings */
+        newOffset = (strings + 7) & ~((size_t) 7);
+        if (newOffset < size && size - newOffset > LDCACHE_HEADER_SIZE_NEW &&
+                memcmp(cache + newOffset, LDCACHE_MAGIC_NEW,
+                    strlen(LDCACHE_MAGIC_NEW)) == 0)
+        {
+            ret = _ldcacheVisitTable(cache, size,
+                    newOffset + LDCACHE_HEADER_SIZE_NEW,
+                    _readUint32(cache + newOffset + 20),
+                    LDCACHE_ENTRY_SIZE_NEW, newOffset, visit, data);
+        } else {
+            ret = _ldcacheVisitTable(cache, size, LDCACHE_HEADER_SIZE, nlibs,
+                    LDCACHE_ENTRY_SIZE, strings, visit, data);
+        }
+    }
+
+_ldcache_exit:
+    if (cache != NULL) {
+        free(cache);
+    }
+    close(fd);
+    return ret;
+}
+
+int shifter_ldcache_libcmp(const char *p1, const char *p2) {
+    while (*p1 != '\0') {
+        if (*p1 >= '0' && *p1 <= '9') {
+            if (*p2 >= '0' && *p2 <= '9') {
+                /* must compare this numerically */
+                int val1 = *p1++ - '0';
+                int val2 = *p2++ - '0';
+                while (*p1 >= '0' && *p1 <= '9') {
+                    val1 = val1 * 10 + *p1++ - '0';
+                }
+                while (*p2 >= '0' && *p2 <= '9') {
+                    val2 = val2 * 10 + *p2++ - '0';
+                }
+                if (val1 != val2) {
+                    return val1 - val2;
+                }
+            } else {
+                return 1;
+            }
+        } else if (*p2 >= '0' && *p2 <= '9') {
+            return -1;
+        } else if (*p1 != *p2) {
+            return *p1 - *p2;
+        } else {
+            p1++;
+            p2++;
+        }
+    }
+    return *p1 - *p2;
+}
+
+typedef struct _LdCacheSortEntry {
+    const ShifterLdCacheEntry *entry;
+    size_t index;
+} LdCacheSortEntry;
+
+/* the loader binary searches for names in descending order, then takes the
+ * first acceptable entry among those with an equal name */
+static int _compareLdCacheEntries(const void *a, const void *b) {
+    const LdCacheSortEntry *e1 = (const LdCacheSortEntry *) a;
+    const LdCacheSortEntry *e2 = (const LdCacheSortEntry *) b;
+    int ret = shifter_ldcache_libcmp(e2->entry->name, e1->entry->name);
+    if (ret != 0) {
+        return ret;
+    }
+    if (e1->index < e2->index) return -1;
+    if (e1->index > e2->index) return 1;
+    return 0;
+}
+
+int shifter_ldcache_write(const char *path, const ShifterLdCacheEntry *entries,
+        size_t n)
+{
+    LdCacheSortEntry *sorted = NULL;
+    unsigned char *cache = NULL;
+    char *tmpPath = NULL;
+    size_t nkeep = 0;
+    size_t stringsSize = 0;
+    size_t size = 0;
+    size_t wptr = 0;
+    size_t written = 0;
+    size_t idx = 0;
+    int fd = -1;
+    int ret = 1;
+
+    if (path == NULL || (entries == NULL && n > 0) ||
+            n > (LDCACHE_MAX_SIZE / LDCACHE_ENTRY_SIZE_NEW))
+    {
+        return 1;
+    }
+    sorted = (LdCacheSortEntry *) _malloc(sizeof(LdCacheSortEntry) * (n + 1));
+    for (idx = 0; idx < n; idx++) {
+        if (entries[idx].name == NULL || entries[idx].path == NULL) {
+            goto _ldcacheWrite_exit;
+        }
+        sorted[idx].entry = &(entries[idx]);
+        sorted[idx].index = idx;
+    }
+    qsort(sorted, n, sizeof(LdCacheSortEntry), _compareLdCacheEntries);
+
+    /* drop entries that can never be chosen */
+    for (idx = 0; idx < n; idx++) {
+        const ShifterLdCacheEntry *entry = sorted[idx].entry;
+        size_t prev = nkeep;
+        int duplicate = 0;
+        while (prev > 0 && shifter_ldcache_libcmp(sorted[prev - 1].entry->name,
+                    entry->name) == 0)
+        {
+            const ShifterLdCacheEntry *kept = sorted[prev - 1].entry;
+            if (strcmp(kept->name, entry->name) == 0 &&
+                    kept->flags == entry->flags && kept->hwcap == entry->hwcap)
+            {
+                duplicate = 1;
+                break;
+            }
+            prev--;
+        }
+        if (duplicate) {
+            continue;
+        }
+        sorted[nkeep++] = sorted[idx];
+        stringsSize += strlen(entry->name) + strlen(entry->path) + 2;
+    }
+
+    size = LDCACHE_HEADER_SIZE_NEW + nkeep * LDCACHE_ENTRY_SIZE_NEW +
+            stringsSize;
+    if (size > LDCACHE_MAX_SIZE) {
+        goto _ldcacheWrite_exit;
+    }
+    cache = (unsigned char *) _malloc(size);
+    memset(cache, 0, LDCACHE_HEADER_SIZE_NEW + nkeep * LDCACHE_ENTRY_SIZE_NEW);
+    memcpy(cache, LDCACHE_MAGIC_NEW, strlen(LDCACHE_MAGIC_NEW));
+    _writeUint32(cache + 20, (uint32_t) nkeep);
+    _writeUint32(cache + 24, (uint32_t) stringsSize);
+    cache[28] = LDCACHE_ENDIAN_FLAG;
+
+    wptr = LDCACHE_HEADER_SIZE_NEW + nkeep * LDCACHE_ENTRY_SIZE_NEW;
+    for (idx = 0; idx < nkeep; idx++) {
+        const ShifterLdCacheEntry *entry = sorted[idx].entry;
+        unsigned char *ptr = cache + LDCACHE_HEADER_SIZE_NEW +
+                idx * LDCACHE_ENTRY_SIZE_NEW;
+        size_t len = 0;
+
+        _writeUint32(ptr, (uint32_t) entry->flags);
+        _writeUint32(ptr + 12, entry->osVersion);
+        _writeUint64(ptr + 16, entry->hwcap);
+
+        len = strlen(entry->name) + 1;
+        _writeUint32(ptr + 4, (uint32_t) wptr);
+        memcpy(cache + wptr, entry->name, len);
+        wptr += len;
+
+        len = strlen(entry->path) + 1;
+        _writeUint32(ptr + 8, (uint32_t) wptr);
+        memcpy(cache + wptr, entry->path, len);
+        wptr += len;
+    }
+
+    tmpPath = alloc_strgenf("%s.XXXXXX", path);
+    fd = mkostemp(tmpPath, O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "FAILED to create %s: %s\n", tmpPath, strerror(errno));
+        goto _ldcacheWrite_exit;
+    }
+    while (written < size) {
+        ssize_t bytes = write(fd, cache + written, size - written);
+        if (bytes <= 0) {
+            fprintf(stderr, "FAILED to write %s\n", tmpPath);
+            goto _ldcacheWrite_exit;
+        }
+        written += (size_t) bytes;
+    }
+    if (fchmod(fd, 0644) != 0 || close(fd) != 0) {
+        fd = -1;
+        fprintf(stderr, "FAILED to finish %s\n", tmpPath);
+        goto _ldcacheWrite_exit;
+    }
+    fd = -1;
+    if (rename(tmpPath, path) != 0) {
+        fprintf(stderr, "FAILED to replace %s: %s\n", path, strerror(errno));
+        goto _ldcacheWrite_exit;
+    }
+    ret = 0;
+
+_ldcacheWrite_exit:
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (ret != 0 && tmpPath != NULL) {
+        unlink(tmpPath);
+    }
+    free(tmpPath);
+    free(cache);
+    free(sorted);
+    return ret;
+}
+
+static int _preadFull(int fd, void *buffer, size_t len, uint64_t offset) {
+    size_t nread = 0;
+    while (nread < len) {
+        ssize_t bytes = pread(fd, (char *) buffer + nread, len - nread,
+                (off_t) (offset + nread));
+        if (bytes <= 0) {
+            return 1;
+        }
+        nread += (size_t) bytes;
+    }
+    return 0;
+}
+
+typedef struct _ElfSection {
+    uint32_t type;
+    uint32_t link;
+    uint64_t offset;
+    uint64_t size;
+} ElfSection;
+
+static int _readElfSection(int fd, int is64, uint64_t shoff, size_t shentsize,
+        size_t index, ElfSection *section)
+{
+    uint64_t offset = shoff + index * shentsize;
+    if (is64) {
+        Elf64_Shdr shdr;
+        if (shentsize < sizeof(Elf64_Shdr) ||
+                _preadFull(fd, &shdr, sizeof(Elf64_Shdr), offset) != 0)
+        {
+            return 1;
+        }
+        section->type = shdr.sh_type;
+        section->link = shdr.sh_link;
+        section->offset = shdr.sh_offset;
+        section->size = shdr.sh_size;
+    } else {
+        Elf32_Shdr shdr;
+        if (shentsize < sizeof(Elf32_Shdr) ||
+                _preadFull(fd, &shdr, sizeof(Elf32_Shdr), offset) != 0)
+        {
+            return 1;
+        }
+        section->type = shdr.sh_type;
+        section->link = shdr.sh_link;
+        section->offset = shdr.sh_offset;
+        section->size = shdr.sh_size;
+    }
+    return 0;
+}
+
+/** _readSoname
+ * find DT_SONAME through the section headers; a library without one (or
+ * with stripped section headers) simply gets no soname
+ */
+static char *_readSoname(int fd, int is64, uint64_t shoff, size_t shentsize,
+        size_t shnum)
+{
+    ElfSection dynamic;
+    ElfSection strtab;
+    unsigned char *dyn = NULL;
+    size_t dynSize = is64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+    uint64_t sonameOffset = 0;
+    int found = 0;
+    char *soname = NULL;
+    size_t idx = 0;
+
+    for (idx = 0; idx < shnum; idx++) {
+        if (_readElfSection(fd, is64, shoff, shentsize, idx, &dynamic) != 0) {
+            return NULL;
+        }
+        if (dynamic.type == SHT_DYNAMIC) {
+            break;
+        }
+    }
+    if (idx == shnum || dynamic.size > ELF_MAX_SECTION ||
+            dynamic.link >= shnum ||
+            _readElfSection(fd, is64, shoff, shentsize, dynamic.link,
+                &strtab) != 0 || strtab.type != SHT_STRTAB)
+    {
+        return NULL;
+    }
+
+    dyn = (unsigned char *) _malloc(dynamic.size + 1);
+    if (_preadFull(fd, dyn, dynamic.size, dynamic.offset) != 0) {
+        free(dyn);
+        return NULL;
+    }
+    for (idx = 0; idx + dynSize <= dynamic.size; idx += dynSize) {
+        int64_t tag = 0;
+        uint64_t value = 0;
+        if (is64) {
+            Elf64_Dyn entry;
+            memcpy(&entry, dyn + idx, sizeof(Elf64_Dyn));
+            tag = entry.d_tag;
+            value = entry.d_un.d_val;
+        } else {
+            Elf32_Dyn entry;
+            memcpy(&entry, dyn + idx, sizeof(Elf32_Dyn));
+            tag = entry.d_tag;
+            value = entry.d_un.d_val;
+        }
+        if (tag == DT_NULL) {
+            break;
+        }
+        if (tag == DT_SONAME) {
+            sonameOffset = value;
+            found = 1;
+            break;
+        }
+    }
+    free(dyn);
+
+    if (found && sonameOffset < strtab.size) {
+        size_t len = strtab.size - sonameOffset;
+        if (len > PATH_MAX) {
+            len = PATH_MAX;
+        }
+        soname = (char *) _malloc(len + 1);
+        if (_preadFull(fd, soname, len, strtab.offset + sonameOffset) != 0 ||
+                strnlen(soname, len) == len || soname[0] == 0 ||
+                strchr(soname, '/') != NULL)
+        {
+            free(soname);
+            return NULL;
+        }
+        soname[len] = 0;
+    }
+    return soname;
+}
+
+int shifter_ldcache_elfInfo(int fd, int32_t *flags, char **soname) {
+    unsigned char ident[EI_NIDENT];
+    uint64_t shoff = 0;
+    size_t shentsize = 0;
+    size_t shnum = 0;
+    int is64 = 0;
+    int type = 0;
+    int machine = 0;
+
+    if (fd < 0 || flags == NULL || soname == NULL) {
+        return 1;
+    }
+    *soname = NULL;
+    if (_preadFull(fd, ident, EI_NIDENT, 0) != 0 ||
+            memcmp(ident, ELFMAG, SELFMAG) != 0 ||
+            ident[EI_DATA] != ELF_HOST_DATA)
+    {
+        return 1;
+    }
+    if (ident[EI_CLASS] == ELFCLASS64) {
+        Elf64_Ehdr ehdr;
+        if (_preadFull(fd, &ehdr, sizeof(Elf64_Ehdr), 0) != 0) return 1;
+        is64 = 1;
+        type = ehdr.e_type;
+        machine = ehdr.e_machine;
+        shoff = ehdr.e_shoff;
+        shentsize = ehdr.e_shentsize;
+        shnum = ehdr.e_shnum;
+    } else if (ident[EI_CLASS] == ELFCLASS32) {
+        Elf32_Ehdr ehdr;
+        if (_preadFull(fd, &ehdr, sizeof(Elf32_Ehdr), 0) != 0) return 1;
+        type = ehdr.e_type;
+        machine = ehdr.e_machine;
+        shoff = ehdr.e_shoff;
+        shentsize = ehdr.e_shentsize;
+        shnum = ehdr.e_shnum;
+    } else {
+        return 1;
+    }
+    if (type != ET_DYN) {
+        return 1;
+    }
+
+    *flags = LDCACHE_FLAG_ELF_LIBC6;
+    if (machine == EM_X86_64) {
+        *flags |= is64 ? LDCACHE_FLAG_X8664_LIB64 : LDCACHE_FLAG_X8664_LIBX32;
+    } else if (machine == EM_AARCH64 && is64) {
+        *flags |= LDCACHE_FLAG_AARCH64_LIB64;
+    } else if (machine == EM_PPC64 && is64) {
+        *flags |= LDCACHE_FLAG_POWERPC_LIB64;
+    } else if (machine == EM_S390 && is64) {
+        *flags |= LDCACHE_FLAG_S390_LIB64;
+    } else if (machine != EM_386 && machine != EM_PPC) {
+        return 1;
+    }
+
+    if (shoff != 0 && shnum > 0) {
+        *soname = _readSoname(fd, is64, shoff, shentsize, shnum);
+    }
+    return 0;
+}
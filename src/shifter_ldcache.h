@@ -0,0 +1,110 @@
+/** @file shifter_ldcache.h
+ *  @brief reading and writing ld.so.cache files
+ *
+ *  Used to locate host libraries without running ldconfig, and to give the
+ *  container a cache which also covers the library directories injected by
+ *  modules, so the dynamic loader does not have to search LD_LIBRARY_PATH.
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef __SHFTR_LDCACHE_INCLUDE
+#define __SHFTR_LDCACHE_INCLUDE
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* entry flags, see glibc sysdeps/generic/ldconfig.h */
+#define LDCACHE_FLAG_ELF_LIBC6 0x0003
+#define LDCACHE_FLAG_X8664_LIB64 0x0300
+#define LDCACHE_FLAG_S390_LIB64 0x0400
+#define LDCACHE_FLAG_POWERPC_LIB64 0x0500
+#define LDCACHE_FLAG_X8664_LIBX32 0x0800
+#define LDCACHE_FLAG_AARCH64_LIB64 0x0a00
+
+/* hwcap bit marking an index into the glibc-hwcaps extension, which is not
+ * carried over when a cache is rewritten */
+#define LDCACHE_HWCAP_EXTENSION (1ULL << 62)
+
+typedef struct _ShifterLdCacheEntry {
+    const char *name;
+    const char *path;
+    int32_t flags;
+    uint32_t osVersion;
+    uint64_t hwcap;
+} ShifterLdCacheEntry;
+
+/** ShifterLdCacheVisit
+ * called for each library in ld.so.cache; the entry's strings are only
+ * valid during the call.  A non-zero return stops the walk and is returned
+ * by shifter_ldcache_parse
+ */
+typedef int (*ShifterLdCacheVisit)(const ShifterLdCacheEntry *entry,
+        void *data);
+
+/** shifter_ldcache_parse
+ * walk the entries of an ld.so.cache file, accepting both the
+ * glibc-ld.so.cache1.1 format and the legacy ld.so-1.7.0 format (alone or
+ * followed by a new-format table)
+ *
+ * Returns 0 on success, -1 if the file cannot be read or is malformed, or
+ * the first non-zero value returned by visit
+ */
+int shifter_ldcache_parse(const char *path, ShifterLdCacheVisit visit,
+        void *data);
+
+/** shifter_ldcache_write
+ * atomically replace path with a glibc-ld.so.cache1.1 file holding the
+ * entries, ordered as the dynamic loader's binary search expects.  Where
+ * several entries share a name and flags the earliest in the array is
+ * the one the loader will use.
+ *
+ * Returns 0 on success
+ */
+int shifter_ldcache_write(const char *path, const ShifterLdCacheEntry *entries,
+        size_t n);
+
+/** shifter_ldcache_libcmp
+ * the loader's ordering of library names (digit runs compare numerically)
+ */
+int shifter_ldcache_libcmp(const char *p1, const char *p2);
+
+/** shifter_ldcache_elfInfo
+ * inspect the shared object open on fd: its cache flags for this host's
+ * loader and its DT_SONAME (NULL if it has none, otherwise newly allocated)
+ *
+ * Returns 0 on success, 1 if fd is not a shared object of a supported
+ * architecture
+ */
+int shifter_ldcache_elfInfo(int fd, int32_t *flags, char **soname);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
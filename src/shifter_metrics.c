@@ -0,0 +1,117 @@
+/** @file shifter_metrics.c
+ *  @brief Display the per-node container setup/teardown histograms
+ *
+ *  Reads the histogram file maintained by the slurm plugin (see the
+ *  metrics_histogram plugstack option) and prints count, mean and approximate
+ *  percentiles for each recorded event and metric.
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "JobMetrics.h"
+#include "shifter_mem.h"
+
+static void _usage(int ret) {
+    FILE *output = ret == 0 ? stdout : stderr;
+    fprintf(output, "Usage:\n shifter_metrics [options] <histogram file>\n\n");
+    fprintf(output, "Options:\n");
+    fprintf(output, " --event/-e <event>    Only show prolog or epilog\n");
+    fprintf(output, " --metric/-m <metric>  Only show one metric (duration_ms, "
+            "helper_ms,\n                       mounts, staged_mib, retries, "
+            "failed)\n");
+    fprintf(output, " --buckets/-b          Show histogram buckets\n");
+    fprintf(output, " --help/-h             Display this help\n");
+    fprintf(output, "\nPercentiles are reported as the upper bound of the "
+            "power-of-two bucket\ncontaining them.\n");
+    exit(ret);
+}
+
+int main(int argc, char **argv) {
+    MetricsHistogram *hist = NULL;
+    MetricsHistogram *selected = NULL;
+    size_t n_hist = 0;
+    size_t n_selected = 0;
+    size_t idx = 0;
+    const char *event = NULL;
+    const char *metric = NULL;
+    int showBuckets = 0;
+    static struct option long_options[] = {
+        {"help", 0, 0, 'h'},
+        {"buckets", 0, 0, 'b'},
+        {"event", 1, 0, 'e'},
+        {"metric", 1, 0, 'm'},
+        {0, 0, 0, 0}
+    };
+
+    for ( ; ; ) {
+        int longopt_index = 0;
+        int opt = getopt_long(argc, argv, "hbe:m:", long_options,
+                &longopt_index);
+        if (opt == -1) break;
+
+        switch (opt) {
+            case 'h':
+                _usage(0);
+                break;
+            case 'b':
+                showBuckets = 1;
+                break;
+            case 'e':
+                event = optarg;
+                break;
+            case 'm':
+                metric = optarg;
+                break;
+            default:
+                _usage(1);
+                break;
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "Must specify a histogram file\n");
+        _usage(1);
+    }
+
+    if (read_MetricsHistogram(argv[optind], &hist, &n_hist) != 0) {
+        fprintf(stderr, "FAILED to read histogram file %s\n", argv[optind]);
+        return 1;
+    }
+
+    selected = (MetricsHistogram *) _malloc(sizeof(MetricsHistogram) *
+            (n_hist + 1));
+    for (idx = 0; idx < n_hist; idx++) {
+        if (event != NULL && strcmp(hist[idx].event, event) != 0) continue;
+        if (metric != NULL && strcmp(hist[idx].metric, metric) != 0) continue;
+        memcpy(&(selected[n_selected++]), &(hist[idx]),
+                sizeof(MetricsHistogram));
+    }
+    fprint_MetricsHistogram(stdout, selected, n_selected, showBuckets);
+
+    /* selected only borrows the strings owned by hist */
+    free(selected);
+    free_MetricsHistogram(hist, n_hist);
+    return 0;
+}
@@ -0,0 +1,255 @@
+/** @file shifter_pack.c
+ *  @brief squashfs snapshots of directories mounted with the packed flag
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "shifter_pack.h"
+#include "shifter_hash.h"
+#include "shifter_mem.h"
+#include "utility.h"
+
+static void _hashU64(ShifterHash *hash, const char *name, uint64_t value) {
+    unsigned char bytes[8];
+    int idx = 0;
+    for (idx = 0; idx < 8; idx++) {
+        bytes[idx] = (unsigned char) (value >> (56 - 8 * idx));
+    }
+    shifter_hash_field(hash, name, bytes, sizeof(bytes));
+}
+
+static void _hashStat(ShifterHash *hash, const struct stat *st) {
+    _hashU64(hash, "mode", st->st_mode);
+    _hashU64(hash, "uid", st->st_uid);
+    _hashU64(hash, "gid", st->st_gid);
+    _hashU64(hash, "size", st->st_size);
+    _hashU64(hash, "rdev", st->st_rdev);
+    _hashU64(hash, "mtime", st->st_mtim.tv_sec);
+    _hashU64(hash, "mtimens", st->st_mtim.tv_nsec);
+    _hashU64(hash, "ctime", st->st_ctim.tv_sec);
+    _hashU64(hash, "ctimens", st->st_ctim.tv_nsec);
+}
+
+/* byte order rather than alphasort so that every node sorts the same way
+ * regardless of locale */
+static int _direntcmp(const struct dirent **a, const struct dirent **b) {
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static int _fingerprintWalk(ShifterHash *hash, const char *path,
+        const char *rel)
+{
+    struct dirent **entries = NULL;
+    int nEntries = 0;
+    int idx = 0;
+    int ret = 0;
+
+    nEntries = scandir(path, &entries, NULL, _direntcmp);
+    if (nEntries < 0) {
+        fprintf(stderr, "FAILED to read %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    for (idx = 0; idx < nEntries; idx++) {
+        const char *name = entries[idx]->d_name;
+        struct stat st;
+        char *childPath = NULL;
+        char *childRel = NULL;
+
+        if (ret != 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            free(entries[idx]);
+            continue;
+        }
+        childPath = alloc_strgenf("%s/%s", path, name);
+        childRel = alloc_strgenf("%s/%s", rel, name);
+        if (lstat(childPath, &st) != 0) {
+            fprintf(stderr, "FAILED to stat %s: %s\n", childPath,
+                    strerror(errno));
+            ret = 1;
+        } else {
+            shifter_hash_string(hash, "path", childRel);
+            _hashStat(hash, &st);
+            if (S_ISLNK(st.st_mode)) {
+                char target[PATH_MAX];
+                ssize_t len = readlink(childPath, target, PATH_MAX);
+                if (len < 0) {
+                    ret = 1;
+                } else {
+                    shifter_hash_field(hash, "target", target, len);
+                }
+            } else if (S_ISDIR(st.st_mode)) {
+                ret = _fingerprintWalk(hash, childPath, childRel);
+            } else if (S_ISREG(st.st_mode) && access(childPath, R_OK) != 0) {
+                fprintf(stderr, "FAILED to read %s: %s\n", childPath,
+                        strerror(errno));
+                ret = 1;
+            }
+        }
+        free(childPath);
+        free(childRel);
+        free(entries[idx]);
+    }
+    free(entries);
+    return ret;
+}
+
+int shifter_pack_fingerprint(const char *path, char *hex) {
+    ShifterHash hash;
+    unsigned char digest[SHIFTER_HASH_SIZE];
+    struct stat st;
+
+    if (path == NULL || hex == NULL) {
+        return 1;
+    }
+    if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "FAILED %s is not a directory\n", path);
+        return 1;
+    }
+    shifter_hash_init(&hash);
+    _hashStat(&hash, &st);
+    if (_fingerprintWalk(&hash, path, "") != 0) {
+        return 1;
+    }
+    shifter_hash_final(&hash, digest);
+    shifter_hash_hex(digest, hex);
+    return 0;
+}
+
+char *shifter_pack_imagePath(const char *cacheDir, const char *path,
+        uid_t owner, const char *fingerprint)
+{
+    ShifterHash hash;
+    unsigned char digest[SHIFTER_HASH_SIZE];
+    char hex[SHIFTER_HASH_HEX_SIZE + 1];
+
+    if (cacheDir == NULL || path == NULL || fingerprint == NULL) {
+        return NULL;
+    }
+    shifter_hash_init(&hash);
+    shifter_hash_string(&hash, "path", path);
+    _hashU64(&hash, "owner", owner);
+    shifter_hash_string(&hash, "fingerprint", fingerprint);
+    shifter_hash_final(&hash, digest);
+    shifter_hash_hex(digest, hex);
+    return alloc_strgenf("%s/%s%s", cacheDir, hex, SHIFTER_PACK_SUFFIX);
+}
+
+static int _runMksquashfs(const char *mksquashfs, const char *src,
+        const char *image)
+{
+    pid_t pid = 0;
+    int status = 0;
+
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        return 1;
+    }
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        if (devNull >= 0) {
+            dup2(devNull, STDOUT_FILENO);
+        }
+        execl(mksquashfs, mksquashfs, src, image, "-noappend", "-no-progress",
+                (char *) NULL);
+        _exit(127);
+    }
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) { }
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+int shifter_pack_build(const char *mksquashfs, const char *src,
+        const char *image, int timeout)
+{
+    struct stat statData;
+    char hostname[128];
+    char *lock = NULL;
+    char *tmp = NULL;
+    int fd = -1;
+    int ret = -1;
+
+    if (mksquashfs == NULL || src == NULL || image == NULL) {
+        return -1;
+    }
+    lock = alloc_strgenf("%s.lock", image);
+    for ( ; ; ) {
+        if (stat(image, &statData) == 0) {
+            ret = 0;
+            goto _pack_build_done;
+        }
+        fd = open(lock, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            break;
+        }
+        if (errno != EEXIST) {
+            fprintf(stderr, "FAILED to create %s: %s\n", lock, strerror(errno));
+            goto _pack_build_done;
+        }
+        if (stat(lock, &statData) == 0 &&
+                time(NULL) - statData.st_mtime > timeout)
+        {
+            fprintf(stderr, "Removing abandoned lock %s\n", lock);
+            unlink(lock);
+            continue;
+        }
+        sleep(1);
+    }
+    close(fd);
+
+    /* another node may have finished between the stat and the lock */
+    if (stat(image, &statData) == 0) {
+        ret = 0;
+    } else {
+        if (gethostname(hostname, sizeof(hostname)) != 0) {
+            snprintf(hostname, sizeof(hostname), "unknown");
+        }
+        hostname[sizeof(hostname) - 1] = 0;
+        tmp = alloc_strgenf("%s.%s.%d", image, hostname, (int) getpid());
+        if (_runMksquashfs(mksquashfs, src, tmp) != 0 ||
+                chmod(tmp, 0600) != 0 || rename(tmp, image) != 0)
+        {
+            fprintf(stderr, "FAILED to pack %s into %s\n", src, image);
+            unlink(tmp);
+        } else {
+            ret = 1;
+        }
+    }
+    unlink(lock);
+
+_pack_build_done:
+    free(lock);
+    free(tmp);
+    return ret;
+}
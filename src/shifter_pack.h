@@ -0,0 +1,86 @@
+/** @file shifter_pack.h
+ *  @brief squashfs snapshots of directories mounted with the packed flag
+ *
+ *  A packed volume is mounted from a read-only squashfs image of its source
+ *  directory instead of being bind mounted, so that a tree of many small
+ *  files costs one loop mount rather than a metadata lookup per file on the
+ *  parallel filesystem.  Images live in a cache directory shared between
+ *  nodes and are named by the source path, its owner and a fingerprint of
+ *  the metadata of the whole tree, so any change to the tree yields a new
+ *  image.
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef __SHFTR_PACK_INCLUDE
+#define __SHFTR_PACK_INCLUDE
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include "shifter_hash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHIFTER_PACK_SUFFIX ".squashfs"
+#define SHIFTER_PACK_LOCK_TIMEOUT 1800
+
+/** shifter_pack_fingerprint
+ * hash the name, type, permissions, ownership, size and timestamps of every
+ * entry under path (sorted, not following symlinks) into hex, which must
+ * hold SHIFTER_HASH_HEX_SIZE + 1 bytes.  Any change to the tree, including
+ * chmod or a new hard link, changes the ctime of some entry and so the
+ * fingerprint.  Every directory must be readable and searchable and every
+ * file readable by the caller.
+ *
+ * Returns 0 on success, 1 if any entry cannot be read
+ */
+int shifter_pack_fingerprint(const char *path, char *hex);
+
+/** shifter_pack_imagePath
+ * Returns the newly allocated path in cacheDir of the image of path owned
+ * by owner with the given fingerprint
+ */
+char *shifter_pack_imagePath(const char *cacheDir, const char *path,
+        uid_t owner, const char *fingerprint);
+
+/** shifter_pack_build
+ * make sure image exists, building it from src with mksquashfs if needed.
+ * Builders on different nodes serialize on image.lock, created with O_EXCL
+ * so that it works on shared filesystems; a lock older than timeout seconds
+ * is considered abandoned and taken over.  The image is written under a
+ * temporary name and renamed into place, so even two builders racing after
+ * a takeover leave a complete image.
+ *
+ * Returns 0 if image already existed, 1 if it was built now, -1 on failure
+ */
+int shifter_pack_build(const char *mksquashfs, const char *src,
+        const char *image, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,395 @@
+/** @file shifter_stage.c
+ *  @brief copying directory trees into and out of per-node cache volumes
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "shifter_stage.h"
+#include "shifter_mem.h"
+#include "utility.h"
+
+typedef struct _StageEntry {
+    char *rel;
+    mode_t mode;
+    off_t size;
+} StageEntry;
+
+typedef struct _StageList {
+    StageEntry *entries;
+    size_t n;
+    size_t capacity;
+    size_t nFiles;
+    size_t bytes;
+    size_t errors;
+} StageList;
+
+/* sent by a copy worker for every file it handled */
+typedef struct _StageRecord {
+    uint64_t bytes;
+    uint32_t ok;
+} StageRecord;
+
+static void _stageAppend(StageList *list, const char *rel, struct stat *st) {
+    if (list->n == list->capacity) {
+        list->capacity += 256;
+        list->entries = (StageEntry *) _realloc(list->entries,
+                sizeof(StageEntry) * list->capacity);
+    }
+    list->entries[list->n].rel = _strdup(rel);
+    list->entries[list->n].mode = st->st_mode;
+    list->entries[list->n].size = st->st_size;
+    list->n++;
+    if (S_ISREG(st->st_mode)) {
+        list->nFiles++;
+        list->bytes += st->st_size;
+    }
+}
+
+static void _stageFree(StageList *list) {
+    size_t idx = 0;
+    for (idx = 0; idx < list->n; idx++) {
+        free(list->entries[idx].rel);
+    }
+    free(list->entries);
+    memset(list, 0, sizeof(StageList));
+}
+
+/** _stageWalk
+ *  Record every entry below src/rel, parents before their contents, without
+ *  following symlinks.
+ *
+ *  Returns 0 on success, 1 if src/rel cannot be read
+ */
+static int _stageWalk(StageList *list, const char *label, const char *src,
+        const char *rel)
+{
+    char *path = rel[0] == 0 ? _strdup(src) : alloc_strgenf("%s/%s", src, rel);
+    struct dirent *entry = NULL;
+    DIR *dir = opendir(path);
+
+    if (dir == NULL) {
+        fprintf(stderr, "%s: FAILED to read %s: %s\n", label, path,
+                strerror(errno));
+        free(path);
+        return 1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        char *child = NULL;
+        char *childPath = NULL;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        child = rel[0] == 0 ? _strdup(entry->d_name) :
+                alloc_strgenf("%s/%s", rel, entry->d_name);
+        childPath = alloc_strgenf("%s/%s", src, child);
+        if (lstat(childPath, &st) != 0) {
+            fprintf(stderr, "%s: FAILED to stat %s: %s\n", label, childPath,
+                    strerror(errno));
+            list->errors++;
+        } else if (S_ISDIR(st.st_mode)) {
+            _stageAppend(list, child, &st);
+            if (_stageWalk(list, label, src, child) != 0) {
+                list->errors++;
+            }
+        } else if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+            _stageAppend(list, child, &st);
+        } else {
+            fprintf(stderr, "%s: skipping %s, not a file, directory or "
+                    "symlink\n", label, childPath);
+            list->errors++;
+        }
+        free(childPath);
+        free(child);
+    }
+    closedir(dir);
+    free(path);
+    return 0;
+}
+
+ssize_t shifter_stage_treeSize(const char *src) {
+    StageList list;
+    ssize_t ret = -1;
+
+    if (src == NULL) {
+        return -1;
+    }
+    memset(&list, 0, sizeof(StageList));
+    if (_stageWalk(&list, "stage", src, "") == 0 && list.errors == 0) {
+        ret = (ssize_t) list.bytes;
+    }
+    _stageFree(&list);
+    return ret;
+}
+
+static int _stageCopyFile(const char *from, const char *to, mode_t mode,
+        char *buffer, uint64_t *bytes)
+{
+    int inFd = open(from, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    int outFd = -1;
+    int err = 0;
+
+    *bytes = 0;
+    if (inFd < 0) {
+        return -1;
+    }
+    outFd = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+            (mode & 0777) | S_IRUSR | S_IWUSR);
+    if (outFd < 0) {
+        err = errno;
+        close(inFd);
+        errno = err;
+        return -1;
+    }
+    for ( ; ; ) {
+        ssize_t nread = read(inFd, buffer, SHIFTER_STAGE_BUFFER_SIZE);
+        ssize_t written = 0;
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            if (nread < 0) err = errno;
+            break;
+        }
+        while (written < nread) {
+            ssize_t ret = write(outFd, buffer + written, nread - written);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret < 0) {
+                err = errno;
+                break;
+            }
+            written += ret;
+        }
+        if (err != 0) {
+            break;
+        }
+        *bytes += nread;
+    }
+    close(inFd);
+    if (close(outFd) != 0 && err == 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/** _stageWorker
+ *  Copy every nWorkers'th regular file starting at worker, reporting each
+ *  one on fd.  Runs in a forked child.
+ */
+static void _stageWorker(StageList *list, const char *label, const char *src,
+        const char *dst, int worker, int nWorkers, int fd)
+{
+    char *buffer = (char *) _malloc(SHIFTER_STAGE_BUFFER_SIZE);
+    size_t idx = 0;
+    size_t nFile = 0;
+
+    for (idx = 0; idx < list->n; idx++) {
+        StageEntry *entry = &(list->entries[idx]);
+        StageRecord record;
+        char *from = NULL;
+        char *to = NULL;
+
+        if (!S_ISREG(entry->mode)) {
+            continue;
+        }
+        if ((nFile++ % nWorkers) != (size_t) worker) {
+            continue;
+        }
+        from = alloc_strgenf("%s/%s", src, entry->rel);
+        to = alloc_strgenf("%s/%s", dst, entry->rel);
+        memset(&record, 0, sizeof(StageRecord));
+        record.ok = _stageCopyFile(from, to, entry->mode, buffer,
+                &(record.bytes)) == 0;
+        if (!record.ok) {
+            fprintf(stderr, "%s: FAILED to copy %s: %s\n", label, entry->rel,
+                    strerror(errno));
+        }
+        free(from);
+        free(to);
+        if (write(fd, &record, sizeof(StageRecord)) != sizeof(StageRecord)) {
+            break;
+        }
+    }
+    free(buffer);
+}
+
+int shifter_stage_copyTree(const char *label, const char *src,
+        const char *dst, int nWorkers, ShifterStageStats *stats)
+{
+    StageList list;
+    StageRecord record;
+    pid_t workers[SHIFTER_STAGE_MAX_WORKERS];
+    int pipeFd[2] = { -1, -1 };
+    size_t filesDone = 0;
+    size_t filesFailed = 0;
+    size_t bytesDone = 0;
+    size_t idx = 0;
+    time_t lastReport = time(NULL);
+    int started = 0;
+    int worker = 0;
+
+    if (label == NULL || src == NULL || dst == NULL) {
+        return -1;
+    }
+    memset(&list, 0, sizeof(StageList));
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(ShifterStageStats));
+    }
+    if (_stageWalk(&list, label, src, "") != 0) {
+        _stageFree(&list);
+        return -1;
+    }
+    fprintf(stderr, "%s: staging %lu files, %lu bytes from %s\n", label,
+            (unsigned long) list.nFiles, (unsigned long) list.bytes, src);
+
+    /* directories and links first, so the workers only create files */
+    for (idx = 0; idx < list.n; idx++) {
+        StageEntry *entry = &(list.entries[idx]);
+        char *to = alloc_strgenf("%s/%s", dst, entry->rel);
+        struct stat st;
+
+        if (S_ISDIR(entry->mode)) {
+            if (mkdir(to, (entry->mode & 0777) | S_IRWXU) != 0 &&
+                    (errno != EEXIST || lstat(to, &st) != 0 ||
+                     !S_ISDIR(st.st_mode)))
+            {
+                fprintf(stderr, "%s: FAILED to create %s: %s\n", label,
+                        entry->rel, strerror(errno));
+                list.errors++;
+            } else if (stats != NULL) {
+                stats->dirs++;
+            }
+        } else if (S_ISLNK(entry->mode)) {
+            char target[PATH_MAX];
+            char *from = alloc_strgenf("%s/%s", src, entry->rel);
+            ssize_t len = readlink(from, target, PATH_MAX - 1);
+            free(from);
+            if (len >= 0) {
+                target[len] = 0;
+                unlink(to);
+            }
+            if (len < 0 || symlink(target, to) != 0) {
+                fprintf(stderr, "%s: FAILED to create link %s: %s\n", label,
+                        entry->rel, strerror(errno));
+                list.errors++;
+            } else if (stats != NULL) {
+                stats->links++;
+            }
+        }
+        free(to);
+    }
+
+    if (nWorkers < 1) {
+        nWorkers = 1;
+    }
+    if (nWorkers > SHIFTER_STAGE_MAX_WORKERS) {
+        nWorkers = SHIFTER_STAGE_MAX_WORKERS;
+    }
+    if ((size_t) nWorkers > list.nFiles) {
+        nWorkers = (int) list.nFiles;
+    }
+    if (nWorkers > 0 && pipe2(pipeFd, O_CLOEXEC) != 0) {
+        fprintf(stderr, "%s: FAILED to start copy workers\n", label);
+        list.errors += list.nFiles;
+        nWorkers = 0;
+    }
+    fflush(stderr);
+    for (worker = 0; worker < nWorkers; worker++) {
+        workers[worker] = fork();
+        if (workers[worker] == 0) {
+            close(pipeFd[0]);
+            _stageWorker(&list, label, src, dst, worker, nWorkers, pipeFd[1]);
+            _exit(0);
+        }
+        if (workers[worker] < 0) {
+            fprintf(stderr, "%s: FAILED to start copy worker\n", label);
+            break;
+        }
+        started++;
+    }
+    if (pipeFd[1] >= 0) {
+        close(pipeFd[1]);
+    }
+
+    while (started > 0) {
+        ssize_t nread = read(pipeFd[0], &record, sizeof(StageRecord));
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread != sizeof(StageRecord)) {
+            break;
+        }
+        filesDone++;
+        bytesDone += record.bytes;
+        if (!record.ok) {
+            filesFailed++;
+        }
+        if (time(NULL) - lastReport >= 1) {
+            lastReport = time(NULL);
+            fprintf(stderr, "%s: staged %lu/%lu files, %lu/%lu bytes\n", label,
+                    (unsigned long) filesDone, (unsigned long) list.nFiles,
+                    (unsigned long) bytesDone, (unsigned long) list.bytes);
+        }
+    }
+    if (pipeFd[0] >= 0) {
+        close(pipeFd[0]);
+    }
+    for (worker = 0; worker < started; worker++) {
+        int status = 0;
+        while (waitpid(workers[worker], &status, 0) < 0 && errno == EINTR) { }
+    }
+
+    /* files whose worker died or was never started count as failed */
+    list.errors += filesFailed + list.nFiles - filesDone;
+    fprintf(stderr, "%s: staged %lu/%lu files, %lu bytes, %lu errors\n", label,
+            (unsigned long) filesDone, (unsigned long) list.nFiles,
+            (unsigned long) bytesDone, (unsigned long) list.errors);
+    if (stats != NULL) {
+        stats->files = filesDone - filesFailed;
+        stats->bytes = bytesDone;
+        stats->errors = list.errors;
+    }
+    idx = list.errors;
+    _stageFree(&list);
+    return idx > INT_MAX ? INT_MAX : (int) idx;
+}
@@ -0,0 +1,77 @@
+/** @file shifter_stage.h
+ *  @brief copying directory trees into and out of per-node cache volumes
+ *
+ *  Used by the stagein= and stageout= volume flags: the tree is walked
+ *  once, directories and symlinks are created in order, and the regular
+ *  files are then copied by several worker processes.  Progress and
+ *  per-file errors are reported on stderr.
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef __SHFTR_STAGE_INCLUDE
+#define __SHFTR_STAGE_INCLUDE
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHIFTER_STAGE_BUFFER_SIZE (1024 * 1024)
+#define SHIFTER_STAGE_MAX_WORKERS 64
+#define SHIFTER_STAGE_DEFAULT_WORKERS 4
+
+typedef struct _ShifterStageStats {
+    size_t files;
+    size_t dirs;
+    size_t links;
+    size_t bytes;
+    size_t errors;
+} ShifterStageStats;
+
+/** shifter_stage_treeSize
+ * Returns the total size in bytes of the regular files under src, not
+ * following symlinks, or -1 if src cannot be read
+ */
+ssize_t shifter_stage_treeSize(const char *src);
+
+/** shifter_stage_copyTree
+ * copy the tree at src into the existing directory dst using nWorkers
+ * processes for the regular files.  Entries that cannot be copied are
+ * reported and skipped; progress is reported on stderr prefixed by label.
+ * stats, if not NULL, receives the totals.
+ *
+ * Returns 0 if everything was copied, the number of errors otherwise, or
+ * -1 if src could not be walked
+ */
+int shifter_stage_copyTree(const char *label, const char *src,
+        const char *dst, int nWorkers, ShifterStageStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
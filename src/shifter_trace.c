@@ -0,0 +1,263 @@
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "shifter_trace.h"
+#include "shifter_mem.h"
+#include "utility.h"
+
+typedef struct _ShifterTraceEvent {
+    const char *category;
+    char *name;
+    char *detail;
+    char phase;
+    uint64_t ts;
+    uint64_t dur;
+    long value;
+    pid_t pid;
+} ShifterTraceEvent;
+
+int shifter_trace_enabled = 0;
+
+static ShifterTraceEvent *traceEvents = NULL;
+static size_t traceEvents_size = 0;
+static size_t traceEvents_capacity = 0;
+static int traceFd = -1;
+static char *traceProgram = NULL;
+static uint64_t traceEpochOffset = 0;
+static pid_t tracePid = 0;
+
+uint64_t shifter_trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000;
+}
+
+int shifter_trace_requested(void) {
+    const char *value = getenv(SHIFTER_TRACE_ENV);
+    if (value == NULL || *value == 0) return 0;
+    if (strcmp(value, "0") == 0) return 0;
+    return 1;
+}
+
+static void _shifter_trace_atexit(void) {
+    shifter_trace_close();
+}
+
+int shifter_trace_open(const char *program, const char *traceDir,
+        const char *jobIdentifier)
+{
+    char hostname[256];
+    char *job = NULL;
+    char *filename = NULL;
+    struct timespec wallclock;
+
+    if (traceFd >= 0) return 0;
+    if (program == NULL || traceDir == NULL || traceDir[0] != '/') {
+        fprintf(stderr, "FAILED to enable tracing, traceDir must be an "
+                "absolute path\n");
+        return 1;
+    }
+
+    if (gethostname(hostname, sizeof(hostname)) != 0) {
+        snprintf(hostname, sizeof(hostname), "unknown");
+    }
+    hostname[sizeof(hostname) - 1] = 0;
+    if (jobIdentifier != NULL) {
+        job = userInputPathFilter(jobIdentifier, 0);
+    }
+
+    filename = alloc_strgenf("%s/%s.%s%s%s.%d.json", traceDir, program,
+            job != NULL && strlen(job) > 0 ? job : "",
+            job != NULL && strlen(job) > 0 ? "." : "",
+            hostname, (int) getpid());
+    if (job != NULL) {
+        free(job);
+    }
+    if (filename == NULL) {
+        return 1;
+    }
+
+    traceFd = open(filename, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,
+            0644);
+    if (traceFd < 0) {
+        fprintf(stderr, "FAILED to open trace file %s: %s\n", filename,
+                strerror(errno));
+        free(filename);
+        return 1;
+    }
+    free(filename);
+
+    /* record offset between monotonic and wallclock time so traces from
+     * different processes/nodes can be correlated */
+    clock_gettime(CLOCK_REALTIME, &wallclock);
+    traceEpochOffset = (uint64_t) wallclock.tv_sec * 1000000ULL +
+            (uint64_t) wallclock.tv_nsec / 1000 - shifter_trace_now();
+
+    traceProgram = _strdup(program);
+    tracePid = getpid();
+    shifter_trace_enabled = 1;
+    atexit(_shifter_trace_atexit);
+    return 0;
+}
+
+static ShifterTraceEvent *_shifter_trace_append(void) {
+    ShifterTraceEvent *event = NULL;
+    if (traceEvents_size == traceEvents_capacity) {
+        traceEvents_capacity += SHIFTER_TRACE_ALLOC_BLOCK;
+        traceEvents = _realloc(traceEvents,
+                sizeof(ShifterTraceEvent) * traceEvents_capacity);
+    }
+    event = &(traceEvents[traceEvents_size++]);
+    memset(event, 0, sizeof(ShifterTraceEvent));
+    event->pid = getpid();
+    return event;
+}
+
+void shifter_trace_event(const char *category, const char *name,
+        const char *detail, uint64_t start)
+{
+    ShifterTraceEvent *event = NULL;
+    int saved_errno = errno;
+    uint64_t end = 0;
+
+    if (!shifter_trace_enabled || start == 0 || name == NULL) return;
+
+    end = shifter_trace_now();
+    event = _shifter_trace_append();
+    event->category = category != NULL ? category : "shifter";
+    event->name = _strdup(name);
+    if (detail != NULL) {
+        event->detail = _strndup(detail, SHIFTER_TRACE_DETAIL_MAX);
+    }
+    event->phase = 'X';
+    event->ts = start;
+    event->dur = end > start ? end - start : 0;
+    errno = saved_errno;
+}
+
+void shifter_trace_counter(const char *name, long value) {
+    ShifterTraceEvent *event = NULL;
+    int saved_errno = errno;
+
+    if (!shifter_trace_enabled || name == NULL) return;
+
+    event = _shifter_trace_append();
+    event->category = "counter";
+    event->name = _strdup(name);
+    event->phase = 'C';
+    event->ts = shifter_trace_now();
+    event->value = value;
+    errno = saved_errno;
+}
+
+static void _shifter_trace_writeString(FILE *fp, const char *str) {
+    const char *ptr = NULL;
+    fputc('"', fp);
+    for (ptr = str; ptr && *ptr; ptr++) {
+        if (*ptr == '"' || *ptr == '\\') {
+            fputc('\\', fp);
+            fputc(*ptr, fp);
+        } else if ((unsigned char) *ptr < 0x20) {
+            fprintf(fp, "\\u%04x", (unsigned char) *ptr);
+        } else {
+            fputc(*ptr, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+void shifter_trace_close(void) {
+    FILE *fp = NULL;
+    size_t idx = 0;
+    int saved_errno = errno;
+
+    if (traceFd < 0) return;
+    shifter_trace_enabled = 0;
+
+    /* a forked child exiting (e.g., failed exec) must not write the trace */
+    if (getpid() != tracePid) {
+        return;
+    }
+
+    fp = fdopen(traceFd, "w");
+    if (fp == NULL) {
+        close(traceFd);
+        goto _trace_close_cleanup;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"otherData\": {\"program\": ");
+    _shifter_trace_writeString(fp, traceProgram);
+    fprintf(fp, ", \"epochOffsetUs\": %lu},\n\"traceEvents\": [",
+            (unsigned long) traceEpochOffset);
+    for (idx = 0; idx < traceEvents_size; idx++) {
+        ShifterTraceEvent *event = &(traceEvents[idx]);
+        fprintf(fp, "%s\n{\"name\": ", idx > 0 ? "," : "");
+        _shifter_trace_writeString(fp, event->name);
+        fprintf(fp, ", \"cat\": ");
+        _shifter_trace_writeString(fp, event->category);
+        fprintf(fp, ", \"ph\": \"%c\", \"ts\": %lu, \"pid\": %d, \"tid\": %d",
+                event->phase, (unsigned long) event->ts, (int) event->pid,
+                (int) event->pid);
+        if (event->phase == 'X') {
+            fprintf(fp, ", \"dur\": %lu", (unsigned long) event->dur);
+            if (event->detail != NULL) {
+                fprintf(fp, ", \"args\": {\"detail\": ");
+                _shifter_trace_writeString(fp, event->detail);
+                fprintf(fp, "}");
+            }
+        } else if (event->phase == 'C') {
+            fprintf(fp, ", \"args\": {\"value\": %ld}", event->value);
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+
+_trace_close_cleanup:
+    traceFd = -1;
+    for (idx = 0; idx < traceEvents_size; idx++) {
+        free(traceEvents[idx].name);
+        if (traceEvents[idx].detail != NULL) {
+            free(traceEvents[idx].detail);
+        }
+    }
+    free(traceEvents);
+    traceEvents = NULL;
+    traceEvents_size = 0;
+    traceEvents_capacity = 0;
+    if (traceProgram != NULL) {
+        free(traceProgram);
+        traceProgram = NULL;
+    }
+    errno = saved_errno;
+}
@@ -0,0 +1,96 @@
+/** @file shifter_trace.h
+ *  @brief Lightweight phase tracing for shifter, setupRoot and unsetupRoot
+ *
+ *  Events are buffered in memory and written out as a Chrome trace-event
+ *  JSON document (load with chrome://tracing or Perfetto) when the trace is
+ *  closed.  When tracing is not enabled the only cost at each traced site is
+ *  a test of shifter_trace_enabled.
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef __SHFTR_TRACE_INCLUDE
+#define __SHFTR_TRACE_INCLUDE
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHIFTER_TRACE_ENV "SHIFTER_TRACE"
+#define SHIFTER_TRACE_ALLOC_BLOCK 64
+#define SHIFTER_TRACE_DETAIL_MAX 256
+
+extern int shifter_trace_enabled;
+
+/** SHIFTER_TRACE_START
+ * returns the current monotonic time (microseconds) if tracing is enabled,
+ * 0 otherwise; pass the value to shifter_trace_event() when the traced
+ * operation completes
+ */
+#define SHIFTER_TRACE_START() (shifter_trace_enabled ? shifter_trace_now() : 0)
+
+uint64_t shifter_trace_now(void);
+
+/** shifter_trace_requested
+ * check the environment for a per-invocation tracing request; must be called
+ * before the environment is cleared
+ */
+int shifter_trace_requested(void);
+
+/** shifter_trace_open
+ * Enable tracing and create the output file under traceDir.  The file is
+ * opened immediately (before any chroot or privilege change) and written
+ * when shifter_trace_close() is called, or at exit.
+ *
+ * Returns 0 on success, 1 on failure (tracing stays disabled)
+ */
+int shifter_trace_open(const char *program, const char *traceDir,
+        const char *jobIdentifier);
+
+/** shifter_trace_event
+ * record a complete event which started at start (from SHIFTER_TRACE_START)
+ * and ends now; a start of 0 is ignored.  errno is preserved so this may be
+ * called between a failed syscall and its error reporting.
+ */
+void shifter_trace_event(const char *category, const char *name,
+        const char *detail, uint64_t start);
+
+/** shifter_trace_counter
+ * record an instantaneous counter value (e.g. number of mounts)
+ */
+void shifter_trace_counter(const char *name, long value);
+
+/** shifter_trace_close
+ * write all buffered events and close the trace file
+ */
+void shifter_trace_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,209 @@
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench_harness.h"
+#include "shifter_mem.h"
+
+uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void init_BenchSuite(BenchSuite *suite) {
+    if (suite == NULL) return;
+    memset(suite, 0, sizeof(BenchSuite));
+    suite->minTime_ns = BENCH_DEFAULT_MIN_TIME_NS;
+    suite->maxIterations = BENCH_DEFAULT_MAX_ITER;
+}
+
+void free_BenchSuite(BenchSuite *suite) {
+    size_t idx = 0;
+    if (suite == NULL) return;
+    for (idx = 0; idx < suite->n_results; idx++) {
+        free(suite->results[idx].name);
+    }
+    free(suite->results);
+    memset(suite, 0, sizeof(BenchSuite));
+}
+
+static int _cmpSample(const void *va, const void *vb) {
+    uint64_t a = *(const uint64_t *) va;
+    uint64_t b = *(const uint64_t *) vb;
+    if (a < b) return -1;
+    if (a > b) return 1;
+    return 0;
+}
+
+int bench_record(BenchSuite *suite, const char *name, size_t param,
+        uint64_t *samples, size_t n_samples, size_t mounts)
+{
+    BenchResult *result = NULL;
+    uint64_t total = 0;
+    size_t idx = 0;
+
+    if (suite == NULL || name == NULL || samples == NULL || n_samples == 0) {
+        return 1;
+    }
+    if (suite->n_results == suite->capacity) {
+        suite->capacity += BENCH_ALLOC_BLOCK;
+        suite->results = _realloc(suite->results,
+                sizeof(BenchResult) * suite->capacity);
+    }
+    result = &(suite->results[suite->n_results++]);
+    memset(result, 0, sizeof(BenchResult));
+
+    for (idx = 0; idx < n_samples; idx++) {
+        total += samples[idx];
+    }
+    qsort(samples, n_samples, sizeof(uint64_t), _cmpSample);
+    result->name = _strdup(name);
+    result->param = param;
+    result->iterations = n_samples;
+    result->total_ns = total;
+    result->min_ns = samples[0];
+    result->max_ns = samples[n_samples - 1];
+    result->median_ns = samples[n_samples / 2];
+    result->mean_ns = total / n_samples;
+    result->mounts = mounts;
+
+    if (suite->verbose) {
+        fprintf(stderr, "%-40s %8lu %10lu iter %12lu ns/op (median)",
+                result->name, (unsigned long) result->param,
+                (unsigned long) result->iterations,
+                (unsigned long) result->median_ns);
+        if (mounts > 0) {
+            fprintf(stderr, " %6lu mounts", (unsigned long) mounts);
+        }
+        fprintf(stderr, "\n");
+    }
+    return 0;
+}
+
+int bench_run(BenchSuite *suite, BenchCase *bcase) {
+    uint64_t *samples = NULL;
+    size_t n_samples = 0;
+    size_t samplesCapacity = 0;
+    uint64_t total = 0;
+
+    if (suite == NULL || bcase == NULL || bcase->name == NULL ||
+            bcase->fn == NULL) {
+        return 1;
+    }
+    if (suite->filter != NULL && strstr(bcase->name, suite->filter) == NULL) {
+        return 0;
+    }
+
+    while (n_samples == 0 ||
+            (total < suite->minTime_ns && n_samples < suite->maxIterations)) {
+        uint64_t start = 0;
+        uint64_t end = 0;
+        int rc = 0;
+
+        if (bcase->setup != NULL && bcase->setup(bcase->ctx) != 0) {
+            fprintf(stderr, "FAILED to setup benchmark %s/%lu\n",
+                    bcase->name, (unsigned long) bcase->param);
+            goto _bench_run_unclean;
+        }
+        start = bench_now_ns();
+        rc = bcase->fn(bcase->ctx);
+        end = bench_now_ns();
+        if (bcase->teardown != NULL) {
+            bcase->teardown(bcase->ctx);
+        }
+        if (rc != 0) {
+            fprintf(stderr, "FAILED to run benchmark %s/%lu\n",
+                    bcase->name, (unsigned long) bcase->param);
+            goto _bench_run_unclean;
+        }
+
+        if (n_samples == samplesCapacity) {
+            samplesCapacity += BENCH_ALLOC_BLOCK * 32;
+            samples = _realloc(samples, sizeof(uint64_t) * samplesCapacity);
+        }
+        samples[n_samples++] = end - start;
+        total += end - start;
+    }
+
+    bench_record(suite, bcase->name, bcase->param, samples, n_samples, 0);
+    free(samples);
+    return 0;
+
+_bench_run_unclean:
+    if (samples != NULL) {
+        free(samples);
+    }
+    return 1;
+}
+
+static void _writeJsonString(FILE *fp, const char *str) {
+    const char *ptr = NULL;
+    fputc('"', fp);
+    for (ptr = str; ptr && *ptr; ptr++) {
+        if (*ptr == '"' || *ptr == '\\') {
+            fputc('\\', fp);
+            fputc(*ptr, fp);
+        } else if ((unsigned char) *ptr < 0x20) {
+            fprintf(fp, "\\u%04x", (unsigned char) *ptr);
+        } else {
+            fputc(*ptr, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+int bench_write_json(BenchSuite *suite, FILE *fp, const char *version) {
+    size_t idx = 0;
+    if (suite == NULL || fp == NULL) return 1;
+
+    fprintf(fp, "{\n  \"suite\": \"shifter\",\n  \"version\": ");
+    _writeJsonString(fp, version != NULL ? version : "unknown");
+    fprintf(fp, ",\n  \"timestamp\": %ld,\n  \"unit\": \"ns\",\n",
+            (long) time(NULL));
+    fprintf(fp, "  \"benchmarks\": [");
+    for (idx = 0; idx < suite->n_results; idx++) {
+        BenchResult *res = &(suite->results[idx]);
+        fprintf(fp, "%s\n    {\"name\": ", idx > 0 ? "," : "");
+        _writeJsonString(fp, res->name);
+        fprintf(fp, ", \"param\": %lu, \"iterations\": %lu, "
+                "\"min_ns\": %lu, \"median_ns\": %lu, \"mean_ns\": %lu, "
+                "\"max_ns\": %lu",
+                (unsigned long) res->param,
+                (unsigned long) res->iterations,
+                (unsigned long) res->min_ns,
+                (unsigned long) res->median_ns,
+                (unsigned long) res->mean_ns,
+                (unsigned long) res->max_ns);
+        if (res->mounts > 0) {
+            fprintf(fp, ", \"mounts\": %lu", (unsigned long) res->mounts);
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    return ferror(fp) ? 1 : 0;
+}
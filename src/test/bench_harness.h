@@ -0,0 +1,114 @@
+/** @file bench_harness.h
+ *  @brief Minimal timer harness for shifter microbenchmarks
+ */
+
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+#ifndef __SHFTR_BENCH_HARNESS_INCLUDE
+#define __SHFTR_BENCH_HARNESS_INCLUDE
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BENCH_ALLOC_BLOCK 32
+#define BENCH_DEFAULT_MIN_TIME_NS 200000000ULL
+#define BENCH_DEFAULT_MAX_ITER 100000
+
+/** BenchResult
+ * summary statistics for one benchmark at one input size; all times are
+ * nanoseconds per iteration as measured by CLOCK_MONOTONIC
+ */
+typedef struct _BenchResult {
+    char *name;
+    size_t param;
+    size_t iterations;
+    uint64_t min_ns;
+    uint64_t median_ns;
+    uint64_t mean_ns;
+    uint64_t max_ns;
+    uint64_t total_ns;
+    size_t mounts;      /*! mounts present after the operation, if known */
+} BenchResult;
+
+typedef struct _BenchSuite {
+    BenchResult *results;
+    size_t n_results;
+    size_t capacity;
+    uint64_t minTime_ns;
+    size_t maxIterations;
+    const char *filter;
+    int verbose;
+} BenchSuite;
+
+/** BenchCase
+ * A benchmark is described by an optional setup and teardown (not timed,
+ * called around every iteration) and the timed function itself.  All three
+ * receive the caller-supplied context.  A nonzero return from setup or fn
+ * aborts the benchmark.
+ */
+typedef struct _BenchCase {
+    const char *name;
+    size_t param;
+    int (*setup)(void *ctx);
+    int (*fn)(void *ctx);
+    void (*teardown)(void *ctx);
+    void *ctx;
+} BenchCase;
+
+uint64_t bench_now_ns(void);
+void init_BenchSuite(BenchSuite *suite);
+void free_BenchSuite(BenchSuite *suite);
+
+/** bench_run
+ * run the benchmark repeatedly until minTime_ns of timed work has
+ * accumulated (or maxIterations is reached) and record the result
+ *
+ * Returns 0 on success (or if skipped by filter), 1 on failure
+ */
+int bench_run(BenchSuite *suite, BenchCase *bcase);
+
+/** bench_record
+ * record a result from externally collected samples, for operations too
+ * heavy or stateful to run under bench_run; samples is sorted in place
+ *
+ * Returns 0 on success, 1 on failure
+ */
+int bench_record(BenchSuite *suite, const char *name, size_t param,
+        uint64_t *samples, size_t n_samples, size_t mounts);
+
+/** bench_write_json
+ * write all recorded results as a single JSON document
+ */
+int bench_write_json(BenchSuite *suite, FILE *fp, const char *version);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,755 @@
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+/* Microbenchmarks for the core runtime data structures.  Built by
+ * "make bench", which runs this program and writes bench_results.json; the
+ * JSON can be compared between releases to catch regressions.
+ *
+ * Nothing here requires root: mount tables are synthesized in memory and
+ * unmountTree is exercised against a base that matches no entries, so only
+ * its scan/sort cost is measured.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "bench_harness.h"
+#include "MountList.h"
+#include "PathList.h"
+#include "VolumeMap.h"
+#include "UdiRootConfig.h"
+#include "ImageData.h"
+#include "shifter_core.h"
+#include "shifter_mem.h"
+#include "utility.h"
+
+#ifndef VERSION
+#define VERSION "0Test0"
+#endif
+
+#define BENCH_FIND_LOOKUPS 1000
+#define BENCH_ENV_OPS 100
+
+/* not in ImageData.h; used to build acl lists the way parse_ImageData does */
+size_t _convert_to_list(const char *text, uid_t **uids, size_t *n_uids);
+
+/* deterministic LCG so runs are comparable across hosts and releases */
+static unsigned long benchSeed = 1;
+static unsigned long _bench_rand(void) {
+    benchSeed = benchSeed * 6364136223846793005UL + 1442695040888963407UL;
+    return benchSeed >> 33;
+}
+
+static char *benchTmpDir = NULL;
+static const char *benchConfigFile = CONFIG_FILE;
+
+/***************************************************************************
+ * MountList
+ ***************************************************************************/
+typedef struct _MountBench {
+    char **names;
+    size_t count;
+    MountList list;
+} MountBench;
+
+static char **_genMountNames(size_t count, int shuffle) {
+    char **names = _malloc(sizeof(char *) * (count + 1));
+    size_t idx = 0;
+    for (idx = 0; idx < count; idx++) {
+        /* mimic a udiMount with many volumes each carrying a few submounts */
+        names[idx] = alloc_strgenf("/var/udiMount/vol%06lu/sub%02lu",
+                (unsigned long) (idx / 4), (unsigned long) (idx % 4));
+    }
+    names[count] = NULL;
+    if (shuffle) {
+        for (idx = count - 1; idx > 0; idx--) {
+            size_t swp = _bench_rand() % (idx + 1);
+            char *tmp = names[idx];
+            names[idx] = names[swp];
+            names[swp] = tmp;
+        }
+    }
+    return names;
+}
+
+static void _fillMountList(MountBench *mb) {
+    size_t idx = 0;
+    memset(&(mb->list), 0, sizeof(MountList));
+    for (idx = 0; idx < mb->count; idx++) {
+        insert_MountList(&(mb->list), mb->names[idx]);
+    }
+}
+
+static int bench_MountList_insert(void *ctx) {
+    _fillMountList((MountBench *) ctx);
+    return 0;
+}
+
+static void teardown_MountList(void *ctx) {
+    MountBench *mb = (MountBench *) ctx;
+    free_MountList(&(mb->list), 0);
+}
+
+static int bench_MountList_find(void *ctx) {
+    MountBench *mb = (MountBench *) ctx;
+    size_t idx = 0;
+    for (idx = 0; idx < BENCH_FIND_LOOKUPS; idx++) {
+        const char *key = mb->names[(idx * 7919) % mb->count];
+        if (find_MountList(&(mb->list), key) == NULL) return 1;
+    }
+    return 0;
+}
+
+static int bench_MountList_findstartswith(void *ctx) {
+    MountBench *mb = (MountBench *) ctx;
+    char **found = findstartswith_MountList(&(mb->list),
+            mb->names[mb->count - 1]);
+    return found == NULL ? 1 : 0;
+}
+
+static int bench_unmountTree_scan(void *ctx) {
+    MountBench *mb = (MountBench *) ctx;
+    /* base matches nothing, so no umount2() is attempted */
+    return unmountTree(&(mb->list), "/var/shifterBenchNoSuchBase");
+}
+
+static int bench_parse_MountList(void *ctx) {
+    MountList *list = (MountList *) ctx;
+    memset(list, 0, sizeof(MountList));
+    return parse_MountList(list);
+}
+
+static void teardown_parse_MountList(void *ctx) {
+    free_MountList((MountList *) ctx, 0);
+}
+
+static void run_MountList(BenchSuite *suite) {
+    const size_t sizes[] = { 100, 1000, 10000, 100000, 0 };
+    const size_t *size = NULL;
+    MountList live;
+    BenchCase bcase;
+
+    for (size = sizes; *size != 0; size++) {
+        MountBench mb;
+        memset(&mb, 0, sizeof(MountBench));
+        mb.count = *size;
+
+        /* insertion into a shuffled table is quadratic; cap input size */
+        if (*size <= 10000) {
+            mb.names = _genMountNames(mb.count, 1);
+            bcase = (BenchCase) { "MountList_insert_shuffled", *size, NULL,
+                bench_MountList_insert, teardown_MountList, &mb };
+            bench_run(suite, &bcase);
+            free_string_array(mb.names);
+        }
+
+        /* kernel-ordered tables arrive already (nearly) sorted */
+        mb.names = _genMountNames(mb.count, 0);
+        bcase = (BenchCase) { "MountList_insert_ordered", *size, NULL,
+            bench_MountList_insert, teardown_MountList, &mb };
+        bench_run(suite, &bcase);
+
+        _fillMountList(&mb);
+        bcase = (BenchCase) { "MountList_find_x1000", *size, NULL,
+            bench_MountList_find, NULL, &mb };
+        bench_run(suite, &bcase);
+
+        bcase = (BenchCase) { "MountList_findstartswith", *size, NULL,
+            bench_MountList_findstartswith, NULL, &mb };
+        bench_run(suite, &bcase);
+
+        bcase = (BenchCase) { "unmountTree_scan", *size, NULL,
+            bench_unmountTree_scan, NULL, &mb };
+        bench_run(suite, &bcase);
+
+        free_MountList(&(mb.list), 0);
+        free_string_array(mb.names);
+    }
+
+    memset(&live, 0, sizeof(MountList));
+    if (parse_MountList(&live) == 0) {
+        size_t liveCount = live.count;
+        free_MountList(&live, 0);
+        bcase = (BenchCase) { "parse_MountList_live", liveCount, NULL,
+            bench_parse_MountList, teardown_parse_MountList, &live };
+        bench_run(suite, &bcase);
+    }
+}
+
+/***************************************************************************
+ * PathList and shifter_realpath
+ ***************************************************************************/
+typedef struct _PathBench {
+    char *path;
+    char *other;
+    UdiRootConfig config;
+} PathBench;
+
+static char *_genPath(size_t depth, int withDots) {
+    char *path = NULL;
+    size_t len = 0;
+    size_t capacity = 0;
+    size_t idx = 0;
+    for (idx = 0; idx < depth; idx++) {
+        path = alloc_strcatf(path, &len, &capacity, "/dir%02lu",
+                (unsigned long) idx);
+        if (withDots && idx % 4 == 3) {
+            path = alloc_strcatf(path, &len, &capacity, "/./junk/../");
+        }
+    }
+    return path;
+}
+
+static int bench_pathList_roundtrip(void *ctx) {
+    PathBench *pb = (PathBench *) ctx;
+    PathList *path = pathList_init(pb->path);
+    char *str = NULL;
+    if (path == NULL) return 1;
+    str = pathList_string(path);
+    pathList_free(path);
+    if (str == NULL) return 1;
+    free(str);
+    return 0;
+}
+
+static int bench_pathList_commonPath(void *ctx) {
+    PathBench *pb = (PathBench *) ctx;
+    PathList *a = pathList_init(pb->path);
+    PathList *b = pathList_init(pb->other);
+    PathList *common = pathList_commonPath(a, b);
+    int ret = common == NULL ? 1 : 0;
+    pathList_free(a);
+    pathList_free(b);
+    if (common != NULL) pathList_free(common);
+    return ret;
+}
+
+static int bench_pathList_append(void *ctx) {
+    PathBench *pb = (PathBench *) ctx;
+    PathList *base = pathList_init("/var/udiMount");
+    int ret = 0;
+    if (base == NULL) return 1;
+    ret = pathList_append(base, pb->path);
+    pathList_free(base);
+    return ret;
+}
+
+static int bench_shifter_realpath(void *ctx) {
+    PathBench *pb = (PathBench *) ctx;
+    char *resolved = shifter_realpath(pb->path, &(pb->config));
+    if (resolved == NULL) return 1;
+    free(resolved);
+    return 0;
+}
+
+/* build <tmp>/realpathN/dir00/.../dirNN with a symlink "link" in the middle
+ * directory pointing (absolute, so relative to the udiMount root) back at
+ * its own parent; the benchmarked path traverses the link once */
+static int _setupRealpathTree(PathBench *pb, size_t depth) {
+    char *root = alloc_strgenf("%s/realpath%lu", benchTmpDir,
+            (unsigned long) depth);
+    char *curr = _strdup(root);
+    char *prefix = _genPath(depth / 2 + 1, 0);
+    char *suffix = NULL;
+    size_t suffixLen = 0;
+    size_t suffixCapacity = 0;
+    size_t idx = 0;
+    int ret = 0;
+
+    mkdir(root, 0755);
+    for (idx = 0; idx < depth; idx++) {
+        char *next = alloc_strgenf("%s/dir%02lu", curr, (unsigned long) idx);
+        free(curr);
+        curr = next;
+        mkdir(curr, 0755);
+        if (idx == depth / 2) {
+            char *link = alloc_strgenf("%s/link", curr);
+            if (symlink(prefix, link) != 0) ret = 1;
+            free(link);
+        } else if (idx > depth / 2) {
+            suffix = alloc_strcatf(suffix, &suffixLen, &suffixCapacity,
+                    "/dir%02lu", (unsigned long) idx);
+        }
+    }
+
+    memset(&(pb->config), 0, sizeof(UdiRootConfig));
+    pb->config.udiMountPoint = root;
+    pb->path = alloc_strgenf("%s/link%s", prefix,
+            suffix != NULL ? suffix : "");
+    free(curr);
+    free(prefix);
+    free(suffix);
+    return ret;
+}
+
+static void run_PathList(BenchSuite *suite) {
+    const size_t depths[] = { 4, 16, 64, 0 };
+    const size_t *depth = NULL;
+    BenchCase bcase;
+
+    for (depth = depths; *depth != 0; depth++) {
+        PathBench pb;
+        memset(&pb, 0, sizeof(PathBench));
+
+        pb.path = _genPath(*depth, 0);
+        pb.other = _genPath(*depth / 2, 0);
+        bcase = (BenchCase) { "pathList_init_string", *depth, NULL,
+            bench_pathList_roundtrip, NULL, &pb };
+        bench_run(suite, &bcase);
+        bcase = (BenchCase) { "pathList_commonPath", *depth, NULL,
+            bench_pathList_commonPath, NULL, &pb };
+        bench_run(suite, &bcase);
+        free(pb.path);
+
+        pb.path = _genPath(*depth, 1);
+        bcase = (BenchCase) { "pathList_init_resolve_dots", *depth, NULL,
+            bench_pathList_roundtrip, NULL, &pb };
+        bench_run(suite, &bcase);
+        bcase = (BenchCase) { "pathList_append", *depth, NULL,
+            bench_pathList_append, NULL, &pb };
+        bench_run(suite, &bcase);
+        free(pb.path);
+        free(pb.other);
+        pb.path = NULL;
+        pb.other = NULL;
+
+        if (*depth <= 16 && _setupRealpathTree(&pb, *depth) == 0) {
+            bcase = (BenchCase) { "shifter_realpath_symlink", *depth, NULL,
+                bench_shifter_realpath, NULL, &pb };
+            bench_run(suite, &bcase);
+        }
+        free(pb.path);
+        free(pb.config.udiMountPoint);
+    }
+}
+
+/***************************************************************************
+ * VolumeMap
+ ***************************************************************************/
+typedef struct _VolMapBench {
+    char *input;
+    VolumeMap map;
+} VolMapBench;
+
+static int bench_parseVolumeMap(void *ctx) {
+    VolMapBench *vb = (VolMapBench *) ctx;
+    memset(&(vb->map), 0, sizeof(VolumeMap));
+    return parseVolumeMap(vb->input, &(vb->map));
+}
+
+static void teardown_VolumeMap(void *ctx) {
+    VolMapBench *vb = (VolMapBench *) ctx;
+    free_VolumeMap(&(vb->map), 0);
+}
+
+static int bench_getVolMapSignature(void *ctx) {
+    VolMapBench *vb = (VolMapBench *) ctx;
+    char *sig = getVolMapSignature(&(vb->map));
+    if (sig == NULL) return 1;
+    free(sig);
+    return 0;
+}
+
+static int bench_validateVolumeMap_targets(void *ctx) {
+    VolMapBench *vb = (VolMapBench *) ctx;
+    return validateVolumeMap_targets(&(vb->map));
+}
+
+static void run_VolumeMap(BenchSuite *suite) {
+    const size_t sizes[] = { 1, 10, 100, 1000, 10000, 0 };
+    const size_t *size = NULL;
+    BenchCase bcase;
+
+    for (size = sizes; *size != 0; size++) {
+        VolMapBench vb;
+        size_t len = 0;
+        size_t capacity = 0;
+        size_t idx = 0;
+        memset(&vb, 0, sizeof(VolMapBench));
+
+        for (idx = 0; idx < *size; idx++) {
+            /* reverse order so the signature sort has work to do */
+            vb.input = alloc_strcatf(vb.input, &len, &capacity,
+                    "%s/global/project/vol%05lu:/data/vol%05lu%s",
+                    idx > 0 ? ";" : "",
+                    (unsigned long) (*size - idx),
+                    (unsigned long) (*size - idx),
+                    idx % 2 ? ":ro" : "");
+        }
+
+        bcase = (BenchCase) { "parseVolumeMap", *size, NULL,
+            bench_parseVolumeMap, teardown_VolumeMap, &vb };
+        bench_run(suite, &bcase);
+
+        memset(&(vb.map), 0, sizeof(VolumeMap));
+        if (parseVolumeMap(vb.input, &(vb.map)) == 0) {
+            bcase = (BenchCase) { "getVolMapSignature", *size, NULL,
+                bench_getVolMapSignature, NULL, &vb };
+            bench_run(suite, &bcase);
+
+            bcase = (BenchCase) { "validateVolumeMap_targets", *size, NULL,
+                bench_validateVolumeMap_targets, NULL, &vb };
+            bench_run(suite, &bcase);
+        }
+        free_VolumeMap(&(vb.map), 0);
+        free(vb.input);
+    }
+}
+
+/***************************************************************************
+ * environment manipulation
+ ***************************************************************************/
+typedef struct _EnvBench {
+    char **base;
+    char **env;
+    char *key;
+    int (*op)(char ***, const char *);
+} EnvBench;
+
+static int setup_env(void *ctx) {
+    EnvBench *eb = (EnvBench *) ctx;
+    eb->env = dup_string_array(eb->base);
+    return eb->env == NULL ? 1 : 0;
+}
+
+static void teardown_env(void *ctx) {
+    EnvBench *eb = (EnvBench *) ctx;
+    free_string_array(eb->env);
+    eb->env = NULL;
+}
+
+static int bench_env_op(void *ctx) {
+    EnvBench *eb = (EnvBench *) ctx;
+    size_t idx = 0;
+    for (idx = 0; idx < BENCH_ENV_OPS; idx++) {
+        if (eb->op(&(eb->env), eb->key) != 0) return 1;
+    }
+    return 0;
+}
+
+static int _unsetenv_op(char ***env, const char *var) {
+    /* unset is idempotent; only the first of BENCH_ENV_OPS removes anything */
+    char *key = _strdup(var);
+    char *eq = strchr(key, '=');
+    int ret = 0;
+    if (eq != NULL) *eq = 0;
+    ret = shifter_unsetenv(env, key);
+    free(key);
+    return ret;
+}
+
+static void run_env(BenchSuite *suite) {
+    const size_t sizes[] = { 16, 128, 1024, 0 };
+    const size_t *size = NULL;
+    BenchCase bcase;
+
+    for (size = sizes; *size != 0; size++) {
+        EnvBench eb;
+        size_t idx = 0;
+        memset(&eb, 0, sizeof(EnvBench));
+
+        eb.base = _malloc(sizeof(char *) * (*size + 1));
+        for (idx = 0; idx < *size; idx++) {
+            eb.base[idx] = alloc_strgenf("BENCH_VAR_%05lu=/opt/value/%05lu",
+                    (unsigned long) idx, (unsigned long) idx);
+        }
+        eb.base[*size] = NULL;
+
+        /* operate on the last variable: worst case for the linear search */
+        eb.key = alloc_strgenf("BENCH_VAR_%05lu=/x", (unsigned long) (*size - 1));
+
+        eb.op = shifter_putenv;
+        bcase = (BenchCase) { "shifter_putenv_x100", *size, setup_env,
+            bench_env_op, teardown_env, &eb };
+        bench_run(suite, &bcase);
+
+        eb.op = shifter_appendenv;
+        bcase = (BenchCase) { "shifter_appendenv_x100", *size, setup_env,
+            bench_env_op, teardown_env, &eb };
+        bench_run(suite, &bcase);
+
+        eb.op = shifter_prependenv;
+        bcase = (BenchCase) { "shifter_prependenv_x100", *size, setup_env,
+            bench_env_op, teardown_env, &eb };
+        bench_run(suite, &bcase);
+
+        eb.op = _unsetenv_op;
+        bcase = (BenchCase) { "shifter_unsetenv_x100", *size, setup_env,
+            bench_env_op, teardown_env, &eb };
+        bench_run(suite, &bcase);
+
+        free(eb.key);
+        free_string_array(eb.base);
+    }
+}
+
+/***************************************************************************
+ * configuration and image metadata parsing
+ ***************************************************************************/
+typedef struct _ConfigBench {
+    UdiRootConfig config;
+    ImageData image;
+    char *identifier;
+    int savedStderr;
+} ConfigBench;
+
+/* parse_UdiRootConfig warns about deprecated keys in the test config on
+ * every call; keep that out of the benchmark report */
+static int setup_UdiRootConfig(void *ctx) {
+    ConfigBench *cb = (ConfigBench *) ctx;
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0) return 1;
+    fflush(stderr);
+    cb->savedStderr = dup(STDERR_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    close(devnull);
+    return 0;
+}
+
+static int bench_parse_UdiRootConfig(void *ctx) {
+    ConfigBench *cb = (ConfigBench *) ctx;
+    memset(&(cb->config), 0, sizeof(UdiRootConfig));
+    return parse_UdiRootConfig(benchConfigFile, &(cb->config), 0);
+}
+
+static void teardown_UdiRootConfig(void *ctx) {
+    ConfigBench *cb = (ConfigBench *) ctx;
+    free_UdiRootConfig(&(cb->config), 0);
+    fflush(stderr);
+    dup2(cb->savedStderr, STDERR_FILENO);
+    close(cb->savedStderr);
+}
+
+static int bench_parse_ImageData(void *ctx) {
+    ConfigBench *cb = (ConfigBench *) ctx;
+    memset(&(cb->image), 0, sizeof(ImageData));
+    return parse_ImageData("docker", cb->identifier, &(cb->config),
+            &(cb->image));
+}
+
+static void teardown_ImageData(void *ctx) {
+    ConfigBench *cb = (ConfigBench *) ctx;
+    free_ImageData(&(cb->image), 0);
+}
+
+static int _writeImageMeta(const char *identifier, size_t n_acl) {
+    char *fname = alloc_strgenf("%s/%s.meta", benchTmpDir, identifier);
+    FILE *fp = fopen(fname, "w");
+    size_t idx = 0;
+    free(fname);
+    if (fp == NULL) return 1;
+
+    fprintf(fp, "FORMAT: squashfs\n");
+    fprintf(fp, "ENTRY: /bin/bash -l\n");
+    fprintf(fp, "WORKDIR: /\n");
+    fprintf(fp, "ENV: PATH=/usr/local/bin:/usr/bin:/bin\n");
+    fprintf(fp, "ENV: LANG=C.UTF-8\n");
+    if (n_acl > 0) {
+        fprintf(fp, "USERACL: ");
+        for (idx = 0; idx < n_acl; idx++) {
+            fprintf(fp, "%s%lu", idx > 0 ? "," : "",
+                    (unsigned long) (20000 + idx));
+        }
+        fprintf(fp, "\nGROUPACL: ");
+        for (idx = 0; idx < n_acl; idx++) {
+            fprintf(fp, "%s%lu", idx > 0 ? "," : "",
+                    (unsigned long) (50000 + idx));
+        }
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void run_config(BenchSuite *suite) {
+    const size_t aclSizes[] = { 0, 10, 100, 900, SIZE_MAX };
+    const size_t *aclSize = NULL;
+    ConfigBench cb;
+    BenchCase bcase;
+
+    memset(&cb, 0, sizeof(ConfigBench));
+    if (access(benchConfigFile, R_OK) == 0) {
+        bcase = (BenchCase) { "parse_UdiRootConfig", 0, setup_UdiRootConfig,
+            bench_parse_UdiRootConfig, teardown_UdiRootConfig, &cb };
+        bench_run(suite, &bcase);
+    } else {
+        fprintf(stderr, "Skipping parse_UdiRootConfig, cannot read %s\n",
+                benchConfigFile);
+    }
+
+    memset(&(cb.config), 0, sizeof(UdiRootConfig));
+    cb.config.imageBasePath = benchTmpDir;
+    for (aclSize = aclSizes; *aclSize != SIZE_MAX; aclSize++) {
+        cb.identifier = alloc_strgenf("benchimage%lu", (unsigned long) *aclSize);
+        if (_writeImageMeta(cb.identifier, *aclSize) == 0) {
+            bcase = (BenchCase) { "parse_ImageData_acl", *aclSize, NULL,
+                bench_parse_ImageData, teardown_ImageData, &cb };
+            bench_run(suite, &bcase);
+        }
+        free(cb.identifier);
+        cb.identifier = NULL;
+    }
+}
+
+/***************************************************************************
+ * image acl checks
+ ***************************************************************************/
+typedef struct _AclBench {
+    ImageData image;
+    gid_t *groups;
+    size_t n_groups;
+} AclBench;
+
+/* random ids in [base, base + 100000), written unsorted as in a .meta */
+static char *_genIdList(size_t count, unsigned long base) {
+    char *ret = NULL;
+    size_t len = 0;
+    size_t capacity = 0;
+    size_t idx = 0;
+    for (idx = 0; idx < count; idx++) {
+        ret = alloc_strcatf(ret, &len, &capacity, "%s%lu", idx > 0 ? "," : "",
+                base + _bench_rand() % 100000);
+    }
+    return ret;
+}
+
+/* the user is in none of the acl groups, so every check scans everything */
+static int bench_check_image_permissions(void *ctx) {
+    AclBench *ab = (AclBench *) ctx;
+    return check_image_permissions(1, 2, ab->groups, (int) ab->n_groups,
+            &(ab->image)) != 0;
+}
+
+static void run_acl(BenchSuite *suite) {
+    const size_t aclSizes[] = { 10, 100, 1000, SIZE_MAX };
+    const size_t groupSizes[] = { 16, 256, 1024, SIZE_MAX };
+    const size_t *aclSize = NULL;
+    const size_t *groupSize = NULL;
+    BenchCase bcase;
+    AclBench ab;
+    size_t idx = 0;
+
+    for (aclSize = aclSizes; *aclSize != SIZE_MAX; aclSize++) {
+        char *uidList = _genIdList(*aclSize, 20000);
+        char *gidList = _genIdList(*aclSize, 200000);
+
+        memset(&ab, 0, sizeof(AclBench));
+        _convert_to_list(uidList, &(ab.image.uids), &(ab.image.n_uids));
+        _convert_to_list(gidList, (uid_t **) &(ab.image.gids),
+                &(ab.image.n_gids));
+        free(uidList);
+        free(gidList);
+
+        for (groupSize = groupSizes; *groupSize != SIZE_MAX; groupSize++) {
+            char *name = alloc_strgenf("check_image_permissions_acl%lu_groups",
+                    (unsigned long) *aclSize);
+            ab.n_groups = *groupSize;
+            ab.groups = (gid_t *) _malloc(sizeof(gid_t) * ab.n_groups);
+            for (idx = 0; idx < ab.n_groups; idx++) {
+                ab.groups[idx] = 100000 + _bench_rand() % 100000;
+            }
+            bcase = (BenchCase) { name, *groupSize, NULL,
+                bench_check_image_permissions, NULL, &ab };
+            bench_run(suite, &bcase);
+            free(ab.groups);
+            free(name);
+        }
+        free(ab.image.uids);
+        free(ab.image.gids);
+    }
+}
+
+static void _usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-o output.json] [-f filter] [-t min_seconds] "
+            "[-c udiRoot.conf] [-q]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    BenchSuite suite;
+    const char *output = NULL;
+    char tmpTemplate[] = "/tmp/shifterBench.XXXXXX";
+    FILE *fp = stdout;
+    int opt = 0;
+    int ret = 0;
+    char *cmd = NULL;
+
+    init_BenchSuite(&suite);
+    suite.verbose = 1;
+
+    while ((opt = getopt(argc, argv, "o:f:t:c:qh")) != -1) {
+        switch (opt) {
+            case 'o': output = optarg; break;
+            case 'f': suite.filter = optarg; break;
+            case 't': suite.minTime_ns = (uint64_t) (strtod(optarg, NULL) * 1e9); break;
+            case 'c': benchConfigFile = optarg; break;
+            case 'q': suite.verbose = 0; break;
+            case 'h': _usage(argv[0]); return 0;
+            default: _usage(argv[0]); return 1;
+        }
+    }
+
+    benchTmpDir = mkdtemp(tmpTemplate);
+    if (benchTmpDir == NULL) {
+        fprintf(stderr, "FAILED to create temporary directory\n");
+        return 1;
+    }
+
+    run_MountList(&suite);
+    run_PathList(&suite);
+    run_VolumeMap(&suite);
+    run_env(&suite);
+    run_config(&suite);
+    run_acl(&suite);
+
+    if (output != NULL) {
+        fp = fopen(output, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "FAILED to open %s for writing\n", output);
+            ret = 1;
+            goto _main_cleanup;
+        }
+    }
+    ret = bench_write_json(&suite, fp, VERSION);
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+_main_cleanup:
+    cmd = alloc_strgenf("rm -rf %s", benchTmpDir);
+    if (cmd != NULL) {
+        if (system(cmd) != 0) {
+            fprintf(stderr, "FAILED to remove %s\n", benchTmpDir);
+        }
+        free(cmd);
+    }
+    free_BenchSuite(&suite);
+    return ret;
+}
@@ -0,0 +1,821 @@
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. Neither the name of the University of California, Lawrence Berkeley
+ *     National Laboratory, U.S. Dept. of Energy nor the names of its
+ *     contributors may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * See LICENSE for full text.
+ */
+
+/* End-to-end benchmark of UDI construction and teardown.
+ *
+ * The real mountImageVFS / setupUserMounts / destructUDI code is run inside
+ * a private user and mount namespace, so no privileges are needed and the
+ * host mount table is never touched.  A synthetic "local" image directory,
+ * site volumes, user volumes, site etc files and modules are generated in a
+ * temporary directory together with a udiRoot.conf describing them.  Each
+ * input dimension is scaled separately while the others stay at their
+ * baseline, and per-phase latency plus the number of mounts built are
+ * reported.
+ *
+ * Run without arguments (as "make check" does) a small sweep is used as a
+ * smoke test; -F runs the full sweep ("make bench").  If user namespaces
+ * are unavailable the program exits 77 so automake reports a skip.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <grp.h>
+
+#include "config.h"
+#include "bench_harness.h"
+#include "MountList.h"
+#include "VolumeMap.h"
+#include "UdiRootConfig.h"
+#include "ImageData.h"
+#include "shifter_core.h"
+#include "shifter_mem.h"
+#include "utility.h"
+
+#ifndef VERSION
+#define VERSION "0Test0"
+#endif
+
+#define BENCH_UDI_SKIP 77
+#define BENCH_UDI_REPEATS 5
+#define BENCH_UDI_ID_RANGE 65536
+#define BENCH_UDI_TARGET_ID 1000
+#define BENCH_UDI_USER "bench"
+#define BENCH_UDI_USER_SITEFS "/benchuser"
+
+/** UdiScale
+ * sizes of each generated input for one scenario
+ */
+typedef struct _UdiScale {
+    size_t imageEntries;
+    size_t siteVolumes;
+    size_t userVolumes;
+    size_t etcFiles;
+    size_t modules;
+} UdiScale;
+
+typedef enum _UdiPhase {
+    PHASE_MOUNT_IMAGE = 0,
+    PHASE_USER_MOUNTS,
+    PHASE_SAVE_CONFIG,
+    PHASE_REMOUNT_RO,
+    PHASE_DESTRUCT,
+    PHASE_TOTAL,
+    PHASE_COUNT
+} UdiPhase;
+
+static const char *phaseNames[PHASE_COUNT] = {
+    "mountImageVFS", "setupUserMounts", "saveShifterConfig",
+    "remountUdiRootReadonly", "destructUDI", "total"
+};
+
+static const UdiScale baselineScale = { 16, 2, 2, 8, 0 };
+
+static char *benchTmpDir = NULL;
+static int benchQuiet = 0;
+
+/* uid/gid of the simulated job user; 0 if only root is mapped, in which
+ * case user volume mounts cannot be exercised */
+static uid_t benchTargetId = 0;
+
+static int _writeFile(const char *path, const char *data) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "FAILED to open %s for writing\n", path);
+        return 1;
+    }
+    fputs(data, fp);
+    fclose(fp);
+    return 0;
+}
+
+static int _writeProcFile(const char *path, const char *data) {
+    int fd = open(path, O_WRONLY);
+    ssize_t len = strlen(data);
+    if (fd < 0) return 1;
+    if (write(fd, data, len) != len) {
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
+
+static void _waitAndExit(pid_t child) {
+    int status = 0;
+    while (waitpid(child, &status, 0) < 0) {
+        if (errno != EINTR) exit(1);
+    }
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+/* write the id maps for a child which has just created its user namespace;
+ * run as root the whole low id range is mapped so the target user of user
+ * volume mounts can be distinct from root, otherwise only the caller's own
+ * ids can be mapped */
+static int _writeIdMaps(pid_t child) {
+    char path[PATH_MAX];
+    char map[64];
+
+    if (getuid() == 0) {
+        snprintf(map, sizeof(map), "0 0 %u", BENCH_UDI_ID_RANGE);
+    } else {
+        snprintf(path, PATH_MAX, "/proc/%d/setgroups", (int) child);
+        if (_writeProcFile(path, "deny") != 0 && errno != ENOENT) {
+            fprintf(stderr, "FAILED to disable setgroups\n");
+            return 1;
+        }
+        snprintf(map, sizeof(map), "0 %u 1", (unsigned int) getuid());
+    }
+    snprintf(path, PATH_MAX, "/proc/%d/uid_map", (int) child);
+    if (_writeProcFile(path, map) != 0) {
+        fprintf(stderr, "FAILED to write uid_map\n");
+        return 1;
+    }
+    if (getuid() != 0) {
+        snprintf(map, sizeof(map), "0 %u 1", (unsigned int) getgid());
+    }
+    snprintf(path, PATH_MAX, "/proc/%d/gid_map", (int) child);
+    if (_writeProcFile(path, map) != 0) {
+        fprintf(stderr, "FAILED to write gid_map\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* replace /dev with a tmpfs holding binds of a few device nodes; the host
+ * /dev submounts (pts, shm, mqueue) are locked in this namespace, so they
+ * could not be unmounted from the UDI's recursive bind of /dev */
+static int _privateDev(void) {
+    const char *devices[] = { "null", "zero", "full", "random", "urandom",
+        "tty", NULL };
+    const char **device = NULL;
+    char staging[] = "/tmp/shifterUdiBenchDev.XXXXXX";
+    char path[PATH_MAX];
+    char source[PATH_MAX];
+    int ret = 1;
+
+    if (mkdtemp(staging) == NULL) return 1;
+    if (mount("none", staging, "tmpfs", MS_NOSUID, "mode=0755") != 0) {
+        goto _privateDev_exit;
+    }
+    for (device = devices; *device != NULL; device++) {
+        int fd = -1;
+        snprintf(source, PATH_MAX, "/dev/%s", *device);
+        snprintf(path, PATH_MAX, "%s/%s", staging, *device);
+        if (access(source, F_OK) != 0) continue;
+        fd = open(path, O_WRONLY | O_CREAT, 0666);
+        if (fd < 0) goto _privateDev_exit;
+        close(fd);
+        if (mount(source, path, NULL, MS_BIND, NULL) != 0) {
+            goto _privateDev_exit;
+        }
+    }
+    if (mount(staging, "/dev", NULL, MS_MOVE, NULL) != 0) {
+        goto _privateDev_exit;
+    }
+    ret = 0;
+
+_privateDev_exit:
+    if (ret != 0) {
+        umount2(staging, MNT_DETACH);
+    }
+    rmdir(staging);
+    return ret;
+}
+
+/* Move into private user, mount, pid and net namespaces, mapped to root.
+ *
+ * A child creates the user namespace and its id maps are written from
+ * outside it.  Owning the pid and net namespaces allows fresh proc and sysfs
+ * mounts: the UDI gets a new /proc, and /sys is replaced because the host
+ * /sys has submounts which an unprivileged non-recursive bind (as done for
+ * the UDI /sys) may not expose.  The work is done in a grandchild, pid 1 of
+ * the new pid namespace; every ancestor only waits and exits with its
+ * status, so this returns 0 only in the grandchild. */
+static int _enterNamespace(void) {
+    int ready[2];
+    int mapped[2];
+    char token = 0;
+    pid_t child = 0;
+
+    if (pipe(ready) != 0 || pipe(mapped) != 0) {
+        return 1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    child = fork();
+    if (child < 0) {
+        return 1;
+    }
+    if (child > 0) {
+        int ret = 0;
+        close(ready[1]);
+        close(mapped[0]);
+        if (read(ready[0], &token, 1) != 1 || token != 'u') {
+            _waitAndExit(child);
+        }
+        ret = _writeIdMaps(child);
+        token = ret == 0 ? 'm' : 'x';
+        if (write(mapped[1], &token, 1) != 1) {
+            ret = 1;
+        }
+        close(mapped[1]);
+        _waitAndExit(child);
+    }
+
+    close(ready[0]);
+    close(mapped[1]);
+    if (unshare(CLONE_NEWUSER) != 0) {
+        fprintf(stderr, "Cannot create user namespace: %s\n",
+                strerror(errno));
+        exit(BENCH_UDI_SKIP);
+    }
+    token = 'u';
+    if (write(ready[1], &token, 1) != 1 ||
+            read(mapped[0], &token, 1) != 1 || token != 'm') {
+        exit(BENCH_UDI_SKIP);
+    }
+    close(ready[1]);
+    close(mapped[0]);
+
+    if (unshare(CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWNET) != 0) {
+        fprintf(stderr, "Cannot create namespaces: %s\n", strerror(errno));
+        exit(BENCH_UDI_SKIP);
+    }
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+        fprintf(stderr, "FAILED to make mounts private: %s\n",
+                strerror(errno));
+        exit(BENCH_UDI_SKIP);
+    }
+    child = fork();
+    if (child < 0) {
+        exit(1);
+    }
+    if (child > 0) {
+        _waitAndExit(child);
+    }
+
+    /* shifter reads /proc/<getpid()>/mounts, which must describe this
+     * pid namespace */
+    if (mount("proc", "/proc", "proc", MS_NOSUID|MS_NODEV|MS_NOEXEC,
+                NULL) != 0) {
+        fprintf(stderr, "FAILED to mount private proc: %s\n",
+                strerror(errno));
+        exit(BENCH_UDI_SKIP);
+    }
+    if (mount("sysfs", "/sys", "sysfs", MS_NOSUID|MS_NODEV|MS_NOEXEC,
+                NULL) != 0) {
+        fprintf(stderr, "FAILED to mount private sysfs: %s\n",
+                strerror(errno));
+        exit(BENCH_UDI_SKIP);
+    }
+    if (_privateDev() != 0) {
+        fprintf(stderr, "FAILED to setup private /dev: %s\n",
+                strerror(errno));
+        exit(BENCH_UDI_SKIP);
+    }
+    benchTargetId = 0;
+    if (setgroups(0, NULL) == 0) {
+        benchTargetId = BENCH_UDI_TARGET_ID;
+    }
+    return 0;
+}
+
+static int _mkdirf(mode_t mode, const char *fmt, ...) {
+    char *path = NULL;
+    int ret = 0;
+    va_list ap;
+    va_start(ap, fmt);
+    if (vasprintf(&path, fmt, ap) < 0) {
+        va_end(ap);
+        return 1;
+    }
+    va_end(ap);
+    if (mkdir(path, mode) != 0 && errno != EEXIST) {
+        fprintf(stderr, "FAILED to mkdir %s\n", path);
+        ret = 1;
+    }
+    free(path);
+    return ret;
+}
+
+/* populate the scenario directory: image/, site/, user/, etc/, modules/ and
+ * udiRoot.conf; returns the path to the configuration file */
+static char *_generateScenario(const char *dir, const UdiScale *scale,
+        char **userVolumes, char **modules)
+{
+    char *conf = NULL;
+    char *path = NULL;
+    char *siteFs = NULL;
+    size_t siteFsLen = 0;
+    size_t siteFsCap = 0;
+    size_t userLen = 0;
+    size_t userCap = 0;
+    size_t modLen = 0;
+    size_t modCap = 0;
+    size_t confLen = 0;
+    size_t confCap = 0;
+    size_t idx = 0;
+    int ret = 0;
+
+    ret |= _mkdirf(0755, "%s", dir);
+    ret |= _mkdirf(0755, "%s/udi", dir);
+    ret |= _mkdirf(0755, "%s/image", dir);
+    ret |= _mkdirf(0755, "%s/image/etc", dir);
+    ret |= _mkdirf(0755, "%s/image/var", dir);
+    ret |= _mkdirf(0755, "%s/image/opt", dir);
+    ret |= _mkdirf(0755, "%s/site", dir);
+    ret |= _mkdirf(0755, "%s/user", dir);
+    ret |= _mkdirf(0755, "%s/etc", dir);
+    ret |= _mkdirf(0755, "%s/modules", dir);
+    if (ret != 0) return NULL;
+
+    /* image: top-level directories plus a few etc/var/opt entries */
+    for (idx = 0; idx < scale->imageEntries; idx++) {
+        ret |= _mkdirf(0755, "%s/image/d%05lu", dir, (unsigned long) idx);
+    }
+    for (idx = 0; idx < 4; idx++) {
+        ret |= _mkdirf(0755, "%s/image/var/v%lu", dir, (unsigned long) idx);
+        ret |= _mkdirf(0755, "%s/image/opt/o%lu", dir, (unsigned long) idx);
+        path = alloc_strgenf("%s/image/etc/image%lu.conf", dir,
+                (unsigned long) idx);
+        ret |= _writeFile(path, "image=1\n");
+        free(path);
+    }
+
+    /* site etc: the mandatory files plus synthetic extras */
+    path = alloc_strgenf("%s/etc/passwd", dir);
+    ret |= _writeFile(path, "root:x:0:0:root:/root:/bin/sh\n"
+            BENCH_UDI_USER ":x:1000:1000::/tmp:/bin/sh\n");
+    free(path);
+    path = alloc_strgenf("%s/etc/group", dir);
+    ret |= _writeFile(path, "root:x:0:root\n"
+            BENCH_UDI_USER ":x:1000:\n");
+    free(path);
+    path = alloc_strgenf("%s/etc/nsswitch.conf", dir);
+    ret |= _writeFile(path, "passwd: files\ngroup: files\n");
+    free(path);
+    for (idx = 0; idx < scale->etcFiles; idx++) {
+        path = alloc_strgenf("%s/etc/site%05lu.conf", dir, (unsigned long) idx);
+        ret |= _writeFile(path, "site=1\n");
+        free(path);
+    }
+
+    /* site and user volume sources */
+    for (idx = 0; idx < scale->siteVolumes; idx++) {
+        ret |= _mkdirf(0755, "%s/site/s%05lu", dir, (unsigned long) idx);
+        siteFs = alloc_strcatf(siteFs, &siteFsLen, &siteFsCap,
+                "%s%s/site/s%05lu:/site%05lu", idx > 0 ? ";" : "",
+                dir, (unsigned long) idx, (unsigned long) idx);
+    }
+    /* user volume sources are resolved inside the UDI, so like site
+     * filesystems on a real system they are reached through a siteFs
+     * volume */
+    if (scale->userVolumes > 0) {
+        siteFs = alloc_strcatf(siteFs, &siteFsLen, &siteFsCap,
+                "%s%s/user:" BENCH_UDI_USER_SITEFS,
+                siteFs != NULL ? ";" : "", dir);
+    }
+    for (idx = 0; idx < scale->userVolumes; idx++) {
+        ret |= _mkdirf(0755, "%s/user/u%05lu", dir, (unsigned long) idx);
+        *userVolumes = alloc_strcatf(*userVolumes, &userLen, &userCap,
+                "%s" BENCH_UDI_USER_SITEFS "/u%05lu:/d%05lu%s",
+                idx > 0 ? ";" : "", (unsigned long) idx,
+                (unsigned long) (idx % (scale->imageEntries ?
+                    scale->imageEntries : 1)),
+                idx % 2 ? ":ro" : "");
+    }
+
+    conf = alloc_strcatf(conf, &confLen, &confCap,
+            "udiMount=%s/udi\n"
+            "loopMount=%s/loop\n"
+            "imagePath=%s\n"
+            "udiRootPath=%s\n"
+            "etcPath=%s/etc\n"
+            "cpPath=/bin/cp\n"
+            "mvPath=/bin/mv\n"
+            "chmodPath=/bin/chmod\n"
+            "ddPath=/bin/dd\n"
+            "rootfsType=tmpfs\n"
+            "allowLocalChroot=1\n"
+            "mountPropagationStyle=private\n"
+            "system=bench\n"
+            "imageGateway=http://localhost\n",
+            dir, dir, dir, dir, dir);
+    if (siteFs != NULL) {
+        conf = alloc_strcatf(conf, &confLen, &confCap, "siteFs=%s\n", siteFs);
+    }
+
+    /* modules: each contributes a siteFs volume and a copied tree */
+    for (idx = 0; idx < scale->modules; idx++) {
+        ret |= _mkdirf(0755, "%s/modules/m%03lu", dir, (unsigned long) idx);
+        ret |= _mkdirf(0755, "%s/modules/m%03lu/lib", dir,
+                (unsigned long) idx);
+        conf = alloc_strcatf(conf, &confLen, &confCap,
+                "module_m%03lu_siteFs = %s/modules/m%03lu/lib:/module%03lu\n"
+                "module_m%03lu_copyPath = %s/modules/m%03lu\n"
+                "module_m%03lu_siteEnv = BENCH_MODULE_M%03lu=1\n",
+                (unsigned long) idx, dir, (unsigned long) idx,
+                (unsigned long) idx,
+                (unsigned long) idx, dir, (unsigned long) idx,
+                (unsigned long) idx, (unsigned long) idx);
+        *modules = alloc_strcatf(*modules, &modLen, &modCap, "%sm%03lu",
+                idx > 0 ? "," : "", (unsigned long) idx);
+    }
+
+    path = alloc_strgenf("%s/udiRoot.conf", dir);
+    ret |= _writeFile(path, conf);
+    free(conf);
+    free(siteFs);
+    if (ret != 0) {
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+/* count mounts at or below base */
+static size_t _countMounts(const char *base) {
+    MountList mounts;
+    size_t count = 0;
+    size_t baseLen = strlen(base);
+    size_t idx = 0;
+
+    memset(&mounts, 0, sizeof(MountList));
+    if (parse_MountList(&mounts) != 0) return 0;
+    for (idx = 0; idx < mounts.count; idx++) {
+        const char *mnt = mounts.mountPointList[idx];
+        if (strncmp(mnt, base, baseLen) == 0 &&
+                (mnt[baseLen] == 0 || mnt[baseLen] == '/')) {
+            count++;
+        }
+    }
+    free_MountList(&mounts, 0);
+    return count;
+}
+
+/* one full setup/teardown cycle; samples[phase] receives the elapsed ns */
+static int _runCycle(const char *confPath, const char *imagePath,
+        const char *userVolumes, const char *modules, uint64_t *samples,
+        size_t *n_mounts)
+{
+    UdiRootConfig udiConfig;
+    ImageData image;
+    VolumeMap volumeMap;
+    uint64_t start = 0;
+    uint64_t cycleStart = 0;
+    int ret = 1;
+
+    memset(&udiConfig, 0, sizeof(UdiRootConfig));
+    memset(&image, 0, sizeof(ImageData));
+    memset(&volumeMap, 0, sizeof(VolumeMap));
+
+    if (parse_UdiRootConfig(confPath, &udiConfig, 0) != 0) {
+        fprintf(stderr, "FAILED to parse %s\n", confPath);
+        goto _runCycle_exit;
+    }
+    udiConfig.target_uid = benchTargetId;
+    udiConfig.target_gid = benchTargetId;
+    udiConfig.auxiliary_gids = _malloc(sizeof(gid_t));
+    udiConfig.auxiliary_gids[0] = benchTargetId;
+    udiConfig.nauxiliary_gids = 1;
+    if (modules != NULL &&
+            parse_selected_ShifterModule(modules, &udiConfig) != 0) {
+        fprintf(stderr, "FAILED to select modules %s\n", modules);
+        goto _runCycle_exit;
+    }
+    if (parse_ImageData("local", (char *) imagePath, &udiConfig, &image) != 0) {
+        fprintf(stderr, "FAILED to describe image %s\n", imagePath);
+        goto _runCycle_exit;
+    }
+    if (userVolumes != NULL && parseVolumeMap(userVolumes, &volumeMap) != 0) {
+        fprintf(stderr, "FAILED to parse user volumes\n");
+        goto _runCycle_exit;
+    }
+
+    cycleStart = bench_now_ns();
+    start = cycleStart;
+    if (mountImageVFS(&image, BENCH_UDI_USER, 0, NULL, &udiConfig) != 0) {
+        fprintf(stderr, "FAILED to mount image into UDI\n");
+        goto _runCycle_teardown;
+    }
+    samples[PHASE_MOUNT_IMAGE] = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    if (setupUserMounts(&volumeMap, &udiConfig) != 0) {
+        fprintf(stderr, "FAILED to setup user mounts\n");
+        goto _runCycle_teardown;
+    }
+    samples[PHASE_USER_MOUNTS] = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    if (saveShifterConfig(BENCH_UDI_USER, &image, &volumeMap, &udiConfig) != 0) {
+        fprintf(stderr, "FAILED to save shifter configuration\n");
+        goto _runCycle_teardown;
+    }
+    samples[PHASE_SAVE_CONFIG] = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    if (remountUdiRootReadonly(&udiConfig) != 0) {
+        fprintf(stderr, "FAILED to remount udiRoot readonly\n");
+        goto _runCycle_teardown;
+    }
+    samples[PHASE_REMOUNT_RO] = bench_now_ns() - start;
+
+    *n_mounts = _countMounts(udiConfig.udiMountPoint);
+    ret = 0;
+
+_runCycle_teardown:
+    /* chdir away so the udiMount is not busy */
+    if (chdir("/") != 0) {
+        ret = 1;
+    }
+    start = bench_now_ns();
+    if (destructUDI(&udiConfig, 0) != 0) {
+        fprintf(stderr, "FAILED to tear down UDI\n");
+        ret = 1;
+    }
+    samples[PHASE_DESTRUCT] = bench_now_ns() - start;
+    samples[PHASE_TOTAL] = bench_now_ns() - cycleStart;
+    if (ret == 0 && _countMounts(udiConfig.udiMountPoint) != 0) {
+        fprintf(stderr, "FAILED destructUDI left mounts behind\n");
+        ret = 1;
+    }
+
+_runCycle_exit:
+    free_VolumeMap(&volumeMap, 0);
+    free_ImageData(&image, 0);
+    free(udiConfig.auxiliary_gids);
+    free_UdiRootConfig(&udiConfig, 0);
+    return ret;
+}
+
+static int _runScenario(BenchSuite *suite, const char *dimension,
+        size_t param, const UdiScale *scale, size_t repeats)
+{
+    char *dir = alloc_strgenf("%s/%s_%lu", benchTmpDir, dimension,
+            (unsigned long) param);
+    char *imagePath = alloc_strgenf("%s/image", dir);
+    char *userVolumes = NULL;
+    char *modules = NULL;
+    char *confPath = NULL;
+    uint64_t *samples[PHASE_COUNT];
+    size_t n_mounts = 0;
+    size_t rep = 0;
+    size_t phase = 0;
+    int savedStderr = -1;
+    int ret = 1;
+
+    memset(samples, 0, sizeof(samples));
+    if (suite->filter != NULL && strstr(dimension, suite->filter) == NULL) {
+        ret = 0;
+        goto _runScenario_exit;
+    }
+
+    confPath = _generateScenario(dir, scale, &userVolumes, &modules);
+    if (confPath == NULL) {
+        fprintf(stderr, "FAILED to generate scenario %s/%lu\n", dimension,
+                (unsigned long) param);
+        goto _runScenario_exit;
+    }
+    for (phase = 0; phase < PHASE_COUNT; phase++) {
+        samples[phase] = _malloc(sizeof(uint64_t) * repeats);
+    }
+
+    /* setup code is chatty on stderr; keep the report readable */
+    if (benchQuiet) {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) {
+            fflush(stderr);
+            savedStderr = dup(STDERR_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            close(devnull);
+        }
+    }
+    for (rep = 0; rep < repeats; rep++) {
+        uint64_t cycle[PHASE_COUNT];
+        memset(cycle, 0, sizeof(cycle));
+        if (_runCycle(confPath, imagePath, userVolumes, modules, cycle,
+                    &n_mounts) != 0) {
+            break;
+        }
+        for (phase = 0; phase < PHASE_COUNT; phase++) {
+            samples[phase][rep] = cycle[phase];
+        }
+    }
+    if (savedStderr >= 0) {
+        fflush(stderr);
+        dup2(savedStderr, STDERR_FILENO);
+        close(savedStderr);
+    }
+    if (rep != repeats) {
+        fprintf(stderr, "FAILED scenario %s/%lu on repeat %lu (rerun with "
+                "-v for details)\n", dimension, (unsigned long) param,
+                (unsigned long) rep);
+        goto _runScenario_exit;
+    }
+
+    for (phase = 0; phase < PHASE_COUNT; phase++) {
+        char *name = alloc_strgenf("udi_%s_%s", dimension, phaseNames[phase]);
+        bench_record(suite, name, param, samples[phase], repeats,
+                phase == PHASE_TOTAL ? n_mounts : 0);
+        free(name);
+    }
+    ret = 0;
+
+_runScenario_exit:
+    for (phase = 0; phase < PHASE_COUNT; phase++) {
+        free(samples[phase]);
+    }
+    free(dir);
+    free(imagePath);
+    free(userVolumes);
+    free(modules);
+    free(confPath);
+    return ret;
+}
+
+static int _runSweep(BenchSuite *suite, int full, size_t repeats) {
+    const size_t quickSizes[] = { 4, 0 };
+    const size_t fullSizes[] = { 1, 16, 128, 1024, 0 };
+    const size_t quickModules[] = { 1, 0 };
+    const size_t fullModules[] = { 1, 4, 16, 0 };
+    const size_t *sizes = full ? fullSizes : quickSizes;
+    const size_t *moduleSizes = full ? fullModules : quickModules;
+    const size_t *size = NULL;
+    UdiScale baseline = baselineScale;
+    UdiScale scale;
+
+    if (benchTargetId == 0) {
+        fprintf(stderr, "Only one id could be mapped into the namespace "
+                "(run as root to map a range); skipping user volumes\n");
+        baseline.userVolumes = 0;
+    }
+
+    scale = baseline;
+    if (_runScenario(suite, "baseline", 0, &scale, repeats) != 0) {
+        return 1;
+    }
+
+    for (size = sizes; *size != 0; size++) {
+        scale = baseline;
+        scale.imageEntries = *size;
+        if (_runScenario(suite, "imageEntries", *size, &scale, repeats) != 0) {
+            return 1;
+        }
+
+        scale = baseline;
+        scale.siteVolumes = *size;
+        if (_runScenario(suite, "siteVolumes", *size, &scale, repeats) != 0) {
+            return 1;
+        }
+
+        if (benchTargetId != 0) {
+            scale = baseline;
+            scale.userVolumes = *size;
+            scale.imageEntries = *size > scale.imageEntries ? *size :
+                    scale.imageEntries;
+            if (_runScenario(suite, "userVolumes", *size, &scale,
+                        repeats) != 0) {
+                return 1;
+            }
+        }
+
+        scale = baseline;
+        scale.etcFiles = *size;
+        if (_runScenario(suite, "etcFiles", *size, &scale, repeats) != 0) {
+            return 1;
+        }
+    }
+    for (size = moduleSizes; *size != 0; size++) {
+        scale = baseline;
+        scale.modules = *size;
+        if (_runScenario(suite, "modules", *size, &scale, repeats) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void _usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-F] [-r repeats] [-o output.json] "
+            "[-f filter] [-v] [-q]\n", prog);
+    fprintf(stderr, "  -F  run the full sweep (default is a quick smoke "
+            "test)\n");
+    fprintf(stderr, "  -v  show output from the setup code\n");
+}
+
+int main(int argc, char **argv) {
+    BenchSuite suite;
+    const char *output = NULL;
+    char tmpTemplate[] = "/tmp/shifterUdiBench.XXXXXX";
+    char cwd[PATH_MAX];
+    size_t repeats = 0;
+    int full = 0;
+    int verbose = 0;
+    int opt = 0;
+    int ret = 0;
+    FILE *fp = stdout;
+
+    init_BenchSuite(&suite);
+    suite.verbose = 1;
+
+    while ((opt = getopt(argc, argv, "Fr:o:f:vqh")) != -1) {
+        switch (opt) {
+            case 'F': full = 1; break;
+            case 'r': repeats = strtoul(optarg, NULL, 10); break;
+            case 'o': output = optarg; break;
+            case 'f': suite.filter = optarg; break;
+            case 'v': verbose = 1; break;
+            case 'q': suite.verbose = 0; break;
+            case 'h': _usage(argv[0]); return 0;
+            default: _usage(argv[0]); return 1;
+        }
+    }
+    if (repeats == 0) {
+        repeats = full ? BENCH_UDI_REPEATS : 1;
+    }
+    benchQuiet = !verbose;
+
+    if (_enterNamespace() != 0) {
+        fprintf(stderr, "Skipping UDI benchmark, user namespaces are "
+                "unavailable\n");
+        return BENCH_UDI_SKIP;
+    }
+
+    benchTmpDir = mkdtemp(tmpTemplate);
+    if (benchTmpDir == NULL) {
+        fprintf(stderr, "FAILED to create temporary directory\n");
+        return 1;
+    }
+    /* keep the generated tree on a private tmpfs, discarded on exit */
+    if (mount("none", benchTmpDir, "tmpfs", 0, NULL) != 0) {
+        fprintf(stderr, "FAILED to mount tmpfs on %s\n", benchTmpDir);
+        rmdir(benchTmpDir);
+        return 1;
+    }
+
+    if (getcwd(cwd, PATH_MAX) == NULL) {
+        fprintf(stderr, "FAILED to get working directory\n");
+        return 1;
+    }
+    ret = _runSweep(&suite, full, repeats);
+
+    /* UDI setup changes directory; output paths are relative to the
+     * original one */
+    if (chdir(cwd) != 0) {
+        fprintf(stderr, "FAILED to return to %s\n", cwd);
+        ret = 1;
+    }
+    if (output != NULL) {
+        fp = fopen(output, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "FAILED to open %s for writing\n", output);
+            ret = 1;
+        }
+    }
+    if (fp != NULL && (output != NULL || !suite.verbose)) {
+        ret |= bench_write_json(&suite, fp, VERSION);
+    }
+    if (fp != NULL && fp != stdout) {
+        fclose(fp);
+    }
+
+    if (umount2(benchTmpDir, MNT_DETACH) != 0 || rmdir(benchTmpDir) != 0) {
+        fprintf(stderr, "FAILED to remove %s\n", benchTmpDir);
+    }
+    free_BenchSuite(&suite);
+    return ret;
+}
@@ -175,6 +175,37 @@ TEST(ImageDataTestGroup, convertToListTests) {
     free(uids);
     uids = NULL;
 
+    ret = _convert_to_list("5000,1000,10000,1000", &uids, &n_uids);
+    CHECK(ret == 3);
+    CHECK(n_uids == 3);
+    CHECK(uids[0] == 1000);
+    CHECK(uids[1] == 5000);
+    CHECK(uids[2] == 10000);
+    free(uids);
+    uids = NULL;
+}
+
+TEST(ImageDataTestGroup, checkImagePermissions) {
+    ImageData image;
+    gid_t aux_gids[] = { 700, 60, 900, 55 };
+
+    memset(&image, 0, sizeof(ImageData));
+    CHECK(check_image_permissions(100, 100, NULL, 0, &image) == 1);
+
+    CHECK(_convert_to_list("300,200,100", &image.uids, &image.n_uids) == 3);
+    CHECK(check_image_permissions(200, 1, NULL, 0, &image) == 1);
+    CHECK(check_image_permissions(250, 1, aux_gids, 4, &image) == 0);
+
+    CHECK(_convert_to_list("900,50,40", (uid_t **) &image.gids,
+            &image.n_gids) == 3);
+    CHECK(check_image_permissions(250, 40, NULL, 0, &image) == 1);
+    CHECK(check_image_permissions(250, 41, aux_gids, 4, &image) == 1);
+    CHECK(check_image_permissions(250, 41, aux_gids, 3, &image) == 1);
+    CHECK(check_image_permissions(250, 41, aux_gids, 2, &image) == 0);
+    CHECK(check_image_permissions(250, 1000, NULL, 0, &image) == 0);
+
+    free(image.uids);
+    free(image.gids);
 }
 
 TEST(ImageDataTestGroup, parseImageDescriptor) {
@@ -0,0 +1,174 @@
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+## through Lawrence Berkeley National Laboratory (subject to receipt of any
+## required approvals from the U.S. Dept. of Energy).  All rights reserved.
+##
+## Redistribution and use in source and binary forms, with or without
+## modification, are permitted provided that the following conditions are met:
+##  1. Redistributions of source code must retain the above copyright notice,
+##     this list of conditions and the following disclaimer.
+##  2. Redistributions in binary form must reproduce the above copyright notice,
+##     this list of conditions and the following disclaimer in the documentation
+##     and/or other materials provided with the distribution.
+##  3. Neither the name of the University of California, Lawrence Berkeley
+##     National Laboratory, U.S. Dept. of Energy nor the names of its
+##     contributors may be used to endorse or promote products derived from this
+##     software without specific prior written permission.
+##
+## See LICENSE for full text.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "JobMetrics.h"
+#include <CppUTest/CommandLineTestRunner.h>
+
+TEST_GROUP(JobMetricsTestGroup) {
+    char tmpDir[PATH_MAX];
+    char histPath[PATH_MAX];
+    char jsonPath[PATH_MAX];
+    JobMetrics metrics;
+
+    void setup() {
+        snprintf(tmpDir, PATH_MAX, "/tmp/shifter_metrics.XXXXXX");
+        CHECK(mkdtemp(tmpDir) != NULL);
+        snprintf(histPath, PATH_MAX, "%s/histogram", tmpDir);
+        snprintf(jsonPath, PATH_MAX, "%s/metrics.jsonl", tmpDir);
+
+        memset(&metrics, 0, sizeof(JobMetrics));
+        metrics.event = strdup("prolog");
+        metrics.jobid = 1234;
+        metrics.uid = 500;
+        metrics.hostname = strdup("nid00001");
+        metrics.imageType = strdup("docker");
+        metrics.imageIdentifier = strdup("abc\"def");
+        metrics.outcome = strdup("success");
+        metrics.duration_ms = 1500;
+        metrics.helper_ms = 1200;
+        metrics.bytesStaged = 5 << 20;
+        metrics.nMounts = 12;
+    }
+
+    void teardown() {
+        free_JobMetrics(&metrics, 0);
+        unlink(histPath);
+        unlink(jsonPath);
+        rmdir(tmpDir);
+    }
+};
+
+TEST(JobMetricsTestGroup, ParseReport) {
+    CHECK(parse_JobMetrics_report("some other output", &metrics) == 1);
+    CHECK(metrics.retries == 0);
+    CHECK(parse_JobMetrics_report(JOBMETRICS_REPORT_TAG " retries=3",
+                &metrics) == 0);
+    CHECK(metrics.retries == 3);
+    CHECK(parse_JobMetrics_report(JOBMETRICS_REPORT_TAG " retries=2 other=7",
+                &metrics) == 0);
+    CHECK(metrics.retries == 5);
+}
+
+TEST(JobMetricsTestGroup, FormatRecords) {
+    char *json = format_JobMetrics_json(&metrics);
+    char *statsd = format_JobMetrics_statsd(&metrics, NULL);
+    char *comment = format_JobMetrics_comment(&metrics);
+
+    CHECK(json != NULL);
+    CHECK(strstr(json, "\"event\": \"prolog\"") != NULL);
+    CHECK(strstr(json, "\"jobid\": 1234") != NULL);
+    CHECK(strstr(json, "\"image\": \"abc\\\"def\"") != NULL);
+    CHECK(strstr(json, "\"duration_ms\": 1500") != NULL);
+    CHECK(json[strlen(json) - 1] == '\n');
+
+    CHECK(statsd != NULL);
+    CHECK(strstr(statsd, "shifter.prolog.duration_ms:1500|ms") != NULL);
+    CHECK(strstr(statsd, "shifter.prolog.mounts:12|g") != NULL);
+    CHECK(strstr(statsd, "shifter.prolog.success:1|c") != NULL);
+
+    CHECK(comment != NULL);
+    CHECK(strstr(comment, "nid00001") != NULL);
+    CHECK(strstr(comment, "5 MiB staged") != NULL);
+
+    free(json);
+    free(statsd);
+    free(comment);
+}
+
+TEST(JobMetricsTestGroup, WriteJsonl) {
+    struct stat st;
+    off_t first = 0;
+
+    CHECK(write_JobMetrics_jsonl(&metrics, jsonPath) == 0);
+    CHECK(stat(jsonPath, &st) == 0);
+    first = st.st_size;
+    CHECK(write_JobMetrics_jsonl(&metrics, jsonPath) == 0);
+    CHECK(stat(jsonPath, &st) == 0);
+    CHECK(st.st_size == 2 * first);
+
+    /* no socket listening, must fail without blocking */
+    CHECK(send_JobMetrics_statsd(&metrics, histPath, NULL) != 0);
+}
+
+TEST(JobMetricsTestGroup, UpdateHistogram) {
+    MetricsHistogram *hist = NULL;
+    size_t n_hist = 0;
+    size_t idx = 0;
+    MetricsHistogram *duration = NULL;
+
+    CHECK(read_MetricsHistogram(histPath, &hist, &n_hist) != 0);
+
+    CHECK(update_MetricsHistogram(histPath, &metrics) == 0);
+    metrics.duration_ms = 100;
+    metrics.status = 1;
+    CHECK(update_MetricsHistogram(histPath, &metrics) == 0);
+    free(metrics.event);
+    metrics.event = strdup("epilog");
+    CHECK(update_MetricsHistogram(histPath, &metrics) == 0);
+
+    CHECK(read_MetricsHistogram(histPath, &hist, &n_hist) == 0);
+    CHECK(n_hist == 12);
+    for (idx = 0; idx < n_hist; idx++) {
+        if (strcmp(hist[idx].event, "prolog") == 0 &&
+                strcmp(hist[idx].metric, "duration_ms") == 0) {
+            duration = &(hist[idx]);
+        }
+    }
+    CHECK(duration != NULL);
+    CHECK(duration->count == 2);
+    CHECK(duration->sum == 1600);
+    CHECK(duration->min == 100);
+    CHECK(duration->max == 1500);
+    CHECK(quantile_MetricsHistogram(duration, 0.5) == 127);
+    CHECK(quantile_MetricsHistogram(duration, 0.99) == 1500);
+    free_MetricsHistogram(hist, n_hist);
+}
+
+TEST(JobMetricsTestGroup, AddHistogram) {
+    MetricsHistogram *hist = NULL;
+    size_t n_hist = 0;
+    size_t idx = 0;
+
+    for (idx = 0; idx < 20; idx++) {
+        add_MetricsHistogram(&hist, &n_hist, "prolog", "mounts", idx);
+        add_MetricsHistogram(&hist, &n_hist, "epilog", "mounts", 0);
+    }
+    CHECK(n_hist == 2);
+    CHECK(hist[0].count == 20);
+    CHECK(hist[0].buckets[0] == 1);
+    CHECK(hist[0].buckets[1] == 1);
+    CHECK(hist[0].buckets[2] == 2);
+    CHECK(hist[1].buckets[0] == 20);
+    CHECK(quantile_MetricsHistogram(&(hist[1]), 0.9) == 0);
+    free_MetricsHistogram(hist, n_hist);
+}
+
+int main(int argc, char** argv) {
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
@@ -62,6 +62,8 @@ TEST(UdiRootConfigTestGroup, ParseUdiRootConfig_basic) {
     CHECK(strcmp(config.modules[0].name, "mpich") == 0);
     CHECK(strcmp(config.modules[0].userhook, "/path/to/userhook") == 0);
     CHECK(strcmp(config.modules[0].roothook, "/path/to/roothook") == 0);
+    CHECK(config.modules[0].roothookTimeout == 30);
+    CHECK(config.modules[0].n_after == 0);
     CHECK(strcmp(config.modules[0].siteEnvPrepend[0], "LD_LIBRARY_PATH=/opt/udiImage/mpich/lib64") == 0);
     CHECK(strcmp(config.modules[0].siteEnvPrepend[1], "PATH=/opt/udiImage/mpich/bin") == 0);
     CHECK(config.modules[0].siteEnvPrepend[2] == NULL);
@@ -95,6 +97,10 @@ TEST(UdiRootConfigTestGroup, ParseUdiRootConfig_basic) {
     CHECK(config.modules[1].conflict_str[1] == NULL);
     CHECK(config.modules[1].conflict[0] == &(config.modules[0]));
     CHECK(config.modules[1].conflict[1] == NULL);
+    CHECK(config.modules[1].n_after == 1);
+    CHECK(strcmp(config.modules[1].after_str[0], "mpich") == 0);
+    CHECK(config.modules[1].after[0] == &(config.modules[0]));
+    CHECK(config.modules[1].after[1] == NULL);
     CHECK(config.defaultModulesStr != NULL);
     CHECK(strcmp(config.defaultModulesStr, "mpich") == 0);
     CHECK(config.n_active_modules == 1);
@@ -102,6 +108,32 @@ TEST(UdiRootConfigTestGroup, ParseUdiRootConfig_basic) {
     free_UdiRootConfig(&config, 0);
 }
 
+TEST(UdiRootConfigTestGroup, ShifterModule_after) {
+    UdiRootConfig config;
+
+    memset(&config, 0, sizeof(UdiRootConfig));
+    CHECK(parse_ShifterModule_key(&config, "module_a_after", "b") == 0);
+    CHECK(parse_ShifterModule_key(&config, "module_b_after", "c") == 0);
+    CHECK(parse_ShifterModule_key(&config, "module_c_roothook", "/x") == 0);
+    CHECK(ShifterModule_postprocessing(&config) == 0);
+    CHECK(config.modules[0].after[0] == &(config.modules[1]));
+    CHECK(config.modules[1].after[0] == &(config.modules[2]));
+    free_UdiRootConfig(&config, 0);
+
+    /* unknown modules and cycles are rejected */
+    memset(&config, 0, sizeof(UdiRootConfig));
+    CHECK(parse_ShifterModule_key(&config, "module_a_after", "z") == 0);
+    CHECK(ShifterModule_postprocessing(&config) != 0);
+    free_UdiRootConfig(&config, 0);
+
+    memset(&config, 0, sizeof(UdiRootConfig));
+    CHECK(parse_ShifterModule_key(&config, "module_a_after", "b") == 0);
+    CHECK(parse_ShifterModule_key(&config, "module_b_after", "c") == 0);
+    CHECK(parse_ShifterModule_key(&config, "module_c_after", "a") == 0);
+    CHECK(ShifterModule_postprocessing(&config) != 0);
+    free_UdiRootConfig(&config, 0);
+}
+
 TEST(UdiRootConfigTestGroup, ParseUdiRootConfig_display) {
     UdiRootConfig config;
     memset(&config, 0, sizeof(UdiRootConfig));
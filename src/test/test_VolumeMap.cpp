@@ -40,19 +40,12 @@
 
 #include <CppUTest/CommandLineTestRunner.h>
 #include "VolumeMap.h"
+#include "utility.h"
 #include <stdio.h>
 
 TEST_GROUP(VolumeMapTestGroup) {
 };
 
-void freeTokens(char **tokens) {
-    char **tk_ptr = NULL;
-    for (tk_ptr = tokens; tk_ptr && *tk_ptr; tk_ptr++) {
-        free(*tk_ptr);
-    }
-    free(tokens);
-}
-
 TEST(VolumeMapTestGroup, FindEndOfVolumeMapInString) {
     const char *input1 = "/volume:/map:test";
     const char *ptr = _findEndVolumeMapString(input1);
@@ -84,55 +77,6 @@ TEST(VolumeMapTestGroup, FindEndOfVolumeMapInString) {
     CHECK(strlen(input3) == ptr - input3);
 }
 
-TEST(VolumeMapTestGroup, VolumeMapTokenize) {
-
-    char *input = strdup("abcd:efgh");
-    char **tokens = _tokenizeVolumeMapInput(input);
-    size_t ntokens = 0;
-    for ( ; tokens && tokens[ntokens]; ntokens++) { }
-
-    CHECK(tokens != NULL && ntokens == 2);
-    CHECK(strcmp(tokens[0], "abcd") == 0);
-    CHECK(strcmp(tokens[1], "efgh") == 0);
-
-    freeTokens(tokens);
-    free(input);
-
-    input = strdup("abcd:efgh:flag");
-    tokens = _tokenizeVolumeMapInput(input);
-    for (ntokens = 0 ; tokens && tokens[ntokens]; ntokens++) { }
-    CHECK(tokens != NULL && ntokens == 3);
-    CHECK(strcmp(tokens[0], "abcd") == 0);
-    CHECK(strcmp(tokens[1], "efgh") == 0);
-    CHECK(strcmp(tokens[2], "flag") == 0);
-
-    freeTokens(tokens);
-    free(input);
-
-    input = strdup("abcd:efgh:flag:extra");
-    tokens = _tokenizeVolumeMapInput(input);
-    for (ntokens = 0 ; tokens && tokens[ntokens]; ntokens++) { }
-    CHECK(tokens != NULL && ntokens == 4);
-    CHECK(strcmp(tokens[0], "abcd") == 0);
-    CHECK(strcmp(tokens[1], "efgh") == 0);
-    CHECK(strcmp(tokens[2], "flag") == 0);
-    CHECK(strcmp(tokens[3], "extra") == 0);
-
-    freeTokens(tokens);
-    free(input);
-
-    input = strdup("no delim test");
-    tokens = _tokenizeVolumeMapInput(input);
-    for (ntokens = 0 ; tokens && tokens[ntokens]; ntokens++) { }
-    //fprintf(stderr," got %lu tokens\n0: %s\n1: %s\n2: %s\n", ntokens, tokens[0], tokens[1], tokens[2]);
-    CHECK(tokens != NULL && ntokens == 1);
-    CHECK(strcmp(tokens[0], "no delim test") == 0);
-
-    freeTokens(tokens);
-    free(input);
-
-}
-
 TEST(VolumeMapTestGroup, VolumeMapParseBytes) {
     ssize_t parsedVal = parseBytes("5");
     CHECK(parsedVal == 5);
@@ -292,6 +236,101 @@ TEST(VolumeMapTestGroup, TestMultipleMountsWithFlags) {
     free_VolumeMap(&volMap, 0);
 }
 
+TEST(VolumeMapTestGroup, VolumeMapParse_stage) {
+    int ret = 0;
+    VolumeMap volMap;
+
+    memset(&volMap, 0, sizeof(VolumeMap));
+
+    /* staging requires a per-node cache to copy into */
+    ret = parseVolumeMap("/scratch1/in:/input:stagein=/scratch1/in", &volMap);
+    CHECK(ret != 0);
+    ret = parseVolumeMap("/tmp:/input:perNodeCache=size=1G:stagein=data", &volMap);
+    CHECK(ret != 0);
+    ret = parseVolumeMap("/tmp:/input:perNodeCache=size=1G:stagein", &volMap);
+    CHECK(ret != 0);
+    CHECK(volMap.n == 0);
+
+    ret = parseVolumeMap("/tmp:/work:stageout=/scratch1/out:"
+            "perNodeCache=size=1G:stagein=/scratch1/in", &volMap);
+    CHECK(ret == 0);
+    CHECK(volMap.n == 1);
+    CHECK(volMap.flags[0][0].type == VOLMAP_FLAG_PERNODECACHE);
+    CHECK(volMap.flags[0][1].type == VOLMAP_FLAG_STAGEIN);
+    CHECK(strcmp((char *) volMap.flags[0][1].value, "/scratch1/in") == 0);
+    CHECK(volMap.flags[0][2].type == VOLMAP_FLAG_STAGEOUT);
+    CHECK(strcmp(volMap.raw[0], "/tmp:/work:perNodeCache=size=1073741824,"
+                "bs=1048576,method=loop,fstype=xfs:stagein=/scratch1/in:"
+                "stageout=/scratch1/out") == 0);
+
+    free_VolumeMap(&volMap, 0);
+}
+
+TEST(VolumeMapTestGroup, VolumeMapParse_packed) {
+    int ret = 0;
+    VolumeMap volMap;
+
+    memset(&volMap, 0, sizeof(VolumeMap));
+
+    ret = parseVolumeMap("/global/common/env:/env:packed=yes", &volMap);
+    CHECK(ret != 0);
+    ret = parseVolumeMap("/tmp:/env:packed:perNodeCache=size=1G", &volMap);
+    CHECK(ret != 0);
+    CHECK(volMap.n == 0);
+
+    ret = parseVolumeMap("/global/common/env:/env:packed:ro", &volMap);
+    CHECK(ret == 0);
+    CHECK(volMap.n == 1);
+    CHECK(strcmp(volMap.raw[0], "/global/common/env:/env:ro:packed") == 0);
+
+    free_VolumeMap(&volMap, 0);
+}
+
+TEST(VolumeMapTestGroup, VolumeMapParse_memFs) {
+    int ret = 0;
+    VolumeMap volMap;
+
+    memset(&volMap, 0, sizeof(VolumeMap));
+
+    ret = parseVolumeMap("/dev/shm:/dev/shm:shm", &volMap);
+    CHECK(ret != 0);
+    ret = parseVolumeMap("/dev/shm:/dev/shm:shm=mpol=local", &volMap);
+    CHECK(ret != 0);
+    ret = parseVolumeMap("/dev/shm:/dev/shm:shm=size=1G,mpol=fast", &volMap);
+    CHECK(ret != 0);
+    ret = parseVolumeMap("/dev/shm:/dev/shm:shm=size=1G,mpol=bind", &volMap);
+    CHECK(ret != 0);
+    ret = parseVolumeMap("/dev/shm:/dev/shm:shm=size=1G,nodes=0-1", &volMap);
+    CHECK(ret != 0);
+    ret = parseVolumeMap("/dev/shm:/dev/shm:shm=size=1G,mpol=bind,nodes=a",
+            &volMap);
+    CHECK(ret != 0);
+    ret = parseVolumeMap("/dev/shm:/dev/shm:shm=size=1G,pagesize=2M", &volMap);
+    CHECK(ret != 0);
+    ret = parseVolumeMap("/x:/huge:shm=size=1G:hugetlbfs=size=1G", &volMap);
+    CHECK(ret != 0);
+    ret = parseVolumeMap("/x:/huge:hugetlbfs=size=1G:perNodeCache=size=1G",
+            &volMap);
+    CHECK(ret != 0);
+    CHECK(volMap.n == 0);
+
+    ret = parseVolumeMap("/dev/shm:/dev/shm:shm=size=1G,mpol=bind,nodes=0-1;"
+            "/x:/huge:hugetlbfs=size=4G,pagesize=2M;"
+            "/y:/shm2:shm=size=2M", &volMap);
+    CHECK(ret == 0);
+    CHECK(volMap.n == 3);
+    CHECK(strcmp(volMap.raw[0],
+            "/dev/shm:/dev/shm:shm=size=1073741824,mpol=bind,nodes=0-1") == 0);
+    CHECK(strcmp(volMap.raw[1],
+            "/x:/huge:hugetlbfs=size=4294967296,pagesize=2097152") == 0);
+    CHECK(strcmp(volMap.raw[2], "/y:/shm2:shm=size=2097152") == 0);
+    CHECK(volMap.flags[1][0].type == VOLMAP_FLAG_HUGETLBFS);
+    VolMapMemFsConfig *memFs = (VolMapMemFsConfig *) volMap.flags[1][0].value;
+    CHECK(memFs->pageSize == 2097152);
+
+    free_VolumeMap(&volMap, 0);
+}
+
 TEST(VolumeMapTestGroup, GetVolumeMapSignature_basic) {
     int ret = 0;
     VolumeMap volMap;
@@ -338,6 +377,111 @@ TEST(VolumeMapTestGroup, GetVolumeMapParseLongSiteFs) {
     fprintf(stderr, "mountStr: %s %d\n", mountStr, ret);
 }
 
+TEST(VolumeMapTestGroup, ValidateVolumeMap_policyTrie) {
+    const char *startsWith[] = { "/etc", "/opt/udiImage", NULL };
+    const char *exact[] = { "/opt", "/", NULL };
+    const char *empty[] = { NULL };
+    VolumeMapPolicy policy;
+
+    int ret = compile_VolumeMapPolicy(&policy, startsWith, exact, empty, empty,
+            VOLMAP_FLAG_READONLY);
+    CHECK(ret == 0);
+    CHECK(match_VolumeMapTrie(&(policy.to), "/etc") == 1);
+    CHECK(match_VolumeMapTrie(&(policy.to), "/etc/passwd") == 1);
+    CHECK(match_VolumeMapTrie(&(policy.to), "/etcetera") == 1);
+    CHECK(match_VolumeMapTrie(&(policy.to), "/et") == 0);
+    CHECK(match_VolumeMapTrie(&(policy.to), "/opt") == 1);
+    CHECK(match_VolumeMapTrie(&(policy.to), "/opt/myStuff") == 0);
+    CHECK(match_VolumeMapTrie(&(policy.to), "/opt/udiImage/modules") == 1);
+    CHECK(match_VolumeMapTrie(&(policy.to), "/") == 1);
+    CHECK(match_VolumeMapTrie(&(policy.to), "/data") == 0);
+    CHECK(match_VolumeMapTrie(&(policy.from), "/etc") == 0);
+
+    CHECK(_validateVolumeMap("/a", "/etc/x", NULL, &policy) == 1);
+    CHECK(_validateVolumeMap("/a", "/data", NULL, &policy) == 0);
+    CHECK(_validateVolumeMap("/a", "/data", NULL, NULL) == 1);
+
+    free_VolumeMapPolicy(&policy, 0);
+}
+
+TEST(VolumeMapTestGroup, VolumeMapParse_targets) {
+    VolumeMap volMap;
+    memset(&volMap, 0, sizeof(VolumeMap));
+
+    int ret = parseVolumeMap("/a:/data;/b:/input", &volMap);
+    CHECK(ret == 0);
+    CHECK(volMap.n == 2);
+    CHECK(validateVolumeMap_targets(&volMap) == 0);
+
+    /* nested mount listed after its parent is fine */
+    ret = parseVolumeMap("/c:/data/sub:ro", &volMap);
+    CHECK(ret == 0);
+    CHECK(volMap.n == 3);
+    CHECK(validateVolumeMap_targets(&volMap) == 0);
+
+    /* siblings sharing a name prefix do not overlap */
+    ret = parseVolumeMap("/e:/data-old;/f:/input2", &volMap);
+    CHECK(ret == 0);
+    CHECK(volMap.n == 5);
+    CHECK(validateVolumeMap_targets(&volMap) == 0);
+
+    CHECK(strcmp(volMap.to[2], "/data/sub") == 0);
+    CHECK(strcmp(volMap.raw[2], "/c:/data/sub:ro") == 0);
+    CHECK(volMap.to[5] == NULL);
+
+    /* duplicate target, also across separate inputs */
+    ret = parseVolumeMap("/d:/data/", &volMap);
+    CHECK(ret == 0);
+    CHECK(validateVolumeMap_targets(&volMap) == 1);
+    free_VolumeMap(&volMap, 0);
+
+    /* nested mount that would be hidden by a later mount, also when the
+     * later mount comes from a separate input */
+    memset(&volMap, 0, sizeof(VolumeMap));
+    CHECK(parseVolumeMap("/d:/output/sub", &volMap) == 0);
+    CHECK(validateVolumeMap_targets(&volMap) == 0);
+    CHECK(parseVolumeMap("/e:/output", &volMap) == 0);
+    CHECK(validateVolumeMap_targets(&volMap) == 2);
+
+    free_VolumeMap(&volMap, 0);
+}
+
+TEST(VolumeMapTestGroup, VolumeMapParse_many) {
+    VolumeMap volMap;
+    char *input = NULL;
+    size_t len = 0;
+    size_t capacity = 0;
+    size_t idx = 0;
+    const size_t count = 5000;
+    char expected[128];
+
+    memset(&volMap, 0, sizeof(VolumeMap));
+    for (idx = 0; idx < count; idx++) {
+        input = alloc_strcatf(input, &len, &capacity, "%s/src/v%lu:/dst/v%lu",
+                idx > 0 ? ";" : "", (unsigned long) idx, (unsigned long) idx);
+    }
+    int ret = parseVolumeMap(input, &volMap);
+    CHECK(ret == 0);
+    CHECK(volMap.n == count);
+    CHECK(validateVolumeMap_targets(&volMap) == 0);
+
+    char *sig = getVolMapSignature(&volMap);
+    CHECK(sig != NULL);
+    CHECK(strncmp(sig, "/src/v0:/dst/v0;/src/v1000:/dst/v1000;/src/v1001:", 49) == 0);
+    free(sig);
+
+    /* generating the signature must not reorder the map itself */
+    for (idx = 0; idx < count; idx++) {
+        snprintf(expected, 128, "/src/v%lu:/dst/v%lu", (unsigned long) idx,
+                (unsigned long) idx);
+        CHECK(strcmp(volMap.raw[idx], expected) == 0);
+        CHECK(strcmp(volMap.to[idx], expected + strlen(volMap.from[idx]) + 1) == 0);
+    }
+
+    free_VolumeMap(&volMap, 0);
+    free(input);
+}
+
 int main(int argc, char** argv) {
         return CommandLineTestRunner::RunAllTests(argc, argv);
 }
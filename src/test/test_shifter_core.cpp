@@ -39,6 +39,9 @@
 #include "utility.h"
 #include "VolumeMap.h"
 #include "MountList.h"
+#include "shifter_hash.h"
+#include "shifter_ldcache.h"
+#include "shifter_trace.h"
 #include <fcntl.h>
 
 extern "C" {
@@ -734,6 +737,41 @@ TEST(ShifterCoreTestGroup, validatePrivateNamespace) {
     }
 }
 
+#ifdef NOTROOT
+IGNORE_TEST(ShifterCoreTestGroup, pivotIntoUdi_basic) {
+#else
+TEST(ShifterCoreTestGroup, pivotIntoUdi_basic) {
+#endif
+    pid_t child = 0;
+    int status = 0;
+
+    CHECK(pivotIntoUdi(NULL) != 0);
+
+    child = fork();
+    if (child == 0) {
+        char marker[PATH_MAX];
+        FILE *fp = NULL;
+
+        if (unshare(CLONE_NEWNS) != 0) exit(1);
+        if (mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL) != 0) exit(1);
+        if (mount("tmpfs", tmpDir, "tmpfs", 0, NULL) != 0) exit(1);
+        snprintf(marker, PATH_MAX, "%s/marker", tmpDir);
+        fp = fopen(marker, "w");
+        if (fp == NULL) exit(1);
+        fclose(fp);
+
+        if (pivotIntoUdi(tmpDir) != 0) exit(2);
+
+        /* only the UDI is left */
+        if (access("/marker", F_OK) != 0) exit(3);
+        if (access(tmpDir, F_OK) == 0) exit(4);
+        exit(0);
+    }
+    CHECK(child > 0);
+    waitpid(child, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
 TEST(ShifterCoreTestGroup, writeHostFile_basic) {
    char tmpDirVar[] = "/tmp/shifter.XXXXXX/var";
    char hostsFilename[] = "/tmp/shifter.XXXXXX/var/hostsfile";
@@ -937,6 +975,556 @@ TEST(ShifterCoreTestGroup, _test_shifterconfig_str) {
     free(image.identifier);
 }
 
+TEST(ShifterCoreTestGroup, UdiBuildLock_basic) {
+    UdiRootConfig config;
+    const char *fingerprint = "0123abcd";
+    char *lockFile = alloc_strgenf("%s/udi.%s.lock", tmpDir, fingerprint);
+    char record[128];
+    int lockFd = -1;
+    int otherFd = -1;
+    ssize_t nread = 0;
+    pid_t child = 0;
+    int status = 0;
+
+    memset(&config, 0, sizeof(UdiRootConfig));
+    tmpFiles.push_back(lockFile);
+
+    /* coordination is disabled without udiRunDir */
+    CHECK(openUdiBuildLock(&config, fingerprint) == -1);
+    config.udiRunDir = tmpDir;
+
+    lockFd = openUdiBuildLock(&config, fingerprint);
+    CHECK(lockFd >= 0);
+    otherFd = openUdiBuildLock(&config, fingerprint);
+    CHECK(otherFd >= 0);
+
+    /* nothing published yet */
+    CHECK(joinPublishedUdi(lockFd) == 1);
+
+    CHECK(acquireUdiBuildLock(lockFd, 1) == 0);
+    CHECK(acquireUdiBuildLock(otherFd, 1) == 1);
+
+    /* a dead holder releases the lock */
+    child = fork();
+    if (child == 0) {
+        int fd = openUdiBuildLock(&config, fingerprint);
+        _exit(acquireUdiBuildLock(fd, 1));
+    }
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+    close(lockFd);
+    CHECK(acquireUdiBuildLock(otherFd, 1) == 0);
+
+    /* records of exited processes are stale */
+    CHECK(publishUdi(otherFd) == 0);
+    nread = pread(otherFd, record, sizeof(record) - 1, 0);
+    CHECK(nread > 0);
+    record[nread > 0 ? nread : 0] = 0;
+    CHECK(atoi(record) == getpid());
+
+    child = fork();
+    if (child == 0) {
+        int fd = openUdiBuildLock(&config, fingerprint);
+        _exit(publishUdi(fd));
+    }
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(joinPublishedUdi(otherFd) == 1);
+
+    close(otherFd);
+    free(lockFile);
+}
+
+static int findLibc(const ShifterLdCacheEntry *entry, void *data) {
+    char **path = (char **) data;
+    if (*path == NULL && strcmp(entry->name, "libc.so.6") == 0) {
+        *path = strdup(entry->path);
+    }
+    return 0;
+}
+
+TEST(ShifterCoreTestGroup, ContainerLdCache_basic) {
+    UdiRootConfig config;
+    ShifterModule module;
+    ShifterModule *active[1];
+    ShifterLdCacheEntry imageEntry;
+    char *libraryPath[] = { (char *) "/missing", (char *) "/mod", NULL };
+    char *hostLibc = NULL;
+    char *found = NULL;
+    char *etcDir = alloc_strgenf("%s/etc", tmpDir);
+    char *modDir = alloc_strgenf("%s/mod", tmpDir);
+    char *cacheFile = alloc_strgenf("%s/etc/ld.so.cache", tmpDir);
+    char *modLibc = alloc_strgenf("%s/mod/libc.so.6", tmpDir);
+    char *cmd = NULL;
+    char *soname = NULL;
+    int32_t flags = 0;
+    int fd = -1;
+
+    memset(&config, 0, sizeof(UdiRootConfig));
+    memset(&module, 0, sizeof(ShifterModule));
+    config.udiMountPoint = tmpDir;
+
+    /* nothing to index without module library directories */
+    CHECK(setupContainerLdCache(&config) == 0);
+
+    if (shifter_ldcache_parse("/etc/ld.so.cache", findLibc, &hostLibc) != 0 ||
+            hostLibc == NULL)
+    {
+        free(etcDir);
+        free(modDir);
+        free(cacheFile);
+        free(modLibc);
+        return;
+    }
+    CHECK(mkdir(etcDir, 0755) == 0);
+    CHECK(mkdir(modDir, 0755) == 0);
+    tmpFiles.push_back(cacheFile);
+    tmpFiles.push_back(modLibc);
+    tmpDirs.push_back(etcDir);
+    tmpDirs.push_back(modDir);
+    cmd = alloc_strgenf("cp %s %s", hostLibc, modLibc);
+    CHECK(system(cmd) == 0);
+    free(cmd);
+
+    fd = open(modLibc, O_RDONLY);
+    CHECK(fd >= 0);
+    CHECK(shifter_ldcache_elfInfo(fd, &flags, &soname) == 0);
+    close(fd);
+    free(soname);
+
+    /* the image's cache points at its own libc */
+    memset(&imageEntry, 0, sizeof(ShifterLdCacheEntry));
+    imageEntry.name = "libc.so.6";
+    imageEntry.path = "/lib64/libc.so.6";
+    imageEntry.flags = flags;
+    CHECK(shifter_ldcache_write(cacheFile, &imageEntry, 1) == 0);
+
+    module.name = (char *) "test";
+    module.libraryPath = libraryPath;
+    module.n_libraryPath = 2;
+    active[0] = &module;
+    config.active_modules = active;
+    config.n_active_modules = 1;
+    CHECK(setupContainerLdCache(&config) == 0);
+
+    /* the module's copy takes precedence over the image's */
+    CHECK(shifter_ldcache_parse(cacheFile, findLibc, &found) == 0);
+    CHECK(found != NULL && strcmp(found, "/mod/libc.so.6") == 0);
+
+    free(found);
+    free(hostLibc);
+    free(etcDir);
+    free(modDir);
+    free(cacheFile);
+    free(modLibc);
+}
+
+static char *writeRoothook(const char *dir, const char *name,
+        const char *script)
+{
+    char *path = alloc_strgenf("%s/%s.sh", dir, name);
+    FILE *fp = fopen(path, "w");
+    if (fp != NULL) {
+        fprintf(fp, "%s\n", script);
+        fclose(fp);
+    }
+    return path;
+}
+
+TEST(ShifterCoreTestGroup, ModuleRoothooks_basic) {
+    UdiRootConfig config;
+    ShifterModule modules[4];
+    ShifterModule *active[5];
+    ShifterModule *afterFirst[] = { &modules[0], NULL };
+    char *logFile = alloc_strgenf("%s/hooks.log", tmpDir);
+    char *script = NULL;
+    char buffer[128];
+    uint64_t start = 0;
+    size_t nread = 0;
+    FILE *fp = NULL;
+    int idx = 0;
+
+    memset(&config, 0, sizeof(UdiRootConfig));
+    memset(modules, 0, sizeof(modules));
+    for (idx = 0; idx < 4; idx++) {
+        active[idx] = &modules[idx];
+    }
+    active[4] = NULL;
+    modules[0].name = (char *) "first";
+    modules[1].name = (char *) "second";
+    modules[1].after = afterFirst;
+    modules[1].n_after = 1;
+    modules[2].name = (char *) "independent";
+    modules[3].name = (char *) "nohook";
+
+    script = alloc_strgenf("sleep 1; echo first >> %s", logFile);
+    modules[0].roothook = writeRoothook(tmpDir, "first", script);
+    free(script);
+    script = alloc_strgenf("echo second >> %s", logFile);
+    modules[1].roothook = writeRoothook(tmpDir, "second", script);
+    free(script);
+    script = alloc_strgenf("sleep 1; echo independent >> %s", logFile);
+    modules[2].roothook = writeRoothook(tmpDir, "independent", script);
+    free(script);
+    for (idx = 0; idx < 3; idx++) {
+        tmpFiles.push_back(modules[idx].roothook);
+    }
+    tmpFiles.push_back(logFile);
+
+    /* nothing to do */
+    CHECK(runModuleRoothooks(&config) == 0);
+
+    /* second waits for first, independent runs alongside first */
+    config.active_modules = active;
+    config.n_active_modules = 4;
+    config.moduleRoothookWorkers = 2;
+    start = shifter_trace_now();
+    CHECK(runModuleRoothooks(&config) == 0);
+    CHECK(shifter_trace_now() - start < 1900000);
+    fp = fopen(logFile, "r");
+    CHECK(fp != NULL);
+    nread = fread(buffer, 1, sizeof(buffer) - 1, fp);
+    buffer[nread] = 0;
+    fclose(fp);
+    CHECK(strstr(buffer, "first\n") != NULL);
+    CHECK(strstr(buffer, "independent\n") != NULL);
+    CHECK(strstr(buffer, "second\n") > strstr(buffer, "first\n"));
+
+    /* a failed roothook stops those that depend on it */
+    unlink(logFile);
+    fp = fopen(modules[0].roothook, "w");
+    CHECK(fp != NULL);
+    fprintf(fp, "exit 1\n");
+    fclose(fp);
+    CHECK(runModuleRoothooks(&config) == 1);
+    fp = fopen(logFile, "r");
+    if (fp != NULL) {
+        nread = fread(buffer, 1, sizeof(buffer) - 1, fp);
+        buffer[nread] = 0;
+        fclose(fp);
+        CHECK(strstr(buffer, "second") == NULL);
+    }
+
+    /* a roothook exceeding its timeout is killed */
+    fp = fopen(modules[0].roothook, "w");
+    CHECK(fp != NULL);
+    fprintf(fp, "sleep 30\n");
+    fclose(fp);
+    modules[0].roothookTimeout = 1;
+    start = shifter_trace_now();
+    CHECK(runModuleRoothooks(&config) == 1);
+    CHECK(shifter_trace_now() - start < 10000000);
+
+    for (idx = 0; idx < 3; idx++) {
+        free(modules[idx].roothook);
+    }
+    free(logFile);
+}
+
+TEST(ShifterCoreTestGroup, UserhookEnv_basic) {
+    char *hook = alloc_strgenf("%s/userhook.sh", tmpDir);
+    char *cacheFile = alloc_strgenf("%s/test.env", tmpDir);
+    char **env = (char **) malloc(sizeof(char *) * 5);
+    char **delta = NULL;
+    char **ptr = NULL;
+    FILE *fp = NULL;
+    int found = 0;
+
+    env[0] = strdup("PATH=/usr/bin:/bin");
+    env[1] = strdup("KEEP=1");
+    env[2] = strdup("REMOVE=1");
+    env[3] = strdup("CHANGE=old");
+    env[4] = NULL;
+    tmpFiles.push_back(hook);
+    tmpFiles.push_back(cacheFile);
+
+    fp = fopen(hook, "w");
+    CHECK(fp != NULL);
+    fprintf(fp, "echo configuring\nexport ADDED=\"a b\"\n"
+            "CHANGE=new\nunset REMOVE\ncd /\n");
+    fclose(fp);
+
+    CHECK(shifter_userhookenv(&env, hook, cacheFile) == 0);
+    for (ptr = env; ptr && *ptr; ptr++) {
+        CHECK(strncmp(*ptr, "REMOVE=", 7) != 0);
+        CHECK(strncmp(*ptr, "PWD=", 4) != 0);
+        if (strcmp(*ptr, "ADDED=a b") == 0) found |= 1;
+        if (strcmp(*ptr, "CHANGE=new") == 0) found |= 2;
+        if (strcmp(*ptr, "KEEP=1") == 0) found |= 4;
+    }
+    CHECK(found == 7);
+    free_string_array(env);
+
+    /* capturing needs nothing from the image but /bin/sh */
+    env = (char **) malloc(sizeof(char *) * 2);
+    env[0] = strdup("PATH=/nonexistent");
+    env[1] = NULL;
+    CHECK(shifter_userhookenv(&env, hook, NULL) == 0);
+    found = 0;
+    for (ptr = env; ptr && *ptr; ptr++) {
+        if (strcmp(*ptr, "ADDED=a b") == 0) found |= 1;
+    }
+    CHECK(found == 1);
+    free_string_array(env);
+
+    /* later runs use the stored result without running the hook */
+    fp = fopen(hook, "w");
+    CHECK(fp != NULL);
+    fprintf(fp, "exit 1\n");
+    fclose(fp);
+    env = (char **) malloc(sizeof(char *) * 3);
+    env[0] = strdup("PATH=/usr/bin:/bin");
+    env[1] = strdup("REMOVE=1");
+    env[2] = NULL;
+    CHECK(shifter_userhookenv(&env, hook, cacheFile) == 0);
+    found = 0;
+    for (ptr = env; ptr && *ptr; ptr++) {
+        CHECK(strncmp(*ptr, "REMOVE=", 7) != 0);
+        if (strcmp(*ptr, "ADDED=a b") == 0) found |= 1;
+    }
+    CHECK(found == 1);
+
+    /* without the stored result the failing hook is run */
+    unlink(cacheFile);
+    CHECK(shifter_userhookenv(&env, hook, cacheFile) != 0);
+    CHECK(shifter_userhookenv(&env, hook, NULL) != 0);
+    free_string_array(env);
+
+    /* unchanged variables are not part of the delta */
+    {
+        char *before[] = { (char *) "A=1", (char *) "B=2", (char *) "_=x", NULL };
+        char *after[] = { (char *) "A=1", (char *) "C=3", (char *) "_=y", NULL };
+        delta = shifter_envdelta(before, after);
+        CHECK(delta[0] != NULL && strcmp(delta[0], "C=3") == 0);
+        CHECK(delta[1] != NULL && strcmp(delta[1], "B") == 0);
+        CHECK(delta[2] == NULL);
+        free_string_array(delta);
+    }
+
+    free(hook);
+    free(cacheFile);
+}
+
+TEST(ShifterCoreTestGroup, UdiInstance_basic) {
+    UdiRootConfig config;
+    char *udiRoot = alloc_strgenf("%s/udi", tmpDir);
+    char *loopMount = alloc_strgenf("%s/loop", tmpDir);
+    char *instance = alloc_strgenf("%s/udi/1234", tmpDir);
+    char *loopInstance = alloc_strgenf("%s/loop/1234", tmpDir);
+    char *registry = alloc_strgenf("%s/udi.jobs", tmpDir);
+    char *record = alloc_strgenf("%s/udi.jobs/1234", tmpDir);
+    struct stat statData;
+
+    memset(&config, 0, sizeof(UdiRootConfig));
+    CHECK(mkdir(udiRoot, 0755) == 0);
+    CHECK(mkdir(loopMount, 0755) == 0);
+    tmpDirs.push_back(instance);
+    tmpDirs.push_back(loopInstance);
+    tmpDirs.push_back(registry);
+    tmpDirs.push_back(udiRoot);
+    tmpDirs.push_back(loopMount);
+    config.udiMountPoint = strdup(udiRoot);
+    config.loopMountPoint = strdup(loopMount);
+
+    /* disabled, the node-wide UDI is used */
+    CHECK(selectUdiInstance(&config, "1234", 1) == 0);
+    CHECK(strcmp(config.udiMountPoint, udiRoot) == 0);
+    CHECK(config.jobIdentifier == NULL);
+
+    config.perJobUdi = 1;
+    CHECK(selectUdiInstance(&config, "../1234", 1) != 0);
+    CHECK(selectUdiInstance(&config, "..", 1) != 0);
+    CHECK(selectUdiInstance(&config, "", 1) != 0);
+
+    /* only an existing instance is selected without create */
+    CHECK(selectUdiInstance(&config, "1234", 0) == 2);
+    CHECK(strcmp(config.udiMountPoint, udiRoot) == 0);
+    CHECK(config.jobIdentifier == NULL);
+
+    CHECK(selectUdiInstance(&config, "1234", 1) == 0);
+    CHECK(strcmp(config.udiMountPoint, instance) == 0);
+    CHECK(strcmp(config.loopMountPoint, loopInstance) == 0);
+    CHECK(stat(instance, &statData) == 0 && S_ISDIR(statData.st_mode));
+    CHECK(stat(loopInstance, &statData) == 0 && S_ISDIR(statData.st_mode));
+    CHECK(stat(record, &statData) == 0 && S_ISREG(statData.st_mode));
+
+    /* selecting again keeps the instance */
+    CHECK(selectUdiInstance(&config, "5678", 1) == 0);
+    CHECK(strcmp(config.udiMountPoint, instance) == 0);
+
+    CHECK(removeUdiInstance(&config) == 0);
+    CHECK(stat(instance, &statData) != 0);
+    CHECK(stat(loopInstance, &statData) != 0);
+    CHECK(stat(record, &statData) != 0);
+
+    free(config.udiMountPoint);
+    free(config.loopMountPoint);
+    free(config.jobIdentifier);
+    free(udiRoot);
+    free(loopMount);
+    free(instance);
+    free(loopInstance);
+    free(registry);
+    free(record);
+}
+
+TEST(ShifterCoreTestGroup, KeepWarm_basic) {
+    UdiRootConfig config;
+    char *udiRoot = alloc_strgenf("%s/udi", tmpDir);
+    char *loopMount = alloc_strgenf("%s/loop", tmpDir);
+    char *marker = alloc_strgenf("%s/udi.warm", tmpDir);
+    char *lock = alloc_strgenf("%s/udi.warm.lock", tmpDir);
+    char *varDir = alloc_strgenf("%s/udi/var", tmpDir);
+    char *envDir = alloc_strgenf("%s/udi/var/shifterEnv", tmpDir);
+    char *envFile = alloc_strgenf("%s/udi/var/shifterEnv/hook.env", tmpDir);
+    char *saveFile = alloc_strgenf("%s/udi/var/shifterConfig.json", tmpDir);
+    char *stageFile = alloc_strgenf("%s/udi/var/shifterStageout", tmpDir);
+    struct stat statData;
+    int fd = -1;
+
+    memset(&config, 0, sizeof(UdiRootConfig));
+    CHECK(mkdir(udiRoot, 0755) == 0);
+    CHECK(mkdir(loopMount, 0755) == 0);
+    tmpFiles.push_back(marker);
+    tmpFiles.push_back(lock);
+    tmpFiles.push_back(saveFile);
+    tmpFiles.push_back(stageFile);
+    tmpDirs.push_back(envDir);
+    tmpDirs.push_back(varDir);
+    tmpDirs.push_back(udiRoot);
+    tmpDirs.push_back(loopMount);
+    config.udiMountPoint = strdup(udiRoot);
+    config.loopMountPoint = strdup(loopMount);
+    config.udiKeepWarmTimeout = 3600;
+
+    CHECK(isUdiParked(&config) == 0);
+    CHECK(expireParkedUDI(&config) == 0);
+
+    /* an incomplete UDI is not kept */
+    CHECK(parkUDI(&config) != 0);
+    CHECK(isUdiParked(&config) == 0);
+
+    /* neither is one holding per-node caches */
+    config.mountUdiRootWritable = 1;
+    CHECK(mkdir(varDir, 0755) == 0);
+    CHECK(mkdir(envDir, 0700) == 0);
+    fd = open(saveFile, O_WRONLY|O_CREAT, 0600);
+    CHECK(fd >= 0);
+    close(fd);
+    fd = open(stageFile, O_WRONLY|O_CREAT, 0600);
+    CHECK(fd >= 0);
+    close(fd);
+    CHECK(parkUDI(&config) != 0);
+    CHECK(isUdiParked(&config) == 0);
+    unlink(stageFile);
+
+    /* the cached userhook environments go with the job */
+    fd = open(envFile, O_WRONLY|O_CREAT, 0600);
+    CHECK(fd >= 0);
+    close(fd);
+    CHECK(parkUDI(&config) == 0);
+    CHECK(isUdiParked(&config) == 1);
+    CHECK(stat(envFile, &statData) != 0);
+    CHECK(stat(envDir, &statData) == 0);
+
+    /* still within the idle timeout */
+    CHECK(expireParkedUDI(&config) == 0);
+    CHECK(isUdiParked(&config) == 1);
+
+    config.udiKeepWarmTimeout = 0;
+    CHECK(expireParkedUDI(&config) == 0);
+    CHECK(isUdiParked(&config) == 0);
+
+    free(config.udiMountPoint);
+    free(config.loopMountPoint);
+    free(udiRoot);
+    free(loopMount);
+    free(marker);
+    free(lock);
+    free(varDir);
+    free(envDir);
+    free(envFile);
+    free(saveFile);
+    free(stageFile);
+}
+
+TEST(ShifterCoreTestGroup, ShifterConfigFingerprint_basic) {
+    ImageData image;
+    VolumeMap vmap;
+    UdiRootConfig config;
+    char fp1[SHIFTER_HASH_HEX_SIZE + 1];
+    char fp2[SHIFTER_HASH_HEX_SIZE + 1];
+    char *varDir = alloc_strgenf("%s/var", tmpDir);
+    char *imageFile = alloc_strgenf("%s/image.squashfs", tmpDir);
+    char *saveFile = alloc_strgenf("%s/var/shifterConfig.json", tmpDir);
+    struct timespec times[2];
+    FILE *fp = NULL;
+
+    memset(&image, 0, sizeof(ImageData));
+    memset(&vmap, 0, sizeof(VolumeMap));
+    memset(&config, 0, sizeof(UdiRootConfig));
+    tmpDirs.push_back(varDir);
+    tmpFiles.push_back(imageFile);
+    tmpFiles.push_back(saveFile);
+    CHECK(mkdir(varDir, 0755) == 0);
+    fp = fopen(imageFile, "w");
+    CHECK(fp != NULL);
+    fprintf(fp, "image\n");
+    fclose(fp);
+
+    image.identifier = strdup("testImage");
+    image.filename = strdup(imageFile);
+    config.udiMountPoint = tmpDir;
+    CHECK(parseVolumeMap("/tmp:/data", &vmap) == 0);
+
+    /* missing backing file cannot be fingerprinted */
+    image.filename[0] = 'x';
+    CHECK(generateShifterConfigFingerprint("dmj", &image, &vmap, &config, fp1) == 2);
+    image.filename[0] = '/';
+
+    CHECK(generateShifterConfigFingerprint("dmj", &image, &vmap, &config, fp1) == 0);
+    CHECK(strlen(fp1) == SHIFTER_HASH_HEX_SIZE);
+    CHECK(generateShifterConfigFingerprint("dmj", &image, &vmap, &config, fp2) == 0);
+    CHECK(strcmp(fp1, fp2) == 0);
+    CHECK(generateShifterConfigFingerprint("other", &image, &vmap, &config, fp2) == 0);
+    CHECK(strcmp(fp1, fp2) != 0);
+
+    /* no saved config yet */
+    CHECK(compareShifterConfig("dmj", &image, &vmap, &config) != 0);
+    CHECK(saveShifterConfig("dmj", &image, &vmap, &config) == 0);
+    CHECK(compareShifterConfig("dmj", &image, &vmap, &config) == 0);
+    CHECK(compareShifterConfig("other", &image, &vmap, &config) != 0);
+
+    /* site configuration changes invalidate the udi */
+    config.mountUdiRootWritable = 1;
+    CHECK(compareShifterConfig("dmj", &image, &vmap, &config) != 0);
+    config.mountUdiRootWritable = 0;
+    CHECK(compareShifterConfig("dmj", &image, &vmap, &config) == 0);
+
+    /* as do volume map changes */
+    CHECK(parseVolumeMap("/tmp:/data2", &vmap) == 0);
+    CHECK(compareShifterConfig("dmj", &image, &vmap, &config) != 0);
+    free_VolumeMap(&vmap, 0);
+    memset(&vmap, 0, sizeof(VolumeMap));
+    CHECK(parseVolumeMap("/tmp:/data", &vmap) == 0);
+    CHECK(compareShifterConfig("dmj", &image, &vmap, &config) == 0);
+
+    /* and an image file replaced in place */
+    times[0].tv_sec = 1000000000;
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = 1000000000;
+    times[1].tv_nsec = 0;
+    CHECK(utimensat(AT_FDCWD, imageFile, times, 0) == 0);
+    CHECK(compareShifterConfig("dmj", &image, &vmap, &config) != 0);
+
+    free_VolumeMap(&vmap, 0);
+    free(image.identifier);
+    free(image.filename);
+    free(varDir);
+    free(imageFile);
+    free(saveFile);
+}
+
 #ifdef NOTROOT
 IGNORE_TEST(ShifterCoreTestGroup, _bindMount_basic) {
 #else
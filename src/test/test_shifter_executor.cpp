@@ -0,0 +1,248 @@
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+## through Lawrence Berkeley National Laboratory (subject to receipt of any
+## required approvals from the U.S. Dept. of Energy).  All rights reserved.
+##
+## Redistribution and use in source and binary forms, with or without
+## modification, are permitted provided that the following conditions are met:
+##  1. Redistributions of source code must retain the above copyright notice,
+##     this list of conditions and the following disclaimer.
+##  2. Redistributions in binary form must reproduce the above copyright notice,
+##     this list of conditions and the following disclaimer in the documentation
+##     and/or other materials provided with the distribution.
+##  3. Neither the name of the University of California, Lawrence Berkeley
+##     National Laboratory, U.S. Dept. of Energy nor the names of its
+##     contributors may be used to endorse or promote products derived from this
+##     software without specific prior written permission.
+##
+## See LICENSE for full text.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "shifter_executor.h"
+#include <CppUTest/CommandLineTestRunner.h>
+
+static void _testLaunch(ShifterExecutorRequest *request, void *data) {
+    char *emptyEnv[] = { NULL };
+    execve(request->args[0], request->args,
+            request->env != NULL ? request->env : emptyEnv);
+}
+
+static int _testAdmit(ShifterExecutorRequest *request, void *data) {
+    if (request->peer.uid != getuid()) {
+        return EXECUTOR_REJECT_PERMISSION;
+    }
+    if (strcmp(request->workdir, "/denied") == 0) {
+        return EXECUTOR_REJECT_PERMISSION;
+    }
+    return 0;
+}
+
+TEST_GROUP(ShifterExecutorTestGroup) {
+    char tmpDir[PATH_MAX];
+    char socketPath[PATH_MAX];
+
+    void setup() {
+        snprintf(tmpDir, PATH_MAX, "/tmp/shifter_exec.XXXXXX");
+        CHECK(mkdtemp(tmpDir) != NULL);
+        snprintf(socketPath, PATH_MAX, "%s/executor.sock", tmpDir);
+    }
+
+    void teardown() {
+        unlink(socketPath);
+        rmdir(tmpDir);
+    }
+};
+
+TEST(ShifterExecutorTestGroup, SocketPath) {
+    char longDir[256];
+    char *path = NULL;
+
+    CHECK(shifter_executor_socketPath(NULL, 1000, "42", "0") == NULL);
+    CHECK(shifter_executor_socketPath("run/shifter", 1000, "42", "0") == NULL);
+    CHECK(shifter_executor_socketPath("/run/shifter", 1000, NULL, "0") == NULL);
+    CHECK(shifter_executor_socketPath("/run/shifter", 1000, "42", NULL) == NULL);
+
+    path = shifter_executor_socketPath("/run/shifter", 1000, "42", "0");
+    CHECK(path != NULL);
+    CHECK(strcmp(path, "/run/shifter/executor.1000.42.0.sock") == 0);
+    free(path);
+
+    /* job identifiers cannot escape the socket directory */
+    path = shifter_executor_socketPath("/run/shifter", 1000, "../42", "0");
+    CHECK(path != NULL);
+    CHECK(strstr(path, "/..") == NULL);
+    free(path);
+
+    memset(longDir, 'a', sizeof(longDir) - 1);
+    longDir[0] = '/';
+    longDir[sizeof(longDir) - 1] = 0;
+    CHECK(shifter_executor_socketPath(longDir, 1000, "42", "0") == NULL);
+}
+
+TEST(ShifterExecutorTestGroup, RequestRoundTrip) {
+    ShifterExecutorRequest request;
+    ShifterExecutorRequest received;
+    struct ucred peer;
+    char *args[] = { (char *) "/bin/echo", (char *) "", (char *) "hi", NULL };
+    char *env[] = { (char *) "PATH=/usr/bin", NULL };
+    char buffer[16];
+    int sockets[2];
+    int pipes[2];
+    int idx = 0;
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    CHECK(pipe(pipes) == 0);
+
+    memset(&request, 0, sizeof(ShifterExecutorRequest));
+    request.fingerprint = (char *) "abc123";
+    request.workdir = (char *) "/home/user";
+    request.clearenv = 1;
+    request.args = args;
+    request.env = env;
+    request.fds[0] = pipes[1];
+    request.fds[1] = pipes[1];
+    request.fds[2] = pipes[1];
+    shifter_executor_captureContext(&request);
+
+    CHECK(shifter_executor_sendRequest(sockets[0], &request) == 0);
+    CHECK(shifter_executor_recvRequest(sockets[1], &received, &peer) == 0);
+    CHECK(peer.uid == getuid());
+    CHECK(strcmp(received.fingerprint, "abc123") == 0);
+    CHECK(strcmp(received.workdir, "/home/user") == 0);
+    CHECK(received.request == NULL);
+    CHECK(received.envfile == NULL);
+    CHECK(received.clearenv == 1);
+    CHECK(received.args != NULL);
+    CHECK(strcmp(received.args[0], "/bin/echo") == 0);
+    CHECK(strcmp(received.args[1], "") == 0);
+    CHECK(strcmp(received.args[2], "hi") == 0);
+    CHECK(received.args[3] == NULL);
+    CHECK(strcmp(received.env[0], "PATH=/usr/bin") == 0);
+    CHECK(received.env[1] == NULL);
+    CHECK(received.userEnv == NULL);
+    CHECK(received.umask == request.umask);
+    CHECK(CPU_EQUAL(&(received.affinity), &(request.affinity)));
+    CHECK(memcmp(received.rlimits, request.rlimits,
+                sizeof(request.rlimits)) == 0);
+    CHECK(received.peer.pid == getpid());
+
+    /* passed descriptors refer to the same pipe */
+    CHECK(write(received.fds[1], "ok", 2) == 2);
+    CHECK(read(pipes[0], buffer, sizeof(buffer)) == 2);
+    CHECK(memcmp(buffer, "ok", 2) == 0);
+
+    for (idx = 0; idx < SHIFTER_EXECUTOR_NFDS; idx++) {
+        close(received.fds[idx]);
+    }
+    free_ShifterExecutorRequest(&received, 0);
+
+    /* a truncated request is rejected */
+    CHECK(shifter_executor_sendRequest(sockets[0], &request) == 0);
+    shutdown(sockets[0], SHUT_WR);
+    CHECK(read(sockets[1], buffer, 4) == 4);
+    CHECK(shifter_executor_recvRequest(sockets[1], &received, &peer) != 0);
+
+    close(sockets[0]);
+    close(sockets[1]);
+    close(pipes[0]);
+    close(pipes[1]);
+}
+
+TEST(ShifterExecutorTestGroup, ServeAndRun) {
+    ShifterExecutorRequest request;
+    char *args[] = { (char *) "/bin/sh", (char *) "-c",
+        (char *) "echo $GREETING $(umask) $(ulimit -n); exit 3", NULL };
+    char *env[] = { (char *) "GREETING=hello", NULL };
+    char buffer[64];
+    struct stat statData;
+    struct rlimit nofile;
+    struct rlimit lowered;
+    mode_t mask = 0;
+    int pipes[2];
+    int status = 0;
+    int listenFd = -1;
+    ssize_t nread = 0;
+    pid_t server = 0;
+
+    /* nothing listening yet */
+    memset(&request, 0, sizeof(ShifterExecutorRequest));
+    CHECK(shifter_executor_run(socketPath, getuid(), &request, &status) == 1);
+
+    listenFd = shifter_executor_listen(socketPath, getuid());
+    CHECK(listenFd >= 0);
+    CHECK(stat(socketPath, &statData) == 0);
+    CHECK((statData.st_mode & 0777) == 0600);
+
+    /* a second daemon must not steal a live socket */
+    CHECK(shifter_executor_listen(socketPath, getuid()) < 0);
+
+    server = fork();
+    CHECK(server >= 0);
+    if (server == 0) {
+        shifter_executor_serve(listenFd, socketPath, getuid(), "fp1", 1,
+                _testAdmit, _testLaunch, NULL);
+        _exit(0);
+    }
+    close(listenFd);
+
+    CHECK(pipe(pipes) == 0);
+    request.fingerprint = (char *) "fp1";
+    request.workdir = (char *) "/";
+    request.args = args;
+    request.env = env;
+    request.fds[0] = pipes[0];
+    request.fds[1] = pipes[1];
+    request.fds[2] = STDERR_FILENO;
+
+    /* the rank runs with the umask and limits of the client */
+    CHECK(getrlimit(RLIMIT_NOFILE, &nofile) == 0);
+    lowered = nofile;
+    lowered.rlim_cur = 100;
+    CHECK(setrlimit(RLIMIT_NOFILE, &lowered) == 0);
+    mask = umask(027);
+    CHECK(shifter_executor_run(socketPath, getuid(), &request, &status) == 0);
+    umask(mask);
+    CHECK(setrlimit(RLIMIT_NOFILE, &nofile) == 0);
+    CHECK(WIFEXITED(status));
+    CHECK(WEXITSTATUS(status) == 3);
+    nread = read(pipes[0], buffer, sizeof(buffer) - 1);
+    buffer[nread > 0 ? nread : 0] = 0;
+    CHECK(strcmp(buffer, "hello 0027 100\n") == 0);
+
+    /* a rank the executor does not admit is launched directly */
+    request.workdir = (char *) "/denied";
+    CHECK(shifter_executor_run(socketPath, getuid(), &request, &status) == 1);
+    request.workdir = (char *) "/";
+
+    /* mismatched configuration falls back to a direct launch */
+    request.fingerprint = (char *) "fp2";
+    CHECK(shifter_executor_run(socketPath, getuid(), &request, &status) == 1);
+
+    /* the executor must be run by the expected user */
+    request.fingerprint = (char *) "fp1";
+    CHECK(shifter_executor_run(socketPath, getuid() + 1, &request, &status) == 1);
+
+    /* idle daemon exits and removes its socket */
+    CHECK(waitpid(server, &status, 0) == server);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(stat(socketPath, &statData) != 0);
+
+    close(pipes[0]);
+    close(pipes[1]);
+}
+
+int main(int argc, char** argv) {
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
@@ -0,0 +1,144 @@
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+## through Lawrence Berkeley National Laboratory (subject to receipt of any
+## required approvals from the U.S. Dept. of Energy).  All rights reserved.
+##
+## Redistribution and use in source and binary forms, with or without
+## modification, are permitted provided that the following conditions are met:
+##  1. Redistributions of source code must retain the above copyright notice,
+##     this list of conditions and the following disclaimer.
+##  2. Redistributions in binary form must reproduce the above copyright notice,
+##     this list of conditions and the following disclaimer in the documentation
+##     and/or other materials provided with the distribution.
+##  3. Neither the name of the University of California, Lawrence Berkeley
+##     National Laboratory, U.S. Dept. of Energy nor the names of its
+##     contributors may be used to endorse or promote products derived from this
+##     software without specific prior written permission.
+##
+## See LICENSE for full text.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "shifter_gpu.h"
+#include "shifter_ldcache.h"
+#include <CppUTest/CommandLineTestRunner.h>
+
+static int writeFile(const char *path, const char *content, mode_t mode) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) return 1;
+    fputs(content, fp);
+    fclose(fp);
+    return chmod(path, mode);
+}
+
+TEST_GROUP(ShifterGpuTestGroup) {
+    char tmpDir[PATH_MAX];
+    char cachePath[PATH_MAX];
+
+    void setup() {
+        snprintf(tmpDir, PATH_MAX, "/tmp/shifter_gpu.XXXXXX");
+        CHECK(mkdtemp(tmpDir) != NULL);
+        snprintf(cachePath, PATH_MAX, "%s/ld.so.cache", tmpDir);
+    }
+
+    void teardown() {
+        char *cmd = NULL;
+        CHECK(asprintf(&cmd, "rm -rf %s", tmpDir) > 0);
+        CHECK(system(cmd) == 0);
+        free(cmd);
+    }
+};
+
+TEST(ShifterGpuTestGroup, DriverVersion) {
+    char path[PATH_MAX];
+    char version[128];
+
+    snprintf(path, PATH_MAX, "%s/version", tmpDir);
+    CHECK(shifter_gpu_driverVersion(path, version, sizeof(version)) == 1);
+    CHECK(writeFile(path, "NVRM version: NVIDIA UNIX x86_64 Kernel Module  "
+                "470.57.02\nGCC version: 9\n", 0644) == 0);
+    CHECK(shifter_gpu_driverVersion(path, version, sizeof(version)) == 0);
+    CHECK(strcmp(version, "NVRM version: NVIDIA UNIX x86_64 Kernel Module  "
+                "470.57.02") == 0);
+    CHECK(writeFile(path, "\n", 0644) == 0);
+    CHECK(shifter_gpu_driverVersion(path, version, sizeof(version)) == 1);
+}
+
+TEST(ShifterGpuTestGroup, Discover) {
+    char lib64[PATH_MAX];
+    char lib32[PATH_MAX];
+    char other[PATH_MAX];
+    char bin[PATH_MAX];
+    char smi[PATH_MAX];
+    char expected[4 * PATH_MAX];
+    char *siteFs = NULL;
+    ShifterLdCacheEntry entries[3];
+
+    snprintf(lib64, PATH_MAX, "%s/libcuda.so.1", tmpDir);
+    snprintf(lib32, PATH_MAX, "%s/libnvidia-ml.so.1", tmpDir);
+    snprintf(other, PATH_MAX, "%s/libcudart.so.10", tmpDir);
+    snprintf(bin, PATH_MAX, "%s/bin", tmpDir);
+    snprintf(smi, PATH_MAX, "%s/bin/nvidia-smi", tmpDir);
+    CHECK(writeFile(lib64, "\177ELF\002", 0644) == 0);
+    CHECK(writeFile(lib32, "\177ELF\001", 0644) == 0);
+    CHECK(writeFile(other, "\177ELF\002", 0644) == 0);
+    CHECK(mkdir(bin, 0755) == 0);
+
+    memset(entries, 0, sizeof(entries));
+    entries[0].name = "libcuda.so.1";
+    entries[0].path = lib64;
+    entries[1].name = "libnvidia-ml.so.1";
+    entries[1].path = lib32;
+    entries[2].name = "libcudart.so.10";
+    entries[2].path = other;
+    CHECK(shifter_ldcache_write(cachePath, entries, 3) == 0);
+
+    /* nvidia-smi is required */
+    CHECK(shifter_gpu_discover(cachePath, bin, "/opt/gpu") == NULL);
+    CHECK(writeFile(smi, "#!/bin/sh\n", 0755) == 0);
+    CHECK(shifter_gpu_discover(cachePath, bin, "opt/gpu") == NULL);
+
+    siteFs = shifter_gpu_discover(cachePath, bin, "/opt/gpu");
+    CHECK(siteFs != NULL);
+    snprintf(expected, sizeof(expected),
+            "%s:/opt/gpu/lib/libnvidia-ml.so.1:ro;"
+            "%s:/opt/gpu/lib64/libcuda.so.1:ro;"
+            "%s:/opt/gpu/bin/nvidia-smi:ro", lib32, lib64, smi);
+    CHECK(siteFs != NULL && strcmp(siteFs, expected) == 0);
+
+    /* a library that is not ELF cannot be placed */
+    CHECK(writeFile(lib64, "not elf", 0644) == 0);
+    CHECK(shifter_gpu_discover(cachePath, bin, "/opt/gpu") == NULL);
+
+    free(siteFs);
+}
+
+TEST(ShifterGpuTestGroup, Cache) {
+    char path[PATH_MAX];
+    char *siteFs = NULL;
+
+    snprintf(path, PATH_MAX, "%s/gpu.test.cache", tmpDir);
+    CHECK(shifter_gpu_loadCache(path, "v1", "/opt/gpu") == NULL);
+    CHECK(shifter_gpu_saveCache(path, "v1", "/opt/gpu", "a\nb") != 0);
+    CHECK(shifter_gpu_saveCache(path, "v1", "/opt/gpu", "/a:/opt/gpu/a:ro") == 0);
+
+    siteFs = shifter_gpu_loadCache(path, "v1", "/opt/gpu");
+    CHECK(siteFs != NULL && strcmp(siteFs, "/a:/opt/gpu/a:ro") == 0);
+    free(siteFs);
+
+    /* a driver update or new target invalidates the cache */
+    CHECK(shifter_gpu_loadCache(path, "v2", "/opt/gpu") == NULL);
+    CHECK(shifter_gpu_loadCache(path, "v1", "/opt/other") == NULL);
+}
+
+int main(int argc, char** argv) {
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
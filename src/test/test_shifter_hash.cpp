@@ -0,0 +1,98 @@
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+## through Lawrence Berkeley National Laboratory (subject to receipt of any
+## required approvals from the U.S. Dept. of Energy).  All rights reserved.
+##
+## Redistribution and use in source and binary forms, with or without
+## modification, are permitted provided that the following conditions are met:
+##  1. Redistributions of source code must retain the above copyright notice,
+##     this list of conditions and the following disclaimer.
+##  2. Redistributions in binary form must reproduce the above copyright notice,
+##     this list of conditions and the following disclaimer in the documentation
+##     and/or other materials provided with the distribution.
+##  3. Neither the name of the University of California, Lawrence Berkeley
+##     National Laboratory, U.S. Dept. of Energy nor the names of its
+##     contributors may be used to endorse or promote products derived from this
+##     software without specific prior written permission.
+##
+## See LICENSE for full text.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "shifter_hash.h"
+#include <CppUTest/CommandLineTestRunner.h>
+
+static void digestHex(const char *input, size_t len, char *hex) {
+    ShifterHash hash;
+    unsigned char digest[SHIFTER_HASH_SIZE];
+    shifter_hash_init(&hash);
+    shifter_hash_update(&hash, input, len);
+    shifter_hash_final(&hash, digest);
+    shifter_hash_hex(digest, hex);
+}
+
+TEST_GROUP(ShifterHashTestGroup) {
+};
+
+TEST(ShifterHashTestGroup, KnownVectors) {
+    char hex[SHIFTER_HASH_HEX_SIZE + 1];
+    const char *twoBlock = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+
+    digestHex("", 0, hex);
+    CHECK(strcmp(hex, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855") == 0);
+
+    digestHex("abc", 3, hex);
+    CHECK(strcmp(hex, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad") == 0);
+
+    digestHex(twoBlock, strlen(twoBlock), hex);
+    CHECK(strcmp(hex, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1") == 0);
+}
+
+TEST(ShifterHashTestGroup, IncrementalUpdate) {
+    ShifterHash hash;
+    unsigned char digest[SHIFTER_HASH_SIZE];
+    char hex[SHIFTER_HASH_HEX_SIZE + 1];
+    char chunk[1000];
+    int idx = 0;
+
+    /* one million 'a', fed in uneven pieces */
+    memset(chunk, 'a', sizeof(chunk));
+    shifter_hash_init(&hash);
+    for (idx = 0; idx < 1000; idx++) {
+        shifter_hash_update(&hash, chunk, 1 + (idx % 7));
+        shifter_hash_update(&hash, chunk, 1000 - 1 - (idx % 7));
+    }
+    shifter_hash_final(&hash, digest);
+    shifter_hash_hex(digest, hex);
+    CHECK(strcmp(hex, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0") == 0);
+}
+
+TEST(ShifterHashTestGroup, FieldsAreSeparated) {
+    ShifterHash hash;
+    unsigned char a[SHIFTER_HASH_SIZE];
+    unsigned char b[SHIFTER_HASH_SIZE];
+
+    shifter_hash_init(&hash);
+    shifter_hash_string(&hash, "x", "ab");
+    shifter_hash_string(&hash, "y", "c");
+    shifter_hash_final(&hash, a);
+
+    shifter_hash_init(&hash);
+    shifter_hash_string(&hash, "x", "a");
+    shifter_hash_string(&hash, "y", "bc");
+    shifter_hash_final(&hash, b);
+    CHECK(memcmp(a, b, SHIFTER_HASH_SIZE) != 0);
+
+    shifter_hash_init(&hash);
+    shifter_hash_string(&hash, "x", NULL);
+    shifter_hash_final(&hash, a);
+
+    shifter_hash_init(&hash);
+    shifter_hash_string(&hash, "x", "");
+    shifter_hash_final(&hash, b);
+    CHECK(memcmp(a, b, SHIFTER_HASH_SIZE) != 0);
+}
+
+int main(int argc, char** argv) {
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
@@ -0,0 +1,251 @@
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+## through Lawrence Berkeley National Laboratory (subject to receipt of any
+## required approvals from the U.S. Dept. of Energy).  All rights reserved.
+##
+## Redistribution and use in source and binary forms, with or without
+## modification, are permitted provided that the following conditions are met:
+##  1. Redistributions of source code must retain the above copyright notice,
+##     this list of conditions and the following disclaimer.
+##  2. Redistributions in binary form must reproduce the above copyright notice,
+##     this list of conditions and the following disclaimer in the documentation
+##     and/or other materials provided with the distribution.
+##  3. Neither the name of the University of California, Lawrence Berkeley
+##     National Laboratory, U.S. Dept. of Energy nor the names of its
+##     contributors may be used to endorse or promote products derived from this
+##     software without specific prior written permission.
+##
+## See LICENSE for full text.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "shifter_ldcache.h"
+#include <CppUTest/CommandLineTestRunner.h>
+
+static void put32(unsigned char *ptr, uint32_t value) {
+    memcpy(ptr, &value, sizeof(uint32_t));
+}
+
+/* write an ld.so.cache as older ldconfig versions did: a legacy table,
+ * optionally followed by a new-format table hidden in its strings */
+static int writeLegacyLdCache(const char *path, const char **names,
+        const char **paths, size_t n, int withNew)
+{
+    unsigned char buffer[8192];
+    size_t oldSize = 16 + 12 * n;
+    size_t base = (oldSize + 7) & ~((size_t) 7);
+    size_t wptr = withNew ? base + 48 + 24 * n : oldSize;
+    size_t idx = 0;
+    FILE *fp = NULL;
+
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, "ld.so-1.7.0", 11);
+    put32(buffer + 12, n);
+    if (withNew) {
+        memcpy(buffer + base, "glibc-ld.so.cache1.1", 20);
+        put32(buffer + base + 20, n);
+    }
+    for (idx = 0; idx < n; idx++) {
+        unsigned char *entry = buffer + 16 + 12 * idx;
+        unsigned char *newEntry = buffer + base + 48 + 24 * idx;
+
+        put32(entry, LDCACHE_FLAG_ELF_LIBC6);
+        put32(entry + 4, wptr - oldSize);
+        if (withNew) put32(newEntry + 4, wptr - base);
+        strcpy((char *) buffer + wptr, names[idx]);
+        wptr += strlen(names[idx]) + 1;
+
+        put32(entry + 8, wptr - oldSize);
+        if (withNew) put32(newEntry + 8, wptr - base);
+        strcpy((char *) buffer + wptr, paths[idx]);
+        wptr += strlen(paths[idx]) + 1;
+    }
+
+    fp = fopen(path, "w");
+    if (fp == NULL) return 1;
+    fwrite(buffer, 1, wptr, fp);
+    fclose(fp);
+    return 0;
+}
+
+typedef struct {
+    char names[16][64];
+    char paths[16][64];
+    int32_t flags[16];
+    size_t count;
+} Collected;
+
+static int collect(const ShifterLdCacheEntry *entry, void *data) {
+    Collected *collected = (Collected *) data;
+    if (collected->count == 16) return 0;
+    snprintf(collected->names[collected->count], 64, "%s", entry->name);
+    snprintf(collected->paths[collected->count], 64, "%s", entry->path);
+    collected->flags[collected->count] = entry->flags;
+    collected->count++;
+    return 0;
+}
+
+static int findLibc(const ShifterLdCacheEntry *entry, void *data) {
+    char *path = (char *) data;
+    if (strcmp(entry->name, "libc.so.6") == 0 && path[0] == 0) {
+        snprintf(path, PATH_MAX, "%s", entry->path);
+    }
+    return 0;
+}
+
+TEST_GROUP(ShifterLdCacheTestGroup) {
+    char tmpDir[PATH_MAX];
+    char cachePath[PATH_MAX];
+
+    void setup() {
+        snprintf(tmpDir, PATH_MAX, "/tmp/shifter_ldcache.XXXXXX");
+        CHECK(mkdtemp(tmpDir) != NULL);
+        CHECK(snprintf(cachePath, PATH_MAX, "%s/ld.so.cache", tmpDir)
+                < PATH_MAX);
+    }
+
+    void teardown() {
+        unlink(cachePath);
+        rmdir(tmpDir);
+    }
+};
+
+TEST(ShifterLdCacheTestGroup, Libcmp) {
+    CHECK(shifter_ldcache_libcmp("libfoo.so.10", "libfoo.so.9") > 0);
+    CHECK(shifter_ldcache_libcmp("libfoo.so.9", "libfoo.so.10") < 0);
+    CHECK(shifter_ldcache_libcmp("libfoo.so.1", "libfoo.so.1") == 0);
+    CHECK(shifter_ldcache_libcmp("libfoo.so.1", "libfoo.so") > 0);
+    CHECK(shifter_ldcache_libcmp("libb.so", "liba.so") > 0);
+}
+
+TEST(ShifterLdCacheTestGroup, ParseLegacy) {
+    const char *names[] = { "libcuda.so.1", "libc.so.6" };
+    const char *paths[] = { "/usr/lib64/libcuda.so.1", "/lib64/libc.so.6" };
+    unsigned char junk[64];
+    Collected collected;
+    FILE *fp = NULL;
+
+    memset(&collected, 0, sizeof(Collected));
+    CHECK(shifter_ldcache_parse(NULL, collect, &collected) == -1);
+    CHECK(shifter_ldcache_parse(cachePath, collect, &collected) == -1);
+
+    CHECK(writeLegacyLdCache(cachePath, names, paths, 2, 0) == 0);
+    CHECK(shifter_ldcache_parse(cachePath, collect, &collected) == 0);
+    CHECK(collected.count == 2);
+    CHECK(strcmp(collected.names[1], "libc.so.6") == 0);
+    CHECK(strcmp(collected.paths[1], "/lib64/libc.so.6") == 0);
+
+    memset(&collected, 0, sizeof(Collected));
+    CHECK(writeLegacyLdCache(cachePath, names, paths, 2, 1) == 0);
+    CHECK(shifter_ldcache_parse(cachePath, collect, &collected) == 0);
+    CHECK(collected.count == 2);
+    CHECK(strcmp(collected.names[0], "libcuda.so.1") == 0);
+    CHECK(strcmp(collected.paths[0], "/usr/lib64/libcuda.so.1") == 0);
+
+    /* entries pointing past the end of the file are rejected */
+    memset(junk, 0xff, sizeof(junk));
+    memcpy(junk, "glibc-ld.so.cache1.1", 20);
+    put32(junk + 20, 1);
+    fp = fopen(cachePath, "w");
+    CHECK(fp != NULL);
+    fwrite(junk, 1, sizeof(junk), fp);
+    fclose(fp);
+    CHECK(shifter_ldcache_parse(cachePath, collect, &collected) == -1);
+}
+
+TEST(ShifterLdCacheTestGroup, WriteRoundTrip) {
+    ShifterLdCacheEntry entries[5];
+    Collected collected;
+    struct stat statData;
+
+    memset(entries, 0, sizeof(entries));
+    entries[0].name = "libmpi.so.12";
+    entries[0].path = "/opt/udiImage/modules/mpich/lib64/libmpi.so.12";
+    entries[0].flags = LDCACHE_FLAG_ELF_LIBC6 | LDCACHE_FLAG_X8664_LIB64;
+    entries[1].name = "libc.so.6";
+    entries[1].path = "/lib64/libc.so.6";
+    entries[1].flags = LDCACHE_FLAG_ELF_LIBC6 | LDCACHE_FLAG_X8664_LIB64;
+    entries[2].name = "libmpi.so.12";
+    entries[2].path = "/usr/lib64/libmpi.so.12";
+    entries[2].flags = LDCACHE_FLAG_ELF_LIBC6 | LDCACHE_FLAG_X8664_LIB64;
+    entries[3].name = "libmpi.so.12";
+    entries[3].path = "/usr/lib/libmpi.so.12";
+    entries[3].flags = LDCACHE_FLAG_ELF_LIBC6;
+    entries[4].name = "libmpi.so.2";
+    entries[4].path = "/usr/lib64/libmpi.so.2";
+    entries[4].flags = LDCACHE_FLAG_ELF_LIBC6 | LDCACHE_FLAG_X8664_LIB64;
+
+    CHECK(shifter_ldcache_write(cachePath, entries, 5) == 0);
+    CHECK(stat(cachePath, &statData) == 0);
+    CHECK((statData.st_mode & 0777) == 0644);
+
+    memset(&collected, 0, sizeof(Collected));
+    CHECK(shifter_ldcache_parse(cachePath, collect, &collected) == 0);
+
+    /* descending order, the shadowed 64-bit libmpi.so.12 is dropped and the
+     * module's copy comes before the 32-bit one */
+    CHECK(collected.count == 4);
+    CHECK(strcmp(collected.names[0], "libmpi.so.12") == 0);
+    CHECK(strcmp(collected.paths[0],
+                "/opt/udiImage/modules/mpich/lib64/libmpi.so.12") == 0);
+    CHECK(strcmp(collected.paths[1], "/usr/lib/libmpi.so.12") == 0);
+    CHECK(collected.flags[1] == LDCACHE_FLAG_ELF_LIBC6);
+    CHECK(strcmp(collected.names[2], "libmpi.so.2") == 0);
+    CHECK(strcmp(collected.names[3], "libc.so.6") == 0);
+
+    /* an empty cache is valid */
+    CHECK(shifter_ldcache_write(cachePath, NULL, 0) == 0);
+    memset(&collected, 0, sizeof(Collected));
+    CHECK(shifter_ldcache_parse(cachePath, collect, &collected) == 0);
+    CHECK(collected.count == 0);
+}
+
+TEST(ShifterLdCacheTestGroup, ElfInfo) {
+    char libc[PATH_MAX];
+    char *soname = NULL;
+    int32_t flags = 0;
+    int fd = -1;
+
+    fd = open("/bin/sh", O_RDONLY);
+    if (fd >= 0) {
+        /* executables do not go in the cache, unless built as PIE */
+        if (shifter_ldcache_elfInfo(fd, &flags, &soname) == 0) {
+            CHECK(soname == NULL);
+        }
+        close(fd);
+    }
+
+    fd = open("/etc/hostname", O_RDONLY);
+    if (fd >= 0) {
+        CHECK(shifter_ldcache_elfInfo(fd, &flags, &soname) == 1);
+        close(fd);
+    }
+
+    libc[0] = 0;
+    if (shifter_ldcache_parse("/etc/ld.so.cache", findLibc, libc) != 0 ||
+            libc[0] == 0)
+    {
+        return;
+    }
+    fd = open(libc, O_RDONLY);
+    CHECK(fd >= 0);
+    CHECK(shifter_ldcache_elfInfo(fd, &flags, &soname) == 0);
+    CHECK(soname != NULL && strcmp(soname, "libc.so.6") == 0);
+    CHECK((flags & 0xff) == LDCACHE_FLAG_ELF_LIBC6);
+    free(soname);
+    close(fd);
+}
+
+int main(int argc, char** argv) {
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
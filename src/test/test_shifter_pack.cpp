@@ -0,0 +1,176 @@
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+## through Lawrence Berkeley National Laboratory (subject to receipt of any
+## required approvals from the U.S. Dept. of Energy).  All rights reserved.
+##
+## Redistribution and use in source and binary forms, with or without
+## modification, are permitted provided that the following conditions are met:
+##  1. Redistributions of source code must retain the above copyright notice,
+##     this list of conditions and the following disclaimer.
+##  2. Redistributions in binary form must reproduce the above copyright notice,
+##     this list of conditions and the following disclaimer in the documentation
+##     and/or other materials provided with the distribution.
+##  3. Neither the name of the University of California, Lawrence Berkeley
+##     National Laboratory, U.S. Dept. of Energy nor the names of its
+##     contributors may be used to endorse or promote products derived from this
+##     software without specific prior written permission.
+##
+## See LICENSE for full text.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <utime.h>
+#include "shifter_pack.h"
+#include <CppUTest/CommandLineTestRunner.h>
+
+static int writeFile(const char *path, const char *content, mode_t mode) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) return 1;
+    fputs(content, fp);
+    fclose(fp);
+    return chmod(path, mode);
+}
+
+TEST_GROUP(ShifterPackTestGroup) {
+    char tmpDir[PATH_MAX];
+    char src[PATH_MAX];
+    char cache[PATH_MAX];
+    char mksquashfs[PATH_MAX];
+
+    void setup() {
+        snprintf(tmpDir, PATH_MAX, "/tmp/shifter_pack.XXXXXX");
+        CHECK(mkdtemp(tmpDir) != NULL);
+        CHECK(snprintf(src, PATH_MAX, "%s/src", tmpDir) < PATH_MAX);
+        CHECK(snprintf(cache, PATH_MAX, "%s/cache", tmpDir) < PATH_MAX);
+        CHECK(snprintf(mksquashfs, PATH_MAX, "%s/mksquashfs", tmpDir)
+                < PATH_MAX);
+        CHECK(mkdir(src, 0755) == 0);
+        CHECK(mkdir(cache, 0700) == 0);
+
+        /* stands in for mksquashfs: records the source and refuses to
+         * append to an existing image */
+        CHECK(writeFile(mksquashfs, "#!/bin/sh\n"
+                    "[ \"$3\" = \"-noappend\" ] || exit 1\n"
+                    "[ -e \"$2\" ] && exit 1\n"
+                    "echo \"$1\" > \"$2\"\n", 0755) == 0);
+    }
+
+    void teardown() {
+        char *cmd = NULL;
+        CHECK(asprintf(&cmd, "rm -rf %s", tmpDir) > 0);
+        CHECK(system(cmd) == 0);
+        free(cmd);
+    }
+};
+
+TEST(ShifterPackTestGroup, Fingerprint) {
+    char hex[SHIFTER_HASH_HEX_SIZE + 1];
+    char again[SHIFTER_HASH_HEX_SIZE + 1];
+    char path[PATH_MAX];
+
+    CHECK(shifter_pack_fingerprint(NULL, hex) != 0);
+    CHECK(snprintf(path, PATH_MAX, "%s/missing", tmpDir) < PATH_MAX);
+    CHECK(shifter_pack_fingerprint(path, hex) != 0);
+
+    CHECK(snprintf(path, PATH_MAX, "%s/lib", src) < PATH_MAX);
+    CHECK(mkdir(path, 0755) == 0);
+    CHECK(snprintf(path, PATH_MAX, "%s/lib/mod.py", src) < PATH_MAX);
+    CHECK(writeFile(path, "import os\n", 0644) == 0);
+    CHECK(snprintf(path, PATH_MAX, "%s/link", src) < PATH_MAX);
+    CHECK(symlink("lib/mod.py", path) == 0);
+
+    CHECK(shifter_pack_fingerprint(src, hex) == 0);
+    CHECK(strlen(hex) == SHIFTER_HASH_HEX_SIZE);
+    CHECK(shifter_pack_fingerprint(src, again) == 0);
+    CHECK(strcmp(hex, again) == 0);
+
+    /* a metadata-only change gives a new fingerprint */
+    CHECK(snprintf(path, PATH_MAX, "%s/lib/mod.py", src) < PATH_MAX);
+    CHECK(chmod(path, 0640) == 0);
+    CHECK(shifter_pack_fingerprint(src, again) == 0);
+    CHECK(strcmp(hex, again) != 0);
+    memcpy(hex, again, sizeof(hex));
+
+    CHECK(snprintf(path, PATH_MAX, "%s/lib/new.py", src) < PATH_MAX);
+    CHECK(writeFile(path, "", 0644) == 0);
+    CHECK(shifter_pack_fingerprint(src, again) == 0);
+    CHECK(strcmp(hex, again) != 0);
+}
+
+TEST(ShifterPackTestGroup, ImagePath) {
+    char *a = shifter_pack_imagePath(cache, "/global/common/env", 1000, "f1");
+    char *b = shifter_pack_imagePath(cache, "/global/common/env", 1001, "f1");
+    char *c = shifter_pack_imagePath(cache, "/global/common/env", 1000, "f2");
+    char *d = shifter_pack_imagePath(cache, "/global/common/env", 1000, "f1");
+
+    CHECK(shifter_pack_imagePath(NULL, "/a", 0, "f1") == NULL);
+    CHECK(a != NULL && b != NULL && c != NULL && d != NULL);
+    CHECK(strncmp(a, cache, strlen(cache)) == 0);
+    CHECK(strlen(a) == strlen(cache) + 1 + SHIFTER_HASH_HEX_SIZE +
+            strlen(SHIFTER_PACK_SUFFIX));
+    CHECK(strcmp(a, b) != 0);
+    CHECK(strcmp(a, c) != 0);
+    CHECK(strcmp(a, d) == 0);
+    free(a);
+    free(b);
+    free(c);
+    free(d);
+}
+
+TEST(ShifterPackTestGroup, Build) {
+    char image[PATH_MAX];
+    char lock[PATH_MAX];
+    char line[PATH_MAX];
+    struct stat statData;
+    struct utimbuf times;
+    FILE *fp = NULL;
+
+    CHECK(snprintf(image, PATH_MAX, "%s/img.squashfs", cache) < PATH_MAX);
+    CHECK(snprintf(lock, PATH_MAX, "%s.lock", image) < PATH_MAX);
+
+    CHECK(shifter_pack_build(NULL, src, image, 5) == -1);
+    CHECK(shifter_pack_build("/nonexistent/mksquashfs", src, image, 5) == -1);
+    CHECK(stat(image, &statData) != 0);
+    CHECK(stat(lock, &statData) != 0);
+
+    CHECK(shifter_pack_build(mksquashfs, src, image, 5) == 1);
+    CHECK(stat(image, &statData) == 0);
+    CHECK((statData.st_mode & 0777) == 0600);
+    CHECK(stat(lock, &statData) != 0);
+    fp = fopen(image, "r");
+    CHECK(fp != NULL);
+    CHECK(fgets(line, PATH_MAX, fp) != NULL);
+    fclose(fp);
+    CHECK(strncmp(line, src, strlen(src)) == 0);
+
+    /* an existing image is reused */
+    CHECK(shifter_pack_build(mksquashfs, src, image, 5) == 0);
+
+    /* an abandoned build is taken over */
+    CHECK(unlink(image) == 0);
+    CHECK(writeFile(lock, "", 0600) == 0);
+    times.actime = time(NULL) - 60;
+    times.modtime = time(NULL) - 60;
+    CHECK(utime(lock, &times) == 0);
+    CHECK(shifter_pack_build(mksquashfs, src, image, 30) == 1);
+    CHECK(stat(lock, &statData) != 0);
+
+    /* a build in progress elsewhere is waited for */
+    CHECK(writeFile(lock, "", 0600) == 0);
+    CHECK(shifter_pack_build(mksquashfs, src, image, 30) == 0);
+    CHECK(unlink(image) == 0);
+    CHECK(shifter_pack_build(mksquashfs, src, image, 1) == 1);
+}
+
+int main(int argc, char** argv) {
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
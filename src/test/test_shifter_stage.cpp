@@ -0,0 +1,180 @@
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+## through Lawrence Berkeley National Laboratory (subject to receipt of any
+## required approvals from the U.S. Dept. of Energy).  All rights reserved.
+##
+## Redistribution and use in source and binary forms, with or without
+## modification, are permitted provided that the following conditions are met:
+##  1. Redistributions of source code must retain the above copyright notice,
+##     this list of conditions and the following disclaimer.
+##  2. Redistributions in binary form must reproduce the above copyright notice,
+##     this list of conditions and the following disclaimer in the documentation
+##     and/or other materials provided with the distribution.
+##  3. Neither the name of the University of California, Lawrence Berkeley
+##     National Laboratory, U.S. Dept. of Energy nor the names of its
+##     contributors may be used to endorse or promote products derived from this
+##     software without specific prior written permission.
+##
+## See LICENSE for full text.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "shifter_stage.h"
+#include <CppUTest/CommandLineTestRunner.h>
+
+static int writeFile(const char *path, size_t size, mode_t mode) {
+    FILE *fp = fopen(path, "w");
+    size_t idx = 0;
+    if (fp == NULL) return 1;
+    for (idx = 0; idx < size; idx++) {
+        fputc('a' + idx % 26, fp);
+    }
+    fclose(fp);
+    return chmod(path, mode);
+}
+
+static int sameContent(const char *a, const char *b) {
+    char *cmd = NULL;
+    int ret = 0;
+    if (asprintf(&cmd, "cmp -s %s %s", a, b) < 0) return 0;
+    ret = system(cmd) == 0;
+    free(cmd);
+    return ret;
+}
+
+TEST_GROUP(ShifterStageTestGroup) {
+    char tmpDir[PATH_MAX];
+    char src[PATH_MAX];
+    char dst[PATH_MAX];
+
+    void setup() {
+        snprintf(tmpDir, PATH_MAX, "/tmp/shifter_stage.XXXXXX");
+        CHECK(mkdtemp(tmpDir) != NULL);
+        CHECK(snprintf(src, PATH_MAX, "%s/src", tmpDir) < PATH_MAX);
+        CHECK(snprintf(dst, PATH_MAX, "%s/dst", tmpDir) < PATH_MAX);
+        CHECK(mkdir(src, 0755) == 0);
+        CHECK(mkdir(dst, 0755) == 0);
+    }
+
+    void teardown() {
+        char *cmd = NULL;
+        CHECK(asprintf(&cmd, "rm -rf %s", tmpDir) > 0);
+        CHECK(system(cmd) == 0);
+        free(cmd);
+    }
+};
+
+TEST(ShifterStageTestGroup, TreeSize) {
+    char path[PATH_MAX];
+
+    CHECK(shifter_stage_treeSize(NULL) == -1);
+    CHECK(shifter_stage_treeSize(dst) == 0);
+
+    CHECK(snprintf(path, PATH_MAX, "%s/a", src) < PATH_MAX);
+    CHECK(writeFile(path, 100, 0644) == 0);
+    CHECK(snprintf(path, PATH_MAX, "%s/sub", src) < PATH_MAX);
+    CHECK(mkdir(path, 0755) == 0);
+    CHECK(snprintf(path, PATH_MAX, "%s/sub/b", src) < PATH_MAX);
+    CHECK(writeFile(path, 23, 0644) == 0);
+
+    /* links are not followed */
+    CHECK(snprintf(path, PATH_MAX, "%s/link", src) < PATH_MAX);
+    CHECK(symlink("/etc", path) == 0);
+
+    CHECK(shifter_stage_treeSize(src) == 123);
+    CHECK(snprintf(path, PATH_MAX, "%s/missing", src) < PATH_MAX);
+    CHECK(shifter_stage_treeSize(path) == -1);
+}
+
+TEST(ShifterStageTestGroup, CopyTree) {
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    char target[PATH_MAX];
+    ShifterStageStats stats;
+    struct stat statData;
+    size_t idx = 0;
+    ssize_t len = 0;
+
+    CHECK(snprintf(from, PATH_MAX, "%s/d1", src) < PATH_MAX);
+    CHECK(mkdir(from, 0750) == 0);
+    CHECK(snprintf(from, PATH_MAX, "%s/d1/d2", src) < PATH_MAX);
+    CHECK(mkdir(from, 0755) == 0);
+    for (idx = 0; idx < 20; idx++) {
+        CHECK(snprintf(from, PATH_MAX, "%s/%s/f%lu", src,
+                idx % 2 ? "d1" : "d1/d2", (unsigned long) idx) < PATH_MAX);
+        CHECK(writeFile(from, idx * (SHIFTER_STAGE_BUFFER_SIZE / 7), 0640) == 0);
+    }
+    CHECK(snprintf(from, PATH_MAX, "%s/exec", src) < PATH_MAX);
+    CHECK(writeFile(from, 10, 0755) == 0);
+    CHECK(snprintf(from, PATH_MAX, "%s/d1/link", src) < PATH_MAX);
+    CHECK(symlink("d2/f0", from) == 0);
+
+    CHECK(shifter_stage_copyTree("test", NULL, dst, 4, &stats) == -1);
+    CHECK(shifter_stage_copyTree("test", src, dst, 4, &stats) == 0);
+    CHECK(stats.files == 21);
+    CHECK(stats.dirs == 2);
+    CHECK(stats.links == 1);
+    CHECK(stats.errors == 0);
+    CHECK((ssize_t) stats.bytes == shifter_stage_treeSize(src));
+
+    for (idx = 0; idx < 20; idx++) {
+        CHECK(snprintf(from, PATH_MAX, "%s/%s/f%lu", src,
+                idx % 2 ? "d1" : "d1/d2", (unsigned long) idx) < PATH_MAX);
+        CHECK(snprintf(to, PATH_MAX, "%s/%s/f%lu", dst,
+                idx % 2 ? "d1" : "d1/d2", (unsigned long) idx) < PATH_MAX);
+        CHECK(sameContent(from, to));
+    }
+    CHECK(snprintf(to, PATH_MAX, "%s/exec", dst) < PATH_MAX);
+    CHECK(stat(to, &statData) == 0);
+    CHECK((statData.st_mode & 0777) == 0755);
+    CHECK(snprintf(to, PATH_MAX, "%s/d1", dst) < PATH_MAX);
+    CHECK(stat(to, &statData) == 0);
+    CHECK((statData.st_mode & 0777) == 0750);
+    CHECK(snprintf(to, PATH_MAX, "%s/d1/link", dst) < PATH_MAX);
+    len = readlink(to, target, PATH_MAX - 1);
+    CHECK(len == 5);
+    target[len] = 0;
+    CHECK(strcmp(target, "d2/f0") == 0);
+
+    /* copying again over the existing tree works, with a single worker */
+    CHECK(shifter_stage_copyTree("test", src, dst, 1, &stats) == 0);
+    CHECK(stats.files == 21);
+}
+
+TEST(ShifterStageTestGroup, CopyTreeErrors) {
+    char path[PATH_MAX];
+    ShifterStageStats stats;
+
+    CHECK(snprintf(path, PATH_MAX, "%s/good", src) < PATH_MAX);
+    CHECK(writeFile(path, 10, 0644) == 0);
+    CHECK(snprintf(path, PATH_MAX, "%s/fifo", src) < PATH_MAX);
+    CHECK(mkfifo(path, 0644) == 0);
+
+    /* a file in the way of a directory fails only that subtree */
+    CHECK(snprintf(path, PATH_MAX, "%s/sub", src) < PATH_MAX);
+    CHECK(mkdir(path, 0755) == 0);
+    CHECK(snprintf(path, PATH_MAX, "%s/sub/inner", src) < PATH_MAX);
+    CHECK(writeFile(path, 10, 0644) == 0);
+    CHECK(snprintf(path, PATH_MAX, "%s/sub", dst) < PATH_MAX);
+    CHECK(writeFile(path, 1, 0644) == 0);
+
+    CHECK(shifter_stage_copyTree("test", src, dst, 8, &stats) == 3);
+    CHECK(stats.files == 1);
+    CHECK(stats.errors == 3);
+    CHECK(snprintf(path, PATH_MAX, "%s/good", dst) < PATH_MAX);
+    CHECK(access(path, F_OK) == 0);
+    CHECK(snprintf(path, PATH_MAX, "%s/fifo", dst) < PATH_MAX);
+    CHECK(access(path, F_OK) != 0);
+}
+
+int main(int argc, char** argv) {
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
@@ -0,0 +1,132 @@
+/* Shifter, Copyright (c) 2018, The Regents of the University of California,
+## through Lawrence Berkeley National Laboratory (subject to receipt of any
+## required approvals from the U.S. Dept. of Energy).  All rights reserved.
+##
+## Redistribution and use in source and binary forms, with or without
+## modification, are permitted provided that the following conditions are met:
+##  1. Redistributions of source code must retain the above copyright notice,
+##     this list of conditions and the following disclaimer.
+##  2. Redistributions in binary form must reproduce the above copyright notice,
+##     this list of conditions and the following disclaimer in the documentation
+##     and/or other materials provided with the distribution.
+##  3. Neither the name of the University of California, Lawrence Berkeley
+##     National Laboratory, U.S. Dept. of Energy nor the names of its
+##     contributors may be used to endorse or promote products derived from this
+##     software without specific prior written permission.
+##
+## See LICENSE for full text.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "shifter_trace.h"
+#include <CppUTest/CommandLineTestRunner.h>
+
+TEST_GROUP(ShifterTraceTestGroup) {
+    char tmpDir[PATH_MAX];
+
+    void setup() {
+        snprintf(tmpDir, PATH_MAX, "/tmp/shifter_trace.XXXXXX");
+        CHECK(mkdtemp(tmpDir) != NULL);
+    }
+
+    void teardown() {
+        DIR *dir = opendir(tmpDir);
+        struct dirent *entry = NULL;
+        char path[PATH_MAX];
+        while (dir != NULL && (entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            CHECK(snprintf(path, PATH_MAX, "%s/%s", tmpDir, entry->d_name)
+                    < PATH_MAX);
+            unlink(path);
+        }
+        if (dir != NULL) closedir(dir);
+        rmdir(tmpDir);
+    }
+
+    char *readTrace() {
+        DIR *dir = opendir(tmpDir);
+        struct dirent *entry = NULL;
+        char path[PATH_MAX];
+        char *data = NULL;
+        size_t len = 0;
+        FILE *fp = NULL;
+
+        path[0] = 0;
+        while (dir != NULL && (entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            CHECK(snprintf(path, PATH_MAX, "%s/%s", tmpDir, entry->d_name)
+                    < PATH_MAX);
+        }
+        if (dir != NULL) closedir(dir);
+        if (path[0] == 0) return NULL;
+
+        fp = fopen(path, "r");
+        if (fp == NULL) return NULL;
+        data = (char *) malloc(65536);
+        len = fread(data, 1, 65535, fp);
+        data[len] = 0;
+        fclose(fp);
+        return data;
+    }
+};
+
+TEST(ShifterTraceTestGroup, DisabledIsNoop) {
+    uint64_t start = SHIFTER_TRACE_START();
+    CHECK(shifter_trace_enabled == 0);
+    CHECK(start == 0);
+
+    /* none of these may crash or create output when disabled */
+    shifter_trace_event("phase", "test", NULL, start);
+    shifter_trace_counter("count", 1);
+    shifter_trace_close();
+    CHECK(readTrace() == NULL);
+}
+
+TEST(ShifterTraceTestGroup, RejectRelativeDir) {
+    CHECK(shifter_trace_open("test", "relative/dir", NULL) != 0);
+    CHECK(shifter_trace_open("test", NULL, NULL) != 0);
+    CHECK(shifter_trace_enabled == 0);
+}
+
+TEST(ShifterTraceTestGroup, WriteTrace) {
+    uint64_t start = 0;
+    char *data = NULL;
+
+    CHECK(shifter_trace_open("test", tmpDir, "1234/../5") == 0);
+    CHECK(shifter_trace_enabled == 1);
+
+    start = SHIFTER_TRACE_START();
+    CHECK(start > 0);
+    shifter_trace_event("phase", "parseConfig", "with \"quotes\"", start);
+    shifter_trace_event("mount", "mount", "/var/udiMount", start);
+    shifter_trace_counter("destructUDI_attempts", 3);
+    shifter_trace_close();
+    CHECK(shifter_trace_enabled == 0);
+
+    data = readTrace();
+    CHECK(data != NULL);
+    CHECK(strstr(data, "\"traceEvents\"") != NULL);
+    CHECK(strstr(data, "\"name\": \"parseConfig\"") != NULL);
+    CHECK(strstr(data, "\"detail\": \"with \\\"quotes\\\"\"") != NULL);
+    CHECK(strstr(data, "\"cat\": \"mount\"") != NULL);
+    CHECK(strstr(data, "\"ph\": \"C\"") != NULL);
+    CHECK(strstr(data, "\"value\": 3") != NULL);
+    free(data);
+
+    /* closing twice must be harmless */
+    shifter_trace_close();
+}
+
+int main(int argc, char** argv) {
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
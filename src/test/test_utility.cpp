@@ -350,6 +350,15 @@ TEST(UtilityTestGroup, userInputPathFilter_basic) {
     free(filtered);
 }
 
+TEST(UtilityTestGroup, userInputPathFilterInPlace_basic) {
+    char buffer[] = "/path/to; rm -rf *:/target";
+    char *filtered = userInputPathFilterInPlace(buffer, 1);
+    CHECK(filtered == buffer);
+    CHECK(strcmp(filtered, "/path/torm-rf:/target") == 0);
+
+    CHECK(userInputPathFilterInPlace(NULL, 1) == NULL);
+}
+
 TEST(UtilityTestGroup, allocStrgenf_basic) {
     char *myString = alloc_strgenf("This is a test: %d\n", 37*73);
     CHECK(myString != NULL)
@@ -48,26 +48,120 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "UdiRootConfig.h"
 #include "shifter_core.h"
+#include "shifter_mem.h"
+#include "shifter_trace.h"
+#include "JobMetrics.h"
 
 #include "config.h"
 
-int main(void) {
+static pid_t metricsPid = 0;
+
+static void _reportMetrics(void) {
+    if (getpid() != metricsPid) return;
+    printf("%s retries=%lu\n", JOBMETRICS_REPORT_TAG,
+            (unsigned long) shifter_getRetryCount());
+}
+
+int main(int argc, char **argv) {
     UdiRootConfig udiConfig;
+    uint64_t traceStart = shifter_trace_now();
+    int traceRequested = shifter_trace_requested();
+    char *jobIdentifier = NULL;
+    char *instance = NULL;
+    int force = 0;
+    int idleOnly = 0;
+    int rc = 0;
+    int opt = 0;
 
     memset(&udiConfig, 0, sizeof(UdiRootConfig));
 
+    if (getenv("SLURM_JOB_ID") != NULL) {
+        jobIdentifier = _strdup(getenv("SLURM_JOB_ID"));
+    }
     clearenv();
     setenv("PATH", "/usr/bin:/usr/sbin:/bin:/sbin", 1);
 
+    /* -M: report retry counts on stdout for the job epilog
+     * -j: tear down the UDI instance of this job (perJobUdi)
+     * -f: tear down even if udiKeepWarmTimeout would keep the UDI
+     * -i: only tear down a kept UDI that has been idle too long */
+    while ((opt = getopt(argc, argv, "Mj:fi")) != -1) {
+        switch (opt) {
+            case 'M':
+                metricsPid = getpid();
+                atexit(_reportMetrics);
+                break;
+            case 'j':
+                instance = _strdup(optarg);
+                break;
+            case 'f':
+                force = 1;
+                break;
+            case 'i':
+                idleOnly = 1;
+                break;
+            default:
+                break;
+        }
+    }
+
     if (parse_UdiRootConfig(CONFIG_FILE, &udiConfig, UDIROOT_VAL_ALL) != 0) {
         fprintf(stderr, "FAILED to parse udiRoot configuration. Exiting.\n");
         exit(1);
     }
+    if ((traceRequested || udiConfig.traceAlways) && udiConfig.traceDir != NULL) {
+        shifter_trace_open("unsetupRoot", udiConfig.traceDir, jobIdentifier);
+    }
+    if (jobIdentifier != NULL) {
+        free(jobIdentifier);
+        jobIdentifier = NULL;
+    }
+    shifter_trace_event("phase", "parseConfig", NULL, traceStart);
 
-    destructUDI(&udiConfig, 1);
+    rc = selectUdiInstance(&udiConfig, instance, 0);
+    if (rc == 2) {
+        /* never set up, or already torn down: the node-wide UDI is not ours */
+        fprintf(stderr, "No UDI instance for job %s, nothing to do.\n",
+                instance);
+        free(instance);
+        return 0;
+    } else if (rc != 0) {
+        fprintf(stderr, "FAILED to find UDI instance for job %s. Exiting.\n",
+                instance);
+        exit(1);
+    }
+    if (instance != NULL) {
+        free(instance);
+        instance = NULL;
+    }
+
+    traceStart = SHIFTER_TRACE_START();
+    if (idleOnly) {
+        expireParkedUDI(&udiConfig);
+        shifter_trace_event("phase", "expireParkedUDI", NULL, traceStart);
+        return 0;
+    }
+    if (startVolumeStageOut(&udiConfig) != 0) {
+        fprintf(stderr, "FAILED to start stageout of all per-node caches\n");
+    }
+    shifter_trace_event("phase", "startVolumeStageOut", NULL, traceStart);
+
+    traceStart = SHIFTER_TRACE_START();
+    if (!force && udiConfig.udiKeepWarmTimeout > 0 &&
+            udiConfig.jobIdentifier == NULL && parkUDI(&udiConfig) == 0)
+    {
+        shifter_trace_event("phase", "parkUDI", NULL, traceStart);
+        return 0;
+    }
+    if (destructUDI(&udiConfig, 1) == 0) {
+        removeUdiInstance(&udiConfig);
+    }
+    shifter_trace_event("phase", "destructUDI", NULL, traceStart);
 
     return 0;
 }
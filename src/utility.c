@@ -383,29 +383,35 @@ char *alloc_strgenf(const char *format, ...) {
  * Returns NULL if input is NULL or there is a memory allocation error
  */
 char *userInputPathFilter(const char *input, int allowSlash) {
-    ssize_t len = 0;
     char *ret = NULL;
-    const char *rptr = NULL;
-    char *wptr = NULL;
     if (input == NULL) return NULL;
 
-    len = strlen(input) + 1;
-    ret = _malloc(sizeof(char) * len);
+    ret = _strdup(input);
     if (ret == NULL) return NULL;
+    return userInputPathFilterInPlace(ret, allowSlash);
+}
 
-    rptr = input;
-    wptr = ret;
-    while (wptr - ret < len && *rptr != 0) {
+/**
+ * userInputPathFilterInPlace applies the same screening as
+ * userInputPathFilter but overwrites the input string, avoiding an allocation
+ * when the caller already owns a scratch copy.
+ *
+ * Returns input, or NULL if input is NULL
+ */
+char *userInputPathFilterInPlace(char *input, int allowSlash) {
+    const char *rptr = NULL;
+    char *wptr = NULL;
+    if (input == NULL) return NULL;
+
+    for (rptr = input, wptr = input; *rptr != 0; rptr++) {
         if (isalnum(*rptr) || *rptr == '_' || *rptr == ':' || *rptr == '.' || *rptr == '+' || *rptr == '-') {
             *wptr++ = *rptr;
-        }
-        if (allowSlash && *rptr == '/') {
+        } else if (allowSlash && *rptr == '/') {
             *wptr++ = *rptr;
         }
-        rptr++;
     }
     *wptr = 0;
-    return ret;
+    return input;
 }
 
 char *cleanPath(const char *path) {
@@ -63,6 +63,7 @@ char *alloc_strcatf(char *string, size_t *currLen, size_t *capacity, const char
 int pathcmp(const char *a, const char *b);
 char *cleanPath(const char *path);
 char *userInputPathFilter(const char *input, int allowSlash);
+char *userInputPathFilterInPlace(char *input, int allowSlash);
 int is_json_array(const char *value);
 char **split_json_array(const char *value);
 size_t _count_args(char **args);
@@ -32,11 +32,15 @@ See LICENSE for full text.
 #include <limits.h>
 #include <pwd.h>
 #include <grp.h>
+#include <time.h>
 
 #include "UdiRootConfig.h"
 #include "shifter_core.h"
 #include "shifter_mem.h"
 #include "utility.h"
+#include "MountList.h"
+#include "JobMetrics.h"
+#include "shifter_trace.h"
 
 #include "shifterSpank.h"
 #include "wrapper.h"
@@ -124,6 +128,24 @@ shifterSpank_config *shifterSpank_init(
         } else if (strncasecmp("enable_sshd=", argv[idx], 12) == 0) {
             char *ptr = argv[idx] + 12;
             ssconfig->sshdEnabled = (int) strtol(ptr, NULL, 10);
+        } else if (strncasecmp("metrics_file=", argv[idx], 13) == 0) {
+            char *ptr = argv[idx] + 13;
+            snprintf(buffer, PATH_MAX, "%s", ptr);
+            ptr = shifter_trim(buffer);
+            ssconfig->metrics_file = _strdup(ptr);
+        } else if (strncasecmp("metrics_statsd=", argv[idx], 15) == 0) {
+            char *ptr = argv[idx] + 15;
+            snprintf(buffer, PATH_MAX, "%s", ptr);
+            ptr = shifter_trim(buffer);
+            ssconfig->metrics_statsd = _strdup(ptr);
+        } else if (strncasecmp("metrics_histogram=", argv[idx], 18) == 0) {
+            char *ptr = argv[idx] + 18;
+            snprintf(buffer, PATH_MAX, "%s", ptr);
+            ptr = shifter_trim(buffer);
+            ssconfig->metrics_histogram = _strdup(ptr);
+        } else if (strncasecmp("metrics_comment=", argv[idx], 16) == 0) {
+            char *ptr = argv[idx] + 16;
+            ssconfig->metrics_comment = (int) strtol(ptr, NULL, 10);
         }
     }
 
@@ -195,6 +217,18 @@ void shifterSpank_config_free(shifterSpank_config *ssconfig) {
         free(ssconfig->extern_setup);
         ssconfig->extern_setup = NULL;
     }
+    if (ssconfig->metrics_file != NULL) {
+        free(ssconfig->metrics_file);
+        ssconfig->metrics_file = NULL;
+    }
+    if (ssconfig->metrics_statsd != NULL) {
+        free(ssconfig->metrics_statsd);
+        ssconfig->metrics_statsd = NULL;
+    }
+    if (ssconfig->metrics_histogram != NULL) {
+        free(ssconfig->metrics_histogram);
+        ssconfig->metrics_histogram = NULL;
+    }
     memset(ssconfig, 0, sizeof(shifterSpank_config));
     free(ssconfig);
 }
@@ -251,7 +285,9 @@ int shifterSpank_process_option_volume(
         VolumeMap *vmap = (VolumeMap *) _malloc(sizeof(VolumeMap));
         memset(vmap, 0, sizeof(VolumeMap));
 
-        if (parseVolumeMap(optarg, vmap) != 0) {
+        if (parseVolumeMap(optarg, vmap) != 0 ||
+                validateVolumeMap_targets(vmap) != 0)
+        {
             _log(LOG_ERROR, "Failed to parse or invalid/disallowed volume map request: %s\n", optarg);
             free_VolumeMap(vmap, 1);
             exit(1);
@@ -288,7 +324,11 @@ int shifterSpank_process_option_module(
     return ERROR;
 }
 
-int forkAndExecvLogToSlurm(const char *appname, char **args) {
+/* run args, relaying its output to the slurm log; if metrics is not NULL,
+ * JOBMETRICS_REPORT_TAG lines are folded into it instead of logged */
+static int _forkAndExecvLogToSlurm(const char *appname, char **args,
+        JobMetrics *metrics)
+{
     int rc = 0;
     pid_t pid = 0;
 
@@ -326,9 +366,13 @@ int forkAndExecvLogToSlurm(const char *appname, char **args) {
         stdoutStream = fdopen(stdoutPipe[0], "r");
         stderrStream = fdopen(stderrPipe[0], "r");
 
-        for ( ; stdoutStream && stderrStream ; ) {
+        for ( ; stdoutStream || stderrStream ; ) {
             if (stdoutStream) {
                 ssize_t nBytes = getline(&lineBuffer, &lineBuffer_sz, stdoutStream);
+                if (nBytes > 0 && metrics != NULL &&
+                        parse_JobMetrics_report(lineBuffer, metrics) == 0) {
+                    continue;
+                }
                 if (nBytes > 0) {
                     _log(LOG_ERROR, "%s stdout: %s", appname, lineBuffer);
                 } else {
@@ -379,6 +423,113 @@ endf:
     return rc;
 }
 
+int forkAndExecvLogToSlurm(const char *appname, char **args) {
+    return _forkAndExecvLogToSlurm(appname, args, NULL);
+}
+
+static int _metricsEnabled(shifterSpank_config *ssconfig) {
+    return ssconfig->metrics_file != NULL || ssconfig->metrics_statsd != NULL
+        || ssconfig->metrics_histogram != NULL || ssconfig->metrics_comment;
+}
+
+/* count mounts at or below the udiMount point */
+static size_t _countUdiMounts(const char *udiMountPoint) {
+    MountList mounts;
+    char **ptr = NULL;
+    size_t len = strlen(udiMountPoint);
+    size_t count = 0;
+
+    memset(&mounts, 0, sizeof(MountList));
+    if (parse_MountList(&mounts) != 0) {
+        return 0;
+    }
+    for (ptr = mounts.mountPointList; ptr && *ptr; ptr++) {
+        if (strncmp(*ptr, udiMountPoint, len) == 0 &&
+                ((*ptr)[len] == '/' || (*ptr)[len] == 0)) {
+            count++;
+        }
+    }
+    free_MountList(&mounts, 0);
+    return count;
+}
+
+#define NO_JOB_UDI 2
+
+/** _selectJobUdi
+ *  with perJobUdi, point udiConfig at this job's UDI instance, creating it
+ *  if create is set (the prolog).  Returns SUCCESS, ERROR, or NO_JOB_UDI if
+ *  create is 0 and no instance was set up for the job; udiConfig is then
+ *  left pointing at the node-wide UDI.
+ */
+static int _selectJobUdi(shifterSpank_config *ssconfig, int create) {
+    uint32_t jobid = 0;
+    char jobstr[32];
+    int ret = 0;
+
+    if (!ssconfig->udiConfig->perJobUdi) {
+        return SUCCESS;
+    }
+    if (wrap_spank_get_jobid(ssconfig, &jobid) == ERROR) {
+        return ERROR;
+    }
+    snprintf(jobstr, sizeof(jobstr), "%u", jobid);
+    ret = selectUdiInstance(ssconfig->udiConfig, jobstr, create);
+    if (ret == 2) {
+        return NO_JOB_UDI;
+    } else if (ret != 0) {
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+/** emitJobMetrics
+ *  fill in the common fields of a prolog/epilog metrics record and send it to
+ *  every configured sink.  Sink failures are logged but never fail the job.
+ */
+static void emitJobMetrics(shifterSpank_config *ssconfig, JobMetrics *metrics,
+        uint64_t start, int postComment)
+{
+    char hostname[256];
+
+    metrics->duration_ms = (shifter_trace_now() - start) / 1000;
+    if (gethostname(hostname, sizeof(hostname)) != 0) {
+        snprintf(hostname, sizeof(hostname), "unknown");
+    }
+    hostname[sizeof(hostname) - 1] = 0;
+    metrics->hostname = _strdup(hostname);
+    if (ssconfig->imageType != NULL) {
+        metrics->imageType = _strdup(ssconfig->imageType);
+    }
+    if (ssconfig->image != NULL) {
+        metrics->imageIdentifier = _strdup(ssconfig->image);
+    }
+
+    if (ssconfig->metrics_file != NULL &&
+            write_JobMetrics_jsonl(metrics, ssconfig->metrics_file) != 0) {
+        _log(LOG_ERROR, "FAILED to write job metrics to %s",
+                ssconfig->metrics_file);
+    }
+    if (ssconfig->metrics_statsd != NULL &&
+            send_JobMetrics_statsd(metrics, ssconfig->metrics_statsd,
+                NULL) != 0) {
+        _log(LOG_DEBUG, "FAILED to send job metrics to %s",
+                ssconfig->metrics_statsd);
+    }
+    if (ssconfig->metrics_histogram != NULL &&
+            update_MetricsHistogram(ssconfig->metrics_histogram,
+                metrics) != 0) {
+        _log(LOG_ERROR, "FAILED to update metrics histogram %s",
+                ssconfig->metrics_histogram);
+    }
+    if (ssconfig->metrics_comment && postComment) {
+        char *comment = format_JobMetrics_comment(metrics);
+        if (comment != NULL) {
+            wrap_spank_append_job_comment(ssconfig, metrics->jobid, comment);
+            free(comment);
+        }
+    }
+}
+
 
 /** generateSshKey
  *  checks to see if a udiRoot-specific ssh key exists and creates one if
@@ -499,6 +650,10 @@ int doExternStepTaskSetup(shifterSpank_config *ssconfig) {
     char buffer[PATH_MAX];
 
     if (ssconfig == NULL || ssconfig->udiConfig == NULL) return ERROR;
+    if (_selectJobUdi(ssconfig, 0) != SUCCESS) {
+        _log(LOG_ERROR, "Couldn't select UDI instance for job");
+        return ERROR;
+    }
 
     /* check and see if there is an existing configuration */
     memset(&statData, 0, sizeof(struct stat));
@@ -867,7 +1022,7 @@ int shifterSpank_job_prolog(shifterSpank_config *ssconfig) {
 
     char *ptr = NULL;
     size_t idx = 0;
-    uint32_t job;
+    uint32_t job = 0;
     uid_t uid = 0;
     gid_t gid = 0;
     uint16_t shared = 0;
@@ -885,6 +1040,14 @@ int shifterSpank_job_prolog(shifterSpank_config *ssconfig) {
     char *sshPubKey = NULL;
     size_t tasksPerNode = 0;
     pid_t pid = 0;
+    JobMetrics metrics;
+    uint64_t metricsStart = shifter_trace_now();
+    uint64_t helperStart = 0;
+    int helperRan = 0;
+    int status = 0;
+
+    memset(&metrics, 0, sizeof(JobMetrics));
+    metrics.timestamp = (uint64_t) time(NULL);
 
 #define PROLOG_ERROR(message, errCode) \
     _log(LOG_ERROR, "%s", message); \
@@ -981,11 +1144,15 @@ int shifterSpank_job_prolog(shifterSpank_config *ssconfig) {
     }
     _log(LOG_DEBUG, "shifter prolog, id after looking at env: %s:%s", ssconfig->imageType, ssconfig->image);
 
+    if (_selectJobUdi(ssconfig, 1) != SUCCESS) {
+        PROLOG_ERROR("FAILED to setup UDI instance for job", ERROR);
+    }
+
     /* check and see if there is an existing configuration */
     struct stat statData;
     memset(&statData, 0, sizeof(struct stat));
     snprintf(buffer, PATH_MAX, "%s/var/shifterConfig.json", ssconfig->udiConfig->udiMountPoint);
-    if (stat(buffer, &statData) == 0) {
+    if (stat(buffer, &statData) == 0 && !isUdiParked(ssconfig->udiConfig)) {
         /* oops, already something there -- do not run setupRoot
          * this is probably going to be an issue for the job, however the 
          * shifter executable can be relied upon to detect the mismatch and
@@ -1002,8 +1169,9 @@ int shifterSpank_job_prolog(shifterSpank_config *ssconfig) {
         PROLOG_ERROR("FAILED to get job information.", ERROR);
     }
 
-    /* this prolog should not be used for shared-node jobs */
-    if (shared != 0) {
+    /* this prolog should not be used for shared-node jobs, unless each job
+     * gets its own UDI instance */
+    if (shared != 0 && ssconfig->udiConfig->jobIdentifier == NULL) {
         _log(LOG_DEBUG, "shifter prolog: job is shared, moving on");
         goto _prolog_exit_unclean;
     }
@@ -1080,7 +1248,9 @@ int shifterSpank_job_prolog(shifterSpank_config *ssconfig) {
         memset(vmap, 0, sizeof(VolumeMap));
 
         /* validate input */
-        if (parseVolumeMap(ssconfig->volume, vmap) != 0) {
+        if (parseVolumeMap(ssconfig->volume, vmap) != 0 ||
+                validateVolumeMap_targets(vmap) != 0)
+        {
             free_VolumeMap(vmap, 1);
             PROLOG_ERROR("Failed to parse or invalid/disallowed volume map request", ERROR);
         }
@@ -1102,6 +1272,9 @@ int shifterSpank_job_prolog(shifterSpank_config *ssconfig) {
     }
     snprintf(setupRootPath, PATH_MAX, "%s/sbin/setupRoot", ssconfig->udiConfig->udiRootPath);
     strncpy_StringArray(setupRootPath, strlen(setupRootPath), &setupRootArgs_sv, &setupRootArgs, &n_setupRootArgs, 10);
+    if (_metricsEnabled(ssconfig)) {
+        strncpy_StringArray("-M", 3, &setupRootArgs_sv, &setupRootArgs, &n_setupRootArgs, 10);
+    }
     if (uid != 0) {
         int bytes = snprintf(buffer, sizeof(buffer), "%u", uid);
         if (bytes <= 0 || bytes >= sizeof(buffer)) {
@@ -1134,6 +1307,10 @@ int shifterSpank_job_prolog(shifterSpank_config *ssconfig) {
         strncpy_StringArray("-v", 3, &setupRootArgs_sv, &setupRootArgs, &n_setupRootArgs, 10);
         strncpy_StringArray(volArgs[idx], strlen(volArgs[idx]), &setupRootArgs_sv, &setupRootArgs, &n_setupRootArgs, 10);
     }
+    if (ssconfig->udiConfig->jobIdentifier != NULL) {
+        strncpy_StringArray("-j", 3, &setupRootArgs_sv, &setupRootArgs, &n_setupRootArgs, 10);
+        strncpy_StringArray(ssconfig->udiConfig->jobIdentifier, strlen(ssconfig->udiConfig->jobIdentifier), &setupRootArgs_sv, &setupRootArgs, &n_setupRootArgs, 10);
+    }
     if (ssconfig->modules != NULL) {
         strncpy_StringArray("-m", 3, &setupRootArgs_sv, &setupRootArgs, &n_setupRootArgs, 10);
         strncpy_StringArray(ssconfig->modules, strlen(ssconfig->modules), &setupRootArgs_sv, &setupRootArgs, &n_setupRootArgs, 10);
@@ -1164,10 +1341,29 @@ int shifterSpank_job_prolog(shifterSpank_config *ssconfig) {
         free(memory_cgroup_path);
     }
 
-    int status = forkAndExecvLogToSlurm("setupRoot", setupRootArgs);
+    helperStart = shifter_trace_now();
+    status = _forkAndExecvLogToSlurm("setupRoot", setupRootArgs, &metrics);
+    metrics.helper_ms = (shifter_trace_now() - helperStart) / 1000;
+    helperRan = 1;
 
     _log(LOG_ERROR, "after setupRoot, exit code: %d", status);
 
+    if (_metricsEnabled(ssconfig)) {
+        metrics.nMounts = _countUdiMounts(ssconfig->udiConfig->udiMountPoint);
+        if (status == 0) {
+            ImageData imageData;
+            struct stat imageStat;
+            memset(&imageData, 0, sizeof(ImageData));
+            if (parse_ImageData(ssconfig->imageType, ssconfig->image, ssconfig->udiConfig, &imageData) == 0
+                    && imageData.filename != NULL
+                    && stat(imageData.filename, &imageStat) == 0
+                    && S_ISREG(imageStat.st_mode)) {
+                metrics.bytesStaged = (uint64_t) imageStat.st_size;
+            }
+            free_ImageData(&imageData, 0);
+        }
+    }
+
 
     if (status == 0) {
         snprintf(buffer, PATH_MAX, "%s/var/shifterSlurm.jobid", ssconfig->udiConfig->udiMountPoint);
@@ -1184,6 +1380,27 @@ int shifterSpank_job_prolog(shifterSpank_config *ssconfig) {
     _log(LOG_DEBUG, "shifter_prolog: sshd on pid %d\n", pid);
     
 _prolog_exit_unclean:
+    if (_metricsEnabled(ssconfig)) {
+        int firstNode = 0;
+        char hostname[256];
+        metrics.event = _strdup("prolog");
+        metrics.jobid = job;
+        metrics.uid = uid;
+        metrics.status = helperRan ? status : (rc != SUCCESS ? 1 : 0);
+        if (helperRan) {
+            metrics.outcome = _strdup(status == 0 ? "success" : "failure");
+        } else {
+            metrics.outcome = _strdup(rc != SUCCESS ? "failure" : "skipped");
+        }
+        /* only the first node of the allocation updates the job comment */
+        if (nodelist != NULL && gethostname(hostname, sizeof(hostname)) == 0) {
+            size_t len = strcspn(nodelist, "/ ");
+            hostname[sizeof(hostname) - 1] = 0;
+            firstNode = strlen(hostname) == len && strncmp(nodelist, hostname, len) == 0;
+        }
+        emitJobMetrics(ssconfig, &metrics, metricsStart, firstNode);
+        free_JobMetrics(&metrics, 0);
+    }
     if (setupRootArgs != NULL) {
         char **ptr = NULL;
         for (ptr = setupRootArgs; ptr && *ptr; ptr++) {
@@ -1206,9 +1423,18 @@ _prolog_exit_unclean:
 int shifterSpank_job_epilog(shifterSpank_config *ssconfig) {
     int rc = SUCCESS;
     char path[PATH_MAX];
-    char *epilogueArgs[2];
+    char *epilogueArgs[5];
+    size_t n_epilogueArgs = 0;
     uid_t uid = 0;
     uint32_t job = 0;
+    JobMetrics metrics;
+    uint64_t metricsStart = shifter_trace_now();
+    uint64_t helperStart = 0;
+    int helperRan = 0;
+    int status = 0;
+
+    memset(&metrics, 0, sizeof(JobMetrics));
+    metrics.timestamp = (uint64_t) time(NULL);
 
 #define EPILOG_ERROR(message, errCode) \
     _log(LOG_ERROR, "%s", message); \
@@ -1279,10 +1505,29 @@ int shifterSpank_job_epilog(shifterSpank_config *ssconfig) {
         }
     }
 
+    status = _selectJobUdi(ssconfig, 0);
+    if (status == NO_JOB_UDI) {
+        /* the node-wide UDI belongs to no job, leave it alone */
+        _log(LOG_DEBUG, "shifter_epilog: no UDI instance for job, nothing to do");
+        return rc;
+    } else if (status != SUCCESS) {
+        EPILOG_ERROR("FAILED to find UDI instance for job", ERROR);
+    }
+
     snprintf(path, PATH_MAX, "%s/sbin/unsetupRoot", ssconfig->udiConfig->udiRootPath);
-    epilogueArgs[0] = path;
-    epilogueArgs[1] = NULL;
-    int status = forkAndExecvLogToSlurm("unsetupRoot", epilogueArgs);
+    epilogueArgs[n_epilogueArgs++] = path;
+    if (_metricsEnabled(ssconfig)) {
+        epilogueArgs[n_epilogueArgs++] = "-M";
+    }
+    if (ssconfig->udiConfig->jobIdentifier != NULL) {
+        epilogueArgs[n_epilogueArgs++] = "-j";
+        epilogueArgs[n_epilogueArgs++] = ssconfig->udiConfig->jobIdentifier;
+    }
+    epilogueArgs[n_epilogueArgs] = NULL;
+    helperStart = shifter_trace_now();
+    status = _forkAndExecvLogToSlurm("unsetupRoot", epilogueArgs, &metrics);
+    metrics.helper_ms = (shifter_trace_now() - helperStart) / 1000;
+    helperRan = 1;
     if (status != 0) {
         rc = SLURM_ERROR;
     }
@@ -1290,6 +1535,17 @@ int shifterSpank_job_epilog(shifterSpank_config *ssconfig) {
     _log(LOG_DEBUG, "shifter_epilog: done with unsetupRoot");
 
 _epilog_exit_unclean:
+    if (_metricsEnabled(ssconfig)) {
+        /* any mounts left behind after teardown are counted */
+        metrics.nMounts = _countUdiMounts(ssconfig->udiConfig->udiMountPoint);
+        metrics.event = _strdup("epilog");
+        metrics.jobid = job;
+        metrics.uid = uid;
+        metrics.status = helperRan ? status : 1;
+        metrics.outcome = _strdup(helperRan && status == 0 ? "success" : "failure");
+        emitJobMetrics(ssconfig, &metrics, metricsStart, 0);
+        free_JobMetrics(&metrics, 0);
+    }
     return rc;
 }
 
@@ -1304,6 +1560,7 @@ int shifterSpank_task_init_privileged(shifterSpank_config *ssconfig) {
     int n_existing_suppl_gids = 0;
     gid_t existing_gid = getegid();
     uint32_t stepid = 0;
+    int selected = SUCCESS;
 
     memset(&imageData, 0, sizeof(ImageData));
     if (wrap_spank_get_stepid(ssconfig, &stepid) == ERROR) {
@@ -1318,6 +1575,10 @@ int shifterSpank_task_init_privileged(shifterSpank_config *ssconfig) {
     if (ssconfig->udiConfig == NULL) {
         TASKINITPRIV_ERROR("Failed to load udiRoot config!", ERROR);
     }
+    selected = _selectJobUdi(ssconfig, 0);
+    if (selected == ERROR) {
+        TASKINITPRIV_ERROR("FAILED to select UDI instance for job", ERROR);
+    }
 
     if (ssconfig->image == NULL || strlen(ssconfig->image) == 0) {
         return rc;
@@ -1325,6 +1586,9 @@ int shifterSpank_task_init_privileged(shifterSpank_config *ssconfig) {
     if (ssconfig->imageType == NULL || strlen(ssconfig->imageType) == 0) {
         return rc;
     }
+    if (selected == NO_JOB_UDI) {
+        TASKINITPRIV_ERROR("FAILED to find UDI instance for job", ERROR);
+    }
 
     /* if this is the slurmstepd for prologflags=contain, then do the
      * proper setup to finalize shifter setup */
@@ -42,6 +42,11 @@ typedef struct {
     int ccmEnabled;               /*! flag if the ccm option should be offered */
     int sshdEnabled;              /*! flag if the sshd is enabled */
     int useLongOptions;           /*! flag to use long options */
+    char *metrics_file;           /*! append-only JSONL file for job metrics */
+    char *metrics_statsd;         /*! unix datagram socket for statsd metrics */
+    char *metrics_histogram;      /*! per-node metrics histogram file */
+    int metrics_comment;          /*! flag to add prolog metrics to the
+                                      job comment */
 
     /* config options from user */
     char *image;                  /*! user requested image identifier */
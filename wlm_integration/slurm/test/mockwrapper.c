@@ -120,6 +120,14 @@ int wrap_spank_stepd_add_extern_pid(shifterSpank_config *ssconfig,
     return SUCCESS;
 }
 
+int wrap_spank_append_job_comment(
+    shifterSpank_config *ssconfig,
+    uint32_t jobid,
+    const char *comment)
+{
+    return SUCCESS;
+}
+
 int wrap_spank_extra_job_attributes(
     shifterSpank_config *ssconfig,
     uint32_t jobid,
@@ -22,6 +22,8 @@ See LICENSE for full text.
 #include <slurm/spank.h>
 #include <slurm/slurm.h>
 #include "shifterSpank.h"
+#include "shifter_mem.h"
+#include "utility.h"
 #include "wrapper.h"
 
 SPANK_PLUGIN(shifter, 1)
@@ -349,6 +351,55 @@ int wrap_spank_stepd_add_extern_pid(shifterSpank_config *ssconfig,
     return (*stepd_add_extern_pid)(stepd_fd, protocol, pid);
 }
 
+int wrap_spank_append_job_comment(
+    shifterSpank_config *ssconfig,
+    uint32_t jobid,
+    const char *comment)
+{
+    job_info_msg_t *job_buf = NULL;
+    job_desc_msg_t job_desc;
+    char *newComment = NULL;
+    int rc = SUCCESS;
+    int (*load_job)(job_info_msg_t **, uint32_t, uint16_t);
+    void (*free_job_info_msg)(job_info_msg_t *);
+    void (*init_job_desc_msg)(job_desc_msg_t *);
+    int (*update_job)(job_desc_msg_t *);
+
+    if (comment == NULL) return ERROR;
+    if (setup_libslurm() != SUCCESS) {
+        slurm_error("FAILED to dlopen libslurm");
+        return ERROR;
+    }
+    load_job = slurm_load_job;
+    free_job_info_msg = slurm_free_job_info_msg;
+    init_job_desc_msg = slurm_init_job_desc_msg;
+    update_job = slurm_update_job;
+
+    /* keep any user-provided comment, append to it */
+    if ((*load_job)(&job_buf, jobid, SHOW_ALL) != 0) {
+        slurm_error("%s %u", "Couldn't load job data for jobid", jobid);
+        return ERROR;
+    }
+    if (job_buf->record_count == 1 && job_buf->job_array->comment != NULL
+            && strlen(job_buf->job_array->comment) > 0) {
+        newComment = alloc_strgenf("%s; %s", job_buf->job_array->comment,
+                comment);
+    } else {
+        newComment = _strdup(comment);
+    }
+    (*free_job_info_msg)(job_buf);
+
+    (*init_job_desc_msg)(&job_desc);
+    job_desc.job_id = jobid;
+    job_desc.comment = newComment;
+    if ((*update_job)(&job_desc) != 0) {
+        slurm_error("%s %u", "Couldn't update comment for jobid", jobid);
+        rc = ERROR;
+    }
+    free(newComment);
+    return rc;
+}
+
 int wrap_spank_extra_job_attributes(
     shifterSpank_config *ssconfig,
     uint32_t jobid,
@@ -61,6 +61,9 @@ int wrap_spank_extra_job_attributes(shifterSpank_config *ssconfig,
                                     size_t *tasksPerNode,
                                     uint16_t *shared);
 
+int wrap_spank_append_job_comment(shifterSpank_config *ssconfig,
+                                  uint32_t jobid, const char *comment);
+
 int wrap_force_arg_parse(shifterSpank_config *ssconfig);
 
 #ifdef __cplusplus